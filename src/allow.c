@@ -0,0 +1,191 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allow.h"
+
+/*
+ * Compiled numeric allow-list, one binary prefix trie per address
+ * family.  Every -a netaddr/maskbits rule hangs off the node at depth
+ * maskbits, with its port and IPv6 scope filters.  A lookup walks the
+ * bits of the peer address once and reports the lowest matching rule,
+ * so validate() gives the same answer as the old linear scan without
+ * touching the resolver.  Built before any receiver starts, the tries
+ * are read-only after that and need no locking.
+ */
+struct allowrule {
+	struct allowrule *next;
+	int		  rule;		/* index in -a order, from 1 */
+	u_short		  port;		/* 0: any port */
+	uint32_t	  scope;	/* 0: any IPv6 scope */
+};
+
+struct allownode {
+	struct allownode *child[2];
+	struct allowrule *rules;
+};
+
+static struct allownode *root4;
+static struct allownode *root6;
+
+static const uint8_t *addrbits(const struct sockaddr *sa, struct allownode ***root,
+			       int *maxlen, u_short *port, uint32_t *scope)
+{
+	const struct sockaddr_in6 *sin6;
+	const struct sockaddr_in *sin;
+
+	switch (sa->sa_family) {
+	case AF_INET:
+		sin    = (const struct sockaddr_in *)sa;
+		*root  = &root4;
+		*maxlen = 32;
+		*port  = ntohs(sin->sin_port);
+		*scope = 0;
+		return (const uint8_t *)&sin->sin_addr;
+
+	case AF_INET6:
+		sin6   = (const struct sockaddr_in6 *)sa;
+		*root  = &root6;
+		*maxlen = 128;
+		*port  = ntohs(sin6->sin6_port);
+		*scope = sin6->sin6_scope_id;
+		return (const uint8_t *)&sin6->sin6_addr;
+	}
+
+	return NULL;
+}
+
+static inline int bit(const uint8_t *addr, int i)
+{
+	return (addr[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+static struct allownode *node_new(void)
+{
+	return calloc(1, sizeof(struct allownode));
+}
+
+/*
+ * Add numeric rule number `rule` for the network in `sa`, `masklen`
+ * bits long.  The port in `sa` is ignored, `port` is the filter.
+ * Returns -1 and sets errno on error.
+ */
+int allow_add(const struct sockaddr *sa, int masklen, u_short port, int rule)
+{
+	struct allownode **root, *n;
+	struct allowrule *r, **rp;
+	const uint8_t *addr;
+	u_short unused;
+	uint32_t scope;
+	int i, maxlen;
+
+	addr = addrbits(sa, &root, &maxlen, &unused, &scope);
+	if (!addr || masklen < 0 || masklen > maxlen) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!*root && !(*root = node_new()))
+		return -1;
+
+	n = *root;
+	for (i = 0; i < masklen; i++) {
+		int b = bit(addr, i);
+
+		if (!n->child[b] && !(n->child[b] = node_new()))
+			return -1;
+		n = n->child[b];
+	}
+
+	r = malloc(sizeof(*r));
+	if (!r)
+		return -1;
+	r->rule  = rule;
+	r->port  = port;
+	r->scope = scope;
+
+	/* rules are added in order, keep the list sorted anyway */
+	for (rp = &n->rules; *rp && (*rp)->rule < rule; rp = &(*rp)->next)
+		;
+	r->next = *rp;
+	*rp = r;
+
+	return 0;
+}
+
+/*
+ * Check peer address and port in `sa` against the numeric rules.
+ * Returns 1, and the lowest matching rule number in `rule`, if the
+ * peer is allowed, otherwise 0.
+ */
+int allow_match(const struct sockaddr *sa, int *rule)
+{
+	struct allownode **root, *n;
+	const uint8_t *addr;
+	struct allowrule *r;
+	uint32_t scope;
+	u_short port;
+	int i, maxlen;
+	int best = 0;
+
+	addr = addrbits(sa, &root, &maxlen, &port, &scope);
+	if (!addr)
+		return 0;
+
+	for (n = *root, i = 0; n; i++) {
+		for (r = n->rules; r; r = r->next) {
+			if (best && r->rule >= best)
+				break;
+			if (r->port && r->port != port)
+				continue;
+			if (r->scope && r->scope != scope)
+				continue;
+			best = r->rule;
+			break;
+		}
+
+		if (i == maxlen)
+			break;
+		n = n->child[bit(addr, i)];
+	}
+
+	if (!best)
+		return 0;
+
+	*rule = best;
+	return 1;
+}
@@ -0,0 +1,485 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compress.h"
+#include "queue.h"
+
+#define CHUNK (64 * 1024)
+
+/*
+ * Rotated log files are compressed by a worker thread, started on first
+ * use, so the main loop only renames and reopens, it never waits.  The
+ * main loop moves f.0 aside to a unique name, the worker then ages the
+ * chain of compressed files and compresses it to f.1.  Jobs are handled
+ * in order, so the chain stays in order also if rotations are faster
+ * than compression.  Each is written to a temporary file that is
+ * renamed when it is complete, then the uncompressed file is removed.
+ */
+struct job {
+	TAILQ_ENTRY(job) link;
+	int		 codec;
+	int		 level;
+	int		 count;
+	char		*src;		/* in same allocation as path */
+	char		 path[];
+};
+
+static const struct {
+	const char *name;
+	const char *ext;
+	int         min, max, def;
+} codecs[] = {
+	[COMPRESS_NONE] = { "none", "",     0, 0,  0 },
+	[COMPRESS_GZIP] = { "gzip", ".gz",  1, 9,  6 },
+	[COMPRESS_ZSTD] = { "zstd", ".zst", 1, 19, 3 },
+};
+
+static TAILQ_HEAD(, job)  jobs = TAILQ_HEAD_INITIALIZER(jobs);
+static struct job        *current;	/* being compressed by worker */
+static size_t             njobs;
+static uint64_t           errors;
+
+static pthread_mutex_t    lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t     cond = PTHREAD_COND_INITIALIZER; /* new job, or stop */
+static pthread_t          tid;
+static int                running, stop;
+
+static int stopped(void)
+{
+	return __atomic_load_n(&stop, __ATOMIC_RELAXED);
+}
+
+#ifdef HAVE_ZLIB
+static int gzip(int in, int out, int level)
+{
+	char buf[CHUNK];
+	char mode[8];
+	ssize_t len;
+	gzFile gz;
+	int rc = 0;
+	int fd;
+
+	/* gzclose() closes the descriptor, caller syncs and closes out */
+	fd = dup(out);
+	if (fd == -1)
+		return -1;
+
+	snprintf(mode, sizeof(mode), "wb%d", level);
+	gz = gzdopen(fd, mode);
+	if (!gz) {
+		close(fd);
+		return -1;
+	}
+
+	while ((len = read(in, buf, sizeof(buf))) > 0) {
+		if (stopped() || gzwrite(gz, buf, len) != len) {
+			rc = -1;
+			break;
+		}
+	}
+	if (len < 0)
+		rc = -1;
+	if (gzclose(gz) != Z_OK)
+		rc = -1;
+
+	return rc;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int writeall(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t num;
+
+		num = write(fd, buf, len);
+		if (num < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += num;
+		len -= num;
+	}
+
+	return 0;
+}
+
+static int zstd(int in, int out, int level)
+{
+	char ibuf[CHUNK], obuf[CHUNK];
+	ZSTD_CCtx *cctx;
+	int rc = 0;
+
+	cctx = ZSTD_createCCtx();
+	if (!cctx)
+		return -1;
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+
+	while (!rc) {
+		ZSTD_EndDirective mode;
+		ZSTD_inBuffer input;
+		ssize_t len;
+		int finished;
+
+		len = read(in, ibuf, sizeof(ibuf));
+		if (len < 0 || stopped()) {
+			rc = -1;
+			break;
+		}
+
+		mode = len ? ZSTD_e_continue : ZSTD_e_end;
+		input.src  = ibuf;
+		input.size = len;
+		input.pos  = 0;
+		do {
+			ZSTD_outBuffer output = { obuf, sizeof(obuf), 0 };
+			size_t left;
+
+			left = ZSTD_compressStream2(cctx, &output, &input, mode);
+			if (ZSTD_isError(left) || writeall(out, obuf, output.pos)) {
+				rc = -1;
+				break;
+			}
+			finished = mode == ZSTD_e_end ? left == 0 : input.pos == input.size;
+		} while (!finished);
+
+		if (!len)
+			break;
+	}
+	ZSTD_freeCCtx(cctx);
+
+	return rc;
+}
+#endif
+
+static int compress_job(struct job *job)
+{
+	const char *ext = codecs[job->codec].ext;
+	size_t len = strlen(job->path) + 32;
+	char dst[len], tmp[len];
+	struct stat st;
+	int in, out;
+	int rc = -1;
+
+	compress_age(job->path, job->count, job->codec);
+
+	snprintf(dst, len, "%s.1%s", job->path, ext);
+	snprintf(tmp, len, "%s.tmp", dst);
+
+	in = open(job->src, O_RDONLY | O_CLOEXEC);
+	if (in == -1)
+		return -1;
+	if (fstat(in, &st))
+		goto err;
+
+	out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 0777);
+	if (out == -1)
+		goto err;
+
+	switch (job->codec) {
+#ifdef HAVE_ZLIB
+	case COMPRESS_GZIP:
+		rc = gzip(in, out, job->level);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		rc = zstd(in, out, job->level);
+		break;
+#endif
+	default:
+		break;
+	}
+
+	if (!rc)
+		rc = fsync(out);
+	close(out);
+	if (!rc)
+		rc = rename(tmp, dst);
+	if (rc)
+		unlink(tmp);
+	else
+		unlink(job->src);
+err:
+	close(in);
+
+	/* Left uncompressed, as f.1 */
+	if (rc) {
+		snprintf(dst, len, "%s.1", job->path);
+		(void)rename(job->src, dst);
+	}
+
+	return rc;
+}
+
+static void *worker(void *arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		int rc;
+
+		while (!stop && TAILQ_EMPTY(&jobs))
+			pthread_cond_wait(&cond, &lock);
+		if (stop)
+			break;
+
+		current = TAILQ_FIRST(&jobs);
+		TAILQ_REMOVE(&jobs, current, link);
+		njobs--;
+		pthread_mutex_unlock(&lock);
+
+		rc = compress_job(current);
+
+		pthread_mutex_lock(&lock);
+		if (rc)
+			errors++;
+		free(current);
+		current = NULL;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+static int start(void)
+{
+	sigset_t all, old;
+	int rc;
+
+	if (running)
+		return 0;
+
+	/* Signals are handled by the main thread only */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	stop = 0;
+	rc = pthread_create(&tid, NULL, worker, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc)
+		return -1;
+
+	running = 1;
+
+	return 0;
+}
+
+/*
+ * Parse "codec[:level]", level defaults per codec.  Returns -1 on
+ * unknown codec or level out of range.
+ */
+int compress_parse(char *arg, int *codec, int *level)
+{
+	size_t len;
+	char *c;
+
+	c = strchr(arg, ':');
+	len = c ? (size_t)(c - arg) : strlen(arg);
+
+	for (size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+		int val;
+
+		if (strlen(codecs[i].name) != len || strncmp(codecs[i].name, arg, len))
+			continue;
+
+		val = c ? atoi(c + 1) : codecs[i].def;
+		if (i != COMPRESS_NONE && (val < codecs[i].min || val > codecs[i].max))
+			return -1;
+
+		*codec = i;
+		*level = val;
+		return 0;
+	}
+
+	return -1;
+}
+
+/* File name extension of compressed files */
+const char *compress_ext(int codec)
+{
+	return codecs[codec].ext;
+}
+
+/*
+ * Age path.1 .. path.count-1 to make room for a new path.1, both the
+ * files compressed with codec, and those left uncompressed when that
+ * failed.  Ignores errors, files might be missing.
+ */
+void compress_age(const char *path, int count, int codec)
+{
+	const char *ext = codecs[codec].ext;
+	size_t len = strlen(path) + 32;
+	char src[len], dst[len];
+
+	for (int i = count; i > 1; i--) {
+		snprintf(src, len, "%s.%d%s", path, i - 1, ext);
+		snprintf(dst, len, "%s.%d%s", path, i, ext);
+		(void)rename(src, dst);
+		if (!ext[0])
+			continue;
+
+		snprintf(src, len, "%s.%d", path, i - 1);
+		snprintf(dst, len, "%s.%d", path, i);
+		(void)rename(src, dst);
+	}
+}
+
+/* Has the codec been built in? */
+int compress_avail(int codec)
+{
+	switch (codec) {
+	case COMPRESS_NONE:
+		return 1;
+#ifdef HAVE_ZLIB
+	case COMPRESS_GZIP:
+		return 1;
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		return 1;
+#endif
+	}
+
+	return 0;
+}
+
+/*
+ * Queue rotation of log file path, keeping count old files: src, the
+ * previous path.0 moved aside by the caller, is compressed to path.1 +
+ * compress_ext() after aging the older ones.  Returns -1 if the codec
+ * is not available, or the file cannot be queued, src is then left as
+ * it is, uncompressed.
+ */
+int compress_rotate(const char *path, const char *src, int count, int codec, int level)
+{
+	size_t len, slen;
+	struct job *job;
+
+	if (codec == COMPRESS_NONE || !compress_avail(codec)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	len  = strlen(path) + 1;
+	slen = strlen(src) + 1;
+	job = malloc(sizeof(*job) + len + slen);
+	if (!job)
+		goto fail;
+	job->codec = codec;
+	job->level = level;
+	job->count = count;
+	memcpy(job->path, path, len);
+	job->src = &job->path[len];
+	memcpy(job->src, src, slen);
+
+	pthread_mutex_lock(&lock);
+	if (njobs >= COMPRESS_QUEUE || start()) {
+		pthread_mutex_unlock(&lock);
+		free(job);
+		goto fail;
+	}
+	TAILQ_INSERT_TAIL(&jobs, job, link);
+	njobs++;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+fail:
+	pthread_mutex_lock(&lock);
+	errors++;
+	pthread_mutex_unlock(&lock);
+
+	return -1;
+}
+
+/*
+ * Stop the worker, a file being compressed is left uncompressed as f.1,
+ * files still in the queue are then aged into the chain uncompressed,
+ * in order, so none are left under the temporary name from the caller.
+ */
+void compress_exit(void)
+{
+	struct job *job, *next;
+
+	if (!running)
+		return;
+
+	pthread_mutex_lock(&lock);
+	running = 0;
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(tid, NULL);
+
+	TAILQ_FOREACH_SAFE(job, &jobs, link, next) {
+		size_t len = strlen(job->path) + 3;
+		char dst[len];
+
+		compress_age(job->path, job->count, job->codec);
+		snprintf(dst, len, "%s.1", job->path);
+		(void)rename(job->src, dst);
+		free(job);
+	}
+	TAILQ_INIT(&jobs);
+	njobs = 0;
+}
+
+/* Files that failed to compress since last call */
+uint64_t compress_errors(void)
+{
+	uint64_t num;
+
+	pthread_mutex_lock(&lock);
+	num = errors;
+	errors = 0;
+	pthread_mutex_unlock(&lock);
+
+	return num;
+}
@@ -0,0 +1,53 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef SYSKLOGD_COMPRESS_H_
+#define SYSKLOGD_COMPRESS_H_
+
+#include <stdint.h>
+
+/* Codecs for rotated log files */
+#define COMPRESS_NONE 0
+#define COMPRESS_GZIP 1		/* .gz,  levels 1-9,  default 6 */
+#define COMPRESS_ZSTD 2		/* .zst, levels 1-19, default 3 */
+
+#define COMPRESS_QUEUE 64	/* max files waiting to be compressed */
+
+int         compress_parse  (char *arg, int *codec, int *level);
+const char *compress_ext    (int codec);
+int         compress_avail  (int codec);
+void        compress_age    (const char *path, int count, int codec);
+
+int         compress_rotate (const char *path, const char *src, int count, int codec, int level);
+void        compress_exit   (void);
+
+uint64_t    compress_errors (void);
+
+#endif /* SYSKLOGD_COMPRESS_H_ */
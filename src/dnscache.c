@@ -0,0 +1,341 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compat.h"
+#include "dnscache.h"
+#include "hash.h"
+#include "queue.h"
+
+#define DNSCACHE_BUCKETS 2048	/* power of two, >= DNSCACHE_SIZE */
+
+/*
+ * Reverse DNS cache, shared by the main loop and the receiver workers.
+ * Lookups of unknown addresses are queued for a resolver thread, the
+ * caller logs with the numeric address meanwhile.  Entries are kept in
+ * a hash table, and in LRU order for eviction.  A single mutex protects
+ * it all, the resolver thread never holds it while calling the
+ * resolver.
+ */
+enum { DC_PENDING, DC_NAME, DC_NONAME };
+
+struct dcentry {
+	LIST_ENTRY(dcentry)	 link;	/* hash bucket */
+	TAILQ_ENTRY(dcentry)	 lru;	/* most recently used first */
+	SIMPLEQ_ENTRY(dcentry)	 work;	/* pending lookups */
+
+	struct sockaddr_storage	 ss;
+	socklen_t		 sslen;
+	uint64_t		 hash;
+	int			 state;
+	time_t			 expires;
+	char			 name[NI_MAXHOST];
+};
+
+static LIST_HEAD(, dcentry)      buckets[DNSCACHE_BUCKETS];
+static TAILQ_HEAD(dclru, dcentry) lru = TAILQ_HEAD_INITIALIZER(lru);
+static SIMPLEQ_HEAD(, dcentry)   work = SIMPLEQ_HEAD_INITIALIZER(work);
+static size_t                    nentries, npending;
+static struct dnscache_stats     stats;
+
+static pthread_mutex_t           lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t            cond = PTHREAD_COND_INITIALIZER;
+static pthread_t                 tid;
+static int                       running, stop;
+
+static time_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+/*
+ * Only the address is the key, not the port
+ */
+static size_t addrkey(const struct sockaddr *sa, const void **key)
+{
+	switch (sa->sa_family) {
+	case AF_INET:
+		*key = &((const struct sockaddr_in *)sa)->sin_addr;
+		return sizeof(struct in_addr);
+	case AF_INET6:
+		*key = &((const struct sockaddr_in6 *)sa)->sin6_addr;
+		return sizeof(struct in6_addr);
+	}
+
+	*key = NULL;
+	return 0;
+}
+
+static int addreq(const struct sockaddr *a, const struct sockaddr *b)
+{
+	const void *ka, *kb;
+	size_t len;
+
+	if (a->sa_family != b->sa_family)
+		return 0;
+
+	len = addrkey(a, &ka);
+	addrkey(b, &kb);
+
+	return !memcmp(ka, kb, len);
+}
+
+static struct dcentry *find(const struct sockaddr *sa, uint64_t hash)
+{
+	struct dcentry *e;
+
+	LIST_FOREACH(e, &buckets[hash & (DNSCACHE_BUCKETS - 1)], link) {
+		if (e->hash == hash && addreq((const struct sockaddr *)&e->ss, sa))
+			return e;
+	}
+
+	return NULL;
+}
+
+static void drop(struct dcentry *e)
+{
+	LIST_REMOVE(e, link);
+	TAILQ_REMOVE(&lru, e, lru);
+	nentries--;
+	free(e);
+}
+
+/*
+ * Make room for one more entry, pending lookups are never evicted
+ */
+static int evict(void)
+{
+	struct dcentry *e;
+
+	TAILQ_FOREACH_REVERSE(e, &lru, dclru, lru) {
+		if (e->state == DC_PENDING)
+			continue;
+
+		drop(e);
+		stats.evicted++;
+		return 0;
+	}
+
+	return -1;
+}
+
+static void *resolver(void *arg)
+{
+	pthread_mutex_lock(&lock);
+	while (!stop) {
+		struct sockaddr_storage ss;
+		char name[NI_MAXHOST];
+		struct dcentry *e;
+		socklen_t sslen;
+		int err;
+
+		e = SIMPLEQ_FIRST(&work);
+		if (!e) {
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+		SIMPLEQ_REMOVE_HEAD(&work, work);
+		npending--;
+
+		/* Entry stays PENDING, so it cannot be evicted meanwhile */
+		memcpy(&ss, &e->ss, sizeof(ss));
+		sslen = e->sslen;
+		pthread_mutex_unlock(&lock);
+
+		err = getnameinfo((struct sockaddr *)&ss, sslen, name, sizeof(name), NULL, 0, NI_NAMEREQD);
+
+		pthread_mutex_lock(&lock);
+		if (err) {
+			e->state   = DC_NONAME;
+			e->expires = now() + DNSCACHE_NEGTTL;
+		} else {
+			strcpy(e->name, name);
+			e->state   = DC_NAME;
+			e->expires = now() + DNSCACHE_TTL;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+/*
+ * Look up the name of sa in the cache.  On a miss, the lookup is queued
+ * for the resolver thread and the caller should use the numeric address
+ * for now.  Safe to call from any thread.
+ */
+int dnscache_lookup(const struct sockaddr *sa, socklen_t len, char *name, size_t namelen)
+{
+	const void *key;
+	struct dcentry *e;
+	uint64_t hash;
+	size_t klen;
+	int rc;
+
+	klen = addrkey(sa, &key);
+	if (!klen || len > sizeof(e->ss))
+		return DNSCACHE_OFF;
+
+	hash = hash64(key, klen, sa->sa_family);
+
+	pthread_mutex_lock(&lock);
+	if (!running) {
+		pthread_mutex_unlock(&lock);
+		return DNSCACHE_OFF;
+	}
+
+	e = find(sa, hash);
+	if (e && e->state != DC_PENDING && e->expires <= now()) {
+		drop(e);
+		e = NULL;
+	}
+
+	if (e) {
+		TAILQ_REMOVE(&lru, e, lru);
+		TAILQ_INSERT_HEAD(&lru, e, lru);
+
+		switch (e->state) {
+		case DC_NAME:
+			strlcpy(name, e->name, namelen);
+			stats.hits++;
+			rc = DNSCACHE_HIT;
+			break;
+
+		case DC_NONAME:
+			stats.negative++;
+			rc = DNSCACHE_NEGATIVE;
+			break;
+
+		default:	/* lookup already in progress */
+			stats.misses++;
+			rc = DNSCACHE_MISS;
+			break;
+		}
+		goto done;
+	}
+
+	stats.misses++;
+	rc = DNSCACHE_MISS;
+	if (npending >= DNSCACHE_QUEUE || (nentries >= DNSCACHE_SIZE && evict())) {
+		stats.dropped++;
+		goto done;
+	}
+
+	e = calloc(1, sizeof(*e));
+	if (!e) {
+		stats.dropped++;
+		goto done;
+	}
+
+	memcpy(&e->ss, sa, len);
+	e->sslen = len;
+	e->hash  = hash;
+	e->state = DC_PENDING;
+	LIST_INSERT_HEAD(&buckets[hash & (DNSCACHE_BUCKETS - 1)], e, link);
+	TAILQ_INSERT_HEAD(&lru, e, lru);
+	SIMPLEQ_INSERT_TAIL(&work, e, work);
+	nentries++;
+	npending++;
+	pthread_cond_signal(&cond);
+done:
+	pthread_mutex_unlock(&lock);
+
+	return rc;
+}
+
+void dnscache_stats(struct dnscache_stats *st)
+{
+	pthread_mutex_lock(&lock);
+	*st = stats;
+	st->entries = nentries;
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Start the resolver thread, only once.  Returns 0, or the error from
+ * pthread_create(), it does not set errno.
+ */
+int dnscache_init(void)
+{
+	sigset_t all, old;
+	int rc;
+
+	if (running)
+		return 0;
+
+	for (size_t i = 0; i < DNSCACHE_BUCKETS; i++)
+		LIST_INIT(&buckets[i]);
+
+	/* Signals are handled by the main thread only */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	stop = 0;
+	rc = pthread_create(&tid, NULL, resolver, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc)
+		return rc;
+
+	running = 1;
+
+	return 0;
+}
+
+void dnscache_exit(void)
+{
+	struct dcentry *e, *next;
+
+	if (!running)
+		return;
+
+	pthread_mutex_lock(&lock);
+	running = 0;
+	stop = 1;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(tid, NULL);
+
+	TAILQ_FOREACH_SAFE(e, &lru, lru, next)
+		drop(e);
+	SIMPLEQ_INIT(&work);
+	npending = 0;
+}
@@ -0,0 +1,63 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef SYSKLOGD_DNSCACHE_H_
+#define SYSKLOGD_DNSCACHE_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define DNSCACHE_SIZE   1024	/* max cached addresses */
+#define DNSCACHE_TTL    3600	/* seconds to keep a resolved name */
+#define DNSCACHE_NEGTTL 60	/* seconds to keep a failed lookup */
+#define DNSCACHE_QUEUE  256	/* max pending lookups */
+
+/* dnscache_lookup() results */
+#define DNSCACHE_HIT     1	/* name copied to caller */
+#define DNSCACHE_NEGATIVE 2	/* known to have no name */
+#define DNSCACHE_MISS    0	/* not known yet, lookup queued */
+#define DNSCACHE_OFF    -1	/* cache not running, resolve yourself */
+
+struct dnscache_stats {
+	uint64_t hits;
+	uint64_t negative;
+	uint64_t misses;
+	uint64_t evicted;
+	uint64_t dropped;		/* lookups not queued, queue full */
+	size_t   entries;
+};
+
+int  dnscache_init   (void);
+void dnscache_exit   (void);
+
+int  dnscache_lookup (const struct sockaddr *sa, socklen_t len, char *name, size_t namelen);
+void dnscache_stats  (struct dnscache_stats *st);
+
+#endif /* SYSKLOGD_DNSCACHE_H_ */
@@ -0,0 +1,223 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fdcache.h"
+#include "hash.h"
+
+#define FDCACHE_BUCKETS 4096	/* power of two */
+
+/*
+ * Cache of open files for templated file actions, e.g. one file per
+ * remote host.  Files are opened on first use, creating any missing
+ * directories, and kept open in LRU order.  When the cache is full the
+ * least recently written file is closed, so any number of files can be
+ * written with a fixed number of descriptors.  Main thread only.
+ */
+static LIST_HEAD(, fdentry)      buckets[FDCACHE_BUCKETS];
+static TAILQ_HEAD(fdlru, fdentry) lru = TAILQ_HEAD_INITIALIZER(lru);
+static size_t                    nentries;
+static size_t                    maxentries = FDCACHE_SIZE;
+
+static void fdclose(struct fdentry *fe)
+{
+	if (fe->fd < 0)
+		return;
+
+	if (fe->dirty)
+		(void)fdatasync(fe->fd);
+	(void)close(fe->fd);
+	fe->fd = -1;
+	fe->dirty = 0;
+}
+
+void fdcache_drop(struct fdentry *fe)
+{
+	fdclose(fe);
+	LIST_REMOVE(fe, link);
+	TAILQ_REMOVE(&lru, fe, lru);
+	nentries--;
+	free(fe);
+}
+
+/*
+ * Create all missing directories leading up to path
+ */
+static int mkparents(const char *path)
+{
+	char dir[strlen(path) + 1];
+	char *p;
+
+	strcpy(dir, path);
+	for (p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = 0;
+		if (mkdir(dir, 0755) && errno != EEXIST)
+			return -1;
+		*p = '/';
+	}
+
+	return 0;
+}
+
+static int fdopen_path(struct fdentry *fe)
+{
+	struct stat st;
+	int flags = O_WRONLY | O_APPEND | O_CREAT | O_NONBLOCK | O_NOCTTY | O_CLOEXEC;
+
+	fe->fd = open(fe->path, flags, 0644);
+	if (fe->fd < 0 && errno == ENOENT) {
+		if (mkparents(fe->path))
+			return -1;
+		fe->fd = open(fe->path, flags, 0644);
+	}
+	if (fe->fd < 0)
+		return -1;
+
+	if (fstat(fe->fd, &st) || !S_ISREG(st.st_mode))
+		fe->size = -1;
+	else
+		fe->size = st.st_size;
+	fe->dirty = 0;
+
+	return 0;
+}
+
+/*
+ * Set max number of open files, closing the least recently used ones
+ * if there are more than that already.
+ */
+void fdcache_init(size_t max)
+{
+	if (max < 1)
+		max = 1;
+	maxentries = max;
+
+	while (nentries > maxentries)
+		fdcache_drop(TAILQ_LAST(&lru, fdlru));
+}
+
+void fdcache_exit(void)
+{
+	struct fdentry *fe, *tmp;
+
+	TAILQ_FOREACH_SAFE(fe, &lru, lru, tmp)
+		fdcache_drop(fe);
+}
+
+/*
+ * Find, or open, the file at path.  Returns NULL with errno set if it
+ * cannot be opened.
+ */
+struct fdentry *fdcache_open(const char *path)
+{
+	uint64_t hash = hash_str(path, 0);
+	struct fdentry *fe;
+	size_t len;
+
+	LIST_FOREACH(fe, &buckets[hash & (FDCACHE_BUCKETS - 1)], link) {
+		if (fe->hash == hash && !strcmp(fe->path, path))
+			break;
+	}
+
+	if (fe) {
+		if (fe->fd < 0 && fdopen_path(fe)) {
+			int e = errno;
+
+			fdcache_drop(fe);
+			errno = e;
+			return NULL;
+		}
+
+		TAILQ_REMOVE(&lru, fe, lru);
+		TAILQ_INSERT_HEAD(&lru, fe, lru);
+		return fe;
+	}
+
+	len = strlen(path) + 1;
+	fe = calloc(1, sizeof(*fe) + len);
+	if (!fe)
+		return NULL;
+
+	memcpy(fe->path, path, len);
+	fe->hash = hash;
+	if (fdopen_path(fe)) {
+		int e = errno;
+
+		free(fe);
+		errno = e;
+		return NULL;
+	}
+
+	if (nentries >= maxentries)
+		fdcache_drop(TAILQ_LAST(&lru, fdlru));
+
+	LIST_INSERT_HEAD(&buckets[hash & (FDCACHE_BUCKETS - 1)], fe, link);
+	TAILQ_INSERT_HEAD(&lru, fe, lru);
+	nentries++;
+
+	return fe;
+}
+
+void fdcache_foreach(void (*fn)(struct fdentry *fe))
+{
+	struct fdentry *fe, *tmp;
+
+	TAILQ_FOREACH_SAFE(fe, &lru, lru, tmp)
+		fn(fe);
+}
+
+/*
+ * Group fdatasync() of all files written since last time
+ */
+void fdcache_sync(void)
+{
+	struct fdentry *fe;
+
+	TAILQ_FOREACH(fe, &lru, lru) {
+		if (!fe->dirty || fe->fd < 0)
+			continue;
+
+		(void)fdatasync(fe->fd);
+		fe->dirty = 0;
+	}
+}
+
+size_t fdcache_count(void)
+{
+	return nentries;
+}
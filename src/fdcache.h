@@ -0,0 +1,70 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef SYSKLOGD_FDCACHE_H_
+#define SYSKLOGD_FDCACHE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "queue.h"
+
+#define FDCACHE_SIZE  256	/* default max open files */
+#define FDCACHE_MAX   65536
+
+/*
+ * Open file of a templated action, kept by the cache.  The writer owns
+ * fd, size and dirty, and may close and replace fd, e.g. on rotation.
+ */
+struct fdentry {
+	LIST_ENTRY(fdentry)	 link;	/* hash bucket */
+	TAILQ_ENTRY(fdentry)	 lru;	/* most recently used first */
+	uint64_t		 hash;
+
+	int			 fd;	/* -1: reopened on next use */
+	off_t			 size;	/* bytes written, -1: not a regular file */
+	int			 dirty;	/* written since last fdatasync() */
+	int			 rotatesz;    /* from the last action writing */
+	int			 rotatecount; /* ... to this file */
+
+	char			 path[];
+};
+
+void            fdcache_init    (size_t max);
+void            fdcache_exit    (void);
+
+struct fdentry *fdcache_open    (const char *path);
+void            fdcache_drop    (struct fdentry *fe);
+
+void            fdcache_foreach (void (*fn)(struct fdentry *fe));
+void            fdcache_sync    (void);
+size_t          fdcache_count   (void);
+
+#endif /* SYSKLOGD_FDCACHE_H_ */
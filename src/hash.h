@@ -0,0 +1,87 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef SYSKLOGD_HASH_H_
+#define SYSKLOGD_HASH_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define HASH_MUL1 0x9e3779b97f4a7c15ULL
+#define HASH_MUL2 0xbf58476d1ce4e5b9ULL
+
+static inline uint64_t hash_mix(uint64_t h, uint64_t v)
+{
+	h ^= v * HASH_MUL1;
+	h  = (h << 31) | (h >> 33);
+
+	return h * HASH_MUL2;
+}
+
+/*
+ * Fast, non-cryptographic, 64-bit hash of len bytes, eight at a time.
+ * Chain several fields by passing the previous result as seed.  The
+ * length is mixed in, so "ab" + "c" and "a" + "bc" differ.
+ */
+static inline uint64_t hash64(const void *data, size_t len, uint64_t seed)
+{
+	const unsigned char *p = data;
+	uint64_t h = seed ^ (len * HASH_MUL2);
+	uint64_t v;
+
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		h = hash_mix(h, v);
+		p   += 8;
+		len -= 8;
+	}
+
+	if (len) {
+		v = 0;
+		memcpy(&v, p, len);
+		h = hash_mix(h, v);
+	}
+
+	/* splitmix64 finalizer */
+	h ^= h >> 30;
+	h *= HASH_MUL2;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+
+	return h;
+}
+
+static inline uint64_t hash_str(const char *str, uint64_t seed)
+{
+	return hash64(str, strlen(str), seed);
+}
+
+#endif /* SYSKLOGD_HASH_H_ */
@@ -39,15 +39,59 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 
 #define SYSLOG_NAMES
 #include "compat.h"
 #include "syslog.h"
 
+#define STREAM_BLKSZ	65536
+#define STREAM_BATCH	64
+#define STREAM_MSGSZ	2048
+
+/*
+ * Streaming mode, -S: stdin is read in large blocks and each line is
+ * formatted directly into a batch of datagrams sent with one sendmmsg()
+ * per batch, or buffered to a log file which is rotated when the byte
+ * count written exceeds the rotation size.
+ */
+struct stream {
+	int		 sock;		/* connected socket, or -1 for file */
+	FILE		*fp;
+	char		*file;		/* NULL for stdout */
+	off_t		 size;		/* rotate when exceeded, 0: never */
+	int		 num;
+	off_t		 written;
+
+	int		 opts;		/* LOG_* */
+	int		 pri;
+	int		 remote;
+	const char	*hostname;
+	const char	*tag;
+	const char	*msgid;
+	const char	*sd;
+	char		 pid[16];	/* "1234" or "-" for RFC5424 */
+
+	time_t		 sec;		/* cached date and zone */
+	char		 date[32];
+	char		 zone[8];
+
+	struct mmsghdr	 hdr[STREAM_BATCH];
+	struct iovec	 iov[STREAM_BATCH];
+	char		 msg[STREAM_BATCH][STREAM_MSGSZ];
+	unsigned int	 cnt;
+
+	size_t		 lines;
+	size_t		 bytes;
+	size_t		 drops;
+};
+
 static const char version_info[] = PACKAGE_NAME " v" PACKAGE_VERSION;
 static struct syslog_data log    = SYSLOG_DATA_INIT;
 
@@ -193,6 +237,305 @@ static char *chomp(char *str)
         return str;
 }
 
+#ifndef HAVE_SENDMMSG
+static int sendmmsg(int sd, struct mmsghdr *hdr, unsigned int num, int flags)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++) {
+		ssize_t len;
+
+		len = sendmsg(sd, &hdr[i].msg_hdr, flags);
+		if (len < 0) {
+			if (i == 0)
+				return -1;
+			break;
+		}
+		hdr[i].msg_len = len;
+	}
+
+	return i;
+}
+#endif
+
+static int stream_open(struct stream *st)
+{
+	struct stat sb;
+
+	st->fp = fopen(st->file, "a");
+	if (!st->fp)
+		return 1;
+
+	setvbuf(st->fp, NULL, _IOFBF, STREAM_BLKSZ);
+	if (!fstat(fileno(st->fp), &sb) && S_ISREG(sb.st_mode))
+		st->written = sb.st_size;
+	else
+		st->size = 0;
+
+	return 0;
+}
+
+/* Called at end of batch: send, retry on ENOBUFS, count what's lost */
+static void stream_flush(struct stream *st)
+{
+	unsigned int off = 0;
+	int tries = 0;
+
+	if (st->sock == -1) {
+		fflush(st->fp);
+		return;
+	}
+
+	while (off < st->cnt) {
+		int rc;
+
+		rc = sendmmsg(st->sock, &st->hdr[off], st->cnt - off, 0);
+		if (rc > 0) {
+			off += rc;
+			tries = 0;
+			continue;
+		}
+
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 && (errno == ENOBUFS || errno == EAGAIN || errno == ECONNREFUSED) &&
+		    tries++ < 10) {
+			usleep(1000);
+			continue;
+		}
+
+		st->drops += st->cnt - off;
+		break;
+	}
+	st->cnt = 0;
+}
+
+/* Refresh cached date and zone at most once per second, returns usec */
+static long stream_date(struct stream *st)
+{
+	struct timeval tv;
+	struct tm tm;
+	const char *fmt;
+	size_t len;
+
+	gettimeofday(&tv, NULL);
+	if (tv.tv_sec == st->sec)
+		return tv.tv_usec;
+
+	st->sec = tv.tv_sec;
+	localtime_r(&st->sec, &tm);
+
+	if (st->sock == -1)
+		fmt = (st->opts & LOG_RFC3164) ? "%b %d %T" : "%b %d %Y %T";
+	else
+		fmt = (st->opts & LOG_RFC3164) ? "%b %d %T" : "%FT%T";
+	strftime(st->date, sizeof(st->date), fmt, &tm);
+
+	/* strftime gives eg. "+0200", but we need "+02:00" */
+	len = strftime(st->zone, sizeof(st->zone), "%z", &tm);
+	if (len == 5) {
+		st->zone[6] = 0;
+		st->zone[5] = st->zone[4];
+		st->zone[4] = st->zone[3];
+		st->zone[3] = ':';
+	}
+
+	return tv.tv_usec;
+}
+
+static void stream_line(struct stream *st, const char *line, size_t len)
+{
+	char *buf = st->msg[st->cnt];
+	long usec;
+	int n;
+
+	if (len == 0)
+		return;
+
+	usec = stream_date(st);
+	if (st->sock == -1) {
+		/* Same as LOG_NLOG/LOG_STDOUT in syslogp_r() */
+		n = fprintf(st->fp, "%s %s%s%s%s: %.*s\n", st->date, st->tag,
+			    st->pid[0] != '-' ? "[" : "",
+			    st->pid[0] != '-' ? st->pid : "",
+			    st->pid[0] != '-' ? "]" : "", (int)len, line);
+		if (n < 0) {
+			st->drops++;
+			return;
+		}
+		if (st->opts & LOG_PERROR)
+			fprintf(stderr, "%.*s\n", (int)len, line);
+
+		st->lines++;
+		st->bytes += n;
+		st->written += n;
+		if (st->size > 0 && st->written > st->size) {
+			fclose(st->fp);
+			logrotate(st->file, st->num, st->size);
+			if (stream_open(st))
+				err(1, "Failed reopening %s", st->file);
+		}
+		return;
+	}
+
+	if (st->opts & LOG_RFC3164) {
+		const char *pid = st->pid[0] != '-' ? st->pid : NULL;
+
+		/* Only remote gets a date, see syslogp_r() */
+		if (st->remote)
+			n = snprintf(buf, STREAM_MSGSZ, "<%d>%s %s %.32s%s%s%s: %.*s",
+				     st->pri, st->date, st->hostname, st->tag,
+				     pid ? "[" : "", pid ? pid : "", pid ? "]" : "",
+				     (int)len, line);
+		else
+			n = snprintf(buf, STREAM_MSGSZ, "<%d>%s %s%s%s%s: %.*s",
+				     st->pri, st->hostname, st->tag,
+				     pid ? "[" : "", pid ? pid : "", pid ? "]" : "",
+				     (int)len, line);
+	} else
+		n = snprintf(buf, STREAM_MSGSZ, "<%d>1 %s.%06ld%s %s %s %s %s %s %.*s",
+			     st->pri, st->date, usec, st->zone, st->hostname, st->tag, st->pid,
+			     st->msgid ?: "-", st->sd ?: "-", (int)len, line);
+	if (n < 0)
+		return;
+	if (n >= STREAM_MSGSZ)
+		n = STREAM_MSGSZ - 1;
+
+	if (st->opts & LOG_PERROR)
+		fprintf(stderr, "%.*s\n", (int)len, line);
+
+	st->iov[st->cnt].iov_base = buf;
+	st->iov[st->cnt].iov_len  = n;
+	st->hdr[st->cnt].msg_hdr.msg_iov    = &st->iov[st->cnt];
+	st->hdr[st->cnt].msg_hdr.msg_iovlen = 1;
+	st->cnt++;
+	st->lines++;
+	st->bytes += n;
+
+	if (st->cnt == STREAM_BATCH)
+		stream_flush(st);
+}
+
+/*
+ * Read stdin in blocks, log each line.  Lines longer than the block
+ * are split.  A batch is sent when full, or when we have no more input
+ * for the moment, so a slow producer is not delayed.
+ */
+static int stream(struct stream *st)
+{
+	struct timespec start, end;
+	size_t len = 0;
+	double sec;
+	char *blk;
+
+	blk = malloc(STREAM_BLKSZ);
+	if (!blk)
+		err(1, "Failed allocating stream buffer");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;) {
+		char *ptr, *nl;
+		ssize_t num;
+
+		num = read(STDIN_FILENO, &blk[len], STREAM_BLKSZ - len);
+		if (num < 0) {
+			if (errno == EINTR)
+				continue;
+			warn("Failed reading stdin");
+			break;
+		}
+		if (num == 0)
+			break;
+		len += num;
+
+		ptr = blk;
+		while ((nl = memchr(ptr, '\n', len - (ptr - blk)))) {
+			stream_line(st, ptr, nl - ptr);
+			ptr = nl + 1;
+		}
+
+		len -= ptr - blk;
+		if (len == STREAM_BLKSZ) {
+			stream_line(st, blk, len);
+			len = 0;
+		} else if (len > 0)
+			memmove(blk, ptr, len);
+
+		stream_flush(st);
+	}
+
+	if (len > 0)
+		stream_line(st, blk, len);
+	stream_flush(st);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	free(blk);
+
+	sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (sec <= 0)
+		sec = 1e-9;
+	fprintf(stderr, "logger: %zu messages, %zu bytes in %.3f sec, %.0f msg/s, %.1f MiB/s",
+		st->lines, st->bytes, sec, st->lines / sec, st->bytes / sec / (1024 * 1024));
+	if (st->drops)
+		fprintf(stderr, ", %zu dropped", st->drops);
+	fprintf(stderr, "\n");
+
+	if (st->fp && st->fp != stdout)
+		fclose(st->fp);
+	if (st->sock != -1)
+		close(st->sock);
+
+	return st->drops ? 1 : 0;
+}
+
+static int stream_init(struct stream *st, char *logfile, char *sockpath,
+		       struct sockaddr *sa, socklen_t salen)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	static char hostname[256];
+	const char *path;
+
+	if (!st->hostname[0]) {
+		if (gethostname(hostname, sizeof(hostname)))
+			strlcpy(hostname, "-", sizeof(hostname));
+		st->hostname = hostname;
+	}
+	if (!st->tag)
+		st->tag = "-";
+
+	st->sec = -1;
+	st->sock = -1;
+	if (logfile) {
+		if (!strcmp(logfile, "-")) {
+			st->fp = stdout;
+			st->size = 0;
+			setvbuf(stdout, NULL, _IOFBF, STREAM_BLKSZ);
+		} else {
+			st->file = logfile;
+			if (stream_open(st))
+				err(1, "Failed opening %s for writing", logfile);
+		}
+		return 0;
+	}
+
+	if (!sa) {
+		path = sockpath ?: getenv("SYSLOG_UNIX_PATH") ?: _PATH_LOG;
+		strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+		sa = (struct sockaddr *)&sun;
+		salen = sizeof(sun);
+	} else {
+		path = "remote host";
+		st->remote = 1;
+	}
+
+	st->sock = socket(sa->sa_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (st->sock == -1)
+		err(1, "Failed creating socket");
+	if (connect(st->sock, sa, salen))
+		err(1, "Failed connecting to %s", path);
+
+	return 0;
+}
+
 static int parse_prio(char *arg, int *f, int *l)
 {
 	char *ptr;
@@ -248,6 +591,7 @@ static int usage(int code)
 	       "  -P PORT   Use PORT (or named UDP service) for remote server, default: syslog\n"
 	       "  -r S[:R]  Enable log file rotation, default: 200 kB \e[4ms\e[0mize, 5 \e[4mr\e[0motations\n"
 	       "  -s        Log to stderr as well as the system log\n"
+	       "  -S        Streaming mode for stdin: batched sends, buffered file writes\n"
 	       "  -t TAG    Log using the specified tag (defaults to user name)\n"
 	       "  -u SOCK   Log to UNIX domain socket `SOCK` instead of default %s\n"
 	       "  -?        This help text\n"
@@ -271,15 +615,17 @@ int main(int argc, char *argv[])
 	int facility = LOG_USER;
 	int severity = LOG_NOTICE;
 	int family = AF_UNSPEC;
-	struct sockaddr sa;
+	struct sockaddr_storage ss;
+	struct sockaddr *sa = (struct sockaddr *)&ss;
 	int allow_kmsg = 0;
+	int streaming = 0;
 	char buf[512] = "";
 	int log_opts = 0;
 	FILE *fp = NULL;
 	int c, num = 5;
 	int rotate = 0;
 
-	while ((c = getopt(argc, argv, "46?bcd:f:h:H:iI:km:np:P:r:st:u:v")) != EOF) {
+	while ((c = getopt(argc, argv, "46?bcd:f:h:H:iI:km:np:P:r:sSt:u:v")) != EOF) {
 		switch (c) {
 		case '4':
 			family = AF_INET;
@@ -357,6 +703,10 @@ int main(int argc, char *argv[])
 			log_opts |= LOG_PERROR;
 			break;
 
+		case 'S':
+			streaming = 1;
+			break;
+
 		case 't':
 			ident = optarg;
 			break;
@@ -389,6 +739,41 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (streaming && !buf[0] && !(allow_kmsg && !logfile && !sockpath &&
+				      access(_PATH_LOG, W_OK))) {
+		struct stream *st;
+		socklen_t salen = 0;
+
+		st = calloc(1, sizeof(*st));
+		if (!st)
+			err(1, "Failed allocating stream");
+
+		st->opts     = log_opts;
+		st->pri      = facility | severity;
+		st->hostname = log.log_hostname;
+		st->tag      = ident;
+		st->msgid    = msgid;
+		st->sd       = sd;
+		st->size     = rotate ? size : 0;
+		st->num      = num;
+		if (log_opts & LOG_PID)
+			snprintf(st->pid, sizeof(st->pid), "%d",
+				 log.log_pid != -1 ? log.log_pid : getpid());
+		else
+			strlcpy(st->pid, "-", sizeof(st->pid));
+
+		if (!logfile && !sockpath && host) {
+			if (nslookup(host, svcname, family, sa))
+				return 1;
+			salen = sa->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6)
+							  : sizeof(struct sockaddr_in);
+		} else
+			sa = NULL;
+
+		stream_init(st, logfile, sockpath, sa, salen);
+		return stream(st);
+	}
+
 	if (logfile) {
 		if (strcmp(logfile, "-")) {
 			log_opts |= LOG_NLOG;
@@ -427,8 +812,8 @@ int main(int argc, char *argv[])
 			return fclose(fp);
 		}
 	} else if (host) {
-		log.log_host = &sa;
-		if (nslookup(host, svcname, family, &sa))
+		log.log_host = sa;
+		if (nslookup(host, svcname, family, sa))
 			return 1;
 		log_opts |= LOG_NDELAY;
 	}
@@ -0,0 +1,578 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Runtime metrics: global counters and histograms, updated with relaxed
+ * atomics from the main loop and receiver workers, and per-object
+ * counters for sockets and actions provided by syslogd when rendering.
+ * Exposed on a UNIX stream socket, in Prometheus text format or JSON.
+ * Either send a command, "metrics" or "json", or an HTTP GET request
+ * for /metrics or /metrics.json, e.g., with curl --unix-socket.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+#include "queue.h"
+#include "socket.h"
+#include "compat.h"
+
+#define PREFIX   "syslogd_"
+#define MAXCONN  16		/* concurrent control connections */
+#define TIMEOUT  5		/* sec, for a client to get its reply */
+
+uint64_t metrics[M_MAX];
+
+/* Upper bounds of histogram buckets in usec, the last one is +Inf */
+static const uint64_t bounds[] = {
+	10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000
+};
+#define NBOUNDS (sizeof(bounds) / sizeof(bounds[0]))
+
+static struct {
+	uint64_t bucket[NBOUNDS + 1];
+	uint64_t count;
+	uint64_t sum;
+} hist[MH_MAX];
+
+static uint64_t phase[MS_MAX];
+
+/* Counters with a label are one metric, they must be adjacent */
+static const struct {
+	const char *name;
+	const char *help;
+	const char *source;
+} counters[M_MAX] = {
+	[M_RX_UNIX]      = { "received_total",        "Messages received", "unix"   },
+	[M_RX_INET]      = { "received_total",        "Messages received", "inet"   },
+	[M_RX_STREAM]    = { "received_total",        "Messages received", "stream" },
+	[M_RX_KERNEL]    = { "received_total",        "Messages received", "kernel" },
+	[M_RX_ERRORS]    = { "receive_errors_total",  "Failed receive calls", NULL },
+	[M_PARSE_ERRORS] = { "parse_errors_total",    "Invalid messages ignored", NULL },
+	[M_REJECTED]     = { "rejected_total",        "Messages from peers not allowed", NULL },
+	[M_RATELIMITED]  = { "ratelimited_total",     "Messages over the per-source rate limit", NULL },
+	[M_DROPPED]      = { "dropped_total",         "Messages dropped, receiver queue full", NULL },
+	[M_LOGGED]       = { "logged_total",          "Messages handled", NULL },
+	[M_DUPLICATES]   = { "duplicates_total",      "Repeated messages suppressed", NULL },
+	[M_ROTATIONS]    = { "rotations_total",       "Log file rotations", NULL },
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+} hists[MH_MAX] = {
+	[MH_LATENCY] = { "latency_seconds", "Time from receive until written to all actions" },
+	[MH_ROTATE]  = { "rotate_seconds",  "Time to rotate a log file" },
+};
+
+static const char *phases[MS_MAX] = {
+	[MS_CONFIG]  = "config",
+	[MS_SOCKETS] = "sockets",
+	[MS_ACTIONS] = "actions",
+	[MS_KERNEL]  = "kernel",
+	[MS_READY]   = "ready",
+	[MS_RESOLVE] = "resolve",
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+	const char *label;
+} families[MF_MAX] = {
+	[MF_SOCKET_RX]        = { "socket_received_total",   "Messages received per socket", "socket" },
+	[MF_ACTION_WRITES]    = { "action_writes_total",     "Messages written per action", "action" },
+	[MF_ACTION_BYTES]     = { "action_bytes_total",      "Bytes written per action", "action" },
+	[MF_ACTION_ERRORS]    = { "action_errors_total",     "Write errors per action", "action" },
+	[MF_ACTION_DUPS]      = { "action_duplicates_total", "Repeated messages suppressed per action", "action" },
+	[MF_ACTION_SUSPENDED] = { "action_suspended_seconds_total",
+				  "Time forwarding to action was suspended", "action" },
+};
+
+struct emit {
+	FILE		*fp;
+	int		 fmt;
+	const char	*name;
+	const char	*label;
+	int		 num;
+};
+
+/*
+ * Control connection, the reply is rendered when the request is read
+ * and written from the main loop as the client reads it, never waiting
+ * for the client.
+ */
+struct ctl {
+	LIST_ENTRY(ctl)	 link;
+	int		 sd;
+	uint64_t	 since;		/* usec, when accepted */
+	char		*buf;		/* reply, once the request is read */
+	size_t		 len;
+	size_t		 off;		/* sent */
+};
+
+static LIST_HEAD(, ctl) ctl_list = LIST_HEAD_INITIALIZER();
+static int       ctl_sd = -1;
+static char     *ctl_path;
+static metrics_fn ctl_fn;
+static int       ctl_conns;
+
+uint64_t metrics_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void metrics_observe(int h, uint64_t usec)
+{
+	size_t i;
+
+	for (i = 0; i < NBOUNDS; i++) {
+		if (usec <= bounds[i])
+			break;
+	}
+
+	__atomic_add_fetch(&hist[h].bucket[i], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist[h].count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist[h].sum, usec, __ATOMIC_RELAXED);
+}
+
+static uint64_t get(uint64_t *val)
+{
+	return __atomic_load_n(val, __ATOMIC_RELAXED);
+}
+
+/*
+ * Record the duration of a startup phase, or the time since start
+ */
+void metrics_phase(int ph, uint64_t usec)
+{
+	phase[ph] = usec;
+}
+
+/* Quoted label value or JSON key, same escapes in both formats */
+static void quote(FILE *fp, const char *str)
+{
+	fputc('"', fp);
+	for (; *str; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			fprintf(fp, "\\%c", c);
+		else if (c == '\n')
+			fputs("\\n", fp);
+		else if (c < 0x20)
+			fprintf(fp, "\\u%04x", c);
+		else
+			fputc(c, fp);
+	}
+	fputc('"', fp);
+}
+
+static void header(FILE *fp, const char *name, const char *help, const char *type)
+{
+	fprintf(fp, "# HELP " PREFIX "%s %s.\n", name, help);
+	fprintf(fp, "# TYPE " PREFIX "%s %s\n", name, type);
+}
+
+static void emit(void *arg, const char *label, uint64_t val)
+{
+	struct emit *e = arg;
+
+	if (e->fmt == METRICS_JSON) {
+		fprintf(e->fp, "%s\n    ", e->num ? "," : "");
+		quote(e->fp, label);
+		fprintf(e->fp, ": %llu", (unsigned long long)val);
+	} else {
+		fprintf(e->fp, PREFIX "%s{%s=", e->name, e->label);
+		quote(e->fp, label);
+		fprintf(e->fp, "} %llu\n", (unsigned long long)val);
+	}
+	e->num++;
+}
+
+static void render_prom(FILE *fp, metrics_fn fn)
+{
+	const char *prev = NULL;
+
+	for (int i = 0; i < M_MAX; i++) {
+		if (!prev || strcmp(prev, counters[i].name))
+			header(fp, counters[i].name, counters[i].help, "counter");
+		prev = counters[i].name;
+
+		if (counters[i].source)
+			fprintf(fp, PREFIX "%s{source=\"%s\"} %llu\n", counters[i].name,
+				counters[i].source, (unsigned long long)get(&metrics[i]));
+		else
+			fprintf(fp, PREFIX "%s %llu\n", counters[i].name,
+				(unsigned long long)get(&metrics[i]));
+	}
+
+	for (int h = 0; h < MH_MAX; h++) {
+		uint64_t cum = 0;
+
+		header(fp, hists[h].name, hists[h].help, "histogram");
+		for (size_t i = 0; i <= NBOUNDS; i++) {
+			cum += get(&hist[h].bucket[i]);
+			if (i < NBOUNDS)
+				fprintf(fp, PREFIX "%s_bucket{le=\"%g\"} %llu\n", hists[h].name,
+					bounds[i] / 1e6, (unsigned long long)cum);
+			else
+				fprintf(fp, PREFIX "%s_bucket{le=\"+Inf\"} %llu\n", hists[h].name,
+					(unsigned long long)cum);
+		}
+		fprintf(fp, PREFIX "%s_sum %.6f\n", hists[h].name, get(&hist[h].sum) / 1e6);
+		fprintf(fp, PREFIX "%s_count %llu\n", hists[h].name,
+			(unsigned long long)get(&hist[h].count));
+	}
+
+	header(fp, "startup_seconds", "Time of startup phases, ready and resolve since start", "gauge");
+	for (int s = 0; s < MS_MAX; s++)
+		fprintf(fp, PREFIX "startup_seconds{phase=\"%s\"} %.6f\n", phases[s],
+			phase[s] / 1e6);
+
+	for (int m = 0; m < MF_MAX && fn; m++) {
+		struct emit e = { fp, METRICS_PROM, families[m].name, families[m].label, 0 };
+
+		header(fp, families[m].name, families[m].help, "counter");
+		fn(m, emit, &e);
+	}
+}
+
+static void render_json(FILE *fp, metrics_fn fn)
+{
+	const char *prev = NULL;
+
+	fputs("{", fp);
+	for (int i = 0; i < M_MAX; i++) {
+		int same = prev && !strcmp(prev, counters[i].name);
+
+		if (prev && !same && counters[i - 1].source)
+			fputs("\n  }", fp);
+		if (!same)
+			fprintf(fp, "%s\n  \"%s\": ", prev ? "," : "", counters[i].name);
+		prev = counters[i].name;
+
+		if (counters[i].source)
+			fprintf(fp, "%s\n    \"%s\": %llu", same ? "," : "{",
+				counters[i].source, (unsigned long long)get(&metrics[i]));
+		else
+			fprintf(fp, "%llu", (unsigned long long)get(&metrics[i]));
+	}
+	if (counters[M_MAX - 1].source)
+		fputs("\n  }", fp);
+
+	for (int h = 0; h < MH_MAX; h++) {
+		uint64_t cum = 0;
+
+		fprintf(fp, ",\n  \"%s\": {\n    \"le_usec\": [", hists[h].name);
+		for (size_t i = 0; i < NBOUNDS; i++)
+			fprintf(fp, "%s%llu", i ? ", " : "", (unsigned long long)bounds[i]);
+		fputs("],\n    \"buckets\": [", fp);
+		for (size_t i = 0; i <= NBOUNDS; i++) {
+			cum += get(&hist[h].bucket[i]);
+			fprintf(fp, "%s%llu", i ? ", " : "", (unsigned long long)cum);
+		}
+		fprintf(fp, "],\n    \"count\": %llu,\n    \"sum_usec\": %llu\n  }",
+			(unsigned long long)get(&hist[h].count),
+			(unsigned long long)get(&hist[h].sum));
+	}
+
+	fputs(",\n  \"startup_usec\": {", fp);
+	for (int s = 0; s < MS_MAX; s++)
+		fprintf(fp, "%s\n    \"%s\": %llu", s ? "," : "", phases[s],
+			(unsigned long long)phase[s]);
+	fputs("\n  }", fp);
+
+	for (int m = 0; m < MF_MAX && fn; m++) {
+		struct emit e = { fp, METRICS_JSON, families[m].name, families[m].label, 0 };
+
+		fprintf(fp, ",\n  \"%s\": {", families[m].name);
+		fn(m, emit, &e);
+		fputs(e.num ? "\n  }" : "}", fp);
+	}
+	fputs("\n}\n", fp);
+}
+
+/*
+ * Render all metrics, returns a buffer to be freed by the caller.
+ */
+char *metrics_render(int fmt, metrics_fn fn, size_t *len)
+{
+	char *buf = NULL;
+	FILE *fp;
+
+	fp = open_memstream(&buf, len);
+	if (!fp)
+		return NULL;
+
+	if (fmt == METRICS_JSON)
+		render_json(fp, fn);
+	else
+		render_prom(fp, fn);
+
+	if (fclose(fp)) {
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+static void ctl_close(struct ctl *c)
+{
+	socket_close(c->sd);
+	LIST_REMOVE(c, link);
+	free(c->buf);
+	free(c);
+	ctl_conns--;
+}
+
+/* Write as much of the reply as the client takes, close when done */
+static void ctl_write(struct ctl *c)
+{
+	while (c->off < c->len) {
+		ssize_t num;
+
+		num = write(c->sd, &c->buf[c->off], c->len - c->off);
+		if (num < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (socket_pollout(c->sd, 1))
+					break;
+				return;
+			}
+			break;
+		}
+		c->off += num;
+	}
+
+	ctl_close(c);
+}
+
+/* Reply is header, if any, and body, in one buffer */
+static void ctl_reply(struct ctl *c, const char *hdr, size_t hlen, const char *body, size_t len)
+{
+	c->buf = malloc(hlen + len);
+	if (!c->buf) {
+		ctl_close(c);
+		return;
+	}
+
+	memcpy(c->buf, hdr, hlen);
+	if (len)
+		memcpy(&c->buf[hlen], body, len);
+	c->len = hlen + len;
+
+	ctl_write(c);
+}
+
+/*
+ * Requests are tiny, so expected in one read.  Either a command, or
+ * the first line of an HTTP GET request.  One reply, then we close.
+ */
+static void ctl_read(struct ctl *c)
+{
+	const char *type = "text/plain; version=0.0.4";
+	char req[512], *cmd, *body;
+	char hdr[160] = { 0 };
+	int http, fmt = -1;
+	size_t len = 0;
+	int hlen = 0;
+	ssize_t num;
+
+	num = read(c->sd, req, sizeof(req) - 1);
+	if (num < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (num <= 0) {
+		ctl_close(c);
+		return;
+	}
+	req[num] = 0;
+
+	http = !strncmp(req, "GET ", 4);
+	cmd = http ? &req[4] : req;
+	cmd[strcspn(cmd, http ? " \r\n" : " \t\r\n")] = 0;
+
+	if (!strcmp(cmd, "json") || !strcmp(cmd, "/metrics.json")) {
+		fmt = METRICS_JSON;
+		type = "application/json";
+	} else if (!strcmp(cmd, "metrics") || !strcmp(cmd, "/metrics") || !strcmp(cmd, "/"))
+		fmt = METRICS_PROM;
+
+	body = fmt < 0 ? NULL : metrics_render(fmt, ctl_fn, &len);
+	if (http) {
+		if (body)
+			hlen = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+					"Content-Type: %s\r\nContent-Length: %zu\r\n"
+					"Connection: close\r\n\r\n", type, len);
+		else
+			hlen = snprintf(hdr, sizeof(hdr), "HTTP/1.0 404 Not Found\r\n"
+					"Content-Length: 0\r\nConnection: close\r\n\r\n");
+	} else if (!body)
+		hlen = snprintf(hdr, sizeof(hdr), "Unknown command, use: metrics, or json\n");
+
+	ctl_reply(c, hdr, hlen, body, len);
+	free(body);
+}
+
+static void ctl_cb(int sd, void *arg)
+{
+	struct ctl *c = arg;
+
+	(void)sd;
+
+	if (c->buf)
+		ctl_write(c);
+	else
+		ctl_read(c);
+}
+
+static void ctl_accept(int sd, void *arg)
+{
+	struct ctl *c, *tmp;
+	uint64_t now;
+
+	(void)arg;
+
+	/* Drop clients that have not sent a request, or read the reply */
+	now = metrics_usec();
+	LIST_FOREACH_SAFE(c, &ctl_list, link, tmp) {
+		if (now - c->since >= TIMEOUT * 1000000ULL)
+			ctl_close(c);
+	}
+
+	for (;;) {
+		int cd;
+
+		cd = accept4(sd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (cd < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (ctl_conns >= MAXCONN || !(c = calloc(1, sizeof(*c)))) {
+			close(cd);
+			continue;
+		}
+		c->sd    = cd;
+		c->since = now;
+		if (socket_register(cd, NULL, ctl_cb, c) < 0) {
+			free(c);
+			close(cd);
+			continue;
+		}
+		LIST_INSERT_HEAD(&ctl_list, c, link);
+		ctl_conns++;
+	}
+}
+
+/*
+ * Open control socket at path, unless already open there.  Returns -1
+ * and errno on failure.
+ */
+int metrics_open(const char *path, metrics_fn fn)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	int sd, saved;
+
+	ctl_fn = fn;
+	if (ctl_path && !strcmp(ctl_path, path))
+		return 0;
+	metrics_close();
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+
+	sd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sd < 0)
+		return -1;
+
+	(void)unlink(path);
+	if (bind(sd, (struct sockaddr *)&sun, sizeof(sun)) || chmod(path, 0660) ||
+	    listen(sd, MAXCONN))
+		goto err;
+
+	if (socket_register(sd, NULL, ctl_accept, NULL) < 0)
+		goto err;
+
+	ctl_path = strdup(path);
+	ctl_sd = sd;
+
+	return 0;
+err:
+	saved = errno;
+	close(sd);
+	(void)unlink(path);
+	errno = saved;
+
+	return -1;
+}
+
+void metrics_close(void)
+{
+	struct ctl *c, *tmp;
+
+	LIST_FOREACH_SAFE(c, &ctl_list, link, tmp)
+		ctl_close(c);
+
+	if (ctl_sd == -1)
+		return;
+
+	socket_close(ctl_sd);
+	ctl_sd = -1;
+
+	(void)unlink(ctl_path);
+	free(ctl_path);
+	ctl_path = NULL;
+}
+
+/**
+ * Local Variables:
+ *  indent-tabs-mode: t
+ *  c-file-style: "linux"
+ * End:
+ */
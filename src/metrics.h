@@ -0,0 +1,106 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef SYSKLOGD_METRICS_H_
+#define SYSKLOGD_METRICS_H_
+
+#include <stdint.h>
+
+/* Global counters, relaxed atomics since receiver workers count too */
+enum {
+	M_RX_UNIX,		/* messages received on UNIX sockets */
+	M_RX_INET,		/* ... on UDP sockets, incl. workers */
+	M_RX_STREAM,		/* ... on TCP/TLS connections       */
+	M_RX_KERNEL,		/* ... from the kernel log          */
+	M_RX_ERRORS,		/* failed receive calls             */
+	M_PARSE_ERRORS,		/* invalid messages, ignored        */
+	M_REJECTED,		/* from peers not allowed, ignored  */
+	M_RATELIMITED,		/* over the per-source rate limit   */
+	M_DROPPED,		/* receiver worker queue full       */
+	M_LOGGED,		/* messages handled by logmsg()     */
+	M_DUPLICATES,		/* suppressed as repeated           */
+	M_ROTATIONS,		/* log file rotations               */
+	M_MAX
+};
+
+/* Histograms, in microseconds */
+enum {
+	MH_LATENCY,		/* from receive to written to all actions */
+	MH_ROTATE,		/* time to rotate a log file */
+	MH_MAX
+};
+
+/* Startup phases, in microseconds, see metrics_phase() */
+enum {
+	MS_CONFIG,		/* reading .conf files              */
+	MS_SOCKETS,		/* opening listening sockets        */
+	MS_ACTIONS,		/* opening log files, targets, etc. */
+	MS_KERNEL,		/* reading the kernel log backlog   */
+	MS_READY,		/* from start until the main loop   */
+	MS_RESOLVE,		/* ... until all targets resolved   */
+	MS_MAX
+};
+
+/* Per-object counters, e.g. per socket or action, see metrics_fn */
+enum {
+	MF_SOCKET_RX,
+	MF_ACTION_WRITES,
+	MF_ACTION_BYTES,
+	MF_ACTION_ERRORS,
+	MF_ACTION_DUPS,
+	MF_ACTION_SUSPENDED,
+	MF_MAX
+};
+
+#define METRICS_PROM	0	/* Prometheus text exposition format */
+#define METRICS_JSON	1
+
+extern uint64_t metrics[M_MAX];
+
+#define metric_inc(m)     __atomic_add_fetch(&metrics[m], 1, __ATOMIC_RELAXED)
+#define metric_add(m, n)  __atomic_add_fetch(&metrics[m], (n), __ATOMIC_RELAXED)
+
+/*
+ * Called when rendering, once for each MF_ family, to emit the value
+ * of each object, labeled with its name.
+ */
+typedef void (*metrics_emit_fn)(void *ctx, const char *label, uint64_t val);
+typedef void (*metrics_fn)(int family, metrics_emit_fn emit, void *ctx);
+
+uint64_t metrics_usec    (void);
+void     metrics_observe (int hist, uint64_t usec);
+void     metrics_phase   (int phase, uint64_t usec);
+
+char    *metrics_render  (int fmt, metrics_fn fn, size_t *len);
+
+int      metrics_open    (const char *path, metrics_fn fn);
+void     metrics_close   (void);
+
+#endif /* SYSKLOGD_METRICS_H_ */
@@ -0,0 +1,394 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "outq.h"
+
+#define OUTQ_IOVMAX 64		/* messages per writev() */
+
+struct outmsg {
+	struct outmsg *next;
+	size_t         len;
+	char           data[];
+};
+
+/*
+ * A bounded FIFO of formatted messages for one log action, drained by
+ * a dedicated writer thread.  The main thread only copies the message
+ * and signals the writer, so a slow file system, a full pipe, or a
+ * blocked terminal only ever stalls the writer.
+ *
+ * The writer owns the descriptor while it is busy writing a batch.
+ * The main thread retains ownership for open/close/rotate and uses
+ * outq_drain() or outq_setfd() to synchronize with the writer before
+ * it touches the descriptor.
+ */
+struct outq {
+	pthread_mutex_t  lock;
+	pthread_cond_t   work;		/* writer: messages queued, or stop */
+	pthread_cond_t   idle;		/* producer: space available, or idle */
+	pthread_t        tid;
+
+	struct outmsg   *head;
+	struct outmsg  **tail;
+	size_t           depth;
+	size_t           max;
+	int              policy;
+
+	int              fd;
+	int              sync;		/* fsync() after each batch */
+	int              busy;		/* writer holds a batch */
+	int              stop;
+	int              error;		/* last write error, for main thread */
+	uint64_t         drops;
+};
+
+static void outmsg_free(struct outmsg *m)
+{
+	while (m) {
+		struct outmsg *next = m->next;
+
+		free(m);
+		m = next;
+	}
+}
+
+static size_t outmsg_count(struct outmsg *m)
+{
+	size_t num = 0;
+
+	for (; m; m = m->next)
+		num++;
+
+	return num;
+}
+
+/*
+ * Called without the lock held.  Writes up to OUTQ_IOVMAX messages per
+ * system call.  Transient errors, a full pipe or file system, drop the
+ * batch just like the synchronous path in fprintlog_write() does, other
+ * errors are returned for the main thread to act on.
+ */
+static int outq_write(int fd, int sync, struct outmsg *m, uint64_t *drops)
+{
+	struct iovec iov[OUTQ_IOVMAX];
+	int wrote = 0;
+
+	while (m) {
+		struct outmsg *first = m;
+		int num = 0;
+
+		while (m && num < OUTQ_IOVMAX) {
+			iov[num].iov_base = m->data;
+			iov[num].iov_len  = m->len;
+			num++;
+			m = m->next;
+		}
+
+		while (writev(fd, iov, num) < 0) {
+			int e = errno;
+
+			if (e == EINTR)
+				continue;
+
+			if (e == EAGAIN || e == ENOSPC) {
+				*drops += num;
+				break;
+			}
+
+			*drops += outmsg_count(first);
+			return e;
+		}
+		wrote = 1;
+	}
+
+	if (sync && wrote)
+		(void)fsync(fd);
+
+	return 0;
+}
+
+static void *outq_run(void *arg)
+{
+	struct outq *q = arg;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		struct outmsg *batch;
+		uint64_t drops = 0;
+		int fd, sync, e;
+
+		while (!q->head && !q->stop)
+			pthread_cond_wait(&q->work, &q->lock);
+		if (!q->head)
+			break;
+
+		batch    = q->head;
+		q->head  = NULL;
+		q->tail  = &q->head;
+		q->depth = 0;
+		q->busy  = 1;
+		fd       = q->fd;
+		sync     = q->sync;
+		pthread_cond_broadcast(&q->idle);
+		pthread_mutex_unlock(&q->lock);
+
+		if (fd < 0) {
+			drops = outmsg_count(batch);
+			e = 0;
+		} else
+			e = outq_write(fd, sync, batch, &drops);
+		outmsg_free(batch);
+
+		pthread_mutex_lock(&q->lock);
+		if (e)
+			q->error = e;
+		q->drops += drops;
+		q->busy = 0;
+		pthread_cond_broadcast(&q->idle);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return NULL;
+}
+
+/*
+ * Create a queue holding at most max messages for descriptor fd.
+ */
+struct outq *outq_new(int fd, size_t max, int policy, int sync)
+{
+	sigset_t all, old;
+	struct outq *q;
+
+	q = calloc(1, sizeof(*q));
+	if (!q)
+		return NULL;
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->work, NULL);
+	pthread_cond_init(&q->idle, NULL);
+	q->tail   = &q->head;
+	q->max    = max ? max : 1;
+	q->policy = policy;
+	q->fd     = fd;
+	q->sync   = sync;
+
+	/* Signals are handled by the main thread only */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	errno = pthread_create(&q->tid, NULL, outq_run, q);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (errno) {
+		pthread_cond_destroy(&q->idle);
+		pthread_cond_destroy(&q->work);
+		pthread_mutex_destroy(&q->lock);
+		free(q);
+		return NULL;
+	}
+
+	return q;
+}
+
+/*
+ * Stop the writer after it has flushed all queued messages.  The
+ * descriptor is left open, it belongs to the caller.
+ */
+void outq_free(struct outq *q)
+{
+	if (!q)
+		return;
+
+	pthread_mutex_lock(&q->lock);
+	q->stop = 1;
+	pthread_cond_broadcast(&q->work);
+	pthread_cond_broadcast(&q->idle);
+	pthread_mutex_unlock(&q->lock);
+	pthread_join(q->tid, NULL);
+
+	outmsg_free(q->head);
+	pthread_cond_destroy(&q->idle);
+	pthread_cond_destroy(&q->work);
+	pthread_mutex_destroy(&q->lock);
+	free(q);
+}
+
+/*
+ * Copy message to the tail of the queue.  Returns 0 when queued and
+ * 1 when a message, the new one or the oldest one, had to be dropped.
+ */
+int outq_push(struct outq *q, const struct iovec *iov, int iovcnt)
+{
+	struct outmsg *m;
+	size_t len = 0;
+	int dropped = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	m = malloc(sizeof(*m) + len);
+	if (!m)
+		goto drop;
+
+	m->next = NULL;
+	m->len  = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(&m->data[m->len], iov[i].iov_base, iov[i].iov_len);
+		m->len += iov[i].iov_len;
+	}
+
+	pthread_mutex_lock(&q->lock);
+	if (q->depth >= q->max) {
+		switch (q->policy) {
+		case OUTQ_BLOCK:
+			while (q->depth >= q->max && !q->stop)
+				pthread_cond_wait(&q->idle, &q->lock);
+			break;
+
+		case OUTQ_DROP_NEWEST:
+			q->drops++;
+			pthread_mutex_unlock(&q->lock);
+			free(m);
+			return 1;
+
+		default: {
+			struct outmsg *old = q->head;
+
+			q->head = old->next;
+			if (!q->head)
+				q->tail = &q->head;
+			q->depth--;
+			q->drops++;
+			free(old);
+			dropped = 1;
+			break;
+		}
+		}
+	}
+
+	*q->tail = m;
+	q->tail  = &m->next;
+	q->depth++;
+	pthread_cond_signal(&q->work);
+	pthread_mutex_unlock(&q->lock);
+
+	return dropped;
+drop:
+	pthread_mutex_lock(&q->lock);
+	q->drops++;
+	pthread_mutex_unlock(&q->lock);
+
+	return 1;
+}
+
+/*
+ * Wait for the writer to empty the queue, e.g., before log rotation.
+ */
+void outq_drain(struct outq *q)
+{
+	pthread_mutex_lock(&q->lock);
+	while ((q->head || q->busy) && !q->stop)
+		pthread_cond_wait(&q->idle, &q->lock);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Hand a new descriptor to the writer, or -1 to discard all output.
+ * Waits for any in-flight batch so the old descriptor can be closed.
+ */
+void outq_setfd(struct outq *q, int fd)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->busy)
+		pthread_cond_wait(&q->idle, &q->lock);
+	q->fd = fd;
+	q->error = 0;
+	pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Return, and clear, the last error reported by the writer.
+ */
+int outq_error(struct outq *q)
+{
+	int e;
+
+	pthread_mutex_lock(&q->lock);
+	e = q->error;
+	q->error = 0;
+	pthread_mutex_unlock(&q->lock);
+
+	return e;
+}
+
+size_t outq_depth(struct outq *q)
+{
+	size_t depth;
+
+	pthread_mutex_lock(&q->lock);
+	depth = q->depth;
+	pthread_mutex_unlock(&q->lock);
+
+	return depth;
+}
+
+/*
+ * Return, and reset, the number of dropped messages.
+ */
+uint64_t outq_drops(struct outq *q)
+{
+	uint64_t drops;
+
+	pthread_mutex_lock(&q->lock);
+	drops = q->drops;
+	q->drops = 0;
+	pthread_mutex_unlock(&q->lock);
+
+	return drops;
+}
+
+const char *outq_policy(int policy)
+{
+	switch (policy) {
+	case OUTQ_BLOCK:
+		return "block";
+	case OUTQ_DROP_NEWEST:
+		return "drop-newest";
+	default:
+		break;
+	}
+
+	return "drop-oldest";
+}
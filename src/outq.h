@@ -0,0 +1,58 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef SYSKLOGD_OUTQ_H_
+#define SYSKLOGD_OUTQ_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/* Overflow policies, what outq_push() does when the queue is full */
+#define OUTQ_DROP_OLDEST 0	/* discard the oldest queued message */
+#define OUTQ_DROP_NEWEST 1	/* discard the message being queued  */
+#define OUTQ_BLOCK       2	/* wait for the writer to catch up   */
+
+struct outq;
+
+struct outq *outq_new    (int fd, size_t max, int policy, int sync);
+void         outq_free   (struct outq *q);
+
+int          outq_push   (struct outq *q, const struct iovec *iov, int iovcnt);
+void         outq_drain  (struct outq *q);
+void         outq_setfd  (struct outq *q, int fd);
+
+int          outq_error  (struct outq *q);
+size_t       outq_depth  (struct outq *q);
+uint64_t     outq_drops  (struct outq *q);
+
+const char  *outq_policy (int policy);
+
+#endif /* SYSKLOGD_OUTQ_H_ */
@@ -0,0 +1,387 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "queue.h"
+#include "ratelimit.h"
+
+#define RATELIMIT_SHARDS  16	/* power of two, independently locked */
+#define RATELIMIT_BUCKETS 512	/* per shard, power of two */
+#define TOKEN             1000000ULL /* one message, in micro tokens */
+
+/*
+ * Token bucket per source: remote address, or pid and uid of a local
+ * sender.  Each bucket holds at most burst messages, is refilled with
+ * rate messages per second, and every message takes one.  Shared by
+ * the main loop and the receiver workers, so the table is split in
+ * shards by hash, each with its own lock, LRU, and share of the sources
+ * tracked, for senders to rarely contend.  The least recently seen
+ * source in a shard is evicted when it is full, and buckets that have
+ * been refilled to the brim are dropped when reporting, so only active
+ * sources use memory.
+ */
+struct rlkey {
+	int			 family; /* AF_INET, AF_INET6, or AF_UNIX */
+	union {
+		struct in_addr	 in;
+		struct in6_addr	 in6;
+		struct {
+			pid_t	 pid;
+			uid_t	 uid;
+		} cred;
+	} u;
+};
+
+struct rlentry {
+	LIST_ENTRY(rlentry)	 link;	/* hash bucket */
+	TAILQ_ENTRY(rlentry)	 lru;	/* most recently used first */
+
+	struct rlkey		 key;
+	uint64_t		 hash;
+	uint64_t		 tokens; /* micro tokens */
+	uint64_t		 last;	 /* usec of last refill */
+	uint64_t		 suppressed; /* since last report */
+};
+
+struct rlsum {
+	struct rlkey		 key;
+	uint64_t		 num;
+};
+
+struct rlshard {
+	pthread_mutex_t		 lock;
+	LIST_HEAD(, rlentry)	 buckets[RATELIMIT_BUCKETS];
+	TAILQ_HEAD(rllru, rlentry) lru;
+	size_t			 nentries;
+	uint64_t		 evicted; /* suppressed, from evicted sources */
+};
+
+static struct rlshard            shards[RATELIMIT_SHARDS];
+static pthread_once_t            once = PTHREAD_ONCE_INIT;
+static uint64_t                  rate, burst; /* written with all shards locked */
+
+static void init(void)
+{
+	for (size_t i = 0; i < RATELIMIT_SHARDS; i++) {
+		pthread_mutex_init(&shards[i].lock, NULL);
+		TAILQ_INIT(&shards[i].lru);
+	}
+}
+
+/* Low bits pick the shard, the ones above the bucket within it */
+static struct rlshard *shard(uint64_t hash)
+{
+	return &shards[hash & (RATELIMIT_SHARDS - 1)];
+}
+
+static size_t bucket(uint64_t hash)
+{
+	return (hash / RATELIMIT_SHARDS) & (RATELIMIT_BUCKETS - 1);
+}
+
+static void lock_all(void)
+{
+	pthread_once(&once, init);
+	for (size_t i = 0; i < RATELIMIT_SHARDS; i++)
+		pthread_mutex_lock(&shards[i].lock);
+}
+
+static void unlock_all(void)
+{
+	for (size_t i = RATELIMIT_SHARDS; i > 0; i--)
+		pthread_mutex_unlock(&shards[i - 1].lock);
+}
+
+static struct rlentry *find(struct rlshard *s, const struct rlkey *key, uint64_t hash)
+{
+	struct rlentry *e;
+
+	LIST_FOREACH(e, &s->buckets[bucket(hash)], link) {
+		if (e->hash == hash && !memcmp(&e->key, key, sizeof(*key)))
+			return e;
+	}
+
+	return NULL;
+}
+
+static void drop(struct rlshard *s, struct rlentry *e)
+{
+	LIST_REMOVE(e, link);
+	TAILQ_REMOVE(&s->lru, e, lru);
+	s->nentries--;
+	free(e);
+}
+
+static void refill(struct rlentry *e, uint64_t usec)
+{
+	uint64_t cap = burst * TOKEN;
+	uint64_t diff;
+
+	/* Workers timestamp per batch, may be behind the main loop */
+	if (usec <= e->last)
+		return;
+
+	diff = usec - e->last;
+	e->last = usec;
+	if (diff >= (cap - e->tokens) / rate)
+		e->tokens = cap;
+	else
+		e->tokens += diff * rate;
+}
+
+static int check(const struct rlkey *key, uint64_t usec)
+{
+	struct rlshard *s;
+	struct rlentry *e;
+	uint64_t hash;
+	int ok = 1;
+
+	if (!__atomic_load_n(&rate, __ATOMIC_RELAXED))
+		return 1;
+
+	hash = hash64(key, sizeof(*key), 0);
+	s = shard(hash);
+
+	pthread_once(&once, init);
+	pthread_mutex_lock(&s->lock);
+	if (!rate)
+		goto done;
+
+	e = find(s, key, hash);
+	if (e) {
+		refill(e, usec);
+		TAILQ_REMOVE(&s->lru, e, lru);
+		TAILQ_INSERT_HEAD(&s->lru, e, lru);
+	} else {
+		if (s->nentries >= RATELIMIT_SIZE / RATELIMIT_SHARDS) {
+			e = TAILQ_LAST(&s->lru, rllru);
+			s->evicted += e->suppressed;
+			drop(s, e);
+		}
+
+		/* Out of memory, let it through rather than lose it */
+		e = calloc(1, sizeof(*e));
+		if (!e)
+			goto done;
+
+		e->key    = *key;
+		e->hash   = hash;
+		e->tokens = burst * TOKEN;
+		e->last   = usec;
+		LIST_INSERT_HEAD(&s->buckets[bucket(hash)], e, link);
+		TAILQ_INSERT_HEAD(&s->lru, e, lru);
+		s->nentries++;
+	}
+
+	if (e->tokens >= TOKEN) {
+		e->tokens -= TOKEN;
+	} else {
+		e->suppressed++;
+		ok = 0;
+	}
+done:
+	pthread_mutex_unlock(&s->lock);
+
+	return ok;
+}
+
+/*
+ * Set rate, in messages per second, and burst.  A rate of zero disables
+ * rate limiting, suppressed messages are still reported once more.
+ */
+void ratelimit_set(unsigned int r, unsigned int b)
+{
+	struct rlentry *e;
+
+	if (r && b < 1)
+		b = 1;
+
+	lock_all();
+	if (r != rate || b != burst) {
+		__atomic_store_n(&rate, r, __ATOMIC_RELAXED);
+		burst = b;
+
+		/* Start over with full buckets, sources may have been let through */
+		for (size_t i = 0; i < RATELIMIT_SHARDS; i++) {
+			TAILQ_FOREACH(e, &shards[i].lru, lru)
+				e->tokens = burst * TOKEN;
+		}
+	}
+	unlock_all();
+}
+
+void ratelimit_exit(void)
+{
+	struct rlentry *e, *tmp;
+
+	lock_all();
+	for (size_t i = 0; i < RATELIMIT_SHARDS; i++) {
+		struct rlshard *s = &shards[i];
+
+		TAILQ_FOREACH_SAFE(e, &s->lru, lru, tmp)
+			drop(s, e);
+		s->evicted = 0;
+	}
+	unlock_all();
+}
+
+/*
+ * Returns 1 if a message from the remote address sa may be logged,
+ * otherwise 0, the message is then counted as suppressed.  Only the
+ * address is the key, not the port.
+ */
+int ratelimit_addr(const struct sockaddr *sa, uint64_t usec)
+{
+	struct rlkey key;
+
+	memset(&key, 0, sizeof(key));
+	switch (sa->sa_family) {
+	case AF_INET:
+		key.u.in = ((const struct sockaddr_in *)sa)->sin_addr;
+		break;
+	case AF_INET6:
+		key.u.in6 = ((const struct sockaddr_in6 *)sa)->sin6_addr;
+		break;
+	default:
+		return 1;
+	}
+	key.family = sa->sa_family;
+
+	return check(&key, usec);
+}
+
+/*
+ * Same as ratelimit_addr(), for a local sender on a UNIX socket.
+ */
+int ratelimit_cred(pid_t pid, uid_t uid, uint64_t usec)
+{
+	struct rlkey key;
+
+	memset(&key, 0, sizeof(key));
+	key.family     = AF_UNIX;
+	key.u.cred.pid = pid;
+	key.u.cred.uid = uid;
+
+	return check(&key, usec);
+}
+
+static void name(const struct rlkey *key, char *buf, size_t len)
+{
+	char comm[32] = { 0 };
+	char path[64];
+	FILE *fp;
+
+	switch (key->family) {
+	case AF_INET:
+	case AF_INET6:
+		if (!inet_ntop(key->family, &key->u, buf, len))
+			snprintf(buf, len, "unknown");
+		return;
+	}
+
+	snprintf(path, sizeof(path), "/proc/%d/comm", (int)key->u.cred.pid);
+	fp = fopen(path, "r");
+	if (fp) {
+		if (fgets(comm, sizeof(comm), fp))
+			comm[strcspn(comm, "\n")] = 0;
+		fclose(fp);
+	}
+
+	if (comm[0])
+		snprintf(buf, len, "%s[%d], uid %d", comm, (int)key->u.cred.pid,
+			 (int)key->u.cred.uid);
+	else
+		snprintf(buf, len, "pid %d, uid %d", (int)key->u.cred.pid,
+			 (int)key->u.cred.uid);
+}
+
+/*
+ * Call fn for each source with suppressed messages since last time, and
+ * drop sources that have been idle long enough to have a full bucket.
+ * Called from the main loop, fn is called without holding any lock.
+ */
+void ratelimit_report(uint64_t usec, ratelimit_fn fn)
+{
+	struct rlentry *e, *tmp;
+	struct rlsum *sum = NULL;
+	uint64_t others = 0;
+	size_t num = 0;
+	char buf[128];
+
+	lock_all();
+	for (size_t i = 0; i < RATELIMIT_SHARDS; i++) {
+		TAILQ_FOREACH(e, &shards[i].lru, lru) {
+			if (e->suppressed)
+				num++;
+		}
+	}
+	if (num)
+		sum = calloc(num, sizeof(*sum));
+
+	num = 0;
+	for (size_t i = 0; i < RATELIMIT_SHARDS; i++) {
+		struct rlshard *s = &shards[i];
+
+		TAILQ_FOREACH_SAFE(e, &s->lru, lru, tmp) {
+			if (e->suppressed && sum) {
+				sum[num].key = e->key;
+				sum[num].num = e->suppressed;
+				num++;
+			}
+			e->suppressed = 0;
+
+			if (rate)
+				refill(e, usec);
+			if (!rate || e->tokens == burst * TOKEN)
+				drop(s, e);
+		}
+		others    += s->evicted;
+		s->evicted = 0;
+	}
+	unlock_all();
+
+	for (size_t i = 0; i < num; i++) {
+		name(&sum[i].key, buf, sizeof(buf));
+		fn(buf, sum[i].num);
+	}
+	free(sum);
+
+	if (others)
+		fn("evicted sources", others);
+}
@@ -0,0 +1,55 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef SYSKLOGD_RATELIMIT_H_
+#define SYSKLOGD_RATELIMIT_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#define RATELIMIT_SIZE   4096	/* max tracked sources */
+#define RATELIMIT_REPORT 10	/* seconds between suppressed summaries */
+
+/*
+ * Called from ratelimit_report(), for each source that had messages
+ * suppressed since the last report.
+ */
+typedef void (*ratelimit_fn)(const char *source, uint64_t num);
+
+void ratelimit_set    (unsigned int rate, unsigned int burst);
+void ratelimit_exit   (void);
+
+int  ratelimit_addr   (const struct sockaddr *sa, uint64_t usec);
+int  ratelimit_cred   (pid_t pid, uid_t uid, uint64_t usec);
+
+void ratelimit_report (uint64_t usec, ratelimit_fn fn);
+
+#endif /* SYSKLOGD_RATELIMIT_H_ */
@@ -0,0 +1,425 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <pthread.h>
+#include <resolv.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include "compat.h"
+#include "resolve.h"
+#include "queue.h"
+
+/*
+ * Forward lookups of forwarding targets, in a resolver thread, so a
+ * slow or unreachable DNS server at boot does not hold up the start of
+ * syslogd.  Results are cached, also failed ones for a short while, so
+ * retries from every message logged to an unresolved target are cheap.
+ * The main loop is told a lookup is done by a byte on a pipe, it then
+ * retries all unresolved targets, also those that did not fit in the
+ * queue.  The cache is larger than the queue, so there is always an
+ * entry that can be evicted for a new lookup.  A single
+ * mutex protects the cache, the resolver thread never holds it while
+ * calling the resolver.
+ */
+enum { RS_PENDING, RS_OK, RS_FAIL };
+
+struct rsentry {
+	TAILQ_ENTRY(rsentry)	 lru;	/* most recently used first */
+	SIMPLEQ_ENTRY(rsentry)	 work;	/* pending lookups */
+
+	char			 host[NI_MAXHOST];
+	char			 serv[NI_MAXSERV];
+	int			 family;
+	int			 socktype;
+
+	int			 state;
+	int			 err;
+	time_t			 expires;
+	struct addrinfo		*ai;
+};
+
+static TAILQ_HEAD(rslru, rsentry) lru = TAILQ_HEAD_INITIALIZER(lru);
+static SIMPLEQ_HEAD(, rsentry)   work = SIMPLEQ_HEAD_INITIALIZER(work);
+static size_t                    nentries, npending;	/* npending: RS_PENDING entries */
+
+static pthread_mutex_t           lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t            cond = PTHREAD_COND_INITIALIZER;
+static pthread_t                 tid;
+static int                       running, stop;
+static int                       notify[2] = { -1, -1 };
+
+static time_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+/*
+ * Copy of a getaddrinfo() result in a single allocation, without the
+ * canonical name, so that it can be freed with free().
+ */
+static struct addrinfo *aicopy(const struct addrinfo *res)
+{
+	struct sockaddr_storage *ss;
+	const struct addrinfo *r;
+	struct addrinfo *ai;
+	size_t num = 0, i;
+
+	for (r = res; r; r = r->ai_next)
+		num++;
+
+	ai = calloc(num, sizeof(*ai) + sizeof(*ss));
+	if (!ai)
+		return NULL;
+	ss = (struct sockaddr_storage *)&ai[num];
+
+	for (r = res, i = 0; r; r = r->ai_next, i++) {
+		ai[i] = *r;
+		ai[i].ai_canonname = NULL;
+		ai[i].ai_addr = memcpy(&ss[i], r->ai_addr, MIN(r->ai_addrlen, sizeof(*ss)));
+		ai[i].ai_next = r->ai_next ? &ai[i + 1] : NULL;
+	}
+
+	return ai;
+}
+
+/*
+ * The resolver state is only reloaded after a failed lookup, e.g., at
+ * boot before the network is up, not on every lookup.
+ */
+static int lookup(const char *host, const char *serv, int family, int socktype,
+		  int flags, struct addrinfo **ai)
+{
+	struct addrinfo hints, *res;
+	const char *node = host;
+	int err;
+
+	if (!node || !node[0])
+		node = NULL;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags    = flags | (!node ? AI_PASSIVE : 0);
+	hints.ai_family   = family;
+	hints.ai_socktype = socktype;
+
+	err = getaddrinfo(node, serv, &hints, &res);
+	if (err) {
+		if (!(flags & AI_NUMERICHOST))
+			res_init();
+		return err;
+	}
+
+	*ai = aicopy(res);
+	freeaddrinfo(res);
+
+	return *ai ? 0 : EAI_MEMORY;
+}
+
+static struct rsentry *find(const char *host, const char *serv, int family, int socktype)
+{
+	struct rsentry *e;
+
+	TAILQ_FOREACH(e, &lru, lru) {
+		if (e->family == family && e->socktype == socktype &&
+		    !strcmp(e->host, host) && !strcmp(e->serv, serv))
+			return e;
+	}
+
+	return NULL;
+}
+
+static void drop(struct rsentry *e)
+{
+	TAILQ_REMOVE(&lru, e, lru);
+	nentries--;
+	free(e->ai);
+	free(e);
+}
+
+/*
+ * Make room for one more entry, pending lookups are never evicted
+ */
+static int evict(void)
+{
+	struct rsentry *e;
+
+	TAILQ_FOREACH_REVERSE(e, &lru, rslru, lru) {
+		if (e->state == RS_PENDING)
+			continue;
+
+		drop(e);
+		return 0;
+	}
+
+	return -1;
+}
+
+static void *resolver(void *arg)
+{
+	pthread_mutex_lock(&lock);
+	while (!stop) {
+		char host[NI_MAXHOST], serv[NI_MAXSERV];
+		struct addrinfo *ai = NULL;
+		int family, socktype;
+		struct rsentry *e;
+		int err;
+
+		e = SIMPLEQ_FIRST(&work);
+		if (!e) {
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+		SIMPLEQ_REMOVE_HEAD(&work, work);
+
+		/* Entry stays PENDING, so it cannot be evicted meanwhile */
+		strcpy(host, e->host);
+		strcpy(serv, e->serv);
+		family   = e->family;
+		socktype = e->socktype;
+		pthread_mutex_unlock(&lock);
+
+		err = lookup(host, serv, family, socktype, 0, &ai);
+
+		pthread_mutex_lock(&lock);
+		if (err) {
+			e->state   = RS_FAIL;
+			e->err     = err;
+			e->expires = now() + RESOLVE_NEGTTL;
+		} else {
+			e->state   = RS_OK;
+			e->ai      = ai;
+			e->expires = now() + RESOLVE_TTL;
+		}
+		npending--;
+
+		/* Full pipe is fine, the main loop has not read it yet */
+		(void)write(notify[1], "", 1);
+	}
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+/*
+ * Look up host:serv.  Numeric addresses, and all lookups if the resolver
+ * thread could not be started, are resolved directly.  Otherwise the
+ * cached result is returned, or the lookup is queued.  On pending, also
+ * when the queue is full, the caller should try again when resolve_fd()
+ * is readable, or later.  Only called from the main loop.
+ */
+int resolve_lookup(const char *host, const char *serv, int family, int socktype,
+		   struct addrinfo **ai, int *err)
+{
+	struct rsentry *e;
+	int rc;
+
+	*err = lookup(host, serv, family, socktype, AI_NUMERICHOST, ai);
+	if (!*err)
+		return RESOLVE_HIT;
+	if (*err != EAI_NONAME || strlen(host) >= sizeof(e->host) || strlen(serv) >= sizeof(e->serv))
+		return RESOLVE_FAIL;
+
+	pthread_mutex_lock(&lock);
+	if (!running)
+		goto direct;
+
+	e = find(host, serv, family, socktype);
+	if (e && e->state != RS_PENDING && e->expires <= now()) {
+		drop(e);
+		e = NULL;
+	}
+
+	if (e) {
+		TAILQ_REMOVE(&lru, e, lru);
+		TAILQ_INSERT_HEAD(&lru, e, lru);
+
+		switch (e->state) {
+		case RS_OK:
+			*ai = aicopy(e->ai);
+			if (!*ai) {
+				*err = EAI_MEMORY;
+				rc = RESOLVE_FAIL;
+			} else
+				rc = RESOLVE_HIT;
+			break;
+
+		case RS_FAIL:
+			*err = e->err;
+			rc = RESOLVE_FAIL;
+			break;
+
+		default:	/* lookup already in progress */
+			rc = RESOLVE_PENDING;
+			break;
+		}
+		pthread_mutex_unlock(&lock);
+
+		return rc;
+	}
+
+	/* Retried when a queued lookup is done, never blocks the caller */
+	if (npending >= RESOLVE_QUEUE || (nentries >= RESOLVE_SIZE && evict()))
+		goto busy;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		goto busy;
+
+	strcpy(e->host, host);
+	strcpy(e->serv, serv);
+	e->family   = family;
+	e->socktype = socktype;
+	e->state    = RS_PENDING;
+	TAILQ_INSERT_HEAD(&lru, e, lru);
+	SIMPLEQ_INSERT_TAIL(&work, e, work);
+	nentries++;
+	npending++;
+	pthread_cond_signal(&cond);
+busy:
+	pthread_mutex_unlock(&lock);
+
+	return RESOLVE_PENDING;
+direct:
+	pthread_mutex_unlock(&lock);
+	*err = lookup(host, serv, family, socktype, 0, ai);
+
+	return *err ? RESOLVE_FAIL : RESOLVE_HIT;
+}
+
+void resolve_free(struct addrinfo *ai)
+{
+	free(ai);
+}
+
+/*
+ * Readable when a lookup is done, or -1 if not running
+ */
+int resolve_fd(void)
+{
+	return running ? notify[0] : -1;
+}
+
+/*
+ * Empty the notification pipe, call before retrying pending lookups
+ */
+void resolve_ack(void)
+{
+	char buf[64];
+
+	while (read(notify[0], buf, sizeof(buf)) > 0)
+		;
+}
+
+/*
+ * Forget all results, e.g., on reload, pending lookups are kept
+ */
+void resolve_flush(void)
+{
+	struct rsentry *e, *next;
+
+	pthread_mutex_lock(&lock);
+	TAILQ_FOREACH_SAFE(e, &lru, lru, next) {
+		if (e->state != RS_PENDING)
+			drop(e);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Start the resolver thread, only once.  Returns 0, or an error number,
+ * pthread_create() does not set errno.
+ */
+int resolve_init(void)
+{
+	sigset_t all, old;
+	int rc;
+
+	if (running)
+		return 0;
+
+	if (pipe2(notify, O_NONBLOCK | O_CLOEXEC))
+		return errno;
+
+	/* Signals are handled by the main thread only */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	stop = 0;
+	rc = pthread_create(&tid, NULL, resolver, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc) {
+		close(notify[0]);
+		close(notify[1]);
+		notify[0] = notify[1] = -1;
+		return rc;
+	}
+
+	running = 1;
+
+	return 0;
+}
+
+void resolve_exit(void)
+{
+	struct rsentry *e, *next;
+
+	if (!running)
+		return;
+
+	pthread_mutex_lock(&lock);
+	running = 0;
+	stop = 1;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(tid, NULL);
+
+	TAILQ_FOREACH_SAFE(e, &lru, lru, next)
+		drop(e);
+	SIMPLEQ_INIT(&work);
+	npending = 0;
+
+	close(notify[0]);
+	close(notify[1]);
+	notify[0] = notify[1] = -1;
+}
@@ -0,0 +1,56 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef SYSKLOGD_RESOLVE_H_
+#define SYSKLOGD_RESOLVE_H_
+
+#include <netdb.h>
+
+#define RESOLVE_QUEUE   64	/* max pending lookups */
+#define RESOLVE_SIZE    256	/* max cached targets, > RESOLVE_QUEUE */
+#define RESOLVE_TTL     300	/* seconds to keep a resolved target */
+#define RESOLVE_NEGTTL  5	/* seconds to keep a failed lookup */
+
+/* resolve_lookup() results */
+#define RESOLVE_HIT     0	/* *ai set, free with resolve_free() */
+#define RESOLVE_PENDING 1	/* lookup queued, or queue full, try again later */
+#define RESOLVE_FAIL    2	/* *err set, a getaddrinfo() error code */
+
+int  resolve_init   (void);
+void resolve_exit   (void);
+int  resolve_fd     (void);
+void resolve_ack    (void);
+void resolve_flush  (void);
+
+int  resolve_lookup (const char *host, const char *serv, int family, int socktype,
+		     struct addrinfo **ai, int *err);
+void resolve_free   (struct addrinfo *ai);
+
+#endif /* SYSKLOGD_RESOLVE_H_ */
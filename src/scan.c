@@ -0,0 +1,287 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "scan.h"
+
+/*
+ * Vectorized string scanning for the message fast paths.  The best
+ * kernel available at build time is the default: SSE2 on x86_64, NEON
+ * on AArch64, otherwise eight bytes at a time in plain C.  On x86 the
+ * AVX2 kernels are picked at runtime by scan_init(), which must run
+ * before any receiver worker is started.
+ */
+#if defined(__SSE2__)
+#define HAVE_SCAN_SSE2
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_SCAN_AVX2
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define HAVE_SCAN_NEON
+#endif
+
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+/* non-zero if any byte in v is zero */
+#define haszero(v)      (((v) - ONES) & ~(v) & HIGHS)
+/* non-zero if any byte in v is less than n, for n <= 128 */
+#define hasless(v, n)   (((v) - ONES * (n)) & ~(v) & HIGHS)
+
+static inline int unsafe(unsigned char c, int c1)
+{
+	if (c < 0x20 || c == 0x7f)
+		return 1;
+	if (c1 && c >= 0x80 && c < 0xa0)
+		return 1;
+
+	return 0;
+}
+
+static size_t unsafe_tail(const unsigned char *p, size_t i, size_t len, int c1)
+{
+	for (; i < len; i++) {
+		if (unsafe(p[i], c1))
+			return i;
+	}
+
+	return len;
+}
+
+/*
+ * Eight bytes at a time, a word with any suspect byte is then examined
+ * byte by byte.
+ */
+static size_t unsafe_swar(const char *s, size_t len, int c1)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		uint64_t v, hit;
+
+		memcpy(&v, &p[i], 8);
+		hit = hasless(v, 0x20) | haszero(v ^ (ONES * 0x7f));
+		if (c1)
+			hit |= haszero((v & (ONES * 0xe0)) ^ HIGHS);
+		if (hit)
+			break;
+	}
+
+	return unsafe_tail(p, i, len, c1);
+}
+
+/* libc memchr() is vectorized on most platforms */
+static size_t newline_libc(const char *s, size_t len)
+{
+	const char *p = memchr(s, '\n', len);
+
+	return p ? (size_t)(p - s) : len;
+}
+
+#ifdef HAVE_SCAN_SSE2
+static size_t unsafe_sse2(const char *s, size_t len, int c1)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	const __m128i ctl = _mm_set1_epi8(0x1f);
+	const __m128i del = _mm_set1_epi8(0x7f);
+	const __m128i top = _mm_set1_epi8((char)0xe0);
+	const __m128i c1b = _mm_set1_epi8((char)0x80);
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&p[i]);
+		__m128i hit;
+		int mask;
+
+		/* unsigned v <= 0x1f, or v == 0x7f */
+		hit = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v),
+				   _mm_cmpeq_epi8(v, del));
+		if (c1)
+			hit = _mm_or_si128(hit, _mm_cmpeq_epi8(_mm_and_si128(v, top), c1b));
+
+		mask = _mm_movemask_epi8(hit);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + unsafe_swar(s + i, len - i, c1);
+}
+
+static size_t newline_sse2(const char *s, size_t len)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&s[i]);
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + newline_libc(s + i, len - i);
+}
+#endif /* HAVE_SCAN_SSE2 */
+
+#ifdef HAVE_SCAN_AVX2
+__attribute__((target("avx2")))
+static size_t unsafe_avx2(const char *s, size_t len, int c1)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	const __m256i ctl = _mm256_set1_epi8(0x1f);
+	const __m256i del = _mm256_set1_epi8(0x7f);
+	const __m256i top = _mm256_set1_epi8((char)0xe0);
+	const __m256i c1b = _mm256_set1_epi8((char)0x80);
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&p[i]);
+		__m256i hit;
+		unsigned int mask;
+
+		hit = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl), v),
+				      _mm256_cmpeq_epi8(v, del));
+		if (c1)
+			hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(_mm256_and_si256(v, top), c1b));
+
+		mask = (unsigned int)_mm256_movemask_epi8(hit);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + unsafe_swar(s + i, len - i, c1);
+}
+
+__attribute__((target("avx2")))
+static size_t newline_avx2(const char *s, size_t len)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&s[i]);
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + newline_libc(s + i, len - i);
+}
+#endif /* HAVE_SCAN_AVX2 */
+
+#ifdef HAVE_SCAN_NEON
+static size_t unsafe_neon(const char *s, size_t len, int c1)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t v = vld1q_u8(&p[i]);
+		uint8x16_t hit;
+
+		hit = vorrq_u8(vcleq_u8(v, vdupq_n_u8(0x1f)), vceqq_u8(v, vdupq_n_u8(0x7f)));
+		if (c1)
+			hit = vorrq_u8(hit, vceqq_u8(vandq_u8(v, vdupq_n_u8(0xe0)), vdupq_n_u8(0x80)));
+		if (vmaxvq_u8(hit))
+			break;
+	}
+
+	return i + unsafe_swar(s + i, len - i, c1);
+}
+
+static size_t newline_neon(const char *s, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		if (vmaxvq_u8(vceqq_u8(vld1q_u8(&p[i]), vdupq_n_u8('\n'))))
+			break;
+	}
+
+	return i + newline_libc(s + i, len - i);
+}
+#endif /* HAVE_SCAN_NEON */
+
+#if defined(HAVE_SCAN_SSE2)
+static size_t (*unsafe_fn)(const char *, size_t, int) = unsafe_sse2;
+static size_t (*newline_fn)(const char *, size_t)     = newline_sse2;
+#elif defined(HAVE_SCAN_NEON)
+static size_t (*unsafe_fn)(const char *, size_t, int) = unsafe_neon;
+static size_t (*newline_fn)(const char *, size_t)     = newline_neon;
+#else
+static size_t (*unsafe_fn)(const char *, size_t, int) = unsafe_swar;
+static size_t (*newline_fn)(const char *, size_t)     = newline_libc;
+#endif
+
+/*
+ * Pick the fastest kernels supported by this CPU
+ */
+void scan_init(void)
+{
+#ifdef HAVE_SCAN_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		unsafe_fn  = unsafe_avx2;
+		newline_fn = newline_avx2;
+	}
+#endif
+}
+
+/*
+ * Find the first byte in s that is not safe to display as-is, i.e., an
+ * ASCII control character, or with c1 set, a C1 control (0x80-0x9f).
+ * Returns the offset of that byte, or len if the string is clean.
+ */
+size_t scan_unsafe(const char *s, size_t len, int c1)
+{
+	return unsafe_fn(s, len, c1);
+}
+
+/*
+ * Find the first newline in s, returns its offset, or len if none.
+ */
+size_t scan_newline(const char *s, size_t len)
+{
+	return newline_fn(s, len);
+}
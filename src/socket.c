@@ -41,15 +41,25 @@
 #include <unistd.h>
 #include <sys/stat.h>
 
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_KQUEUE
+#include <sys/event.h>
+#endif
+
 #include "queue.h"
 #include "socket.h"
 #include "syslogd.h"
 
+#define MAX_EVENTS 64
+
 struct sock {
 	LIST_ENTRY(sock) link;
 
 	struct addrinfo ai;
 	int sd;
+	int pollout;		/* also callback when writable */
 
 	void (*cb)(int, void *arg);
 	void *arg;
@@ -58,12 +68,105 @@ struct sock {
 static int max_fdnum = -1;
 LIST_HEAD(, sock) sl = LIST_HEAD_INITIALIZER();
 
+/*
+ * Entries closed from a callback while socket_poll() is dispatching
+ * are parked here, the pending event list may still refer to them.
+ */
+static LIST_HEAD(, sock) dead = LIST_HEAD_INITIALIZER();
+static int dispatching;
+
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
+static int evfd = -1;
+#endif
+
 
 int nfds(void)
 {
 	return max_fdnum + 1;
 }
 
+#ifdef HAVE_EPOLL
+/*
+ * Edge-triggered, so all callbacks must drain their descriptor until
+ * EAGAIN, otherwise we will not get another event for it.
+ */
+static int event_add(struct sock *entry)
+{
+	struct epoll_event ev = {
+		.events   = EPOLLIN | EPOLLET,
+		.data.ptr = entry,
+	};
+
+	if (evfd == -1) {
+		evfd = epoll_create1(EPOLL_CLOEXEC);
+		if (evfd == -1)
+			return -1;
+	}
+
+	return epoll_ctl(evfd, EPOLL_CTL_ADD, entry->sd, &ev);
+}
+
+static void event_del(struct sock *entry)
+{
+	(void)epoll_ctl(evfd, EPOLL_CTL_DEL, entry->sd, NULL);
+}
+
+static int event_mod(struct sock *entry)
+{
+	struct epoll_event ev = {
+		.events   = EPOLLIN | EPOLLET,
+		.data.ptr = entry,
+	};
+
+	if (entry->pollout)
+		ev.events |= EPOLLOUT;
+
+	return epoll_ctl(evfd, EPOLL_CTL_MOD, entry->sd, &ev);
+}
+#elif defined(HAVE_KQUEUE)
+static int event_add(struct sock *entry)
+{
+	struct kevent ev;
+
+	if (evfd == -1) {
+		evfd = kqueue();
+		if (evfd == -1)
+			return -1;
+		(void)fcntl(evfd, F_SETFD, FD_CLOEXEC);
+	}
+
+	EV_SET(&ev, entry->sd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, entry);
+
+	return kevent(evfd, &ev, 1, NULL, 0, NULL);
+}
+
+static void event_del(struct sock *entry)
+{
+	struct kevent ev;
+
+	EV_SET(&ev, entry->sd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	(void)kevent(evfd, &ev, 1, NULL, 0, NULL);
+	if (entry->pollout) {
+		EV_SET(&ev, entry->sd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+		(void)kevent(evfd, &ev, 1, NULL, 0, NULL);
+	}
+}
+
+static int event_mod(struct sock *entry)
+{
+	struct kevent ev;
+
+	EV_SET(&ev, entry->sd, EVFILT_WRITE, entry->pollout ? EV_ADD | EV_CLEAR : EV_DELETE,
+	       0, 0, entry);
+
+	return kevent(evfd, &ev, 1, NULL, 0, NULL);
+}
+#else
+static int  event_add(struct sock *entry) { return 0; }
+static void event_del(struct sock *entry) { }
+static int  event_mod(struct sock *entry) { return 0; }
+#endif
+
 /*
  * register socket/fd/pipe created elsewhere, optional callback
  */
@@ -88,6 +191,8 @@ int socket_register(int sd, struct addrinfo *ai, void (*cb)(int, void *), void *
 	entry->sd  = sd;
 	entry->cb  = cb;
 	entry->arg = arg;
+	if (event_add(entry))
+		goto eadd;
 	LIST_INSERT_HEAD(&sl, entry, link);
 
 	/* Keep track for select() */
@@ -95,6 +200,7 @@ int socket_register(int sd, struct addrinfo *ai, void (*cb)(int, void *), void *
 		max_fdnum = sd;
 
 	return sd;
+eadd:	free(entry->ai.ai_addr);
 eaddr:	free(entry);
 err:	return -1;
 }
@@ -142,9 +248,9 @@ skip:	switch (family) {
 }
 
 /*
- * create socket, with optional callback for reading inbound data
+ * create and bind socket, not registered with the event loop
  */
-int socket_create(struct addrinfo *ai, void (*cb)(int, void *), void *arg)
+int socket_open(struct addrinfo *ai)
 {
 	struct sockaddr_un *sun = (struct sockaddr_un *)ai->ai_addr;
 	mode_t mode = ai->ai_protocol;
@@ -175,14 +281,30 @@ skip:	if (ai->ai_family == AF_UNIX) {
 			goto err;
 	}
 
-	if (socket_register(sd, ai, cb, arg) < 0)
-		goto err;
-
 	return sd;
 err:	close(sd);
 	return -1;
 }
 
+/*
+ * create socket, with optional callback for reading inbound data
+ */
+int socket_create(struct addrinfo *ai, void (*cb)(int, void *), void *arg)
+{
+	int sd;
+
+	sd = socket_open(ai);
+	if (sd < 0)
+		return -1;
+
+	if (socket_register(sd, ai, cb, arg) < 0) {
+		close(sd);
+		return -1;
+	}
+
+	return sd;
+}
+
 int socket_close(int sd)
 {
 	struct sockaddr_un *sun;
@@ -193,11 +315,19 @@ int socket_close(int sd)
 			continue;
 
 		LIST_REMOVE(entry, link);
+		event_del(entry);
 		close(entry->sd);
 		if (entry->ai.ai_family == AF_UNIX) {
 			sun = (struct sockaddr_un *)entry->ai.ai_addr;
 			(void)unlink(sun->sun_path);
 		}
+
+		if (dispatching) {
+			entry->sd = -1;
+			LIST_INSERT_HEAD(&dead, entry, link);
+			return 0;
+		}
+
 		free(entry->ai.ai_addr);
 		free(entry);
 
@@ -208,44 +338,133 @@ int socket_close(int sd)
 	return -1;
 }
 
-int socket_ffs(int family)
+/*
+ * Ask for callbacks also when socket is writable, e.g., for connect()
+ * in progress or a full send buffer.  With edge-triggered backends the
+ * callback is only called on the transition to writable.
+ */
+int socket_pollout(int sd, int on)
 {
 	struct sock *entry;
 
 	LIST_FOREACH(entry, &sl, link) {
-		if (entry->ai.ai_family == family)
-			return entry->sd;
+		if (entry->sd != sd)
+			continue;
+
+		if (entry->pollout == !!on)
+			return 0;
+
+		entry->pollout = !!on;
+		return event_mod(entry);
 	}
 
+	errno = ENOENT;
 	return -1;
 }
 
-int socket_poll(struct timeval *timeout)
+static void reap_dead(void)
+{
+	struct sock *entry, *tmp;
+
+	LIST_FOREACH_SAFE(entry, &dead, link, tmp) {
+		LIST_REMOVE(entry, link);
+		free(entry->ai.ai_addr);
+		free(entry);
+	}
+}
+
+static void dispatch(struct sock *entry)
+{
+	if (entry->sd < 0)
+		return;		/* closed by previous callback */
+
+	if (entry->cb)
+		entry->cb(entry->sd, entry->arg);
+}
+
+#ifdef HAVE_EPOLL
+static int event_wait(struct timeval *timeout)
+{
+	struct epoll_event ev[MAX_EVENTS];
+	int num, msec = -1;
+
+	if (timeout)
+		msec = timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
+
+	num = epoll_wait(evfd, ev, NELEMS(ev), msec);
+	for (int i = 0; i < num; i++)
+		dispatch(ev[i].data.ptr);
+
+	return num;
+}
+#elif defined(HAVE_KQUEUE)
+static int event_wait(struct timeval *timeout)
 {
+	struct kevent ev[MAX_EVENTS];
+	struct timespec ts, *tsp = NULL;
 	int num;
-	fd_set fds;
-	struct sock *entry;
+
+	if (timeout) {
+		ts.tv_sec  = timeout->tv_sec;
+		ts.tv_nsec = timeout->tv_usec * 1000;
+		tsp = &ts;
+	}
+
+	num = kevent(evfd, NULL, 0, ev, NELEMS(ev), tsp);
+	for (int i = 0; i < num; i++)
+		dispatch(ev[i].udata);
+
+	return num;
+}
+#else
+static int event_wait(struct timeval *timeout)
+{
+	struct sock *entry, *ready[FD_SETSIZE];
+	fd_set fds, wfds;
+	int num, i = 0;
 
 	FD_ZERO(&fds);
-	LIST_FOREACH(entry, &sl, link)
+	FD_ZERO(&wfds);
+	LIST_FOREACH(entry, &sl, link) {
 		FD_SET(entry->sd, &fds);
+		if (entry->pollout)
+			FD_SET(entry->sd, &wfds);
+	}
 
-	num = select(nfds(), &fds, NULL, NULL, timeout);
-	if (num <= 0) {
-		/* Log all errors, except when signalled, ignore failures. */
-		if (num < 0 && EINTR != errno)
-			WARN("Failed select(): %s", strerror(errno));
-
+	num = select(nfds(), &fds, &wfds, NULL, timeout);
+	if (num <= 0)
 		return num;
-	}
 
+	/* Callbacks may close any socket, collect ready list first */
 	LIST_FOREACH(entry, &sl, link) {
-		if (!FD_ISSET(entry->sd, &fds))
-			continue;
+		if ((FD_ISSET(entry->sd, &fds) || FD_ISSET(entry->sd, &wfds)) && i < FD_SETSIZE)
+			ready[i++] = entry;
+	}
+
+	for (int j = 0; j < i; j++)
+		dispatch(ready[j]);
+
+	return num;
+}
+#endif
 
-		if (entry->cb)
-			entry->cb(entry->sd, entry->arg);
+int socket_poll(struct timeval *timeout)
+{
+	int num;
+
+	dispatching = 1;
+	num = event_wait(timeout);
+	dispatching = 0;
+
+	if (num < 0) {
+		int err = errno;
+
+		/* Log all errors, except when signalled, ignore failures. */
+		if (EINTR != err)
+			WARN("Failed polling sockets: %s", strerror(err));
+		errno = err;
 	}
+	reap_dead();
 
 	return num;
 }
@@ -39,9 +39,10 @@
 #include <sys/types.h>
 
 int socket_register(int sd, struct addrinfo *ai, void (*cb)(int, void *), void *arg);
+int socket_open    (struct addrinfo *ai);
 int socket_create  (struct addrinfo *ai, void (*cb)(int, void *), void *arg);
 int socket_close   (int sd);
-int socket_ffs     (int family);
+int socket_pollout (int sd, int on);
 int socket_poll    (struct timeval *timeout);
 
 #endif /* SYSKLOGD_SOCKET_H_ */
@@ -0,0 +1,429 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "queue.h"
+#include "spool.h"
+
+#define SPOOL_MAGIC   0x53504f4c	/* "SPOL" */
+#define SPOOL_VERSION 1
+#define SPOOL_MINSEG  (64 * 1024)
+
+/* Records are a length followed by the message, 4 byte aligned */
+#define RECSZ(len)    (sizeof(uint32_t) + (((len) + 3) & ~3U))
+
+/*
+ * Disk spool for forwarding targets that are down.  Messages are
+ * appended to memory mapped segment files, named PATH.00000001 and up.
+ * Each segment starts with a header holding the read and write offsets,
+ * which are only updated after a record is complete, so a restarted
+ * syslogd continues where the previous one stopped.  Fully read
+ * segments are removed.  When the size cap is reached the oldest
+ * segment is discarded to make room for new messages.
+ *
+ * Segments are allocated with posix_fallocate() up front, so a full
+ * disk is an error when creating a segment rather than a SIGBUS when
+ * writing to the mapping.  Only used from the main loop.
+ */
+struct seghdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	rpos;		/* next record to read */
+	uint32_t	wpos;		/* end of last written record */
+};
+
+struct seg {
+	TAILQ_ENTRY(seg) link;
+	unsigned	 seq;
+	size_t		 size;
+	char		*map;
+	struct seghdr	*hdr;
+};
+
+struct spool {
+	TAILQ_HEAD(seglist, seg) segs;
+	char		*path;		/* dir/name, without .SEQ */
+	size_t		 max;		/* cap, all segments */
+	size_t		 segsz;		/* size of new segments */
+	size_t		 bytes;		/* size of all segments */
+	size_t		 count;		/* unread messages */
+	uint64_t	 drops;
+};
+
+static void seg_name(struct spool *sp, unsigned seq, char *fn, size_t len)
+{
+	snprintf(fn, len, "%s.%08u", sp->path, seq);
+}
+
+static size_t seg_count(struct seg *seg)
+{
+	size_t pos = seg->hdr->rpos;
+	size_t num = 0;
+
+	while (pos < seg->hdr->wpos) {
+		uint32_t len;
+
+		memcpy(&len, &seg->map[pos], sizeof(len));
+		if (len > SPOOL_MAXREC || pos + RECSZ(len) > seg->hdr->wpos)
+			break;
+		pos += RECSZ(len);
+		num++;
+	}
+
+	return num;
+}
+
+static struct seg *seg_map(struct spool *sp, unsigned seq, int create)
+{
+	char fn[strlen(sp->path) + 16];
+	struct seghdr *hdr;
+	struct stat st;
+	struct seg *seg;
+	int fd;
+
+	seg_name(sp, seq, fn, sizeof(fn));
+	fd = open(fn, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0600);
+	if (fd < 0)
+		return NULL;
+
+	if (create) {
+		errno = posix_fallocate(fd, 0, sp->segsz);
+		if (errno)
+			goto fail;
+		st.st_size = sp->segsz;
+	} else if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*hdr) ||
+		   st.st_size > SPOOL_SEGSZ) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	seg = calloc(1, sizeof(*seg));
+	if (!seg)
+		goto fail;
+
+	seg->map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (seg->map == MAP_FAILED) {
+		free(seg);
+		goto fail;
+	}
+	close(fd);
+
+	seg->seq  = seq;
+	seg->size = st.st_size;
+	seg->hdr  = hdr = (struct seghdr *)seg->map;
+
+	if (create) {
+		hdr->magic   = SPOOL_MAGIC;
+		hdr->version = SPOOL_VERSION;
+		hdr->rpos    = sizeof(*hdr);
+		hdr->wpos    = sizeof(*hdr);
+	} else if (hdr->magic != SPOOL_MAGIC || hdr->version != SPOOL_VERSION ||
+		   hdr->rpos < sizeof(*hdr) || hdr->rpos > hdr->wpos ||
+		   hdr->wpos > seg->size || (hdr->rpos & 3) || (hdr->wpos & 3)) {
+		munmap(seg->map, seg->size);
+		free(seg);
+		(void)unlink(fn);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return seg;
+fail:
+	close(fd);
+	if (create)
+		(void)unlink(fn);
+	return NULL;
+}
+
+static void seg_free(struct spool *sp, struct seg *seg, int remove)
+{
+	char fn[strlen(sp->path) + 16];
+
+	TAILQ_REMOVE(&sp->segs, seg, link);
+	sp->bytes -= seg->size;
+	munmap(seg->map, seg->size);
+	if (remove) {
+		seg_name(sp, seg->seq, fn, sizeof(fn));
+		(void)unlink(fn);
+	}
+	free(seg);
+}
+
+static int seq_cmp(const void *a, const void *b)
+{
+	unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Map all existing segments of a spool, oldest first */
+static void spool_load(struct spool *sp, const char *dir, const char *name)
+{
+	size_t len = strlen(name), num = 0, max = 0;
+	unsigned *seqs = NULL;
+	struct dirent *d;
+	DIR *dp;
+
+	dp = opendir(dir);
+	if (!dp)
+		return;
+
+	while ((d = readdir(dp))) {
+		unsigned seq;
+		char *end;
+
+		if (strncmp(d->d_name, name, len) || d->d_name[len] != '.')
+			continue;
+
+		seq = strtoul(&d->d_name[len + 1], &end, 10);
+		if (*end || end - &d->d_name[len + 1] != 8)
+			continue;
+
+		if (num == max) {
+			unsigned *tmp;
+
+			max = max ? max * 2 : 16;
+			tmp = realloc(seqs, max * sizeof(*seqs));
+			if (!tmp)
+				break;
+			seqs = tmp;
+		}
+		seqs[num++] = seq;
+	}
+	closedir(dp);
+
+	qsort(seqs, num, sizeof(*seqs), seq_cmp);
+	for (size_t i = 0; i < num; i++) {
+		struct seg *seg;
+
+		seg = seg_map(sp, seqs[i], 0);
+		if (!seg)
+			continue;
+
+		TAILQ_INSERT_TAIL(&sp->segs, seg, link);
+		sp->bytes += seg->size;
+		sp->count += seg_count(seg);
+	}
+	free(seqs);
+}
+
+/*
+ * Open, or create, spool `name` in `dir`, with at most `max` bytes on
+ * disk.  Any messages left from a previous run are kept.
+ */
+struct spool *spool_open(const char *dir, const char *name, size_t max)
+{
+	struct spool *sp;
+	char *p;
+
+	if (mkdir(dir, 0700) && errno != EEXIST)
+		return NULL;
+
+	sp = calloc(1, sizeof(*sp));
+	if (!sp)
+		return NULL;
+
+	sp->path = malloc(strlen(dir) + strlen(name) + 2);
+	if (!sp->path) {
+		free(sp);
+		return NULL;
+	}
+	sprintf(sp->path, "%s/%s", dir, name);
+
+	/* name is, e.g., host:port, must not leave the spool directory */
+	for (p = &sp->path[strlen(dir) + 1]; *p; p++) {
+		if (*p == '/')
+			*p = '_';
+	}
+
+	if (max > SPOOL_MAX)
+		max = SPOOL_MAX;
+	sp->segsz = max / 4;
+	if (sp->segsz > SPOOL_SEGSZ)
+		sp->segsz = SPOOL_SEGSZ;
+	if (sp->segsz < SPOOL_MINSEG)
+		sp->segsz = SPOOL_MINSEG;
+	sp->segsz &= ~4095UL;
+	sp->max = max < sp->segsz ? sp->segsz : max;
+
+	TAILQ_INIT(&sp->segs);
+	spool_load(sp, dir, &sp->path[strlen(dir) + 1]);
+
+	return sp;
+}
+
+void spool_close(struct spool *sp)
+{
+	struct seg *seg;
+
+	if (!sp)
+		return;
+
+	while ((seg = TAILQ_FIRST(&sp->segs)))
+		seg_free(sp, seg, 0);
+	free(sp->path);
+	free(sp);
+}
+
+/*
+ * Append message, discarding the oldest segment if the spool is full.
+ * Returns -1 if the message could not be spooled.
+ */
+int spool_put(struct spool *sp, const struct iovec *iov, int iovcnt)
+{
+	struct seg *seg;
+	uint32_t len = 0;
+	char *p;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (len > SPOOL_MAXREC) {
+		sp->drops++;
+		return -1;
+	}
+
+	seg = TAILQ_LAST(&sp->segs, seglist);
+	if (!seg || seg->hdr->wpos + RECSZ(len) > seg->size) {
+		struct seg *old;
+		unsigned seq = seg ? seg->seq + 1 : 1;
+
+		while (sp->bytes + sp->segsz > sp->max && (old = TAILQ_FIRST(&sp->segs))) {
+			size_t num = seg_count(old);
+
+			sp->drops += num;
+			sp->count -= num;
+			seg_free(sp, old, 1);
+		}
+
+		seg = seg_map(sp, seq, 1);
+		if (!seg) {
+			sp->drops++;
+			return -1;
+		}
+		TAILQ_INSERT_TAIL(&sp->segs, seg, link);
+		sp->bytes += seg->size;
+	}
+
+	p = &seg->map[seg->hdr->wpos];
+	memcpy(p, &len, sizeof(len));
+	p += sizeof(len);
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	/* Record complete, now make it visible */
+	seg->hdr->wpos += RECSZ(len);
+	sp->count++;
+
+	return 0;
+}
+
+/*
+ * Remove oldest message from spool and copy it to buf, truncated to
+ * len.  Returns length of message, or 0 if the spool is empty.
+ */
+ssize_t spool_get(struct spool *sp, char *buf, size_t len)
+{
+	struct seg *seg;
+	uint32_t num;
+	char *p;
+
+	while ((seg = TAILQ_FIRST(&sp->segs))) {
+		struct seghdr *hdr = seg->hdr;
+
+		if (hdr->rpos < hdr->wpos) {
+			p = &seg->map[hdr->rpos];
+			memcpy(&num, p, sizeof(num));
+			if (num <= SPOOL_MAXREC && hdr->rpos + RECSZ(num) <= hdr->wpos)
+				break;
+
+			/* Garbled, e.g., crash while writing, skip rest */
+			hdr->rpos = hdr->wpos;
+			sp->count = 0;
+			TAILQ_FOREACH(seg, &sp->segs, link)
+				sp->count += seg_count(seg);
+			continue;
+		}
+
+		if (seg == TAILQ_LAST(&sp->segs, seglist)) {
+			/* Last one, reuse it */
+			hdr->rpos = hdr->wpos = sizeof(*hdr);
+			return 0;
+		}
+
+		seg_free(sp, seg, 1);
+	}
+
+	if (!seg)
+		return 0;
+
+	seg->hdr->rpos += RECSZ(num);
+	if (sp->count)
+		sp->count--;
+
+	if (num > len)
+		num = len;
+	memcpy(buf, p + sizeof(uint32_t), num);
+
+	return num;
+}
+
+int spool_empty(struct spool *sp)
+{
+	return sp->count == 0;
+}
+
+size_t spool_count(struct spool *sp)
+{
+	return sp->count;
+}
+
+/* Messages lost since last call, spool full or errors */
+uint64_t spool_drops(struct spool *sp)
+{
+	uint64_t drops = sp->drops;
+
+	sp->drops = 0;
+
+	return drops;
+}
@@ -0,0 +1,1025 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#endif
+
+#include "compat.h"
+#include "queue.h"
+#include "scan.h"
+#include "socket.h"
+#include "stream.h"
+#include "syslogd.h"
+#include "timer.h"
+
+#define CONNECT_TIMEOUT 10		/* sec, for connect() and handshake */
+#define PEER_TIMEOUT    10		/* sec, to wait for peer_fn() */
+
+/*
+ * Stream transports, TCP with octet-counted framing (RFC 6587) and
+ * TLS (RFC 5425).  Everything here runs in the main loop.
+ *
+ * Forwarding connections are persistent and non-blocking.  Messages
+ * are framed into a per-target send buffer, which stream_flush() writes
+ * from the main loop before it goes back to sleep, so all messages of
+ * one batch go out in a single write().  When the peer is slow, or the
+ * connection is down, messages keep piling up in the buffer until it is
+ * full, then new messages are dropped and counted.  Failed connections
+ * are retried with exponential backoff, up to INET_SUSPEND_TIME.
+ *
+ * Accepted connections have a read buffer each, any number of frames
+ * are parsed from each read.  Both octet-counted and the older, LF
+ * terminated, non-transparent framing are accepted.  A peer that cannot
+ * be validated yet is not read from until stream_peers() can tell.
+ */
+enum {
+	ST_IDLE,			/* no connection, wait for retry */
+	ST_CONNECT,			/* connect() in progress */
+	ST_PEER,			/* accepted, waiting for peer_fn() */
+	ST_HANDSHAKE,			/* TLS handshake in progress */
+	ST_OPEN,
+};
+
+struct stream {
+	LIST_ENTRY(stream) link;
+
+	int		 proto;		/* STREAM_TCP or STREAM_TLS */
+	int		 state;
+	int		 sd;
+	int		 accepted;	/* by a listener, otherwise forwarding */
+	int		 pollout;	/* waiting for socket to be writable */
+#ifdef HAVE_TLS
+	SSL		*ssl;
+#endif
+	char		 host[NI_MAXHOST];
+	char		 serv[NI_MAXSERV];
+	struct sockaddr_storage ss;	/* accepted peer, for stream_peers() */
+	socklen_t	 sslen;
+
+	struct addrinfo	*ai;		/* forwarding targets, from forw_lookup() */
+	int		 aidx;		/* next target to try */
+	time_t		 since;		/* connect() or handshake started */
+	time_t		 retry;		/* earliest next connect() */
+	int		 backoff;	/* sec, doubled on every failure */
+	int		 down;		/* failure logged, log when up again */
+	uint64_t	 drops;
+
+	char		*buf;		/* send or read buffer */
+	size_t		 size;
+	size_t		 off;		/* sent, or parsed */
+	size_t		 len;		/* buffered */
+	size_t		 frame;		/* start of the frame at off */
+	size_t		 skip;		/* bytes to skip of a truncated frame */
+};
+
+static LIST_HEAD(, stream) fwdlist = LIST_HEAD_INITIALIZER();
+static LIST_HEAD(, stream) conlist = LIST_HEAD_INITIALIZER();
+static int nconn;
+
+static stream_peer_fn peer_fn;
+static stream_msg_fn  msg_fn;
+
+#ifdef HAVE_TLS
+static char    *tls_ca, *tls_cert, *tls_key;
+static SSL_CTX *client_ctx;
+static SSL_CTX *server_ctx;
+#endif
+
+static void stream_cb(int sd, void *arg);
+static void conn_close(struct stream *s);
+
+static void want_write(struct stream *s, int on)
+{
+	if (s->pollout == on)
+		return;
+
+	s->pollout = on;
+	socket_pollout(s->sd, on);
+}
+
+static void stream_close(struct stream *s)
+{
+#ifdef HAVE_TLS
+	if (s->ssl) {
+		if (s->state == ST_OPEN)
+			(void)SSL_shutdown(s->ssl);
+		SSL_free(s->ssl);
+		s->ssl = NULL;
+	}
+#endif
+	if (s->sd >= 0)
+		socket_close(s->sd);
+	s->sd = -1;
+	s->state = ST_IDLE;
+	s->pollout = 0;
+}
+
+#ifdef HAVE_TLS
+static const char *tls_error(struct stream *s)
+{
+	unsigned long err;
+	long rc;
+
+	if (!s->accepted && s->ssl) {
+		rc = SSL_get_verify_result(s->ssl);
+		if (rc != X509_V_OK)
+			return X509_verify_cert_error_string(rc);
+	}
+
+	err = ERR_get_error();
+	ERR_clear_error();
+	if (err)
+		return ERR_reason_error_string(err) ?: "unknown TLS error";
+
+	return errno ? strerror(errno) : "connection closed";
+}
+
+static SSL_CTX *tls_ctx(int server)
+{
+	SSL_CTX *ctx;
+	const char *file;
+
+	if (server && server_ctx)
+		return server_ctx;
+	if (!server && client_ctx)
+		return client_ctx;
+
+	if (server && (!tls_cert || !tls_key)) {
+		ERRX("TLS listener requires tls_cert and tls_key");
+		return NULL;
+	}
+
+	ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+	if (!ctx)
+		goto fail;
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+			 SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	if (tls_cert && tls_key) {
+		file = tls_cert;
+		if (SSL_CTX_use_certificate_chain_file(ctx, file) != 1)
+			goto fail;
+		file = tls_key;
+		if (SSL_CTX_use_PrivateKey_file(ctx, file, SSL_FILETYPE_PEM) != 1 ||
+		    SSL_CTX_check_private_key(ctx) != 1)
+			goto fail;
+	}
+
+	if (!server) {
+		file = tls_ca;
+		if (tls_ca) {
+			if (SSL_CTX_load_verify_locations(ctx, tls_ca, NULL) != 1)
+				goto fail;
+		} else if (SSL_CTX_set_default_verify_paths(ctx) != 1)
+			goto fail;
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+		client_ctx = ctx;
+	} else
+		server_ctx = ctx;
+
+	return ctx;
+fail:
+	ERRX("Failed setting up TLS %s: %s", server ? "server" : "client",
+	     ERR_reason_error_string(ERR_get_error()) ?: "unknown error");
+	ERR_clear_error();
+	SSL_CTX_free(ctx);
+
+	return NULL;
+}
+
+static int tls_start(struct stream *s)
+{
+	X509_VERIFY_PARAM *param;
+	struct in6_addr addr;
+	SSL_CTX *ctx;
+
+	ctx = tls_ctx(s->accepted);
+	if (!ctx)
+		return -1;
+
+	s->ssl = SSL_new(ctx);
+	if (!s->ssl || SSL_set_fd(s->ssl, s->sd) != 1)
+		return -1;
+
+	if (s->accepted) {
+		SSL_set_accept_state(s->ssl);
+		return 0;
+	}
+
+	/* verify server name, or address, against its certificate */
+	param = SSL_get0_param(s->ssl);
+	if (inet_pton(AF_INET, s->host, &addr) == 1 || inet_pton(AF_INET6, s->host, &addr) == 1) {
+		X509_VERIFY_PARAM_set1_ip_asc(param, s->host);
+	} else {
+		SSL_set_tlsext_host_name(s->ssl, s->host);
+		X509_VERIFY_PARAM_set1_host(param, s->host, 0);
+	}
+	SSL_set_connect_state(s->ssl);
+
+	return 0;
+}
+#endif /* HAVE_TLS */
+
+static ssize_t xsend(struct stream *s, const char *buf, size_t len)
+{
+#ifdef HAVE_TLS
+	if (s->ssl) {
+		int rc;
+
+		rc = SSL_write(s->ssl, buf, len > INT32_MAX ? INT32_MAX : (int)len);
+		if (rc > 0)
+			return rc;
+
+		switch (SSL_get_error(s->ssl, rc)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			break;
+		default:
+			if (!errno)
+				errno = EPIPE;
+			break;
+		}
+		return -1;
+	}
+#endif
+	return send(s->sd, buf, len, MSG_NOSIGNAL);
+}
+
+static ssize_t xrecv(struct stream *s, char *buf, size_t len)
+{
+#ifdef HAVE_TLS
+	if (s->ssl) {
+		int rc;
+
+		rc = SSL_read(s->ssl, buf, len > INT32_MAX ? INT32_MAX : (int)len);
+		if (rc > 0)
+			return rc;
+
+		switch (SSL_get_error(s->ssl, rc)) {
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			break;
+		default:
+			if (!errno)
+				errno = ECONNRESET;
+			break;
+		}
+		return -1;
+	}
+#endif
+	return recv(s->sd, buf, len, 0);
+}
+
+/* Length of the octet-counted frame at buf, we only buffer complete frames */
+static size_t framelen(const char *buf)
+{
+	char *end;
+	size_t len;
+
+	len = strtoul(buf, &end, 10);
+
+	return (end - buf) + 1 + len;
+}
+
+/*
+ * Forwarding connection failed, or could not be set up.  Any partially
+ * sent frame is lost, the peer cannot resync in the middle of it.
+ */
+static void stream_fail(struct stream *s, const char *reason)
+{
+	stream_close(s);
+
+	if (s->frame < s->off) {
+		s->off = s->frame + framelen(&s->buf[s->frame]);
+		s->frame = s->off;
+		s->drops++;
+	}
+
+	s->aidx++;
+	s->retry = timer_now() + s->backoff;
+	if (s->backoff < INET_SUSPEND_TIME) {
+		s->backoff *= 2;
+		if (s->backoff > INET_SUSPEND_TIME)
+			s->backoff = INET_SUSPEND_TIME;
+	}
+
+	/* Log last, the message may be forwarded to us */
+	if (!s->down) {
+		s->down = 1;
+		WARN("Forwarding to %s:%s failed, %s, retrying", s->host, s->serv, reason);
+	}
+}
+
+static void stream_write(struct stream *s)
+{
+	ssize_t num;
+
+	while (s->off < s->len) {
+		num = xsend(s, &s->buf[s->off], s->len - s->off);
+		if (num < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				want_write(s, 1);
+				return;
+			}
+
+#ifdef HAVE_TLS
+			stream_fail(s, s->ssl ? tls_error(s) : strerror(errno));
+#else
+			stream_fail(s, strerror(errno));
+#endif
+			return;
+		}
+
+		s->off += num;
+		while (s->frame < s->off) {
+			size_t len = framelen(&s->buf[s->frame]);
+
+			if (s->frame + len > s->off)
+				break;
+			s->frame += len;
+		}
+	}
+
+	s->off = s->len = s->frame = 0;
+	want_write(s, 0);
+}
+
+static void stream_up(struct stream *s)
+{
+	s->state = ST_OPEN;
+	s->backoff = 1;
+	want_write(s, 0);
+
+	if (s->down) {
+		s->down = 0;
+		NOTE("Forwarding to %s:%s resumed.", s->host, s->serv);
+	}
+
+	stream_write(s);
+}
+
+static void stream_handshake(struct stream *s)
+{
+#ifdef HAVE_TLS
+	int rc;
+
+	rc = SSL_do_handshake(s->ssl);
+	if (rc == 1) {
+		if (s->accepted) {
+			s->state = ST_OPEN;
+			want_write(s, 0);
+			stream_cb(s->sd, s);
+		} else
+			stream_up(s);
+		return;
+	}
+
+	switch (SSL_get_error(s->ssl, rc)) {
+	case SSL_ERROR_WANT_READ:
+		want_write(s, 0);
+		return;
+	case SSL_ERROR_WANT_WRITE:
+		want_write(s, 1);
+		return;
+	}
+
+	if (s->accepted) {
+		WARN("TLS handshake with %s failed: %s", s->host, tls_error(s));
+		conn_close(s);
+		return;
+	}
+
+	stream_fail(s, tls_error(s));
+#endif
+}
+
+static void stream_connected(struct stream *s)
+{
+#ifdef HAVE_TLS
+	if (s->proto == STREAM_TLS) {
+		if (tls_start(s)) {
+			stream_fail(s, "cannot set up TLS");
+			return;
+		}
+
+		s->state = ST_HANDSHAKE;
+		stream_handshake(s);
+		return;
+	}
+#endif
+	stream_up(s);
+}
+
+static void stream_connect(struct stream *s)
+{
+	struct addrinfo *ai;
+	int i, sd;
+
+	if (s->state != ST_IDLE || !s->ai || timer_now() < s->retry)
+		return;
+
+	for (ai = s->ai, i = 0; ai && i < s->aidx; ai = ai->ai_next)
+		i++;
+	if (!ai) {
+		ai = s->ai;
+		s->aidx = 0;
+	}
+
+	sd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sd < 0) {
+		stream_fail(s, strerror(errno));
+		return;
+	}
+
+	if (socket_register(sd, NULL, stream_cb, s) < 0) {
+		close(sd);
+		stream_fail(s, strerror(errno));
+		return;
+	}
+
+	s->sd    = sd;
+	s->state = ST_CONNECT;
+	s->since = timer_now();
+
+	if (connect(sd, ai->ai_addr, ai->ai_addrlen) == 0) {
+		stream_connected(s);
+		return;
+	}
+
+	if (errno != EINPROGRESS) {
+		stream_fail(s, strerror(errno));
+		return;
+	}
+
+	want_write(s, 1);
+}
+
+/* Hand over one message from an accepted connection */
+static void deliver(struct stream *s, const char *msg, size_t len)
+{
+	char line[MAXLINE + 1];
+
+	while (len > 0 && (msg[len - 1] == '\r' || msg[len - 1] == '\0'))
+		len--;
+	if (!len)
+		return;
+
+	memcpy(line, msg, len);
+	line[len] = 0;
+	msg_fn(s->host, line);
+}
+
+/*
+ * Accepted connection, parse all complete frames in read buffer.
+ * Returns -1 on protocol error.
+ */
+static int stream_parse(struct stream *s)
+{
+	size_t off = 0;
+
+	while (off < s->len) {
+		size_t avail = s->len - off;
+		char *p = &s->buf[off];
+		size_t num, hdr;
+
+		if (s->skip) {
+			num = avail < s->skip ? avail : s->skip;
+			s->skip -= num;
+			off += num;
+			continue;
+		}
+
+		if (isdigit((unsigned char)*p)) {
+			size_t count = 0, skip = 0;
+
+			for (hdr = 0; hdr < avail && isdigit((unsigned char)p[hdr]); hdr++) {
+				if (hdr > 9)
+					return -1;
+				count = count * 10 + p[hdr] - '0';
+			}
+			if (hdr == avail)
+				break;	/* need more */
+			if (p[hdr++] != ' ')
+				return -1;
+
+			num = count;
+			if (num > MAXLINE) {
+				skip = num - MAXLINE;
+				num  = MAXLINE;
+			}
+			if (avail < hdr + num)
+				break;	/* need more */
+
+			deliver(s, &p[hdr], num);
+			off += hdr + num;
+			s->skip = skip;
+			continue;
+		}
+
+		/* Non-transparent framing, and empty trailers */
+		num = scan_newline(p, avail);
+		if (num == avail) {
+			if (avail < MAXLINE)
+				break;	/* need more */
+			deliver(s, p, MAXLINE);
+			off += MAXLINE;
+			continue;
+		}
+
+		deliver(s, p, num);
+		off += num + 1;
+	}
+
+	s->len -= off;
+	if (s->len)
+		memmove(s->buf, &s->buf[off], s->len);
+
+	return 0;
+}
+
+static void conn_close(struct stream *s)
+{
+	stream_close(s);
+	LIST_REMOVE(s, link);
+	nconn--;
+	free(s->buf);
+	free(s);
+}
+
+/* Accepted connection, read until EAGAIN, edge-triggered. */
+static void conn_read(struct stream *s)
+{
+	ssize_t num;
+
+	timer_update();
+	for (;;) {
+		num = xrecv(s, &s->buf[s->len], s->size - s->len);
+		if (num < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			break;
+		}
+		if (num == 0)
+			break;
+
+		s->len += num;
+		if (stream_parse(s)) {
+			WARN("Invalid framing from %s, closing connection.", s->host);
+			break;
+		}
+	}
+
+	conn_close(s);
+}
+
+/* Forwarding connection, nothing expected from peer, except EOF */
+static void stream_drain(struct stream *s)
+{
+	char buf[512];
+	ssize_t num;
+
+	for (;;) {
+		num = xrecv(s, buf, sizeof(buf));
+		if (num > 0)
+			continue;
+		if (num < 0 && errno == EINTR)
+			continue;
+		if (num < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+
+		stream_fail(s, num ? strerror(errno) : "connection closed by peer");
+		return;
+	}
+
+	if (s->pollout)
+		stream_write(s);
+}
+
+static void stream_cb(int sd, void *arg)
+{
+	struct stream *s = arg;
+	socklen_t len;
+	int err = 0;
+
+	switch (s->state) {
+	case ST_CONNECT:
+		len = sizeof(err);
+		if (getsockopt(sd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+			err = errno;
+		if (err) {
+			stream_fail(s, strerror(err));
+			break;
+		}
+		stream_connected(s);
+		break;
+
+	case ST_PEER:
+		/* Edge-triggered, anything sent is read by conn_open() */
+		break;
+
+	case ST_HANDSHAKE:
+		stream_handshake(s);
+		break;
+
+	case ST_OPEN:
+		if (s->accepted)
+			conn_read(s);
+		else
+			stream_drain(s);
+		break;
+
+	default:
+		if (s->accepted)
+			conn_close(s);
+		break;
+	}
+}
+
+/* Accepted peer is valid, start TLS, if any, and read what it sent */
+static void conn_open(struct stream *s)
+{
+	s->state = ST_OPEN;
+#ifdef HAVE_TLS
+	if (s->proto == STREAM_TLS) {
+		if (tls_start(s)) {
+			conn_close(s);
+			return;
+		}
+		s->state = ST_HANDSHAKE;
+	}
+#endif
+	stream_cb(s->sd, s);
+}
+
+static void stream_accept(int sd, void *arg)
+{
+	struct sockaddr_storage ss;
+	struct stream *s;
+	socklen_t len;
+	int proto = (intptr_t)arg;
+	int cd, rc;
+
+	for (;;) {
+		len = sizeof(ss);
+		cd = accept4(sd, (struct sockaddr *)&ss, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (cd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				ERR("Failed accepting connection");
+			return;
+		}
+
+		if (nconn >= STREAM_MAXCONN) {
+			WARN("Too many connections (%d), rejecting new peer.", nconn);
+			close(cd);
+			continue;
+		}
+
+		s = calloc(1, sizeof(*s));
+		if (s)
+			s->buf = malloc(STREAM_RCVBUF);
+		if (!s || !s->buf) {
+			ERR("Failed allocating connection");
+			free(s);
+			close(cd);
+			continue;
+		}
+
+		s->accepted = 1;
+		s->proto = proto;
+		s->size = STREAM_RCVBUF;
+		s->sd = -1;
+		memcpy(&s->ss, &ss, len);
+		s->sslen = len;
+		rc = peer_fn((struct sockaddr *)&ss, len, s->host, sizeof(s->host));
+		if (!rc || socket_register(cd, NULL, stream_cb, s) < 0) {
+			close(cd);
+			free(s->buf);
+			free(s);
+			continue;
+		}
+		s->sd = cd;
+		LIST_INSERT_HEAD(&conlist, s, link);
+		nconn++;
+
+		if (rc < 0) {
+			s->state = ST_PEER;
+			s->since = timer_now();
+			continue;
+		}
+		conn_open(s);
+	}
+}
+
+/*
+ * Ask peer_fn() again about accepted peers it could not validate yet,
+ * peers it still cannot tell after PEER_TIMEOUT are rejected.  Returns
+ * the number of peers still waiting.
+ */
+int stream_peers(void)
+{
+	struct stream *s, *next;
+	struct sockaddr_storage ss;
+	int num = 0;
+	int rc;
+
+	LIST_FOREACH_SAFE(s, &conlist, link, next) {
+		if (s->state != ST_PEER)
+			continue;
+
+		/* peer_fn() may modify the address */
+		memcpy(&ss, &s->ss, s->sslen);
+		rc = peer_fn((struct sockaddr *)&ss, s->sslen, s->host, sizeof(s->host));
+		if (rc > 0) {
+			conn_open(s);
+		} else if (rc == 0 || timer_now() - s->since >= PEER_TIMEOUT) {
+			if (rc)
+				WARN("Timed out validating %s, closing connection.", s->host);
+			conn_close(s);
+		} else
+			num++;
+	}
+
+	return num;
+}
+
+/*
+ * Set up a listening socket for ai, from nslookup() with SOCK_STREAM.
+ * Returns the socket, or -1 on error.
+ */
+int stream_listen(struct addrinfo *ai, int proto)
+{
+	int sd;
+
+#ifdef HAVE_TLS
+	if (proto == STREAM_TLS && !tls_ctx(1)) {
+		errno = EINVAL;
+		return -1;
+	}
+#else
+	if (proto == STREAM_TLS) {
+		errno = ENOTSUP;
+		return -1;
+	}
+#endif
+
+	sd = socket_open(ai);
+	if (sd < 0)
+		return -1;
+
+	if (listen(sd, SOMAXCONN) || socket_register(sd, ai, stream_accept, (void *)(intptr_t)proto) < 0) {
+		close(sd);
+		return -1;
+	}
+
+	return sd;
+}
+
+/*
+ * New forwarding target, connects on first stream_send() or
+ * stream_tick().  Returns NULL and sets errno on error.
+ */
+struct stream *stream_new(int proto, const char *host, const char *serv)
+{
+	struct stream *s;
+
+#ifndef HAVE_TLS
+	if (proto == STREAM_TLS) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+#endif
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	s->buf = malloc(STREAM_SNDBUF);
+	if (!s->buf) {
+		free(s);
+		return NULL;
+	}
+
+	s->size    = STREAM_SNDBUF;
+	s->proto   = proto;
+	s->sd      = -1;
+	s->backoff = 1;
+	strlcpy(s->host, host, sizeof(s->host));
+	strlcpy(s->serv, serv, sizeof(s->serv));
+	LIST_INSERT_HEAD(&fwdlist, s, link);
+
+	return s;
+}
+
+/*
+ * Close forwarding connection, what can be written now is sent first.
+ */
+void stream_free(struct stream *s)
+{
+	if (!s)
+		return;
+
+	if (s->state == ST_OPEN && s->off < s->len)
+		stream_write(s);
+
+	stream_close(s);
+	LIST_REMOVE(s, link);
+	free(s->buf);
+	free(s);
+}
+
+/*
+ * Frame and buffer message for forwarding, it is written by the next
+ * stream_flush().  Returns -1 if the message was dropped, the send
+ * buffer is full.
+ */
+int stream_send(struct stream *s, struct addrinfo *ai, struct iovec *iov, int iovcnt)
+{
+	char hdr[24];
+	size_t len = 0;
+	int hlen;
+
+	s->ai = ai;
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	hlen = snprintf(hdr, sizeof(hdr), "%zu ", len);
+	if (hlen + len > s->size - s->len && s->frame > 0) {
+		s->len -= s->frame;
+		s->off -= s->frame;
+		memmove(s->buf, &s->buf[s->frame], s->len);
+		s->frame = 0;
+	}
+
+	if (hlen + len > s->size - s->len) {
+		s->drops++;
+		stream_connect(s);
+		return -1;
+	}
+
+	memcpy(&s->buf[s->len], hdr, hlen);
+	s->len += hlen;
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(&s->buf[s->len], iov[i].iov_base, iov[i].iov_len);
+		s->len += iov[i].iov_len;
+	}
+
+	stream_connect(s);
+
+	return 0;
+}
+
+/*
+ * Called every second, keep connection up and time out stalled
+ * connection attempts.
+ */
+void stream_tick(struct stream *s, struct addrinfo *ai)
+{
+	s->ai = ai;
+
+	if ((s->state == ST_CONNECT || s->state == ST_HANDSHAKE) &&
+	    timer_now() - s->since >= CONNECT_TIMEOUT) {
+		stream_fail(s, "connection timed out");
+		return;
+	}
+
+	stream_connect(s);
+}
+
+/*
+ * Called from the main loop before it polls, write everything buffered
+ * since last time.
+ */
+void stream_flush(void)
+{
+	struct stream *s;
+
+	LIST_FOREACH(s, &fwdlist, link) {
+		if (s->state == ST_OPEN && !s->pollout && s->off < s->len)
+			stream_write(s);
+	}
+}
+
+int stream_isopen(struct stream *s)
+{
+	return s->state == ST_OPEN;
+}
+
+/* Bytes buffered, not yet written */
+size_t stream_pending(struct stream *s)
+{
+	return s->len - s->off;
+}
+
+/* Messages dropped since last call */
+uint64_t stream_drops(struct stream *s)
+{
+	uint64_t drops = s->drops;
+
+	s->drops = 0;
+
+	return drops;
+}
+
+/*
+ * Set TLS certificate files, replacing any previous settings.  The TLS
+ * contexts are set up when first needed.
+ */
+int stream_tls(const char *ca, const char *cert, const char *key)
+{
+#ifdef HAVE_TLS
+	free(tls_ca);
+	free(tls_cert);
+	free(tls_key);
+	tls_ca   = ca   ? strdup(ca)   : NULL;
+	tls_cert = cert ? strdup(cert) : NULL;
+	tls_key  = key  ? strdup(key)  : NULL;
+
+	/* Existing connections keep a reference to their context */
+	SSL_CTX_free(client_ctx);
+	SSL_CTX_free(server_ctx);
+	client_ctx = server_ctx = NULL;
+
+	return 0;
+#else
+	if (ca || cert || key) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	return 0;
+#endif
+}
+
+int stream_init(stream_peer_fn peer, stream_msg_fn msg)
+{
+	peer_fn = peer;
+	msg_fn  = msg;
+
+	return 0;
+}
+
+/*
+ * Close all accepted connections, forwarding connections are closed
+ * with their actions.
+ */
+void stream_exit(void)
+{
+	struct stream *s, *tmp;
+
+	LIST_FOREACH_SAFE(s, &conlist, link, tmp)
+		conn_close(s);
+
+	stream_tls(NULL, NULL, NULL);
+}
@@ -0,0 +1,73 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef SYSKLOGD_STREAM_H_
+#define SYSKLOGD_STREAM_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netdb.h>
+
+#define STREAM_TCP       1		/* RFC 6587, octet-counted */
+#define STREAM_TLS       2		/* RFC 5425 */
+
+#define STREAM_SNDBUF    (256 * 1024)	/* send buffer per forwarding target */
+#define STREAM_RCVBUF    (8 * 1024)	/* read buffer per accepted connection */
+#define STREAM_MAXCONN   256		/* max accepted connections */
+
+struct stream;
+
+/*
+ * Called for accepted connections, should resolve and validate the
+ * peer.  Returns 0 to reject the peer, otherwise the name of the peer
+ * is in host.  Returns -1 if the peer cannot be validated yet, it is
+ * then called again from stream_peers().
+ */
+typedef int  (*stream_peer_fn)(struct sockaddr *sa, socklen_t len, char *host, size_t hlen);
+typedef void (*stream_msg_fn) (const char *host, char *msg);
+
+int             stream_init    (stream_peer_fn peer, stream_msg_fn msg);
+void            stream_exit    (void);
+int             stream_tls     (const char *ca, const char *cert, const char *key);
+
+int             stream_listen  (struct addrinfo *ai, int proto);
+int             stream_peers   (void);
+
+struct stream  *stream_new     (int proto, const char *host, const char *serv);
+void            stream_free    (struct stream *s);
+int             stream_send    (struct stream *s, struct addrinfo *ai, struct iovec *iov, int iovcnt);
+void            stream_tick    (struct stream *s, struct addrinfo *ai);
+void            stream_flush   (void);
+int             stream_isopen  (struct stream *s);
+size_t          stream_pending (struct stream *s);
+uint64_t        stream_drops   (struct stream *s);
+
+#endif /* SYSKLOGD_STREAM_H_ */
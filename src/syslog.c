@@ -49,6 +49,10 @@ __RCSID("$NetBSD: syslog.c,v 1.55 2015/10/26 11:44:30 roy Exp $");
 #include <errno.h>
 #include <fcntl.h>
 #include <paths.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -68,6 +72,42 @@ static void	connectlog_r(struct syslog_data *);
 
 static mutex_t	syslog_mutex = MUTEX_INITIALIZER;
 
+#define TBUF_LEN	2048
+#define FMT_LEN		1024
+#define MAXTRIES	10
+
+/*
+ * The "host tag pid" part of messages sent with the global syslog(),
+ * built once at openlog(), or on the first message, and published with
+ * a sequence count so threads can copy it without taking the lock.
+ */
+static struct {
+	unsigned int	seq;		/* odd while being updated */
+	size_t		len;		/* 0: not built yet */
+	char		buf[MAXHOSTNAMELEN + 64];
+} prefix;
+
+/*
+ * LOG_ASYNC: bounded multi-producer ring, each slot has a sequence
+ * number telling if it is free for producer pos, or ready for the
+ * sender thread at pos + 1.  When full, callers send themselves.
+ */
+#define ASYNC_SLOTS	128
+
+struct slot {
+	unsigned int	seq;
+	size_t		len;
+	char		buf[TBUF_LEN];
+};
+
+static struct {
+	struct slot	*ring;
+	unsigned int	 head;		/* next slot to claim */
+	unsigned int	 tail;		/* next slot to send */
+	sem_t		 sem;
+	int		 running;
+} async;
+
 /*
  * wrapper to catch GLIBC syslog(), which provides this for security measures
  * Note: we only enter here if user includes GLIBC syslog.h
@@ -110,6 +150,391 @@ static socklen_t sa_len(struct sockaddr *sa)
 }
 #endif
 
+/*
+ * We wouldn't need this mess if printf handled %m, or if
+ * strerror() had been invented before syslog().
+ */
+static void
+expand_m(char *t, const char *fmt, int saved_errno)
+{
+	size_t prlen, fmt_left;
+	char ch;
+
+	for (fmt_left = FMT_LEN; (ch = *fmt) != '\0'; ++fmt) {
+		if (ch == '%' && fmt[1] == 'm') {
+			const char *s;
+
+			if ((s = strerror(saved_errno)) == NULL)
+				prlen = snprintf(t, fmt_left, "Error %d",
+				    saved_errno);
+			else
+				prlen = strlcpy(t, s, fmt_left);
+			if (prlen >= fmt_left)
+				prlen = fmt_left - 1;
+			t += prlen;
+			fmt++;
+			fmt_left -= prlen;
+		} else if (ch == '%' && fmt[1] == '%' && fmt_left > 2) {
+			*t++ = '%';
+			*t++ = '%';
+			fmt++;
+			fmt_left -= 2;
+		} else {
+			if (fmt_left > 1) {
+				*t++ = ch;
+				fmt_left--;
+			}
+		}
+	}
+	*t = '\0';
+}
+
+/*
+ * Build the prefix for sdata, called with syslog_mutex held.
+ */
+static void
+prefix_build(struct syslog_data *data)
+{
+	size_t len;
+
+	if (data->log_hostname[0] == '\0' && gethostname(data->log_hostname,
+	    sizeof(data->log_hostname)) == -1) {
+		data->log_hostname[0] = '-';
+		data->log_hostname[1] = '\0';
+	}
+	if (data->log_tag == NULL)
+		data->log_tag = getprogname();
+	if (data->log_pid == -1)
+		data->log_pid = getpid();
+
+	__atomic_store_n(&prefix.seq, prefix.seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	if (data->log_stat & LOG_RFC3164) {
+		if (data->log_stat & LOG_PID)
+			len = snprintf(prefix.buf, sizeof(prefix.buf), "%s %s[%d]:",
+				       data->log_hostname, data->log_tag, data->log_pid);
+		else
+			len = snprintf(prefix.buf, sizeof(prefix.buf), "%s %s:",
+				       data->log_hostname, data->log_tag);
+	} else {
+		if (data->log_stat & LOG_PID)
+			len = snprintf(prefix.buf, sizeof(prefix.buf), " %s %s %d ",
+				       data->log_hostname, data->log_tag, data->log_pid);
+		else
+			len = snprintf(prefix.buf, sizeof(prefix.buf), " %s %s - ",
+				       data->log_hostname, data->log_tag);
+	}
+	if (len >= sizeof(prefix.buf))
+		len = sizeof(prefix.buf) - 1;
+	prefix.len = len;
+
+	__atomic_store_n(&prefix.seq, prefix.seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copy the prefix to p, retry if it changed while copying.  Returns
+ * the length, or 0 if it has not been built yet.
+ */
+static size_t
+prefix_copy(char *p)
+{
+	unsigned int seq;
+	size_t len;
+
+	for (;;) {
+		seq = __atomic_load_n(&prefix.seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+
+		len = prefix.len;
+		memcpy(p, prefix.buf, len);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&prefix.seq, __ATOMIC_RELAXED) == seq)
+			return len;
+	}
+}
+
+/*
+ * Send a message to syslogd for sdata.  The socket is only ever
+ * (re)connected, not closed, by senders so the descriptor other
+ * threads may be using at the same time stays the same.
+ */
+static int
+sendlog(const char *buf, size_t len)
+{
+	size_t tries;
+	int rc = 0;
+	int fd;
+
+	if (__atomic_load_n(&sdata.log_connected, __ATOMIC_ACQUIRE)) {
+		fd = __atomic_load_n(&sdata.log_file, __ATOMIC_RELAXED);
+		if (fd != -1 && send(fd, buf, len, 0) != -1)
+			return 0;
+	}
+
+	mutex_lock(&syslog_mutex);
+	if (!sdata.log_opened)
+		openlog_unlocked_r(sdata.log_tag, sdata.log_stat, 0, &sdata);
+	connectlog_r(&sdata);
+
+	/* Same as in vsyslogp_r(), reconnect or wait for buffer space */
+	for (tries = 0; tries < MAXTRIES; tries++) {
+		if (send(sdata.log_file, buf, len, 0) != -1)
+			break;
+		if (errno != ENOBUFS) {
+			__atomic_store_n(&sdata.log_connected, 0, __ATOMIC_RELAXED);
+			connectlog_r(&sdata);
+		} else
+			(void)usleep(1);
+	}
+	if (tries == MAXTRIES)
+		rc = -1;
+	mutex_unlock(&syslog_mutex);
+
+	return rc;
+}
+
+static void *
+async_sender(void *arg)
+{
+	struct slot *s;
+	unsigned int pos;
+
+	(void)arg;
+	for (;;) {
+		if (sem_wait(&async.sem))
+			continue;
+
+		pos = __atomic_load_n(&async.tail, __ATOMIC_RELAXED);
+		s = &async.ring[pos % ASYNC_SLOTS];
+
+		/* slot claimed, but producer may not be done copying yet */
+		while (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != pos + 1)
+			sched_yield();
+
+		(void)sendlog(s->buf, s->len);
+
+		__atomic_store_n(&s->seq, pos + ASYNC_SLOTS, __ATOMIC_RELEASE);
+		__atomic_store_n(&async.tail, pos + 1, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/* The sender thread does not survive fork(), start a new one on demand */
+static void
+async_child(void)
+{
+	async.running = 0;
+}
+
+static int
+async_start(void)
+{
+	static int registered;
+	pthread_attr_t attr;
+	sigset_t all, old;
+	pthread_t tid;
+	unsigned int i;
+	int rc = -1;
+
+	mutex_lock(&syslog_mutex);
+	if (async.running) {
+		mutex_unlock(&syslog_mutex);
+		return 0;
+	}
+
+	if (!async.ring) {
+		async.ring = malloc(ASYNC_SLOTS * sizeof(struct slot));
+		if (!async.ring)
+			goto done;
+	} else
+		sem_destroy(&async.sem);
+
+	for (i = 0; i < ASYNC_SLOTS; i++)
+		async.ring[i].seq = i;
+	async.head = async.tail = 0;
+	if (sem_init(&async.sem, 0, 0))
+		goto done;
+
+	if (!registered && pthread_atfork(NULL, NULL, async_child))
+		goto done;
+	registered = 1;
+
+	/* Signals are for the application threads, not for us */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create(&tid, &attr, async_sender, NULL);
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc)
+		goto done;
+
+	__atomic_store_n(&async.running, 1, __ATOMIC_RELEASE);
+done:
+	mutex_unlock(&syslog_mutex);
+	return rc ? -1 : 0;
+}
+
+/* Hand over a message to the sender thread, -1 if ring is full */
+static int
+async_push(const char *buf, size_t len)
+{
+	unsigned int pos, seq;
+	struct slot *s;
+	int diff;
+
+	if (!__atomic_load_n(&async.running, __ATOMIC_ACQUIRE) && async_start())
+		return -1;
+
+	pos = __atomic_load_n(&async.head, __ATOMIC_RELAXED);
+	for (;;) {
+		s = &async.ring[pos % ASYNC_SLOTS];
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		diff = (int)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&async.head, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0)
+			return -1;
+		else
+			pos = __atomic_load_n(&async.head, __ATOMIC_RELAXED);
+	}
+
+	memcpy(s->buf, buf, len);
+	s->len = len;
+	__atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+	sem_post(&async.sem);
+
+	return 0;
+}
+
+/* Wait, at most a second, for the sender thread to empty the ring */
+static void
+async_drain(void)
+{
+	int i;
+
+	if (!__atomic_load_n(&async.running, __ATOMIC_ACQUIRE))
+		return;
+
+	for (i = 0; i < 1000; i++) {
+		if (__atomic_load_n(&async.tail, __ATOMIC_ACQUIRE) ==
+		    __atomic_load_n(&async.head, __ATOMIC_ACQUIRE))
+			break;
+		(void)usleep(1000);
+	}
+}
+
+/*
+ * Fast path for syslog() from threaded programs, everything is done on
+ * the caller's stack and with a per-thread date cache.  No lock is
+ * taken unless the prefix needs to be built, or we need to reconnect.
+ */
+static void
+fastlog(int pri, const char *msgid, const char *sdfmt, const char *msgfmt,
+	va_list ap, int saved_errno)
+{
+	static __thread struct {
+		time_t	sec;
+		size_t	len;
+		char	date[20];	/* 2006-01-02T15:04:05 */
+		char	zone[7];	/* +hh:mm */
+	} tc = { .sec = -1 };
+	char tbuf[TBUF_LEN], fmt_cpy[FMT_LEN], fmt_cat[FMT_LEN] = "";
+	int stat = sdata.log_stat;
+	struct timeval tv;
+	size_t cnt, len, hdr;
+	char *p = tbuf;
+
+	if (__atomic_load_n(&prefix.len, __ATOMIC_ACQUIRE) == 0) {
+		mutex_lock(&syslog_mutex);
+		if (prefix.len == 0)
+			prefix_build(&sdata);
+		mutex_unlock(&syslog_mutex);
+	}
+
+	if (stat & LOG_RFC3164) {
+		p += snprintf(p, TBUF_LEN, "<%d>", pri);
+		hdr = p - tbuf;
+		p += prefix_copy(p);
+		goto output;
+	}
+
+	if (gettimeofday(&tv, NULL) == -1) {
+		tv.tv_sec  = time(NULL);
+		tv.tv_usec = 0;
+	}
+
+	if (tv.tv_sec != tc.sec) {
+		struct tm tmnow;
+		time_t now = tv.tv_sec;
+
+		tzset();
+		localtime_r(&now, &tmnow);
+		tc.len = strftime(tc.date, sizeof(tc.date), "%FT%T", &tmnow);
+		len = strftime(tc.zone, sizeof(tc.zone) - 1, "%z", &tmnow);
+		if (len == 5) {
+			tc.zone[6] = '\0';
+			tc.zone[5] = tc.zone[4];
+			tc.zone[4] = tc.zone[3];
+			tc.zone[3] = ':';
+		}
+		tc.sec = tv.tv_sec;
+	}
+
+	hdr = snprintf(p, TBUF_LEN, "<%d>1 ", pri);
+	p += snprintf(p, TBUF_LEN, "<%d>1 %s.%06ld%s", pri, tc.date,
+		      (long)tv.tv_usec, tc.zone);
+	p += prefix_copy(p);
+
+	if (msgid != NULL && *msgid != '\0') {
+		strlcat(fmt_cat, msgid, FMT_LEN);
+		strlcat(fmt_cat, " ", FMT_LEN);
+	} else
+		strlcat(fmt_cat, "- ", FMT_LEN);
+
+	if (sdfmt != NULL && *sdfmt != '\0')
+		strlcat(fmt_cat, sdfmt, FMT_LEN);
+	else
+		strlcat(fmt_cat, "-", FMT_LEN);
+
+output:
+	if (msgfmt != NULL && *msgfmt != '\0') {
+		strlcat(fmt_cat, " ", FMT_LEN);
+		strlcat(fmt_cat, msgfmt, FMT_LEN);
+	}
+	expand_m(fmt_cpy, fmt_cat, saved_errno);
+
+	cnt = p - tbuf;
+	len = vsnprintf(p, TBUF_LEN - cnt, fmt_cpy, ap);
+	if (len >= TBUF_LEN - cnt)
+		len = TBUF_LEN - cnt - 1;
+	cnt += len;
+
+	if ((stat & LOG_ASYNC) && !async_push(tbuf, cnt))
+		return;
+
+	/* Like vsyslogp_r(), but only skip <PRI> on the console */
+	if (sendlog(tbuf, cnt) && (stat & LOG_CONS)) {
+		int fd;
+
+		fd = open(_PATH_CONSOLE, O_WRONLY | O_NONBLOCK | O_CLOEXEC, 0);
+		if (fd >= 0) {
+			(void)write(fd, tbuf + hdr, cnt - hdr);
+			(void)write(fd, "\r\n", 2);
+			(void)close(fd);
+		}
+	}
+}
+
 /*
  * syslog, vsyslog --
  *	print message on log file; output is intended for syslogd(8).
@@ -207,16 +632,13 @@ vsyslogp_r(int pri, struct syslog_data *data, const char *msgid,
 	struct sockaddr *sa = NULL;
 	socklen_t len = 0;
 	size_t cnt, prlen, tries;
-	char ch, *p, *t;
+	char *p;
 	struct timeval tv;
 	struct tm tmnow;
 	time_t now;
 	int fd, saved_errno;
-#define TBUF_LEN	2048
-#define FMT_LEN		1024
-#define MAXTRIES	10
 	char tbuf[TBUF_LEN], fmt_cpy[FMT_LEN], fmt_cat[FMT_LEN] = "";
-	size_t tbuf_left, fmt_left, msgsdlen;
+	size_t tbuf_left, msgsdlen;
 	char *fmt = fmt_cat;
 	char dbuf[30];
 	struct iovec iov[8];	/* date/time + prog + [ + pid + ]: + fmt + crlf */
@@ -241,6 +663,11 @@ vsyslogp_r(int pri, struct syslog_data *data, const char *msgid,
 	if ((pri & LOG_FACMASK) == 0)
 		pri |= data->log_fac;
 
+	if (data == &sdata && !(data->log_stat & (LOG_PERROR|LOG_NLOG|LOG_STDOUT))) {
+		fastlog(pri, msgid, sdfmt, msgfmt, ap, saved_errno);
+		return;
+	}
+
 	/* Get system time, wallclock, fall back to UNIX time */
 	if (gettimeofday(&tv, NULL) == -1) {
 		tv.tv_sec  = time(NULL);
@@ -436,37 +863,7 @@ output:
 		strlcat(fmt_cat, msgfmt, FMT_LEN);
 	}
 
-	/*
-	 * We wouldn't need this mess if printf handled %m, or if
-	 * strerror() had been invented before syslog().
-	 */
-	for (t = fmt_cpy, fmt_left = FMT_LEN; (ch = *fmt) != '\0'; ++fmt) {
-		if (ch == '%' && fmt[1] == 'm') {
-			const char *s;
-
-			if ((s = strerror(saved_errno)) == NULL)
-				prlen = snprintf(t, fmt_left, "Error %d",
-				    saved_errno);
-			else
-				prlen = strlcpy(t, s, fmt_left);
-			if (prlen >= fmt_left)
-				prlen = fmt_left - 1;
-			t += prlen;
-			fmt++;
-			fmt_left -= prlen;
-		} else if (ch == '%' && fmt[1] == '%' && fmt_left > 2) {
-			*t++ = '%';
-			*t++ = '%';
-			fmt++;
-			fmt_left -= 2;
-		} else {
-			if (fmt_left > 1) {
-				*t++ = ch;
-				fmt_left--;
-			}
-		}
-	}
-	*t = '\0';
+	expand_m(fmt_cpy, fmt, saved_errno);
 
 	prlen = vsnprintf(p, tbuf_left, fmt_cpy, ap);
 	if (data->log_stat & (LOG_PERROR|LOG_CONS|LOG_NLOG)) {
@@ -539,7 +936,10 @@ output:
 		if (sendto(data->log_file, tbuf, cnt, 0, sa, len) != -1)
 			break;
 		if (errno != ENOBUFS) {
-			disconnectlog_r(data);
+			if (data == &sdata)
+				data->log_connected = 0;
+			else
+				disconnectlog_r(data);
 			connectlog_r(data);
 		} else
 			(void)usleep(1);
@@ -638,11 +1038,12 @@ connectlog_r(struct syslog_data *data)
 			return;
 		}
 
-		if (connect(data->log_file, sa, len) == -1) {
-			(void)close(data->log_file);
-			data->log_file = -1;
-		} else
-			data->log_connected = 1;
+		/*
+		 * Keep the socket on failure, sdata may be shared with
+		 * other threads in sendlog(), we retry connect() later.
+		 */
+		if (connect(data->log_file, sa, len) == 0)
+			__atomic_store_n(&data->log_connected, 1, __ATOMIC_RELEASE);
 	}
 }
 
@@ -670,18 +1071,23 @@ openlog_r(const char *ident, int logstat, int logfac, struct syslog_data *data)
 	if (data == &sdata)
 		mutex_lock(&syslog_mutex);
 	openlog_unlocked_r(ident, logstat, logfac, data);
-	if (data == &sdata)
+	if (data == &sdata) {
+		prefix_build(data);
 		mutex_unlock(&syslog_mutex);
+	}
 }
 
 void
 closelog_r(struct syslog_data *data)
 {
-	if (data == &sdata)
+	if (data == &sdata) {
+		async_drain();
 		mutex_lock(&syslog_mutex);
+		prefix.len = 0;
+	}
+	data->log_connected = 0;
 	(void)close(data->log_file);
 	data->log_file = -1;
-	data->log_connected = 0;
 	data->log_tag = NULL;
 	if (data == &sdata)
 		mutex_unlock(&syslog_mutex);
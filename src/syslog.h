@@ -191,6 +191,7 @@ CODE facilitynames[] = {
 #define	LOG_NLOG	0x080	/* don't write to the system log */
 #define	LOG_STDOUT	0x100	/* like nlog, for debugging syslogp() API */
 #define	LOG_RFC3164     0x200	/* Log to remote/ipc socket in old BSD format */
+#define	LOG_ASYNC	0x400	/* send from a background thread, only syslog() */
 
 #ifndef __KERNEL__
 
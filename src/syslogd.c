@@ -56,7 +56,6 @@ static char sccsid[] __attribute__((unused)) =
 #include <ctype.h>
 #include <getopt.h>
 #include <glob.h>
-#include <setjmp.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -78,9 +77,13 @@ static char sccsid[] __attribute__((unused)) =
 #include <sys/time.h>
 #include <sys/uio.h>
 #include <sys/wait.h>
+#include <spawn.h>
 #ifdef __linux__
 #include <sys/sysinfo.h>
 #endif
+#ifdef HAVE_SYS_SIGNALFD_H
+#include <sys/signalfd.h>
+#endif
 
 #include <arpa/inet.h>
 #include <arpa/nameser.h>
@@ -94,6 +97,19 @@ static char sccsid[] __attribute__((unused)) =
 #include "syslogd.h"
 #include "socket.h"
 #include "timer.h"
+#include "mpsc.h"
+#include "hash.h"
+#include "scan.h"
+#include "dnscache.h"
+#include "resolve.h"
+#include "allow.h"
+#include "stream.h"
+#include "spool.h"
+#include "compress.h"
+#include "metrics.h"
+#include "ratelimit.h"
+#include "fdcache.h"
+#include "wall.h"
 #include "compat.h"
 
 #define SecureMode (secure_opt > 0 ? secure_opt : secure_mode)
@@ -106,6 +122,9 @@ char  ctty[]    = _PATH_CONSOLE;
 static volatile sig_atomic_t debugging_on;
 static volatile sig_atomic_t restart;
 static volatile sig_atomic_t rotate_signal;
+#ifndef HAVE_SYS_SIGNALFD_H
+static int signal_pipe[2] = { -1, -1 };
+#endif
 
 static const char version_info[] = PACKAGE_NAME " v" PACKAGE_VERSION;
 
@@ -120,7 +139,7 @@ static int repeatinterval[] = { 30, 120, 600 };	/* # of secs before flush */
 static char *TypeNames[] = {
 	"UNUSED",        "FILE",  "TTY",  "CONSOLE",
 	"FORW",          "USERS", "WALL", "FORW(SUSPENDED)",
-	"FORW(UNKNOWN)", "PIPE"
+	"FORW(UNKNOWN)", "PIPE",  "TEMPLATE"
 };
 
 static SIMPLEQ_HEAD(files, filed) fhead = SIMPLEQ_HEAD_INITIALIZER(fhead);
@@ -131,11 +150,14 @@ static int	  Foreground = 0;	/* don't fork - don't run in daemon mode */
 static time_t	  boot_time;		/* Offset for printsys() */
 static uint64_t	  sys_seqno = 0;	/* Last seen kernel log message */
 static int	  sys_seqno_init;	/* Timestamp can be in the past, use 'now' after first read */
+static uint64_t	  sys_lost;		/* Kernel messages lost, from seqno gaps */
 static int	  resolve = 1;		/* resolve hostname */
 static char	  LocalHostName[MAXHOSTNAMELEN + 1]; /* our hostname */
+static char	  RawHostName[MAXHOSTNAMELEN + 1];   /* ... from gethostname() */
 static char	 *LocalDomain;			     /* our local domain name */
 static char	 *emptystring = "";
 static int	  Initialized = 0;	  /* set when we have initialized ourselves */
+static uint64_t	  StartTime;		  /* metrics_usec() at start, for startup phases */
 static int	  MarkInterval = 20 * 60; /* interval between marks in seconds */
 static int	  family = PF_UNSPEC;	  /* protocol family (IPv4, IPv6 or both) */
 static int	  mask_C1 = 1;		  /* mask characters from 0x80 - 0x9F */
@@ -152,12 +174,70 @@ static int	  KeepKernTime;		  /* Keep kernel timestamp, evern after initial read
 
 static off_t	  RotateSz = 0;		  /* Max file size (bytes) before rotating, disabled by default */
 static int	  RotateCnt = 5;	  /* Max number (count) of log files to keep, set with -c <NUM> */
+static int	  RotateCodec = COMPRESS_GZIP; /* Compression of rotated files, .1 and older */
+static int	  RotateLevel = 6;	  /* Compression level for RotateCodec */
+
+static int	  RcvBatch = RCVBATCH_DEF; /* Max datagrams to read per recvmmsg() */
+static int	  RcvWorkers;		  /* Receiver threads per inet socket, 0: disabled */
+static int	  SyncInterval;		  /* Seconds between fdatasync() of synced files, 0: every write */
+static int	  WflushTimer;		  /* Set when dowflush() timer is installed */
+static int	  HoldTimer;		  /* Set when dohold() timer is installed */
+static int	  RateLimit;		  /* Messages/sec per source, 0: disabled */
+static int	  RateBurst;		  /* ... and burst size */
+static int	  FileCache = FDCACHE_SIZE; /* Max open files of templated actions */
+
+static char	 *TlsCa;		  /* CA certificates to verify TLS servers */
+static char	 *TlsCert;		  /* Our TLS certificate (chain) */
+static char	 *TlsKey;		  /* ... and its private key */
+static char	 *SpoolDir;		  /* Spool for forwarding targets, or _PATH_SPOOL */
+static char	 *MetricsSocket;	  /* Control socket for metrics, or NULL */
+static uint64_t	  CfGlobals;		  /* Hash of settings actions are opened with */
+
+/*
+ * Preallocated ring of receive buffers, shared by all UNIX and inet
+ * sockets handled by the main loop.  Each wakeup drains up to RcvBatch
+ * datagrams at a time.  The batch counters also accumulate the stats
+ * of stopped receiver workers.
+ */
+static struct rcvring rcvring;
+
+/*
+ * Actions to log to for each facility and severity, rebuilt by init()
+ * and swapped in together with fhead.
+ */
+static struct dispatch *dtab;
+
+/*
+ * Receiver workers and the queue of parsed messages they hand over to
+ * the main loop.  The pipe wakes up the main loop, but only when the
+ * rxq_pending flag was not already set.
+ */
+static SIMPLEQ_HEAD(, rxworker) rwhead = SIMPLEQ_HEAD_INITIALIZER(rwhead);
+static struct mpsc rxq;
+static int	  rxq_pipe[2] = { -1, -1 };
+static int	  rxq_pending;
+static int	  rxq_len;
+static uint64_t	  rxq_drops;
+
+/*
+ * Datagrams, and TCP/TLS peers in stream.c, waiting for the reverse DNS
+ * cache to look up a peer that only a domain name rule in -a can allow.
+ * Main loop only.
+ */
+static TAILQ_HEAD(, held) holdq = TAILQ_HEAD_INITIALIZER(holdq);
+static int	  nheld;
 
 /*
  * List of notifiers
  */
 static SIMPLEQ_HEAD(notifiers, notifier) nothead = SIMPLEQ_HEAD_INITIALIZER(nothead);
 
+/*
+ * Running notifiers, repeated rotations of a file while its notifier
+ * runs are coalesced into one more run when it exits.
+ */
+static TAILQ_HEAD(, notify_job) jobhead = TAILQ_HEAD_INITIALIZER(jobhead);
+
 /*
  * List of peers and sockets for binding.
  */
@@ -167,6 +247,8 @@ static SIMPLEQ_HEAD(, peer) pqueue = SIMPLEQ_HEAD_INITIALIZER(pqueue);
  * List fo peers allowed to log to us.
  */
 static SIMPLEQ_HEAD(, allowedpeer) aphead = SIMPLEQ_HEAD_INITIALIZER(aphead);
+static int aprules;		/* number of -a rules */
+static int apnames;		/* ... of which domain names */
 
 /*
  * central list of recognized configuration keywords with an optional
@@ -174,6 +256,17 @@ static SIMPLEQ_HEAD(, allowedpeer) aphead = SIMPLEQ_HEAD_INITIALIZER(aphead);
  * parser moves the argument to the beginning of the parsed line.
  */
 char *secure_str;			  /* string value of secure_mode */
+char *rcvbatch_str;			  /* string value of rcvbatch */
+char *rcvworkers_str;			  /* string value of rcvworkers */
+char *sync_interval_str;		  /* string value of sync_interval */
+char *rotate_compress_str;		  /* string value of rotate_compress */
+char *tls_ca_str;			  /* string value of tls_ca */
+char *tls_cert_str;			  /* string value of tls_cert */
+char *tls_key_str;			  /* string value of tls_key */
+char *spool_dir_str;			  /* string value of spool_dir */
+char *metrics_socket_str;		  /* string value of metrics_socket */
+char *rate_limit_str;			  /* string value of rate_limit */
+char *file_cache_str;			  /* string value of file_cache */
 
 const struct cfkey {
 	const char  *key;
@@ -181,39 +274,68 @@ const struct cfkey {
 } cfkey[] = {
 	{ "notify",      NULL        },
 	{ "secure_mode", &secure_str },
+	{ "rcvbatch",    &rcvbatch_str },
+	{ "rcvworkers",  &rcvworkers_str },
+	{ "sync_interval", &sync_interval_str },
+	{ "rotate_compress", &rotate_compress_str },
+	{ "tls_ca",      &tls_ca_str },
+	{ "tls_cert",    &tls_cert_str },
+	{ "tls_key",     &tls_key_str },
+	{ "spool_dir",   &spool_dir_str },
+	{ "metrics_socket", &metrics_socket_str },
+	{ "rate_limit",  &rate_limit_str },
+	{ "file_cache",  &file_cache_str },
 };
 
 /* Function prototypes. */
 static int  allowaddr(char *s);
 void        untty(void);
+static int  parsemsg_buf(const char *from, char *msg, struct buf_msg *buffer, char *line);
 static void parsemsg(const char *from, char *msg);
+static int  stream_peer(struct sockaddr *sa, socklen_t len, char *host, size_t hlen);
+static void stream_msg(const char *host, char *msg);
 static int  opensys(const char *file);
 static void printsys(char *msg);
+static void printkmsg(char *rec, int64_t offset, int64_t now);
+static void localtime_cached(time_t t, struct tm *tm);
 static void logmsg(struct buf_msg *buffer);
 static void logrotate(struct filed *f);
 static void rotate_file(struct filed *f, struct stat *stp_or_null);
+static void wbuf_flush(struct filed *f);
+static void file_datasync(struct filed *f);
 static void rotate_all_files(void);
-static void fprintlog_first(struct filed *f, struct buf_msg *buffer);
+static void fprintlog_first(struct filed *f, struct buf_msg *buffer, struct fmtcache *fc);
 static void fprintlog_successive(struct filed *f, int flags);
-void        endtty();
 void        wallmsg(struct filed *f, struct iovec *iov, int iovcnt);
 void        reapchild();
 const char *cvtaddr(struct sockaddr_storage *f, int len);
-const char *cvthname(struct sockaddr *f, socklen_t len);
+const char *cvthname(struct sockaddr *f, socklen_t len, char *hname, size_t hlen);
 static void forw_lookup(struct filed *f);
+static void fprintlog_spool(struct filed *f, struct iovec *iov, int iovcnt);
+static void forw_flush(void);
+static void uring_cb(int sd, void *arg);
+static void resolve_cb(int sd, void *arg);
 void        domark(void *arg);
 void        doflush(void *arg);
+static void doratelimit(void *arg);
+static void dowflush(void *arg);
 void        debug_switch();
 void        die(int sig);
-static void signal_init(void);
+static int  signal_init(void);
 static void boot_time_init(void);
 static void init(void);
+static void startup_resolved(void);
+static void metrics_cb(int family, metrics_emit_fn emit, void *ctx);
 static int  strtobytes(char *arg);
 static int  cfparse(FILE *fp, struct files *newf, struct notifiers *newn);
+static void cfopen(struct filed *f);
+static struct filed *cfmatch(struct filed *nf);
+static void cfreuse(struct filed *nf, struct filed *of);
 int         decode(char *name, struct _code *codetab);
 static void logit(char *, ...);
 static void notifier_add(struct notifiers *newn, const char *program);
 static void notifier_invoke(const char *logfile);
+static void notifier_reaped(pid_t pid);
 static void notifier_free_all(void);
 void        reload(int);
 static void signal_rotate(int sig);
@@ -316,8 +438,16 @@ static void sys_seqno_save(void)
 	fclose(fp);
 
 	prev = sys_seqno;
+}
 
-	sys_seqno_init = 1;	/* Ignore sys timestamp from now */
+/*
+ * Checkpoint kernel seqno, on a timer rather than for every message.
+ * Worst case after a crash we log the last few seconds twice.
+ */
+static void sys_seqno_timer(void *arg)
+{
+	(void)arg;
+	sys_seqno_save();
 }
 
 int usage(int code)
@@ -348,6 +478,10 @@ int usage(int code)
 	       "                                    must be enclosed in '[' and ']'\n"
 	       "              :port                 UDP port number, or service name\n"
 	       "                                    default: 'syslog', port 514\n"
+	       "              tcp://address[:port]  Accept TCP connections, RFC 6587,\n"
+	       "                                    default port 514\n"
+	       "              tls://address[:port]  Accept TLS connections, RFC 5425,\n"
+	       "                                    default port 6514\n"
 	       "\n"
 	       "  -C FILE   File to cache last read kernel seqno, default: %s\n"
 	       "            Note: syslogd relies on this file being removed at system reboot.\n"
@@ -388,9 +522,11 @@ int main(int argc, char *argv[])
 	int no_sys = 0;
 	int pflag = 0;
 	int bflag = 0;
+	int proto;
 	char *ptr;
-	int ch;
+	int ch, rc;
 
+	StartTime = metrics_usec();
 	while ((ch = getopt(argc, argv, "468Aa:b:C:dHFf:Kkm:nP:p:r:sTtv?")) != EOF) {
 		switch ((char)ch) {
 		case '4':
@@ -416,12 +552,21 @@ int main(int argc, char *argv[])
 
 		case 'b':
 			bflag = 1;
+			proto = 0;
+			if (!strncmp(optarg, "tcp://", 6))
+				proto = STREAM_TCP;
+			else if (!strncmp(optarg, "tls://", 6))
+				proto = STREAM_TLS;
+			if (proto)
+				optarg += 6;
+
 			ptr = strchr(optarg, ':');
 			if (ptr)
 				*ptr++ = 0;
 			addpeer(&(struct peer) {
-				.pe_name = optarg,
-				.pe_serv = ptr,
+				.pe_name  = optarg,
+				.pe_serv  = ptr,
+				.pe_proto = proto,
 			});
 			break;
 
@@ -546,7 +691,7 @@ int main(int argc, char *argv[])
 		}
 
 		sys_seqno_load();
-		if (opensys("/dev/kmsg")) {
+		if (opensys(_PATH_KMSG)) {
 			if (opensys(_PATH_KLOG))
 				warn("Kernel logging disabled, failed opening %s",
 				     _PATH_KLOG);
@@ -561,7 +706,22 @@ no_klogd:
 
 	logit("Starting.\n");
 	boot_time_init();
-	signal_init();
+	scan_init();
+	if (signal_init())
+		err(1, "Failed setting up signal handling");
+	if (uring_init(URING_ENTRIES))
+		logit("Classic file and UDP output, no io_uring: %s\n", strerror(errno));
+	else if (socket_register(uring_fd(), NULL, uring_cb, NULL) < 0) {
+		logit("Failed registering io_uring: %s\n", strerror(errno));
+		uring_exit();
+	}
+	if ((rc = resolve_init()))
+		logit("Failed starting forward resolver thread: %s\n", strerror(rc));
+	else if (socket_register(resolve_fd(), NULL, resolve_cb, NULL) < 0) {
+		logit("Failed registering forward resolver: %s\n", strerror(errno));
+		resolve_exit();
+	}
+	stream_init(stream_peer, stream_msg);
 	init();
 
 	/*
@@ -575,6 +735,9 @@ no_klogd:
 		timer_add(interval, domark, NULL);
 	}
 	timer_add(TIMERINTVL, doflush, NULL);
+	timer_add(RATELIMIT_REPORT, doratelimit, NULL);
+	if (KernLog)
+		timer_add(SEQNOINTVL, sys_seqno_timer, NULL);
 
 	/* Start 'em */
 	timer_start();
@@ -598,10 +761,16 @@ no_klogd:
 	if (no_sys)
 		NOTE("Running in a container, disabling klogd.");
 
+	metrics_phase(MS_READY, metrics_usec() - StartTime);
+
 	/* Main loop begins here. */
 	for (;;) {
 		int rc;
 
+		/* Send everything forwarded since last time */
+		forw_flush();
+		stream_flush();
+
 		rc = socket_poll(NULL);
 		if (restart > 0) {
 			restart--;
@@ -621,10 +790,7 @@ no_klogd:
 		}
 
 		if (rc < 0 && errno != EINTR)
-			ERR("select()");
-
-		if (KernLog)
-			sys_seqno_save();
+			ERR("socket_poll()");
 	}
 }
 
@@ -633,9 +799,11 @@ no_klogd:
  */
 static void kernel_cb(int fd, void *arg)
 {
-	char *p, *q, line[MAXLINE + 1];
+	char *p, line[MAXLINE + 1];
+	size_t n, rem;
 	int len, i;
 
+	timer_update();
 	len = 0;
 	for (;;) {
 		i = read(fd, line + len, MAXLINE - 1 - len);
@@ -648,7 +816,10 @@ static void kernel_cb(int fd, void *arg)
 					ERRX("Kernel log buffer filling up too quick, "
 					     "or too small log buffer, "
 					     "adjust kernel CONFIG_LOG_BUF_SHIFT");
+					/* fallthrough */
 				case EINTR:
+					continue; /* edge-triggered, must drain */
+
 				case EAGAIN:
 					break;
 
@@ -664,11 +835,14 @@ static void kernel_cb(int fd, void *arg)
 			break;
 		}
 
-		for (p = line; (q = strchr(p, '\n')) != NULL; p = q + 1) {
-			*q = 0;
+		/* Split on newline, the fast scan knows where the data ends */
+		rem = len + i;
+		for (p = line; (n = scan_newline(p, rem)) < rem; p += n + 1) {
+			p[n] = 0;
 			printsys(p);
+			rem -= n + 1;
 		}
-		len = strlen(p);
+		len = rem;
 		if (len >= MAXLINE - 1) {
 			printsys(p);
 			len = 0;
@@ -683,6 +857,95 @@ static void kernel_cb(int fd, void *arg)
 	}
 }
 
+/*
+ * While reading the kernel backlog, at boot or since the last run, log
+ * files without a write buffer get one.  So the backlog is written in
+ * a few large writes, and synced once, instead of one per message.
+ */
+static void kmsg_bulk(int on)
+{
+	struct filed *f;
+
+	SIMPLEQ_FOREACH(f, &fhead, f_link) {
+		if (on) {
+			if (f->f_type != F_FILE || f->f_wbufsz)
+				continue;
+
+			f->f_wbuf = malloc(KMSG_BULK);
+			if (!f->f_wbuf)
+				continue;
+			f->f_wbufsz = KMSG_BULK;
+			f->f_flags |= BULK_WBUF;
+		} else if (f->f_flags & BULK_WBUF) {
+			wbuf_flush(f);
+			free(f->f_wbuf);
+			f->f_wbuf   = NULL;
+			f->f_wbufsz = 0;
+			f->f_flags &= ~BULK_WBUF;
+		}
+	}
+}
+
+/*
+ * Read Linux /dev/kmsg, one record per read().  The kernel timestamp
+ * is converted to wall-clock time with the offset between the real
+ * time and the monotonic clock, sampled once per callback.
+ */
+static void kmsg_cb(int fd, void *arg)
+{
+	static char rec[KMSG_MAXREC + 1];
+	static int backlog = 1;
+	struct timespec rt, mt;
+	int64_t offset, now;
+	uint64_t start = 0;
+	ssize_t len;
+
+	timer_update();
+	if (backlog) {
+		start = metrics_usec();
+		kmsg_bulk(1);
+	}
+	clock_gettime(CLOCK_REALTIME, &rt);
+	clock_gettime(CLOCK_MONOTONIC, &mt);
+	now    = (int64_t)rt.tv_sec * 1000000 + rt.tv_nsec / 1000;
+	offset = now - ((int64_t)mt.tv_sec * 1000000 + mt.tv_nsec / 1000);
+
+	for (;;) {
+		len = read(fd, rec, sizeof(rec) - 1);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EPIPE) {
+				/* records overwritten, gap is seen on next seqno */
+				continue;
+			}
+			if (errno != EAGAIN) {
+				ERR("kmsg read()");
+				socket_close(fd);
+			}
+			break;
+		}
+		if (len == 0)
+			break;
+
+		rec[len] = 0;
+		printkmsg(rec, offset, now);
+	}
+
+	if (sys_lost) {
+		ERRX("Kernel log buffer overrun, lost %" PRIu64 " messages, "
+		     "adjust kernel CONFIG_LOG_BUF_SHIFT", sys_lost);
+		sys_lost = 0;
+	}
+
+	if (backlog) {
+		kmsg_bulk(0);
+		metrics_phase(MS_KERNEL, metrics_usec() - start);
+		backlog = 0;
+	}
+	sys_seqno_init = 1;	/* Ignore sys timestamp from now */
+}
+
 static int opensys(const char *file)
 {
 	struct stat st;
@@ -702,7 +965,7 @@ static int opensys(const char *file)
 	if (fd < 0)
 		return 1;
 
-	if (socket_register(fd, NULL, kernel_cb, NULL) < 0) {
+	if (socket_register(fd, NULL, strcmp(file, _PATH_KMSG) ? kernel_cb : kmsg_cb, NULL) < 0) {
 		close(fd);
 		return 1;
 	}
@@ -710,28 +973,136 @@ static int opensys(const char *file)
 	return 0;
 }
 
-static void unix_cb(int sd, void *arg)
+/*
+ * Read up to batch datagrams into the receive ring, with sender address
+ * if sa is set.  Blocks for the first datagram if wait is set, used by
+ * receiver workers.  Returns number of datagrams read.
+ */
+static int rcvbatch(struct rcvring *rr, int sd, int sa, int wait, int batch)
 {
-	ssize_t msglen;
-	char msg[MAXLINE + 1] = { 0 };
+	int num;
+
+	for (int i = 0; i < batch; i++) {
+		struct msghdr *msg = &rr->hdr[i].msg_hdr;
+
+		if (!rr->bufp[i])
+			rr->bufp[i] = rr->buf[i];
+		rr->iov[i].iov_base = rr->bufp[i];
+		rr->iov[i].iov_len  = MAXLINE;
+		msg->msg_iov        = &rr->iov[i];
+		msg->msg_iovlen     = 1;
+		msg->msg_name       = sa ? &rr->ss[i] : NULL;
+		msg->msg_namelen    = sa ? sizeof(rr->ss[i]) : 0;
+#ifdef SO_PASSCRED
+		msg->msg_control    = rr->ctl[i];
+		msg->msg_controllen = sizeof(rr->ctl[i]);
+#else
+		msg->msg_control    = NULL;
+		msg->msg_controllen = 0;
+#endif
+		msg->msg_flags      = 0;
+	}
 
-	msglen = recv(sd, msg, sizeof(msg) - 1, 0);
-	logit("Message from UNIX socket #%d: %s\n", sd, msg);
-	if (msglen <= 0) {
-		if (msglen < 0 && errno != EINTR)
-			ERR("UNIX recv()");
-		return;
+#ifdef HAVE_RECVMMSG
+	do
+		num = recvmmsg(sd, rr->hdr, batch, wait ? MSG_WAITFORONE : MSG_DONTWAIT, NULL);
+	while (num < 0 && errno == EINTR);
+#else
+	for (num = 0; num < batch; num++) {
+		int flags = (num || !wait) ? MSG_DONTWAIT : 0;
+		ssize_t len;
+
+		len = recvmsg(sd, &rr->hdr[num].msg_hdr, flags);
+		if (len < 0) {
+			if (errno == EINTR) {
+				num--;
+				continue;
+			}
+			if (num == 0)
+				return -1;
+			break;
+		}
+		rr->hdr[num].msg_len = len;
+	}
+#endif
+	if (num <= 0)
+		return num;
+
+	if (num < batch)
+		rr->partial++;
+	else
+		rr->full++;
+
+	for (int i = 0; i < num; i++)
+		rr->bufp[i][rr->hdr[i].msg_len] = 0;
+
+	return num;
+}
+
+/*
+ * Rate limit local senders on their credentials, from SO_PASSCRED
+ */
+static int unix_ratelimit(struct msghdr *msg)
+{
+#ifdef SO_PASSCRED
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		struct ucred cred;
+
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_CREDENTIALS)
+			continue;
+
+		memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+		return ratelimit_cred(cred.pid, cred.uid, timer_now_us());
 	}
-	msg[msglen] = 0;
+#endif
+	return 1;
+}
+
+/*
+ * The event loop is edge-triggered, so drain the socket until EAGAIN,
+ * or a partial batch, which means there was nothing more to read.
+ */
+static void unix_cb(int sd, void *arg)
+{
+	struct peer *pe = arg;
+	int num;
+
+	do {
+		num = rcvbatch(&rcvring, sd, 0, 0, RcvBatch);
+		if (num < 0) {
+			if (errno != EAGAIN) {
+				metric_inc(M_RX_ERRORS);
+				ERR("UNIX recv()");
+			}
+			return;
+		}
+
+		timer_update();
+
+		for (int i = 0; i < num; i++) {
+			if (rcvring.hdr[i].msg_len == 0)
+				continue;
+
+			metric_inc(M_RX_UNIX);
+			__atomic_add_fetch(&pe->pe_rx, 1, __ATOMIC_RELAXED);
+			if (RateLimit && !unix_ratelimit(&rcvring.hdr[i].msg_hdr)) {
+				metric_inc(M_RATELIMITED);
+				continue;
+			}
 
-	parsemsg(LocalHostName, msg);
+			logit("Message from UNIX socket #%d: %s\n", sd, rcvring.buf[i]);
+			parsemsg(LocalHostName, rcvring.buf[i]);
+		}
+	} while (num == RcvBatch);
 }
 
 static void create_unix_socket(struct peer *pe)
 {
 	struct sockaddr_un sun;
 	struct addrinfo ai;
-	int sd = -1;
+	int sd = -1, on = 1;
 
 	if (pe->pe_socknum)
 		return;		/* Already set up */
@@ -744,10 +1115,16 @@ static void create_unix_socket(struct peer *pe)
 	ai.ai_protocol = pe->pe_mode;
 	strlcpy(sun.sun_path, pe->pe_name, sizeof(sun.sun_path));
 
-	sd = socket_create(&ai, unix_cb, NULL);
+	sd = socket_create(&ai, unix_cb, pe);
 	if (sd < 0)
 		goto err;
 
+#ifdef SO_PASSCRED
+	/* Sender credentials, for rate limiting per process */
+	if (setsockopt(sd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)))
+		logit("Failed enabling SO_PASSCRED on %s: %s\n", pe->pe_name, strerror(errno));
+#endif
+
 	logit("Created UNIX socket %d ...\n", sd);
 	pe->pe_sock[pe->pe_socknum++] = sd;
 	return;
@@ -780,156 +1157,700 @@ static void unmapped(struct sockaddr *sa)
 	memcpy(sa, &sin, sizeof(sin));
 }
 
-static void inet_cb(int sd, void *arg)
+static void dohold(void *arg)
 {
-	struct sockaddr_storage ss;
-	struct sockaddr *sa = (struct sockaddr *)&ss;
+	struct held *h, *next;
+	char buf[NI_MAXHOST];
 	const char *hname;
-	socklen_t sslen;
-	ssize_t len;
-	char msg[MAXLINE + 1] = { 0 };
 
-	sslen = sizeof(ss);
-	len = recvfrom(sd, msg, sizeof(msg) - 1, 0, sa, &sslen);
-	if (len <= 0) {
-		if (len < 0 && errno != EINTR && errno != EAGAIN)
-			ERR("INET recvfrom()");
-		return;
+	timer_update();
+	TAILQ_FOREACH_SAFE(h, &holdq, link, next) {
+		struct sockaddr *sa = sstosa(&h->ss);
+
+		hname = cvthname(sa, h->sslen, buf, sizeof(buf));
+		if (!hname && timer_now() - h->since < HOLD_TIMEOUT)
+			continue;
+
+		TAILQ_REMOVE(&holdq, h, link);
+		nheld--;
+
+		unmapped(sa);
+		if (!hname || !validate(sa, hname)) {
+			metric_inc(M_REJECTED);
+			logit("Message from %s was ignored.\n", hname ? hname : buf);
+		} else if (RateLimit && !ratelimit_addr(sa, timer_now_us())) {
+			metric_inc(M_RATELIMITED);
+		} else
+			parsemsg(hname, h->data);
+		free(h);
 	}
-	msg[len] = 0;
 
-	hname = cvthname((struct sockaddr *)&ss, sslen);
-	unmapped(sa);
-	if (!validate(sa, hname)) {
-		logit("Message from %s was ignored.\n", hname);
-		return;
+	if (!nheld && !stream_peers()) {
+		timer_del(dohold, NULL);
+		HoldTimer = 0;
 	}
+}
 
-	parsemsg(hname, msg);
+static void hold_timer(void)
+{
+	if (HoldTimer)
+		return;
+
+	if (!timer_add_ms(HOLDINTVL, dohold, NULL))
+		HoldTimer = 1;
 }
 
-static int nslookup(const char *host, const char *service, struct addrinfo **ai)
+/*
+ * Hold datagram from a peer, until cvthname() knows its name.  From
+ * the main loop, sa as received, before unmapped().
+ */
+static void hold_add(struct sockaddr *sa, socklen_t len, const char *data)
 {
-	struct addrinfo hints;
-	const char *node = host;
+	size_t dlen = strlen(data) + 1;
+	struct held *h;
 
-	if (!node || !node[0])
-		node = NULL;
+	if (nheld >= HOLD_MAX || len > sizeof(h->ss) ||
+	    !(h = malloc(sizeof(*h) + dlen))) {
+		metric_inc(M_REJECTED);
+		logit("Cannot hold message until peer name is known, ignored.\n");
+		return;
+	}
 
-	/* Reset resolver cache and retry name lookup */
-	res_init();
+	memcpy(&h->ss, sa, len);
+	h->sslen = len;
+	h->since = timer_now();
+	memcpy(h->data, data, dlen);
+	TAILQ_INSERT_TAIL(&holdq, h, link);
+	nheld++;
 
-	logit("nslookup '%s:%s'\n", node ?: "none", service);
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_flags    = !node ? AI_PASSIVE : 0;
-	hints.ai_family   = family;
-	hints.ai_socktype = SOCK_DGRAM;
+	hold_timer();
+}
 
-	return getaddrinfo(node, service, &hints, ai);
+static void hold_exit(void)
+{
+	struct held *h, *next;
+
+	TAILQ_FOREACH_SAFE(h, &holdq, link, next)
+		free(h);
+	TAILQ_INIT(&holdq);
+	nheld = 0;
 }
 
-static void create_inet_socket(struct peer *pe)
+static void inet_cb(int sd, void *arg)
 {
-	struct addrinfo *ai, *res;
-	int sd, err;
+	struct peer *pe = arg;
+	char buf[NI_MAXHOST];
+	int num;
+
+	do {
+		num = rcvbatch(&rcvring, sd, 1, 0, RcvBatch);
+		if (num < 0) {
+			if (errno != EAGAIN) {
+				metric_inc(M_RX_ERRORS);
+				ERR("INET recvfrom()");
+			}
+			return;
+		}
 
-	err = nslookup(pe->pe_name, pe->pe_serv, &res);
-	if (err) {
-		ERRX("%s/udp service unknown: %s", pe->pe_serv,
-		     gai_strerror(err));
-		return;
-	}
+		timer_update();
+		for (int i = 0; i < num; i++) {
+			struct sockaddr *sa = sstosa(&rcvring.ss[i]);
+			socklen_t sslen = rcvring.hdr[i].msg_hdr.msg_namelen;
+			const char *hname;
 
-	for (ai = res; ai; ai = ai->ai_next) {
-		if (pe->pe_socknum + 1 >= NELEMS(pe->pe_sock)) {
-			WARN("Only %zd IP addresses per socket supported.",
-			     NELEMS(pe->pe_sock));
-			break;
+			if (rcvring.hdr[i].msg_len == 0)
+				continue;
+
+			metric_inc(M_RX_INET);
+			__atomic_add_fetch(&pe->pe_rx, 1, __ATOMIC_RELAXED);
+			hname = cvthname(sa, sslen, buf, sizeof(buf));
+			if (!hname) {
+				hold_add(sa, sslen, rcvring.buf[i]);
+				continue;
+			}
+			unmapped(sa);
+			if (!validate(sa, hname)) {
+				metric_inc(M_REJECTED);
+				logit("Message from %s was ignored.\n", hname);
+				continue;
+			}
+			if (RateLimit && !ratelimit_addr(sa, timer_now_us())) {
+				metric_inc(M_RATELIMITED);
+				continue;
+			}
+
+			parsemsg(hname, rcvring.buf[i]);
 		}
+	} while (num == RcvBatch);
+}
 
-		if (SecureMode)
-			ai->ai_flags |= AI_SECURE;
-		else
-			ai->ai_flags &= ~AI_SECURE;
+/*
+ * Accepted TCP/TLS connection, check peer like for inet_cb()
+ */
+static int stream_peer(struct sockaddr *sa, socklen_t len, char *host, size_t hlen)
+{
+	const char *hname;
 
-		sd = socket_create(ai, inet_cb, NULL);
-		if (sd < 0)
-			continue;
+	hname = cvthname(sa, len, host, hlen);
+	if (!hname) {
+		hold_timer();
+		return -1;
+	}
+	if (hname != host)
+		strlcpy(host, hname, hlen);
 
-		logit("Created inet socket %d for %s:%s ...\n", sd,
-		      pe->pe_name, pe->pe_serv);
-		pe->pe_sock[pe->pe_socknum++] = sd;
+	unmapped(sa);
+	if (!validate(sa, host)) {
+		metric_inc(M_REJECTED);
+		logit("Connection from %s was rejected.\n", host);
+		return 0;
 	}
 
-	freeaddrinfo(res);
+	return 1;
 }
 
-void untty(void)
+static void stream_msg(const char *host, char *msg)
 {
-	if (!Debug)
-		setsid();
+	metric_inc(M_RX_STREAM);
+	parsemsg(host, msg);
 }
 
 /*
- * Removes characters from log messages that are unsafe to display.
- * TODO: Permit UTF-8 strings that include a BOM per RFC 5424?
+ * Message slots of receiver workers.  Each worker receives straight
+ * into its own preallocated slots, parses in place, and queues the slot
+ * for the main loop.  The main loop hands the slot back to its pool's
+ * return queue, the worker moves returned slots to its free list when
+ * it runs out.  Slots from malloc(), when a pool is exhausted, have no
+ * pool and are freed.
  */
-static void
-parsemsg_remove_unsafe_characters(const char *in, char *out, size_t outlen)
+static struct rxslot *rxslot_get(struct rxpool *pool)
 {
-	char *q;
-	int c;
+	struct rxslot *slot;
 
-	q = out;
-	while ((c = (unsigned char)*in++) != '\0' && q < out + outlen - 4) {
-		if (mask_C1 && (c & 0x80) && c < 0xA0) {
-			c &= 0x7F;
-			*q++ = 'M';
-			*q++ = '-';
-		}
-		if (isascii(c) && iscntrl(c)) {
-			if (c == '\n') {
-				*q++ = ' ';
-			} else if (c == '\t') {
-				*q++ = '\t';
-			} else {
-				*q++ = '^';
-				*q++ = c ^ 0100;
-			}
-		} else {
-			*q++ = c;
+	if (!pool->free) {
+		struct mpsc_node *node;
+
+		while ((node = mpsc_pop(&pool->ret))) {
+			slot = mpsc_entry(node, struct rxslot, node);
+			slot->next = pool->free;
+			pool->free = slot;
 		}
 	}
-	*q = '\0';
+
+	slot = pool->free;
+	if (slot) {
+		pool->free = slot->next;
+		return slot;
+	}
+
+	slot = malloc(sizeof(*slot));
+	if (slot)
+		slot->pool = NULL;
+
+	return slot;
+}
+
+/* Called by the main loop, or the owning worker */
+static void rxslot_put(struct rxslot *slot)
+{
+	if (!slot->pool) {
+		free(slot);
+		return;
+	}
+
+	mpsc_push(&slot->pool->ret, &slot->node);
+}
+
+static struct rxpool *rxpool_new(size_t num)
+{
+	struct rxpool *pool;
+
+	pool = malloc(sizeof(*pool) + num * sizeof(pool->slots[0]));
+	if (!pool)
+		return NULL;
+
+	mpsc_init(&pool->ret);
+	pool->free = NULL;
+	for (size_t i = 0; i < num; i++) {
+		pool->slots[i].pool = pool;
+		pool->slots[i].next = pool->free;
+		pool->free = &pool->slots[i];
+	}
+
+	return pool;
 }
 
 /*
- * Parses a syslog message according to RFC 5424, assuming that PRI and
- * VERSION (i.e., "<%d>1 ") have already been parsed by parsemsg(). The
- * parsed result is passed to logmsg().
+ * Runs in receiver worker, hand over message to main loop and wake it
+ * up, unless a wakeup is already pending.  Returns -1 if the queue is
+ * full, the caller keeps the slot.
  */
-static void
-parsemsg_rfc5424(const char *from, int pri, char *msg)
+static int rxq_push(struct rxslot *slot)
 {
-	const struct logtime *timestamp = NULL;
-	struct logtime timestamp_remote;
-	struct buf_msg buffer;
-	const char *omsg;
-	char line[MAXLINE + 1];
+	if (__atomic_add_fetch(&rxq_len, 1, __ATOMIC_RELAXED) > RXQUEUE_MAX) {
+		__atomic_sub_fetch(&rxq_len, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&rxq_drops, 1, __ATOMIC_RELAXED);
+		metric_inc(M_DROPPED);
+		return -1;
+	}
 
-	memset(&buffer, 0, sizeof(buffer));
-	buffer.recvhost = (char *)from;
-	buffer.pri = pri;
-	buffer.msg = line;
+	mpsc_push(&rxq, &slot->node);
+	if (!__atomic_exchange_n(&rxq_pending, 1, __ATOMIC_SEQ_CST))
+		(void)write(rxq_pipe[1], "!", 1);
 
-#define	FAIL_IF(field, expr) do {					\
-	if (expr) {							\
-		logit("Failed to parse " field " from %s: %s\n",	\
-		      from, omsg);					\
-		return;							\
-	}								\
-} while (0)
-#define	PARSE_CHAR(field, sep) do {					\
+	return 0;
+}
+
+/*
+ * Main loop side of the receiver workers, log all queued messages.
+ */
+static void rxq_cb(int sd, void *arg)
+{
+	struct mpsc_node *node;
+	uint64_t drops;
+	char dummy[64];
+
+	while (read(sd, dummy, sizeof(dummy)) > 0)
+		;
+
+	__atomic_store_n(&rxq_pending, 0, __ATOMIC_SEQ_CST);
+
+	timer_update();
+	while ((node = mpsc_pop(&rxq))) {
+		struct rxslot *slot = mpsc_entry(node, struct rxslot, node);
+
+		__atomic_sub_fetch(&rxq_len, 1, __ATOMIC_RELAXED);
+		if (slot->held)
+			hold_add(sstosa(&slot->ss), slot->sslen, slot->data);
+		else
+			logmsg(&slot->msg);
+		rxslot_put(slot);
+	}
+
+	drops = __atomic_exchange_n(&rxq_drops, 0, __ATOMIC_RELAXED);
+	if (drops)
+		WARN("Receiver workers dropped %" PRIu64 " messages, queue full", drops);
+}
+
+static int rxq_init(void)
+{
+	if (rxq_pipe[0] != -1)
+		return 0;
+
+	if (pipe(rxq_pipe))
+		return -1;
+
+	for (int i = 0; i < 2; i++) {
+		int flags = fcntl(rxq_pipe[i], F_GETFL, 0);
+
+		fcntl(rxq_pipe[i], F_SETFL, flags | O_NONBLOCK);
+		fcntl(rxq_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	mpsc_init(&rxq);
+	if (socket_register(rxq_pipe[0], NULL, rxq_cb, NULL) < 0) {
+		close(rxq_pipe[0]);
+		close(rxq_pipe[1]);
+		rxq_pipe[0] = rxq_pipe[1] = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Receiver worker thread: recvmmsg() -> cvthname() -> validate() ->
+ * parsemsg_buf(), then hand over to the main loop.  Must not call
+ * logmsg(), or anything else that logs with flog(), from here.
+ */
+static void *rxworker_run(void *arg)
+{
+	struct rxworker *rw = arg;
+	struct rcvring *rr = rw->rw_ring;
+	uint64_t rxtime;
+
+	while (!rw->rw_stop) {
+		int batch, num;
+
+		/* Receive directly into free slots */
+		for (batch = 0; batch < rw->rw_batch; batch++) {
+			if (!rw->rw_slot[batch])
+				rw->rw_slot[batch] = rxslot_get(rw->rw_pool);
+			if (!rw->rw_slot[batch])
+				break;
+			rr->bufp[batch] = rw->rw_slot[batch]->data;
+		}
+		if (!batch) {
+			logit("Receiver worker socket %d: out of memory\n", rw->rw_sd);
+			sleep(1);
+			continue;
+		}
+
+		num = rcvbatch(rr, rw->rw_sd, 1, 1, batch);
+		if (num <= 0) {
+			if (num < 0 && errno != EAGAIN && !rw->rw_stop) {
+				metric_inc(M_RX_ERRORS);
+				logit("Receiver worker socket %d: %s\n", rw->rw_sd, strerror(errno));
+			}
+			continue;
+		}
+		rxtime = metrics_usec();
+
+		for (int i = 0; i < num; i++) {
+			struct sockaddr *sa = sstosa(&rr->ss[i]);
+			socklen_t sslen = rr->hdr[i].msg_hdr.msg_namelen;
+			struct rxslot *slot = rw->rw_slot[i];
+			const char *from;
+
+			if (rr->hdr[i].msg_len == 0)
+				continue;
+
+			metric_inc(M_RX_INET);
+			__atomic_add_fetch(&rw->rw_pe->pe_rx, 1, __ATOMIC_RELAXED);
+			from = cvthname(sa, sslen, slot->host, sizeof(slot->host));
+			slot->held = !from;
+			if (slot->held) {
+				/* Main loop holds it, unparsed, see hold_add() */
+				memcpy(&slot->ss, sa, sslen);
+				slot->sslen = sslen;
+				if (!rxq_push(slot))
+					rw->rw_slot[i] = NULL;
+				continue;
+			}
+			unmapped(sa);
+			if (!validate(sa, from)) {
+				metric_inc(M_REJECTED);
+				logit("Message from %s was ignored.\n", from);
+				continue;
+			}
+			if (RateLimit && !ratelimit_addr(sa, rxtime)) {
+				metric_inc(M_RATELIMITED);
+				continue;
+			}
+
+			if (parsemsg_buf(from, slot->data, &slot->msg, slot->line)) {
+				metric_inc(M_PARSE_ERRORS);
+				continue;
+			}
+			slot->msg.rxtime = rxtime;
+
+			/* Slot now owned by main loop, get a new one next time */
+			if (!rxq_push(slot))
+				rw->rw_slot[i] = NULL;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Open an extra SO_REUSEPORT socket for ai, the kernel then spreads the
+ * inbound datagrams across all of them, and a thread to read it.
+ */
+static int rxworker_start(struct peer *pe, struct addrinfo *ai, int batch)
+{
+	struct timeval tv = { .tv_sec = 1 };
+	struct rxworker *rw;
+	sigset_t all, old;
+	int flags, rc;
+
+	rw = calloc(1, sizeof(*rw));
+	if (!rw)
+		return -1;
+
+	rw->rw_ring = calloc(1, sizeof(*rw->rw_ring));
+	if (!rw->rw_ring)
+		goto err;
+
+	rw->rw_pool = rxpool_new(RXPOOL_SLOTS);
+	if (!rw->rw_pool)
+		goto err;
+
+	rw->rw_sd = socket_open(ai);
+	if (rw->rw_sd < 0)
+		goto err;
+
+	/* Blocking reads, with timeout to check for rw_stop */
+	flags = fcntl(rw->rw_sd, F_GETFL, 0);
+	fcntl(rw->rw_sd, F_SETFL, flags & ~O_NONBLOCK);
+	setsockopt(rw->rw_sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	/* Signals are handled by the main thread only */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	rw->rw_batch = batch;
+	rw->rw_pe = pe;
+	rc = pthread_create(&rw->rw_tid, NULL, rxworker_run, rw);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc) {
+		close(rw->rw_sd);
+		goto err;
+	}
+
+	SIMPLEQ_INSERT_TAIL(&rwhead, rw, rw_link);
+
+	return 0;
+err:
+	free(rw->rw_pool);
+	free(rw->rw_ring);
+	free(rw);
+	return -1;
+}
+
+static void rxworker_stop_all(void)
+{
+	struct rxworker *rw, *next;
+
+	SIMPLEQ_FOREACH(rw, &rwhead, rw_link) {
+		rw->rw_stop = 1;
+		/* On Linux this wakes up a blocked reader immediately */
+		shutdown(rw->rw_sd, SHUT_RDWR);
+	}
+
+	SIMPLEQ_FOREACH(rw, &rwhead, rw_link) {
+		pthread_join(rw->rw_tid, NULL);
+		close(rw->rw_sd);
+	}
+
+	/* Log any queued messages before their slots are freed */
+	if (rxq_pipe[0] != -1)
+		rxq_cb(rxq_pipe[0], NULL);
+
+	SIMPLEQ_FOREACH_SAFE(rw, &rwhead, rw_link, next) {
+		rcvring.full    += rw->rw_ring->full;
+		rcvring.partial += rw->rw_ring->partial;
+
+		/* Only slots from malloc() need freeing, the rest are in the pool */
+		for (int i = 0; i < RCVBATCH_MAX; i++) {
+			if (rw->rw_slot[i] && !rw->rw_slot[i]->pool)
+				free(rw->rw_slot[i]);
+		}
+		free(rw->rw_pool);
+		free(rw->rw_ring);
+		free(rw);
+	}
+	SIMPLEQ_INIT(&rwhead);
+}
+
+static int nslookup(const char *host, const char *service, int socktype, struct addrinfo **ai)
+{
+	struct addrinfo hints;
+	const char *node = host;
+
+	if (!node || !node[0])
+		node = NULL;
+
+	logit("nslookup '%s:%s'\n", node ?: "none", service);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags    = !node ? AI_PASSIVE : 0;
+	hints.ai_family   = family;
+	hints.ai_socktype = socktype;
+
+	return getaddrinfo(node, service, &hints, ai);
+}
+
+/*
+ * TCP and TLS listeners, connections are accepted and read by the
+ * main loop, see stream.c
+ */
+static void create_stream_socket(struct peer *pe)
+{
+	struct addrinfo *ai, *res;
+	const char *serv;
+	int sd, err;
+
+	serv = pe->pe_serv;
+	if (!serv || !serv[0])
+		serv = pe->pe_proto == STREAM_TLS ? "6514" : "514";
+
+	err = nslookup(pe->pe_name, serv, SOCK_STREAM, &res);
+	if (err) {
+		ERRX("%s/tcp service unknown: %s", serv, gai_strerror(err));
+		return;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if (pe->pe_socknum + 1 >= NELEMS(pe->pe_sock)) {
+			WARN("Only %zd IP addresses per socket supported.",
+			     NELEMS(pe->pe_sock));
+			break;
+		}
+
+		ai->ai_flags &= ~AI_SECURE;
+		sd = stream_listen(ai, pe->pe_proto);
+		if (sd < 0) {
+			ERR("Failed listening on %s:%s", pe->pe_name ?: "*", serv);
+			continue;
+		}
+
+		logit("Created %s socket %d for %s:%s ...\n", pe->pe_proto == STREAM_TLS
+		      ? "tls" : "tcp", sd, pe->pe_name, serv);
+		pe->pe_sock[pe->pe_socknum++] = sd;
+	}
+
+	freeaddrinfo(res);
+}
+
+static void create_inet_socket(struct peer *pe)
+{
+	struct addrinfo *ai, *res;
+	int sd, err;
+
+	if (pe->pe_proto) {
+		/* No listening sockets at all in secure mode */
+		if (!SecureMode)
+			create_stream_socket(pe);
+		return;
+	}
+
+	err = nslookup(pe->pe_name, pe->pe_serv, SOCK_DGRAM, &res);
+	if (err) {
+		ERRX("%s/udp service unknown: %s", pe->pe_serv,
+		     gai_strerror(err));
+		return;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if (pe->pe_socknum + 1 >= NELEMS(pe->pe_sock)) {
+			WARN("Only %zd IP addresses per socket supported.",
+			     NELEMS(pe->pe_sock));
+			break;
+		}
+
+		if (SecureMode)
+			ai->ai_flags |= AI_SECURE;
+		else
+			ai->ai_flags &= ~AI_SECURE;
+
+		sd = socket_create(ai, inet_cb, pe);
+		if (sd < 0)
+			continue;
+
+		logit("Created inet socket %d for %s:%s ...\n", sd,
+		      pe->pe_name, pe->pe_serv);
+		pe->pe_sock[pe->pe_socknum++] = sd;
+
+		if (SecureMode || RcvWorkers <= 0)
+			continue;
+
+		if (rxq_init()) {
+			ERR("Failed setting up receiver worker queue");
+			continue;
+		}
+
+		for (int i = 0; i < RcvWorkers; i++) {
+			if (rxworker_start(pe, ai, RcvBatch)) {
+				ERR("Failed starting receiver worker for %s:%s",
+				    pe->pe_name ?: "*", pe->pe_serv);
+				break;
+			}
+		}
+		logit("Started %d receiver workers for %s:%s ...\n", RcvWorkers,
+		      pe->pe_name, pe->pe_serv);
+	}
+
+	freeaddrinfo(res);
+}
+
+void untty(void)
+{
+	if (!Debug)
+		setsid();
+}
+
+/*
+ * Removes characters from log messages that are unsafe to display.
+ * TODO: Permit UTF-8 strings that include a BOM per RFC 5424?
+ */
+static void
+parsemsg_remove_unsafe_characters(const char *in, char *out, size_t outlen)
+{
+	char *end = out + outlen - 4;
+	size_t len = strlen(in);
+	char *q = out;
+	int c;
+
+	while (len > 0 && q < end) {
+		size_t n;
+
+		/* Copy run of safe characters in one go */
+		n = scan_unsafe(in, len, mask_C1);
+		if (n > (size_t)(end - q))
+			n = end - q;
+		memcpy(q, in, n);
+		q   += n;
+		in  += n;
+		len -= n;
+		if (!len || q >= end)
+			break;
+
+		c = (unsigned char)*in++;
+		len--;
+		if (mask_C1 && (c & 0x80) && c < 0xA0) {
+			c &= 0x7F;
+			*q++ = 'M';
+			*q++ = '-';
+		}
+		if (isascii(c) && iscntrl(c)) {
+			if (c == '\n') {
+				*q++ = ' ';
+			} else if (c == '\t') {
+				*q++ = '\t';
+			} else {
+				*q++ = '^';
+				*q++ = c ^ 0100;
+			}
+		} else {
+			*q++ = c;
+		}
+	}
+	*q = '\0';
+}
+
+/*
+ * Most messages are clean, so only copy to line, and escape, a message
+ * that actually has unsafe characters.  Returns msg or line, which must
+ * be at least MAXLINE + 1 bytes.
+ */
+static char *parsemsg_safe(char *msg, char *line)
+{
+	size_t len = strlen(msg);
+
+	/* too long, must be truncated like the slow path does */
+	if (len > MAXLINE - 3 || scan_unsafe(msg, len, mask_C1) < len) {
+		parsemsg_remove_unsafe_characters(msg, line, MAXLINE + 1);
+		return line;
+	}
+
+	return msg;
+}
+
+/*
+ * Parses a syslog message according to RFC 5424, assuming that PRI and
+ * VERSION (i.e., "<%d>1 ") have already been parsed by parsemsg_buf().
+ * The parsed result is stored in bm, with the message text in line.
+ */
+static int
+parsemsg_rfc5424(const char *from, int pri, char *msg, struct buf_msg *bm, char *line)
+{
+	const struct logtime *timestamp = NULL;
+	struct logtime timestamp_remote;
+	struct buf_msg buffer;
+	const char *omsg;
+
+	memset(&buffer, 0, sizeof(buffer));
+	buffer.recvhost = (char *)from;
+	buffer.pri = pri;
+	buffer.msg = line;
+
+#define	FAIL_IF(field, expr) do {					\
+	if (expr) {							\
+		logit("Failed to parse " field " from %s: %s\n",	\
+		      from, omsg);					\
+		return -1;						\
+	}								\
+} while (0)
+#define	PARSE_CHAR(field, sep) do {					\
 	FAIL_IF(field, *msg != sep);					\
 	++msg;								\
 } while (0)
@@ -1072,10 +1993,10 @@ parsemsg_rfc5424(const char *from, int pri, char *msg)
 #undef FAIL_IF
 #undef PARSE_CHAR
 #undef IF_NOT_NILVALUE
-	parsemsg_remove_unsafe_characters(msg, line, sizeof(line));
-	buffer.msg = line;
+	buffer.msg = parsemsg_safe(msg, line);
+	*bm = buffer;
 
-	logmsg(&buffer);
+	return 0;
 }
 
 /*
@@ -1135,17 +2056,16 @@ bad:
 
 /*
  * Parses a syslog message according to RFC 3164, assuming that PRI
- * (i.e., "<%d>") has already been parsed by parsemsg(). The parsed
- * result is passed to logmsg().
+ * (i.e., "<%d>") has already been parsed by parsemsg_buf(). The parsed
+ * result is stored in bm, with the message text in line.
  */
-static void
-parsemsg_rfc3164(const char *from, int pri, char *msg)
+static int
+parsemsg_rfc3164(const char *from, int pri, char *msg, struct buf_msg *bm, char *line)
 {
 	struct logtime timestamp_remote = { 0 };
 	struct buf_msg buffer;
 	struct tm tm_parsed;
 	size_t i, msglen;
-	char line[MAXLINE + 1];
 
 	memset(&buffer, 0, sizeof(buffer));
 	buffer.recvhost = (char *)from;
@@ -1224,7 +2144,7 @@ parsemsg_rfc3164(const char *from, int pri, char *msg)
 
 	if (i == MIN(MAXHOSTNAMELEN, msglen)) {
 		logit("Invalid HOSTNAME from %s: %s\n", from, msg);
-		return;
+		return -1;
 	}
 
 	if (buffer.hostname == NULL || !RemoteHostname)
@@ -1232,18 +2152,22 @@ parsemsg_rfc3164(const char *from, int pri, char *msg)
 
 	/* Remove the TAG, if present. */
 	parsemsg_rfc3164_app_name_procid(&msg, &buffer.app_name, &buffer.proc_id);
-	parsemsg_remove_unsafe_characters(msg, line, sizeof(line));
-	logmsg(&buffer);
+	buffer.msg = parsemsg_safe(msg, line);
+	*bm = buffer;
+
+	return 0;
 }
 
 /*
  * Takes a raw input line, extracts PRI and determines whether the
  * message is formatted according to RFC 3164 or RFC 5424. Continues
  * parsing of addition fields in the message according to those
- * standards and prints the message on the appropriate log files.
+ * standards.  The result is stored in buffer, with the message text
+ * in line, which must be at least MAXLINE + 1 bytes.  Safe to call
+ * from receiver workers.  Returns 0 on success, -1 on parse failure.
  */
-static void
-parsemsg(const char *from, char *msg)
+static int
+parsemsg_buf(const char *from, char *msg, struct buf_msg *buffer, char *line)
 {
 	char *q;
 	long n;
@@ -1253,26 +2177,26 @@ parsemsg(const char *from, char *msg)
 	/* Parse PRI. */
 	if (msg[0] != '<' || !isdigit(msg[1])) {
 		logit("Invalid PRI from %s\n", from);
-		return;
+		return -1;
 	}
 	for (i = 2; i <= 4; i++) {
 		if (msg[i] == '>')
 			break;
 		if (!isdigit(msg[i])) {
 			logit("Invalid PRI header from %s\n", from);
-			return;
+			return -1;
 		}
 	}
 	if (msg[i] != '>') {
 		logit("Invalid PRI header from %s\n", from);
-		return;
+		return -1;
 	}
 	errno = 0;
 	n = strtol(msg + 1, &q, 10);
 	if (errno != 0 || *q != msg[i] || n < 0 || n >= INT_MAX) {
 		logit("Invalid PRI %ld from %s: %s\n",
 		      n, from, strerror(errno));
-		return;
+		return -1;
 	}
 	pri = n;
 	if (pri &~ (LOG_FACMASK|LOG_PRIMASK))
@@ -1286,29 +2210,76 @@ parsemsg(const char *from, char *msg)
 	if ((pri & LOG_FACMASK) == LOG_KERN && !KeepKernFac)
 		pri = LOG_MAKEPRI(LOG_USER, LOG_PRI(pri));
 
-	/*
-	 * Message looks OK, update current time and log it
-	 */
-	timer_update();
-
 	/* Parse VERSION. */
 	msg += i + 1;
 	if (msg[0] == '1' && msg[1] == ' ')
-		parsemsg_rfc5424(from, pri, msg + 2);
-	else
-		parsemsg_rfc3164(from, pri, msg);
+		return parsemsg_rfc5424(from, pri, msg + 2, buffer, line);
+
+	return parsemsg_rfc3164(from, pri, msg, buffer, line);
+}
+
+/*
+ * Parse a raw input line and print the message on the appropriate log
+ * files.  Callers are expected to have called timer_update().
+ */
+static void
+parsemsg(const char *from, char *msg)
+{
+	struct buf_msg buffer;
+	char line[MAXLINE + 1];
+
+	if (parsemsg_buf(from, msg, &buffer, line)) {
+		metric_inc(M_PARSE_ERRORS);
+		return;
+	}
+
+	buffer.rxtime = timer_now_us();
+	logmsg(&buffer);
+}
+
+/*
+ * Check for user writing to /dev/kmsg before /dev/log is up.
+ * Syntax to write: <PRI>APP_NAME[PROC_ID]:msg
+ */
+static char *sys_appname(struct buf_msg *buffer, char *p)
+{
+	char *q;
+
+	if (!(buffer->pri & LOG_FACMASK))
+		return p;
+
+	for (q = p; *q && !isspace(*q) && *q != '['; q++)
+		;
+
+	if (*q == '[') {
+		char *ptr = &q[1];
+
+		while (*ptr && isdigit(*ptr))
+			ptr++;
+
+		if (ptr[0] == ']' && ptr[1] == ':') {
+			*ptr++ = 0;
+			*q++   = 0;
+
+			buffer->app_name = p;
+			buffer->proc_id  = q;
+
+			/* user log message cont. here */
+			p = &ptr[1];
+		}
+	}
+
+	return p;
 }
 
 /*
- * Take a raw input line from /dev/klog, Linux /proc/klog, or Linux
- * /dev/kmsg, split and format similar to syslog().
+ * Take a raw input line from /dev/klog, or Linux /proc/klog, split
+ * and format similar to syslog().
  */
 void printsys(char *msg)
 {
 	struct buf_msg buffer;
 	char line[MAXLINE + 1];
-	uint64_t ustime = 0;
-	uint64_t seqno = 0;
 	char *lp, *p, *q;
 	int c;
 
@@ -1319,84 +2290,15 @@ void printsys(char *msg)
 		buffer.hostname = LocalHostName;
 		buffer.pri = DEFSPRI;
 		buffer.msg = line;
+		buffer.rxtime = timer_now_us();
 
 		if (*p == '<') {
-			/* /proc/klog or *BSD /dev/klog */
 			p++;
 			buffer.pri = 0;
 			while (isdigit(*p))
 				buffer.pri = 10 * buffer.pri + (*p++ - '0');
 			if (*p == '>')
 				p++;
-		} else if (isdigit(*p)) {
-			/* Linux /dev/kmsg: "pri,seq#,msec,flag[,..];msg" */
-			time_t now;
-
-			/* pri */
-			buffer.pri = 0;
-			while (isdigit(*p))
-				buffer.pri = 10 * buffer.pri + (*p++ - '0');
-			if (*p == ',')
-				p++;
-
-			/* seq# */
-			while (isdigit(*p))
-				seqno = 10 * seqno + (*p++ - '0');
-
-			/*
-			 * Check if logged already (we've been restarted)
-			 * Account for wrap-around at 18446744073709551615
-			 */
-			if (sys_seqno > 0 && seqno <= sys_seqno) {
-				/* allow dupes around the edge */
-				if (sys_seqno < 18446744073709551000ULL)
-					return;
-			}
-			sys_seqno = seqno;
-			if (*p == ',')
-				p++;
-
-			/* timestamp */
-			while (isdigit(*p))
-				ustime = 10 * ustime + (*p++ - '0');
-
-			/*
-			 * When syslogd starts up, we assume this happens at
-			 * close to system boot, we read all kernel logs from
-			 * /dev/kmsg (Linux) and calculate the precise time
-			 * stamp using boot_time + usec to get the time of a
-			 * log entry.  However, since the kernel time stamp
-			 * is not adjusted for suspend/resume it can be many
-			 * days (!) off after a few weeks of uptime.  It has
-			 * turned out to be quite an interesting problem to
-			 * compensate for, so at runtime we instead use the
-			 * current time of any new kernel messages.
-			 *     -- Joachim Wiberg Nov 23, 2021
-			 */
-			if (KeepKernTime || !sys_seqno_init) {
-				now = boot_time + ustime / 1000000;
-				localtime_r(&now, &buffer.timestamp.tm);
-			} else {
-				struct timeval tv;
-
-				now = time(NULL);
-				if (gettimeofday(&tv, NULL) == -1) {
-					tv.tv_sec  = time(NULL);
-					tv.tv_usec = 0;
-				}
-				ustime = tv.tv_usec * 1000000;
-			}
-
-			localtime_r(&now, &buffer.timestamp.tm);
-			buffer.timestamp.usec = ustime % 1000000;
-
-			/* skip flags for now */
-			q = strchr(p, ';');
-			if (q)
-				p = ++q;
-		} else if (*p == ' ') {
-			/* Linux /dev/kmsg continuation line w/ SUBSYSTEM= DEVICE=, skip */
-			return;
 		} else {
 			/* kernel printf's come out on console */
 			buffer.flags |= IGN_CONS;
@@ -1405,42 +2307,103 @@ void printsys(char *msg)
 		if (buffer.pri & ~(LOG_FACMASK | LOG_PRIMASK))
 			buffer.pri = DEFSPRI;
 
-		/*
-		 * Check for user writing to /dev/kmsg before /dev/log
-		 * is up.  Syntax to write: <PRI>APP_NAME[PROC_ID]:msg
-		 */
-		if (buffer.pri & LOG_FACMASK) {
-			for (q = p; *q && !isspace(*q) && *q != '['; q++)
-				;
-
-			if (*q == '[') {
-				char *ptr = &q[1];
-
-				while (*ptr && isdigit(*ptr))
-					ptr++;
-
-				if (ptr[0] == ']' && ptr[1] == ':') {
-					*ptr++ = 0;
-					*q++   = 0;
-
-					buffer.app_name = p;
-					buffer.proc_id  = q;
-
-					/* user log message cont. here */
-					p = &ptr[1];
-				}
-			}
-		}
+		p = sys_appname(&buffer, p);
 
 		q = lp;
 		while (*p != '\0' && (c = *p++) != '\n' && q < &line[MAXLINE])
 			*q++ = c;
 		*q = '\0';
 
+		metric_inc(M_RX_KERNEL);
 		logmsg(&buffer);
 	}
 }
 
+/*
+ * Log one Linux /dev/kmsg record: "pri,seq#,usec,flag[,..];msg\n"
+ * followed by optional " KEY=VALUE\n" dictionary lines, which we skip.
+ * The seq# is used to detect lost messages and to skip messages we've
+ * already logged before a restart.  Times are in microseconds.
+ */
+static void printkmsg(char *rec, int64_t offset, int64_t now)
+{
+	struct buf_msg buffer;
+	uint64_t ustime = 0;
+	uint64_t seqno = 0;
+	char *p = rec, *q;
+	int64_t wall;
+	time_t sec;
+
+	memset(&buffer, 0, sizeof(buffer));
+	buffer.app_name = "kernel";
+	buffer.hostname = LocalHostName;
+
+	while (isdigit(*p))
+		buffer.pri = 10 * buffer.pri + (*p++ - '0');
+	if (*p++ != ',')
+		return;
+
+	while (isdigit(*p))
+		seqno = 10 * seqno + (*p++ - '0');
+	if (*p++ != ',')
+		return;
+
+	/*
+	 * Check if logged already (we've been restarted)
+	 * Account for wrap-around at 18446744073709551615
+	 */
+	if (sys_seqno > 0 && seqno <= sys_seqno) {
+		/* allow dupes around the edge */
+		if (sys_seqno < 18446744073709551000ULL)
+			return;
+	} else if (sys_seqno > 0 && seqno > sys_seqno + 1)
+		sys_lost += seqno - sys_seqno - 1;
+	sys_seqno = seqno;
+
+	while (isdigit(*p))
+		ustime = 10 * ustime + (*p++ - '0');
+
+	/*
+	 * When syslogd starts up, we assume this happens at close to
+	 * system boot, we read all kernel logs from /dev/kmsg and use
+	 * boot_time + usec to get the time of a log entry.  At runtime
+	 * the kernel timestamp, which is not adjusted for suspend, can
+	 * be days off, so we instead go by the monotonic clock, which
+	 * isn't either, offset to current time.  See -t for details.
+	 */
+	if (KeepKernTime || !sys_seqno_init)
+		wall = (int64_t)boot_time * 1000000 + ustime;
+	else {
+		wall = offset + ustime;
+		if (wall > now)
+			wall = now;
+	}
+	sec = wall / 1000000;
+	localtime_cached(sec, &buffer.timestamp.tm);
+	buffer.timestamp.usec = wall % 1000000;
+
+	/* skip flags for now */
+	q = strchr(p, ';');
+	if (!q)
+		return;
+	p = ++q;
+
+	/* the message ends at the first newline, dictionary follows */
+	q = strchr(p, '\n');
+	if (q)
+		*q = 0;
+	if (strlen(p) > MAXLINE)
+		p[MAXLINE] = 0;
+
+	if (buffer.pri & ~(LOG_FACMASK | LOG_PRIMASK))
+		buffer.pri = DEFSPRI;
+
+	buffer.msg = sys_appname(&buffer, p);
+	buffer.rxtime = timer_now_us();
+	metric_inc(M_RX_KERNEL);
+	logmsg(&buffer);
+}
+
 /*
  * Decode a priority into textual information like auth.emerg.
  */
@@ -1459,6 +2422,23 @@ char *textpri(int pri)
 	return res;
 }
 
+/*
+ * localtime_r() at most once per second, the conversion, including
+ * the time zone offset, is reused for all messages in the same second.
+ * Reset by init() when reloading the time zone.  Main thread only.
+ */
+static time_t    lt_sec = -1;
+static struct tm lt_tm;
+
+static void localtime_cached(time_t t, struct tm *tm)
+{
+	if (t != lt_sec) {
+		localtime_r(&t, &lt_tm);
+		lt_sec = t;
+	}
+	*tm = lt_tm;
+}
+
 static void check_timestamp(struct buf_msg *buffer)
 {
 	struct logtime zero;
@@ -1474,11 +2454,203 @@ static void check_timestamp(struct buf_msg *buffer)
 		tv.tv_usec = 0;
 	}
 
-	localtime_r(&tv.tv_sec, &now.tm);
+	localtime_cached(tv.tv_sec, &now.tm);
 	now.usec = tv.tv_usec;
 	buffer->timestamp = now;
 }
 
+/*
+ * Hash all of the fields of the message, except the timestamp.  Used
+ * to quickly rule out duplicates before comparing with f_prevline.
+ */
+static uint64_t logmsg_hash(struct buf_msg *buffer)
+{
+	uint64_t h;
+
+	h = hash64(&buffer->pri, sizeof(buffer->pri), 0);
+	h = hash_str(buffer->hostname, h);
+	h = hash_str(buffer->app_name == NULL ? "-" : buffer->app_name, h);
+	h = hash_str(buffer->proc_id == NULL ? "-" : buffer->proc_id, h);
+	h = hash_str(buffer->msgid == NULL ? "-" : buffer->msgid, h);
+	h = hash_str(buffer->sd == NULL ? "-" : buffer->sd, h);
+
+	return hash_str(buffer->msg, h);
+}
+
+/*
+ * Store all of the fields of the message, except the timestamp, in a
+ * single string.  This string is used to detect duplicate messages.
+ */
+static size_t logmsg_saved(struct buf_msg *buffer, char *saved, size_t len)
+{
+	int rc;
+
+	rc = snprintf(saved, len, "%d %s %s %s %s %s %s", buffer->pri, buffer->hostname,
+		      buffer->app_name == NULL ? "-" : buffer->app_name,
+		      buffer->proc_id == NULL ? "-" : buffer->proc_id,
+		      buffer->msgid == NULL ? "-" : buffer->msgid,
+		      buffer->sd == NULL ? "-" : buffer->sd, buffer->msg);
+	if (rc < 0)
+		return 0;
+	if ((size_t)rc >= len)
+		return len - 1;
+
+	return rc;
+}
+
+/*
+ * Compare hashes first, the saved string is formatted at most once per
+ * message, into the caller's MAXSVLINE buffer, on the first hash match.
+ */
+static int logmsg_isdup(struct filed *f, struct buf_msg *buffer, uint64_t hash,
+			char *saved, size_t *savedlen)
+{
+	if (!f->f_prevline || hash != f->f_prevhash)
+		return 0;
+
+	if (!*savedlen)
+		*savedlen = logmsg_saved(buffer, saved, MAXSVLINE);
+
+	return *savedlen == f->f_prevlen && !memcmp(saved, f->f_prevline, *savedlen);
+}
+
+/*
+ * Save message as the last one logged to f, for duplicate detection.
+ */
+static void logmsg_save(struct filed *f, const char *saved, size_t savedlen, uint64_t hash)
+{
+	if (f->f_prevsz < savedlen + 1) {
+		char *ptr;
+
+		ptr = realloc(f->f_prevline, savedlen + 1);
+		if (!ptr) {
+			free(f->f_prevline);
+			f->f_prevline = NULL;
+			f->f_prevsz = 0;
+			f->f_prevlen = 0;
+			return;
+		}
+		f->f_prevline = ptr;
+		f->f_prevsz = savedlen + 1;
+	}
+
+	memcpy(f->f_prevline, saved, savedlen + 1);
+	f->f_prevlen = savedlen;
+	f->f_prevhash = hash;
+}
+
+/*
+ * Build dispatch table for the list of actions, two passes: first count
+ * the recipients of each cell, then fill in the pointer arrays, all in
+ * a single allocation.
+ */
+static struct dispatch *dispatch_new(struct files *list)
+{
+	size_t num[LOG_NFACILITIES + 1][LOG_PRIMASK + 1] = { 0 };
+	struct dispatch *dt;
+	struct filed *f, **fp;
+	size_t total = 0;
+
+	SIMPLEQ_FOREACH(f, list, f_link) {
+		for (int fac = 0; fac <= LOG_NFACILITIES; fac++) {
+			for (int pri = 0; pri <= LOG_PRIMASK; pri++) {
+				if (f->f_pmask[fac] & (1 << pri))
+					num[fac][pri]++;
+			}
+		}
+	}
+
+	for (int fac = 0; fac <= LOG_NFACILITIES; fac++) {
+		for (int pri = 0; pri <= LOG_PRIMASK; pri++)
+			total += num[fac][pri] + 1;
+	}
+
+	dt = calloc(1, sizeof(*dt) + total * sizeof(dt->slab[0]));
+	if (!dt)
+		return NULL;
+
+	fp = dt->slab;
+	for (int fac = 0; fac <= LOG_NFACILITIES; fac++) {
+		for (int pri = 0; pri <= LOG_PRIMASK; pri++) {
+			dt->cell[fac][pri] = fp;
+			fp += num[fac][pri] + 1;
+			num[fac][pri] = 0;
+		}
+	}
+
+	SIMPLEQ_FOREACH(f, list, f_link) {
+		for (int fac = 0; fac <= LOG_NFACILITIES; fac++) {
+			for (int pri = 0; pri <= LOG_PRIMASK; pri++) {
+				if (f->f_pmask[fac] & (1 << pri))
+					dt->cell[fac][pri][num[fac][pri]++] = f;
+			}
+		}
+	}
+
+	return dt;
+}
+
+/*
+ * Log message to one action, f, unless it is a duplicate of the last
+ * message logged there.  The priority is already matched.
+ */
+static void logmsg_action(struct filed *f, struct buf_msg *buffer, struct fmtcache *fc,
+			  uint64_t hash, char *saved, size_t *savedlen)
+{
+	/* skip message to console if it has already been printed */
+	if (f->f_type == F_CONSOLE && (buffer->flags & IGN_CONS))
+		return;
+
+	/* don't output marks to recently written files */
+	if (buffer->flags & MARK) {
+		time_t t_now = timer_now();
+
+		if (f->f_time + MarkInterval > t_now)
+			return;
+		if (t_now - f->f_time < MarkInterval / 2)
+			return;
+	}
+
+	/*
+	 * suppress duplicate lines to this file, a templated action may
+	 * log the same line to another file
+	 */
+	if ((buffer->flags & MARK) == 0 && f->f_type != F_TEMPLATE &&
+	    logmsg_isdup(f, buffer, hash, saved, savedlen)) {
+		f->f_lasttime = buffer->timestamp;
+		f->f_prevcount++;
+		f->f_metrics.dups++;
+		metric_inc(M_DUPLICATES);
+		logit("msg repeated %lu times, %ld sec of %d.\n",
+		      f->f_prevcount, timer_now() - f->f_time,
+		      repeatinterval[f->f_repeatcount]);
+
+		/*
+		 * If domark would have logged this by now,
+		 * flush it now (so we don't hold isolated messages),
+		 * but back off so we'll flush less often
+		 * in the future.
+		 */
+		if (timer_now() > REPEATTIME(f)) {
+			fprintlog_successive(f, buffer->flags);
+			BACKOFF(f);
+		}
+	} else {
+		/* new line, save it */
+		if (f->f_prevcount)
+			fprintlog_successive(f, 0);
+
+		f->f_prevpri = buffer->pri;
+		f->f_repeatcount = 0;
+		f->f_lasttime = buffer->timestamp;
+		strlcpy(f->f_prevhost, buffer->hostname, sizeof(f->f_prevhost));
+		if (!*savedlen)
+			*savedlen = logmsg_saved(buffer, saved, MAXSVLINE);
+		logmsg_save(f, saved, *savedlen, hash);
+		fprintlog_first(f, buffer, fc);
+	}
+}
+
 /*
  * Logs a message to the appropriate log files, users, etc. based on the
  * priority. Log messages are always formatted according to RFC 3164,
@@ -1487,10 +2659,11 @@ static void check_timestamp(struct buf_msg *buffer)
  */
 static void logmsg(struct buf_msg *buffer)
 {
+	struct fmtcache fc;
 	struct filed *f;
-	sigset_t mask;
-	size_t savedlen;
+	size_t savedlen = 0;
 	char saved[MAXSVLINE];
+	uint64_t hash;
 	int fac, prilev;
 
 	logit("logmsg: %s, flags %x, from %s, app-name %s procid %s msgid %s sd %s msg %s\n",
@@ -1517,11 +2690,6 @@ static void logmsg(struct buf_msg *buffer)
 
 	prilev = LOG_PRI(buffer->pri);
 
-	sigemptyset(&mask);
-	sigaddset(&mask, SIGHUP);
-	sigaddset(&mask, SIGALRM);
-	sigprocmask(SIG_BLOCK, &mask, NULL);
-
 	/* log the message to the particular outputs */
 	if (!Initialized) {
 		f = &consfile;
@@ -1529,127 +2697,143 @@ static void logmsg(struct buf_msg *buffer)
 		f->f_file = open(ctty, O_WRONLY | O_NOCTTY);
 		if (f->f_file >= 0) {
 			untty();
-			fprintlog_first(f, buffer);
+			fprintlog_first(f, buffer, NULL);
 			(void)close(f->f_file);
 			f->f_file = -1;
 		}
 
-		sigprocmask(SIG_UNBLOCK, &mask, NULL);
 		return;
 	}
 
 	/*
-	 * Store all of the fields of the message, except the timestamp,
-	 * in a single string. This string is used to detect duplicate
-	 * messages.
+	 * Hash the message once, the saved string of all its fields is
+	 * only formatted when needed: on a hash match, to rule out any
+	 * collision, or when it must be saved as a new f_prevline.
 	 */
 	assert(buffer->hostname != NULL);
 	assert(buffer->msg != NULL);
-	savedlen = snprintf(saved, sizeof(saved),
-			    "%d %s %s %s %s %s %s", buffer->pri, buffer->hostname,
-			    buffer->app_name == NULL ? "-" : buffer->app_name,
-			    buffer->proc_id == NULL ? "-" : buffer->proc_id,
-			    buffer->msgid == NULL ? "-" : buffer->msgid,
-			    buffer->sd == NULL ? "-" : buffer->sd, buffer->msg);
+	hash = logmsg_hash(buffer);
+	fc.valid = 0;
 
-	SIMPLEQ_FOREACH(f, &fhead, f_link) {
-		/* skip messages that are incorrect priority */
-		if ((f->f_pmask[fac] == INTERNAL_INVPRI) ||
-		    ((f->f_pmask[fac] & (1 << prilev)) == 0))
-			continue;
+	if (dtab) {
+		for (struct filed **fp = dtab->cell[fac][prilev]; *fp; fp++)
+			logmsg_action(*fp, buffer, &fc, hash, saved, &savedlen);
+	} else {
+		/* no dispatch table, out of memory in init() */
+		SIMPLEQ_FOREACH(f, &fhead, f_link) {
+			if (f->f_pmask[fac] & (1 << prilev))
+				logmsg_action(f, buffer, &fc, hash, saved, &savedlen);
+		}
+	}
 
-		/* skip message to console if it has already been printed */
-		if (f->f_type == F_CONSOLE && (buffer->flags & IGN_CONS))
-			continue;
+	metric_inc(M_LOGGED);
+	if (buffer->rxtime)
+		metrics_observe(MH_LATENCY, metrics_usec() - buffer->rxtime);
+}
 
-		/* don't output marks to recently written files */
-		if (buffer->flags & MARK) {
-			time_t t_now = timer_now();
+static void logrotate(struct filed *f)
+{
+	if (!f->f_rotatesz)
+		return;
 
-			if (f->f_time + MarkInterval > t_now)
-				continue;
-			if (t_now - f->f_time < MarkInterval / 2)
-				continue;
-		}
+	/* f_size is what we have written, -1 for non-regular files */
+	if (f->f_size > f->f_rotatesz)
+		rotate_file(f, NULL);
+}
 
-		/*
-		 * suppress duplicate lines to this file
-		 */
-		if ((buffer->flags & MARK) == 0 && savedlen == f->f_prevlen &&
-		    !strcmp(saved, f->f_prevline)) {
-			f->f_lasttime = buffer->timestamp;
-			f->f_prevcount++;
-			logit("msg repeated %lu times, %ld sec of %d.\n",
-			      f->f_prevcount, timer_now() - f->f_time,
-			      repeatinterval[f->f_repeatcount]);
+/*
+ * Hand over src, the previous path.0 moved aside, to the compression
+ * worker.  If it cannot take it, age the chain and move src to path.1
+ * uncompressed, rather than leaving it behind.
+ */
+static void rotate_aside(const char *path, const char *src, int count)
+{
+	size_t len = strlen(path) + 3;
+	char dst[len];
 
-			/*
-			 * If domark would have logged this by now,
-			 * flush it now (so we don't hold isolated messages),
-			 * but back off so we'll flush less often
-			 * in the future.
-			 */
-			if (timer_now() > REPEATTIME(f)) {
-				fprintlog_successive(f, buffer->flags);
-				BACKOFF(f);
-			}
-		} else {
-			/* new line, save it */
-			if (f->f_prevcount)
-				fprintlog_successive(f, 0);
+	if (!compress_rotate(path, src, count, RotateCodec, RotateLevel))
+		return;
 
-			f->f_prevpri = buffer->pri;
-			f->f_repeatcount = 0;
-			f->f_lasttime = buffer->timestamp;
-			strlcpy(f->f_prevhost, buffer->hostname, sizeof(f->f_prevhost));
-			strlcpy(f->f_prevline, saved, sizeof(f->f_prevline));
-			f->f_prevlen = savedlen;
-			fprintlog_first(f, buffer);
-		}
-	}
+	compress_age(path, count, RotateCodec);
+	snprintf(dst, len, "%s.1", path);
+	(void)rename(src, dst);
+}
+
+static int seqcmp(const void *a, const void *b)
+{
+	unsigned long x = strtoul(strrchr(*(char * const *)a, '.') + 1, NULL, 10);
+	unsigned long y = strtoul(strrchr(*(char * const *)b, '.') + 1, NULL, 10);
 
-	sigprocmask(SIG_UNBLOCK, &mask, NULL);
+	return x < y ? -1 : x > y;
 }
 
-static void logrotate(struct filed *f)
+/*
+ * Files moved aside by rotate_path(), but not compressed because we
+ * were killed, are queued again at startup, oldest first.
+ */
+static void rotate_recover(const char *path, int count)
 {
-	struct stat statf;
+	size_t len = strlen(path) + 5;
+	char pattern[len];
+	glob_t gl;
 
-	if (!f->f_rotatesz)
+	snprintf(pattern, len, "%s.0.*", path);
+	if (glob(pattern, GLOB_NOSORT, NULL, &gl))
 		return;
 
-	if (fstat(f->f_file, &statf))
-		return;
+	qsort(gl.gl_pathv, gl.gl_pathc, sizeof(gl.gl_pathv[0]), seqcmp);
+	for (size_t i = 0; i < gl.gl_pathc; i++) {
+		const char *seq = strrchr(gl.gl_pathv[i], '.') + 1;
+
+		if (!*seq || seq[strspn(seq, "0123456789")])
+			continue;
 
-	/* bug (mostly harmless): can wrap around if file > 4gb */
-	if (S_ISREG(statf.st_mode) && statf.st_size > f->f_rotatesz)
-		rotate_file(f, &statf);
+		NOTE("Rotating %s, left behind by previous run.", gl.gl_pathv[i]);
+		rotate_aside(path, gl.gl_pathv[i], count);
+	}
+	globfree(&gl);
 }
 
-static void rotate_file(struct filed *f, struct stat *stp_or_null)
+/*
+ * Rotate the file at path, open on fd, keeping count old files, and
+ * return the descriptor of the new file, or -1 on error.  With count 0
+ * the file is only truncated.
+ */
+static int rotate_path(const char *path, int fd, int count, struct stat *stp_or_null)
 {
-	if (f->f_rotatecount > 0) { /* always 0..999 */
+	uint64_t start = metrics_usec();
+
+	metric_inc(M_ROTATIONS);
+
+	if (count > 0) { /* always 0..999 */
+		static unsigned int seq;
 		struct stat st_stack;
-		int  len = strlen(f->f_un.f_fname) + 10 + 5;
-		int  i;
+		int  len = strlen(path) + 10 + 5;
 		char oldFile[len];
 		char newFile[len];
 
-		/* First age zipped log files */
-		for (i = f->f_rotatecount; i > 1; i--) {
-			snprintf(oldFile, len, "%s.%d.gz", f->f_un.f_fname, i - 1);
-			snprintf(newFile, len, "%s.%d.gz", f->f_un.f_fname, i);
-
-			/* ignore errors - file might be missing */
-			(void)rename(oldFile, newFile);
-		}
-
-		/* rename: f.8 -> f.9; f.7 -> f.8; ... */
-		for (i = 1; i > 0; i--) {
-			snprintf(oldFile, len, "%s.%d", f->f_un.f_fname, i - 1);
-			snprintf(newFile, len, "%s.%d", f->f_un.f_fname, i);
+		if (RotateCodec != COMPRESS_NONE && compress_avail(RotateCodec)) {
+			/*
+			 * f.0 is moved aside, to a name not in use, the worker
+			 * then ages the compressed files and compresses it to
+			 * f.1, in order with earlier rotations.  No waiting.
+			 */
+			do
+				snprintf(newFile, len, "%s.0.%u", path, ++seq);
+			while (!access(newFile, F_OK));
 
-			if (!rename(oldFile, newFile) && i > 0) {
+			snprintf(oldFile, len, "%s.0", path);
+			if (!rename(oldFile, newFile))
+				rotate_aside(path, newFile, count);
+		} else {
+			/* First age compressed log files */
+			compress_age(path, count, RotateCodec);
+
+			/* rename: f.0 -> f.1 */
+			snprintf(oldFile, len, "%s.0", path);
+			snprintf(newFile, len, "%s.1", path);
+			if (!rename(oldFile, newFile) && RotateCodec != COMPRESS_NONE) {
+				/* Built without zlib, fall back to gzip(1) */
 				size_t clen = 18 + strlen(newFile) + 1;
 				char cmd[clen];
 
@@ -1659,30 +2843,70 @@ static void rotate_file(struct filed *f, struct stat *stp_or_null)
 		}
 
 		/* newFile == "f.0" now */
-		snprintf(newFile, len, "%s.0", f->f_un.f_fname);
-		(void)rename(f->f_un.f_fname, newFile);
+		snprintf(newFile, len, "%s.0", path);
+		(void)rename(path, newFile);
 
 		/* Get mode of open descriptor if not yet */
 		if (stp_or_null == NULL) {
 			stp_or_null = &st_stack;
-			if (fstat(f->f_file, stp_or_null))
+			if (fstat(fd, stp_or_null))
 				stp_or_null = NULL;
 		}
 
-		close(f->f_file);
+		close(fd);
 
-		f->f_file = open(f->f_un.f_fname, O_CREATE | O_NONBLOCK | O_NOCTTY,
-				 (stp_or_null ? stp_or_null->st_mode : 0644));
-		if (f->f_file < 0) {
-			f->f_type = F_UNUSED;
-			ERR("Failed re-opening log file %s after rotation", f->f_un.f_fname);
-			return;
-		}
+		fd = open(path, O_CREATE | O_NONBLOCK | O_NOCTTY,
+			  (stp_or_null ? stp_or_null->st_mode : 0644));
+		if (fd < 0)
+			goto done;
 
 		if (!SIMPLEQ_EMPTY(&nothead))
-			notifier_invoke(f->f_un.f_fname);
+			notifier_invoke(path);
 	}
-	ftruncate(f->f_file, 0);
+	ftruncate(fd, 0);
+done:
+	metrics_observe(MH_ROTATE, metrics_usec() - start);
+
+	return fd;
+}
+
+static void rotate_file(struct filed *f, struct stat *stp_or_null)
+{
+	/* Let the writer finish with the current file first */
+	wbuf_flush(f);
+	if (f->f_queue)
+		outq_drain(f->f_queue);
+	file_datasync(f);
+	if (f->f_ring)
+		uring_file_drain(f->f_ring);
+
+	f->f_file = rotate_path(f->f_un.f_fname, f->f_file, f->f_rotatecount, stp_or_null);
+	if (f->f_queue)
+		outq_setfd(f->f_queue, f->f_file);
+	if (f->f_ring)
+		uring_file_setfd(f->f_ring, f->f_file);
+	if (f->f_file < 0) {
+		f->f_type = F_UNUSED;
+		ERR("Failed re-opening log file %s after rotation", f->f_un.f_fname);
+		return;
+	}
+
+	if (f->f_size > 0)
+		f->f_size = 0;
+}
+
+/*
+ * Files of templated actions, reopened on next write if this fails
+ */
+static void rotate_entry(struct fdentry *fe)
+{
+	if (!fe->rotatesz || fe->fd < 0)
+		return;
+
+	fe->dirty = 0;
+	fe->fd = rotate_path(fe->path, fe->fd, fe->rotatecount, NULL);
+	if (fe->size > 0)
+		fe->size = 0;
 }
 
 static void rotate_all_files(void)
@@ -1693,6 +2917,198 @@ static void rotate_all_files(void)
 		if (f->f_type == F_FILE && f->f_rotatesz)
 			rotate_file(f, NULL);
 	}
+	fdcache_foreach(rotate_entry);
+}
+
+/*
+ * Handle a fatal write error on a file, pipe, tty, or console.  TTYs
+ * and the console are reopened on hangup, returns 1 if the write is
+ * to be retried.  Any async writer is detached from the descriptor
+ * before it is closed, and reattached to the new one.
+ */
+static int fprintlog_err(struct filed *f, int e)
+{
+	f->f_metrics.errors++;
+	if (f->f_queue)
+		outq_setfd(f->f_queue, -1);
+	if (f->f_ring)
+		uring_file_setfd(f->f_ring, -1);
+	(void)close(f->f_file);
+
+	/*
+	 * Check for EBADF/EIO on TTY's due to vhangup()
+	 */
+	if ((f->f_type == F_TTY || f->f_type == F_CONSOLE) && e == EHANGUP) {
+		f->f_file = open(f->f_un.f_fname, O_WRONLY | O_APPEND | O_NOCTTY);
+		if (f->f_file < 0) {
+			f->f_type = F_UNUSED;
+			ERR("Failed writing and re-opening %s", f->f_un.f_fname);
+			return 0;
+		}
+
+		untty();
+		if (f->f_queue)
+			outq_setfd(f->f_queue, f->f_file);
+
+		return 1;
+	}
+
+	f->f_type = F_UNUSED;
+	errno = e;
+	ERR("Failed writing to %s", f->f_un.f_fname);
+
+	return 0;
+}
+
+/*
+ * Synced files are either fsync()'ed after every write, or with the
+ * sync_interval setting, marked for a group fdatasync() by dowflush().
+ * With io_uring the fdatasync() is queued after the pending writes.
+ */
+static void file_sync(struct filed *f)
+{
+	if (!SyncInterval) {
+		(void)fsync(f->f_file);
+		return;
+	}
+
+	f->f_flags |= SYNC_PEND;
+}
+
+static void file_datasync(struct filed *f)
+{
+	if (!(f->f_flags & SYNC_PEND))
+		return;
+
+	if (f->f_ring)
+		uring_file_sync(f->f_ring);
+	else
+		(void)fdatasync(f->f_file);
+	f->f_synctime = timer_now();
+
+	/* Async writer may still have unsynced data */
+	if (f->f_queue && outq_depth(f->f_queue))
+		return;
+	f->f_flags &= ~SYNC_PEND;
+}
+
+/*
+ * Write to a file, pipe, tty, or console.  Either directly, or handed
+ * over to the action's async writer or io_uring writer.
+ */
+static void fprintlog_file(struct filed *f, struct iovec *iov, int iovcnt)
+{
+again:
+	if (f->f_file == -1)
+		return;
+
+	if (f->f_queue) {
+		int e;
+
+		/* Errors from the writer thread are handled here */
+		e = outq_error(f->f_queue);
+		if (e && fprintlog_err(f, e))
+			goto again;
+		if (f->f_type == F_UNUSED)
+			return;
+
+		outq_push(f->f_queue, iov, iovcnt);
+		if (f->f_type == F_FILE && (f->f_flags & SYNC_FILE) && SyncInterval)
+			f->f_flags |= SYNC_PEND;
+		return;
+	}
+
+	if (f->f_ring) {
+		int e;
+
+		/* Errors from completed writes, a full disk is ignored */
+		e = uring_file_error(f->f_ring);
+		if (e && e != ENOSPC && fprintlog_err(f, e))
+			goto again;
+		if (f->f_type == F_UNUSED)
+			return;
+
+		/* Written by uring_submit(), on failure fall back to writev() */
+		if (!uring_file_push(f->f_ring, iov, iovcnt)) {
+			if ((f->f_flags & SYNC_FILE) && SyncInterval)
+				f->f_flags |= SYNC_PEND;
+			return;
+		}
+	}
+
+	if (writev(f->f_file, iov, iovcnt) < 0) {
+		int e = errno;
+
+		/* If a named pipe is full, just ignore it for now */
+		if (f->f_type == F_PIPE && e == EAGAIN)
+			return;
+
+		/* If the filesystem is filled up, just ignore
+		   it for now and continue writing when
+		   possible */
+		if (f->f_type == F_FILE && e == ENOSPC)
+			return;
+
+		/*
+		 * If the console is backed up, just ignore it
+		 * and continue writing again when possible.
+		 */
+		if (f->f_type == F_CONSOLE && e == EAGAIN)
+			return;
+
+		if (fprintlog_err(f, e))
+			goto again;
+	} else if (f->f_type == F_FILE && (f->f_flags & SYNC_FILE))
+		file_sync(f);
+}
+
+/*
+ * Write out, and empty, the write buffer of a file.
+ */
+static void wbuf_flush(struct filed *f)
+{
+	struct iovec iov;
+
+	if (!f->f_wlen)
+		return;
+
+	iov.iov_base = f->f_wbuf;
+	iov.iov_len  = f->f_wlen;
+	f->f_wlen = 0;
+
+	if (f->f_type == F_FILE)
+		fprintlog_file(f, &iov, 1);
+}
+
+/*
+ * Append message to the write buffer of a file, flushing the buffer
+ * first if the message does not fit.  Returns -1 if the message is
+ * larger than the buffer, the caller must then write it unbuffered.
+ */
+static int wbuf_append(struct filed *f, struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (len > f->f_wbufsz - f->f_wlen) {
+		wbuf_flush(f);
+		if (f->f_type != F_FILE)
+			return 0;
+		if (len > f->f_wbufsz)
+			return -1;
+	}
+
+	if (!f->f_wlen)
+		f->f_wtime = timer_now();
+
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(&f->f_wbuf[f->f_wlen], iov[i].iov_base, iov[i].iov_len);
+		f->f_wlen += iov[i].iov_len;
+	}
+
+	return 0;
 }
 
 #define pushiov(iov, cnt, val) do {		\
@@ -1707,12 +3123,360 @@ static void rotate_all_files(void)
 		cnt++;				\
 	} while (0);
 
-void fprintlog_write(struct filed *f, struct iovec *iov, int iovcnt, int flags)
+/*
+ * UDP forwarding.  Each target has one connected socket per resolved
+ * address, so the kernel caches the route, and messages are collected
+ * in a per-target batch written with one sendmmsg() per socket.  The
+ * batch is sent when full, and by forw_flush() before the main loop
+ * polls again.  With io_uring, forw_flush() queues the batches of all
+ * targets on their first socket, to be sent in one submission.
+ */
+struct forwq {
+	int		 cnt;			/* messages in batch */
+	int		 ring;			/* messages sent by io_uring */
+	int		 res[FORW_BATCH];	/* ... result, or -errno */
+	size_t		 len;			/* bytes of buf[] used */
+	struct mmsghdr	 hdr[FORW_BATCH];
+	struct iovec	 iov[FORW_BATCH];
+	char		 buf[FORW_BUFSZ];
+};
+
+static int forwpend;			/* targets with a batch to send */
+
+static int forw_connect(struct filed *f)
 {
 	struct addrinfo *ai;
-	struct msghdr msg;
-	ssize_t len = 0;
-	ssize_t lsent;
+	int err = ENETUNREACH;
+	int sd;
+
+	for (ai = f->f_un.f_forw.f_addr; ai; ai = ai->ai_next) {
+		if (f->f_un.f_forw.f_nsd == FORW_MAXSD)
+			break;
+
+		sd = socket(ai->ai_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (sd == -1) {
+			err = errno;
+			continue;
+		}
+
+		if (connect(sd, ai->ai_addr, ai->ai_addrlen)) {
+			err = errno;
+			logit("Failed connecting socket to %s:%s: %s\n", f->f_un.f_forw.f_hname,
+			      f->f_un.f_forw.f_serv, strerror(errno));
+			close(sd);
+			continue;
+		}
+
+		logit("Connected socket %d to %s:%s\n", sd, f->f_un.f_forw.f_hname, f->f_un.f_forw.f_serv);
+		f->f_un.f_forw.f_sd[f->f_un.f_forw.f_nsd++] = sd;
+	}
+
+	if (f->f_un.f_forw.f_nsd)
+		return 0;
+
+	errno = err;
+	return -1;
+}
+
+/* Close sockets and drop anything not yet sent, before a new lookup */
+static void forw_close(struct filed *f)
+{
+	struct forwq *q = f->f_un.f_forw.f_batch;
+
+	if (q && q->cnt)
+		forwpend--;
+	free(q);
+	f->f_un.f_forw.f_batch = NULL;
+
+	for (int i = 0; i < f->f_un.f_forw.f_nsd; i++)
+		close(f->f_un.f_forw.f_sd[i]);
+	f->f_un.f_forw.f_nsd = 0;
+
+	if (f->f_un.f_forw.f_addr) {
+		resolve_free(f->f_un.f_forw.f_addr);
+		f->f_un.f_forw.f_addr = NULL;
+	}
+
+	free(f->f_un.f_forw.f_hold);
+	f->f_un.f_forw.f_hold = NULL;
+	f->f_un.f_forw.f_holdlen = 0;
+}
+
+/*
+ * Handle send error, in errno, on hard errors the target is suspended.
+ * Always returns -1.
+ */
+static int forw_fail(struct filed *f)
+{
+	f->f_metrics.errors++;
+	switch (errno) {
+	case ENOBUFS:
+	case EAGAIN:
+	case ENETDOWN:
+	case ENETUNREACH:
+	case EHOSTUNREACH:
+	case EHOSTDOWN:
+	case EADDRNOTAVAIL:
+	case ECONNREFUSED:	/* ICMP port unreachable on connected socket */
+		/* Ignore and try again later, with the next message */
+		break;
+	/* case EBADF: */
+	/* case EACCES: */
+	/* case ENOTSOCK: */
+	/* case EFAULT: */
+	/* case EMSGSIZE: */
+	default:
+		f->f_type = F_FORW_SUSP;
+		forw_close(f);
+		ERR("INET sendto(%s:%s)", f->f_un.f_forw.f_hname, f->f_un.f_forw.f_serv);
+	}
+
+	return -1;
+}
+
+#ifndef HAVE_SENDMMSG
+static int sendmmsg(int sd, struct mmsghdr *hdr, unsigned int num, int flags)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++) {
+		ssize_t len;
+
+		len = sendmsg(sd, &hdr[i].msg_hdr, flags);
+		if (len < 0) {
+			if (i == 0)
+				return -1;
+			break;
+		}
+		hdr[i].msg_len = len;
+	}
+
+	return i;
+}
+#endif
+
+/*
+ * Send batch to all connected sockets of target, or until the first
+ * one that takes it all, unless send_to_all.  Anything not sent is
+ * spooled, if the target has a spool, otherwise it is lost.
+ */
+static void forw_send(struct filed *f)
+{
+	struct forwq *q = f->f_un.f_forw.f_batch;
+	int sent = 0, err = 0;
+	int cnt;
+
+	if (!q || !q->cnt)
+		return;
+
+	for (int i = 0; i < f->f_un.f_forw.f_nsd; i++) {
+		int sd = f->f_un.f_forw.f_sd[i];
+		int off = send_to_all ? 0 : sent;
+
+		/* Already sent by forw_flush() on the first socket */
+		if (i == 0 && q->ring) {
+			while (off < q->ring && q->res[off] >= 0)
+				off++;
+			if (off < q->cnt)
+				err = off < q->ring ? -q->res[off] : EAGAIN;
+			q->ring = 0;
+		} else {
+			while (off < q->cnt) {
+				int rc;
+
+				rc = sendmmsg(sd, &q->hdr[off], q->cnt - off, 0);
+				if (rc <= 0) {
+					if (rc < 0 && errno == EINTR)
+						continue;
+					err = rc < 0 ? errno : EAGAIN;
+					break;
+				}
+				off += rc;
+			}
+		}
+
+		logit("Sent %d of %d messages to %s:%s on socket %d ...\n", off, q->cnt,
+		      f->f_un.f_forw.f_hname, f->f_un.f_forw.f_serv, sd);
+		if (off > sent)
+			sent = off;
+		if (sent == q->cnt && !send_to_all)
+			break;
+	}
+
+	for (int i = sent; i < q->cnt; i++)
+		fprintlog_spool(f, &q->iov[i], 1);
+
+	cnt = q->cnt;
+	q->cnt = 0;
+	q->len = 0;
+	forwpend--;
+
+	if (sent < cnt) {
+		errno = err;
+		forw_fail(f);
+	}
+}
+
+/* Queue batch on the first socket, stops at the first failed message */
+static void forw_ring(struct filed *f)
+{
+	struct forwq *q = f->f_un.f_forw.f_batch;
+
+	if (f->f_type != F_FORW || !q || !q->cnt || !f->f_un.f_forw.f_nsd)
+		return;
+
+	for (int i = 0; i < q->cnt; i++)
+		uring_sendmsg(f->f_un.f_forw.f_sd[0], &q->hdr[i].msg_hdr, i + 1 < q->cnt, &q->res[i]);
+	q->ring = q->cnt;
+}
+
+/*
+ * Called from the main loop before it polls, send all batches.  With
+ * io_uring, this is also where file writes are submitted, together
+ * with the UDP batches.  Otherwise only targets up to the last one
+ * with a batch are visited, none if forwpend is zero.
+ */
+static void forw_flush(void)
+{
+	struct filed *f;
+
+	if (uring_active()) {
+		SIMPLEQ_FOREACH(f, &fhead, f_link)
+			forw_ring(f);
+		uring_submit();
+	}
+
+	SIMPLEQ_FOREACH(f, &fhead, f_link) {
+		if (forwpend <= 0)
+			break;
+		if (f->f_type != F_FORW || !f->f_un.f_forw.f_batch ||
+		    !f->f_un.f_forw.f_batch->cnt)
+			continue;
+
+		forw_send(f);
+	}
+}
+
+/* Completions of io_uring writes and sends */
+static void uring_cb(int sd, void *arg)
+{
+	uring_reap();
+}
+
+/*
+ * Add message for forwarding target to its UDP batch.  Returns -1 if
+ * the message could not be queued, on hard errors the target is
+ * suspended.  Send errors for queued messages are handled by
+ * forw_send().
+ */
+static int fprintlog_forw(struct filed *f, struct iovec *iov, int iovcnt)
+{
+	struct forwq *q;
+	size_t len = 0;
+
+	for (int i = 0; i < iovcnt; i++) {
+//		logit("iov[%d] => %s\n", i, (char *)iov[i].iov_base);
+		len += iov[i].iov_len;
+	}
+
+	if (!f->f_un.f_forw.f_nsd && forw_connect(f))
+		return forw_fail(f);
+
+	q = f->f_un.f_forw.f_batch;
+	if (!q) {
+		q = calloc(1, sizeof(*q));
+		if (!q)
+			return -1;
+		f->f_un.f_forw.f_batch = q;
+	}
+
+	if (q->cnt == FORW_BATCH || len > sizeof(q->buf) - q->len) {
+		forw_send(f);
+		if (f->f_type != F_FORW)
+			return -1;
+	}
+
+	if (len > sizeof(q->buf)) {
+		errno = EMSGSIZE;
+		return forw_fail(f);
+	}
+
+	q->iov[q->cnt].iov_base = &q->buf[q->len];
+	q->iov[q->cnt].iov_len  = len;
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(&q->buf[q->len], iov[i].iov_base, iov[i].iov_len);
+		q->len += iov[i].iov_len;
+	}
+
+	memset(&q->hdr[q->cnt], 0, sizeof(q->hdr[0]));
+	q->hdr[q->cnt].msg_hdr.msg_iov    = &q->iov[q->cnt];
+	q->hdr[q->cnt].msg_hdr.msg_iovlen = 1;
+	if (!q->cnt++)
+		forwpend++;
+
+	return 0;
+}
+
+/*
+ * Keep message for forwarding target that is down, replayed later by
+ * spool_replay().  Without a spool the message is lost.
+ */
+static void fprintlog_spool(struct filed *f, struct iovec *iov, int iovcnt)
+{
+	if (!f->f_spool)
+		return;
+
+	logit("Spooling message for %s:%s\n", f->f_un.f_forw.f_hname, f->f_un.f_forw.f_serv);
+	spool_put(f->f_spool, iov, iovcnt);
+}
+
+/*
+ * Keep messages logged while the initial lookup of a target without a
+ * spool is pending, e.g., the kernel backlog at boot, for forw_lookup()
+ * to send when it is done.  Records are the length followed by data.
+ */
+static void forw_hold(struct filed *f, struct iovec *iov, int iovcnt)
+{
+	size_t len = 0, need;
+	char *p;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	need = f->f_un.f_forw.f_holdlen + sizeof(len) + len;
+	if (need > FORW_HOLD) {
+		logit("Lookup of %s:%s pending, dropping message\n",
+		      f->f_un.f_forw.f_hname, f->f_un.f_forw.f_serv);
+		return;
+	}
+
+	if (!f->f_un.f_forw.f_hold) {
+		f->f_un.f_forw.f_hold = malloc(FORW_HOLD);
+		if (!f->f_un.f_forw.f_hold)
+			return;
+	}
+
+	p = &f->f_un.f_forw.f_hold[f->f_un.f_forw.f_holdlen];
+	memcpy(p, &len, sizeof(len));
+	p += sizeof(len);
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+	f->f_un.f_forw.f_holdlen = need;
+}
+
+/* Per-action metrics, counted when handed over to the kernel or writer */
+static void fprintlog_count(struct filed *f, struct iovec *iov, int iovcnt)
+{
+	f->f_metrics.writes++;
+	for (int i = 0; i < iovcnt; i++)
+		f->f_metrics.bytes += iov[i].iov_len;
+}
+
+void fprintlog_write(struct filed *f, struct iovec *iov, int iovcnt, int flags)
+{
+	struct stream *conn;
 	time_t fwd_suspend;
 
 	switch (f->f_type) {
@@ -1725,12 +3489,14 @@ void fprintlog_write(struct filed *f, struct iovec *iov, int iovcnt, int flags)
 		fwd_suspend = timer_now() - f->f_time;
 		if (fwd_suspend >= INET_SUSPEND_TIME) {
 			logit("\nForwarding suspension over, retrying FORW ");
+			f->f_metrics.suspended += fwd_suspend;
 			f->f_type = F_FORW_UNKN;
 			goto f_forw_unkn;
 		} else {
 			logit(" %s:%s\n", f->f_un.f_forw.f_hname, f->f_un.f_forw.f_serv);
 			logit("Forwarding suspension not over, time left: %d.\n",
 			      (int)(INET_SUSPEND_TIME - fwd_suspend));
+			fprintlog_spool(f, iov, iovcnt);
 		}
 		break;
 
@@ -1740,80 +3506,33 @@ void fprintlog_write(struct filed *f, struct iovec *iov, int iovcnt, int flags)
 		forw_lookup(f);
 		if (f->f_type == F_FORW)
 			goto f_forw;
-		break;
-
-	case F_FORW:
-	f_forw:
-		logit(" %s:%s\n", f->f_un.f_forw.f_hname, f->f_un.f_forw.f_serv);
-		f->f_time = timer_now();
-
-		memset(&msg, 0, sizeof(msg));
-		msg.msg_iov = iov;
-		msg.msg_iovlen = iovcnt;
-
-		for (int i = 0; i < iovcnt; i++) {
-//			logit("iov[%d] => %s\n", i, (char *)iov[i].iov_base);
-			len += iov[i].iov_len;
-		}
-
-		lsent = 0;
-		for (ai = f->f_un.f_forw.f_addr; ai; ai = ai->ai_next) {
-			int sd;
-
-			sd = socket_ffs(ai->ai_family);
-			if (sd != -1) {
-				char buf[64] = { 0 };
-
-				msg.msg_name = ai->ai_addr;
-				msg.msg_namelen = ai->ai_addrlen;
-				lsent = sendmsg(sd, &msg, 0);
-
-				if (AF_INET == ai->ai_family) {
-					struct sockaddr_in *sin;
-
-					sin = (struct sockaddr_in *)ai->ai_addr;
-					inet_ntop(AF_INET, &sin->sin_addr, buf, sizeof(buf));
-				} else {
-					struct sockaddr_in6 *sin6;
+		if ((f->f_flags & RESOLVING) && !f->f_spool)
+			forw_hold(f, iov, iovcnt);
+		else
+			fprintlog_spool(f, iov, iovcnt);
+		break;
 
-					sin6 = (struct sockaddr_in6 *)ai->ai_addr;
-					inet_ntop(AF_INET6, &sin6->sin6_addr, buf, sizeof(buf));
-				}
+	case F_FORW:
+	f_forw:
+		logit(" %s:%s\n", f->f_un.f_forw.f_hname, f->f_un.f_forw.f_serv);
+		f->f_time = timer_now();
 
-				logit("Sent %zd bytes to %s on socket %d ...\n", lsent, buf, sd);
-				if (lsent == len)
-					break;
-			}
-			if (lsent == len && !send_to_all)
-				break;
-		}
-		if (lsent != len) {
-			switch (errno) {
-			case ENOBUFS:
-			case ENETDOWN:
-			case ENETUNREACH:
-			case EHOSTUNREACH:
-			case EHOSTDOWN:
-			case EADDRNOTAVAIL:
-				/* Ignore and try again later, with the next message */
-				break;
-			/* case EBADF: */
-			/* case EACCES: */
-			/* case ENOTSOCK: */
-			/* case EFAULT: */
-			/* case EMSGSIZE: */
-			/* case EAGAIN: */
-			/* case ENOBUFS: */
-			/* case ECONNREFUSED: */
-			default:
-				f->f_type = F_FORW_SUSP;
-				ERR("INET sendto(%s:%s)", f->f_un.f_forw.f_hname, f->f_un.f_forw.f_serv);
-				if (f->f_un.f_forw.f_addr) {
-					freeaddrinfo(f->f_un.f_forw.f_addr);
-					f->f_un.f_forw.f_addr = NULL;
-				}
-			}
+		/* TCP/TLS, buffered until the main loop flushes, never suspended */
+		conn = f->f_un.f_forw.f_conn;
+		if (conn) {
+			if (f->f_spool && !stream_isopen(conn))
+				fprintlog_spool(f, iov, iovcnt);
+			else if (stream_send(conn, f->f_un.f_forw.f_addr, iov, iovcnt))
+				fprintlog_spool(f, iov, iovcnt);
+			else
+				fprintlog_count(f, iov, iovcnt);
+			break;
 		}
+
+		if (fprintlog_forw(f, iov, iovcnt))
+			fprintlog_spool(f, iov, iovcnt);
+		else
+			fprintlog_count(f, iov, iovcnt);
 		break;
 
 	case F_CONSOLE:
@@ -1834,55 +3553,24 @@ void fprintlog_write(struct filed *f, struct iovec *iov, int iovcnt, int flags)
 		} else {
 			pushiov(iov, iovcnt, "\n");
 		}
-	again:
 		/* f->f_file == -1 is an indicator that we couldn't
 		   open the file at startup. */
 		if (f->f_file == -1)
 			break;
 
-		if (f->f_type == F_FILE)
+		fprintlog_count(f, &iov[1], iovcnt - 1);
+		if (f->f_type == F_FILE) {
 			logrotate(f);
+			if (f->f_size >= 0) {
+				for (int i = 1; i < iovcnt; i++)
+					f->f_size += iov[i].iov_len;
+			}
+		}
 
-		if (writev(f->f_file, &iov[1], iovcnt - 1) < 0) {
-			int e = errno;
-
-			/* If a named pipe is full, just ignore it for now */
-			if (f->f_type == F_PIPE && e == EAGAIN)
-				break;
-
-			/* If the filesystem is filled up, just ignore
-			   it for now and continue writing when
-			   possible */
-			if (f->f_type == F_FILE && e == ENOSPC)
-				break;
-
-			/*
-			 * If the console is backed up, just ignore it
-			 * and continue writing again when possible.
-			 */
-			if (f->f_type == F_CONSOLE && e == EAGAIN)
-				break;
+		if (f->f_wbuf && !wbuf_append(f, &iov[1], iovcnt - 1))
+			break;
 
-			(void)close(f->f_file);
-			/*
-			 * Check for EBADF/EIO on TTY's due to vhangup()
-			 */
-			if ((f->f_type == F_TTY || f->f_type == F_CONSOLE) && e == EHANGUP) {
-				f->f_file = open(f->f_un.f_fname, O_WRONLY | O_APPEND | O_NOCTTY);
-				if (f->f_file < 0) {
-					f->f_type = F_UNUSED;
-					ERR("Failed writing and re-opening %s", f->f_un.f_fname);
-				} else {
-					untty();
-					goto again;
-				}
-			} else {
-				f->f_type = F_UNUSED;
-				errno = e;
-				ERR("Failed writing to %s", f->f_un.f_fname);
-			}
-		} else if (f->f_type == F_FILE && (f->f_flags & SYNC_FILE))
-			(void)fsync(f->f_file);
+		fprintlog_file(f, &iov[1], iovcnt - 1);
 		break;
 
 	case F_USERS:
@@ -1905,23 +3593,56 @@ void fprintlog_write(struct filed *f, struct iovec *iov, int iovcnt, int flags)
 			   bm->msgid ? bm->msgid : "-",					\
 			   bm->sd ? bm->sd : "-", bm->msg ? bm->msg : "-")
 
-static int fmt3164(struct buf_msg *buffer, char *fmt, struct iovec *iov, size_t iovmax)
+/*
+ * Per-second cache of the rendered date, one per format.  Bursts of
+ * messages mostly share the same second, so the date is a compare and
+ * a copy, for RFC5424 the microseconds are then patched in.  The time
+ * zone offset is part of the key, and init() resets the cache when it
+ * reloads the time zone.  Main thread only.
+ */
+struct tscache {
+	const char	*fmt;
+	struct tm	 tm;		/* key: tm_sec .. tm_year, tm_gmtoff */
+	char		 buf[33];
+};
+
+static struct tscache ts3164, ts5424;
+
+static int tscache_get(struct tscache *tc, const char *fmt, const struct tm *tm)
+{
+	if (tc->fmt == fmt &&
+	    tc->tm.tm_sec  == tm->tm_sec  && tc->tm.tm_min  == tm->tm_min  &&
+	    tc->tm.tm_hour == tm->tm_hour && tc->tm.tm_mday == tm->tm_mday &&
+	    tc->tm.tm_mon  == tm->tm_mon  && tc->tm.tm_year == tm->tm_year &&
+	    tc->tm.tm_gmtoff == tm->tm_gmtoff)
+		return 0;
+
+	strftime(tc->buf, sizeof(tc->buf), fmt, tm);
+	tc->fmt = fmt;
+	tc->tm  = *tm;
+
+	return 1;
+}
+
+static int fmt3164(struct buf_msg *buffer, char *fmt, struct fmtbuf *fb)
 {
+	struct iovec *iov = fb->iov;
 	int i = 0;
 
 	fmtlogit(buffer);
 
 	/* Notice difference to RFC5424, in RFC3164 there is *no* space! */
-	snprintf(buffer->pribuf, sizeof(buffer->pribuf), "<%d>", buffer->pri);
-	pushiov(iov, i, buffer->pribuf);
+	snprintf(fb->pribuf, sizeof(fb->pribuf), "<%d>", buffer->pri);
+	pushiov(iov, i, fb->pribuf);
 
 	/*
 	 * sysklogd < 2.0 had the traditional BSD format for remote syslog
 	 * which did not include the timestamp or the hostname.
 	 */
 	if (fmt) {
-		strftime(buffer->timebuf, sizeof(buffer->timebuf), fmt, &buffer->timestamp.tm);
-		pushiov(iov, i, buffer->timebuf);
+		tscache_get(&ts3164, fmt, &buffer->timestamp.tm);
+		memcpy(fb->timebuf, ts3164.buf, sizeof(fb->timebuf));
+		pushiov(iov, i, fb->timebuf);
 		pushsp(iov, i);
 
 		pushiov(iov, i, buffer->hostname ? buffer->hostname : buffer->recvhost);
@@ -1953,32 +3674,34 @@ static int fmt3164(struct buf_msg *buffer, char *fmt, struct iovec *iov, size_t
 }
 
 /* <PRI>1 2003-08-24T05:14:15.000003-07:00 hostname app-name procid msgid sd msg */
-static int fmt5424(struct buf_msg *buffer, char *fmt, struct iovec *iov, size_t iovmax)
+static int fmt5424(struct buf_msg *buffer, char *fmt, struct fmtbuf *fb)
 {
+	struct iovec *iov = fb->iov;
 	suseconds_t usec;
 	int i = 0;
 
 	fmtlogit(buffer);
-	strftime(buffer->timebuf, sizeof(buffer->timebuf), fmt, &buffer->timestamp.tm);
-
-	/* Add colon to the time zone offset, which %z doesn't do */
-	buffer->timebuf[32] = '\0';
-	buffer->timebuf[31] = buffer->timebuf[30];
-	buffer->timebuf[30] = buffer->timebuf[29];
-	buffer->timebuf[29] = ':';
+	if (tscache_get(&ts5424, fmt, &buffer->timestamp.tm)) {
+		/* Add colon to the time zone offset, which %z doesn't do */
+		ts5424.buf[32] = '\0';
+		ts5424.buf[31] = ts5424.buf[30];
+		ts5424.buf[30] = ts5424.buf[29];
+		ts5424.buf[29] = ':';
+	}
+	memcpy(fb->timebuf, ts5424.buf, sizeof(fb->timebuf));
 
 	/* Overwrite space for microseconds with actual value */
 	usec = buffer->timestamp.usec;
 	for (int j = 25; j >= 20; --j) {
-		buffer->timebuf[j] = usec % 10 + '0';
+		fb->timebuf[j] = usec % 10 + '0';
 		usec /= 10;
 	}
 
 	/* RFC 5424 defines itself as v1, notice space before time, c.f. RFC3164 */
-	snprintf(buffer->pribuf, sizeof(buffer->pribuf), "<%d>1 ", buffer->pri);
-	pushiov(iov, i, buffer->pribuf);
+	snprintf(fb->pribuf, sizeof(fb->pribuf), "<%d>1 ", buffer->pri);
+	pushiov(iov, i, fb->pribuf);
 
-	pushiov(iov, i, buffer->timebuf);
+	pushiov(iov, i, fb->timebuf);
 	pushsp(iov, i);
 
 	pushiov(iov, i, buffer->hostname ? buffer->hostname : buffer->recvhost);
@@ -2001,30 +3724,225 @@ static int fmt5424(struct buf_msg *buffer, char *fmt, struct iovec *iov, size_t
 	return i;
 }
 
-static void fprintlog_first(struct filed *f, struct buf_msg *buffer)
+/* Keys of a templated file path, in the order of tmplvalue() */
+static const char *tmplkeys[] = {
+	"hostname", "app-name", "procid", "msgid", "facility", "severity",
+	"year", "month", "day"
+};
+
+static const char *tmplvalue(int key, const struct buf_msg *buffer, char *num, size_t len)
+{
+	const struct tm *tm = &buffer->timestamp.tm;
+	const char *val = NULL;
+	CODE *c;
+
+	switch (key) {
+	case 0:
+		val = buffer->hostname;
+		break;
+	case 1:
+		val = buffer->app_name;
+		break;
+	case 2:
+		val = buffer->proc_id;
+		break;
+	case 3:
+		val = buffer->msgid;
+		break;
+	case 4:
+		for (c = facilitynames; c->c_name && c->c_val != (LOG_FAC(buffer->pri) << 3); c++)
+			;
+		val = c->c_name;
+		break;
+	case 5:
+		for (c = prioritynames; c->c_name && c->c_val != LOG_PRI(buffer->pri); c++)
+			;
+		val = c->c_name;
+		break;
+	case 6:
+		snprintf(num, len, "%04d", tm->tm_year + 1900);
+		return num;
+	case 7:
+		snprintf(num, len, "%02d", tm->tm_mon + 1);
+		return num;
+	case 8:
+		snprintf(num, len, "%02d", tm->tm_mday);
+		return num;
+	}
+
+	return val && *val ? val : "-";
+}
+
+/*
+ * Expand %hostname%, %app-name%, %procid%, %msgid%, %facility%,
+ * %severity%, %year%, %month%, and %day% in the path of a templated
+ * file action, %% is a literal %.  A '/' in a value, or a leading '.',
+ * is replaced with '_', so senders cannot climb out of the directory.
+ * Returns -1 if the result does not fit in len.
+ */
+static int tmplexpand(const char *tmpl, const struct buf_msg *buffer, char *buf, size_t len)
+{
+	size_t n = 0;
+	char num[16];
+
+	while (*tmpl) {
+		const char *val = NULL, *end;
+		size_t i;
+
+		if (tmpl[0] == '%' && tmpl[1] == '%') {
+			tmpl++;
+		} else if (tmpl[0] == '%' && (end = strchr(tmpl + 1, '%'))) {
+			for (i = 0; i < NELEMS(tmplkeys); i++) {
+				if (strlen(tmplkeys[i]) == (size_t)(end - tmpl - 1) &&
+				    !strncmp(tmpl + 1, tmplkeys[i], end - tmpl - 1))
+					break;
+			}
+			if (i < NELEMS(tmplkeys)) {
+				val  = tmplvalue(i, buffer, num, sizeof(num));
+				tmpl = end + 1;
+			}
+		}
+
+		if (!val) {
+			if (n + 1 >= len)
+				return -1;
+			buf[n++] = *tmpl++;
+			continue;
+		}
+
+		for (i = 0; val[i]; i++) {
+			if (n + 1 >= len)
+				return -1;
+			if (val[i] == '/' || (i == 0 && val[i] == '.'))
+				buf[n++] = '_';
+			else
+				buf[n++] = val[i];
+		}
+	}
+	buf[n] = 0;
+
+	return 0;
+}
+
+/*
+ * Write to the file of a templated action, opened on demand by the
+ * file cache.  There is no write buffer or async writer, the action
+ * writes to many files.  Errors are logged at most once a minute,
+ * other files of the same action may still work.
+ */
+static void fprintlog_template(struct filed *f, struct buf_msg *buffer, struct iovec *iov, int iovcnt)
+{
+	static time_t errtime;
+	char path[MAXFNAME];
+	struct fdentry *fe;
+	size_t len = 0;
+
+	f->f_time = timer_now();
+	if (tmplexpand(f->f_un.f_fname, buffer, path, sizeof(path))) {
+		logit(" %s (path too long)\n", f->f_un.f_fname);
+		f->f_metrics.errors++;
+		return;
+	}
+	logit(" %s\n", path);
+	pushiov(iov, iovcnt, "\n");
+
+	fe = fdcache_open(path);
+	if (!fe)
+		goto err;
+
+	fe->rotatesz    = f->f_rotatesz;
+	fe->rotatecount = f->f_rotatecount;
+	if (fe->rotatesz && fe->size > fe->rotatesz) {
+		rotate_entry(fe);
+		if (fe->fd < 0) {
+			fdcache_drop(fe);
+			goto err;
+		}
+	}
+
+	fprintlog_count(f, &iov[1], iovcnt - 1);
+	if (writev(fe->fd, &iov[1], iovcnt - 1) < 0) {
+		int e = errno;
+
+		/* Like for regular files, try again when there is room */
+		if (e == ENOSPC)
+			return;
+
+		fdcache_drop(fe);
+		errno = e;
+		goto err;
+	}
+
+	if (fe->size >= 0) {
+		for (int i = 1; i < iovcnt; i++)
+			len += iov[i].iov_len;
+		fe->size += len;
+	}
+
+	if (f->f_flags & SYNC_FILE) {
+		if (SyncInterval)
+			fe->dirty = 1;
+		else
+			(void)fsync(fe->fd);
+	}
+	return;
+err:
+	f->f_metrics.errors++;
+	if (timer_now() - errtime >= 60) {
+		errtime = timer_now();
+		ERR("Failed writing to %s", path);
+	}
+}
+
+/*
+ * Render message in the output format of action f, unless already done
+ * for another action logging the same message, fc is then shared by
+ * all of them.  Callers without a cache, fc is NULL, render every time.
+ */
+static void fprintlog_first(struct filed *f, struct buf_msg *buffer, struct fmtcache *fc)
 {
+	struct fmtbuf local, *fb;
 	struct iovec iov[20];
-	int iovcnt;
+	int fmt;
 
 	logit("Called fprintlog_first(), ");
 
-	/* Messages generated by syslogd itself may not have a timestamp */
-	check_timestamp(buffer);
-
 	if (f->f_type != F_FORW_SUSP && f->f_type != F_FORW_UNKN) {
 		f->f_time = timer_now();
 		f->f_prevcount = 0;
 	}
 
 	if (f->f_flags & RFC5424)
-		iovcnt = fmt5424(buffer, RFC5424_DATEFMT, iov, NELEMS(iov));
+		fmt = FMT_RFC5424;
 	else if (f->f_flags & RFC3164)
-		iovcnt = fmt3164(buffer, RFC3164_DATEFMT, iov, NELEMS(iov));
+		fmt = FMT_RFC3164;
 	else
-		iovcnt = fmt3164(buffer, BSDFMT_DATEFMT, iov, NELEMS(iov));
+		fmt = FMT_BSD;
+
+	fb = fc ? &fc->fb[fmt] : &local;
+	if (!fc || !(fc->valid & (1 << fmt))) {
+		/* Messages generated by syslogd itself may not have a timestamp */
+		check_timestamp(buffer);
+
+		if (fmt == FMT_RFC5424)
+			fb->iovcnt = fmt5424(buffer, RFC5424_DATEFMT, fb);
+		else if (fmt == FMT_RFC3164)
+			fb->iovcnt = fmt3164(buffer, RFC3164_DATEFMT, fb);
+		else
+			fb->iovcnt = fmt3164(buffer, BSDFMT_DATEFMT, fb);
+
+		if (fc)
+			fc->valid |= 1 << fmt;
+	}
+
+	/* Shared, but each action appends its own line ending */
+	memcpy(iov, fb->iov, fb->iovcnt * sizeof(iov[0]));
 
 	logit(" logging to %s", TypeNames[f->f_type]);
-	fprintlog_write(f, iov, iovcnt, buffer->flags);
+	if (f->f_type == F_TEMPLATE)
+		fprintlog_template(f, buffer, iov, fb->iovcnt);
+	else
+		fprintlog_write(f, iov, fb->iovcnt, buffer->flags);
 }
 
 static void fprintlog_successive(struct filed *f, int flags)
@@ -2044,125 +3962,56 @@ static void fprintlog_successive(struct filed *f, int flags)
 		 f->f_prevcount);
 	buffer.msg = msg;
 
-	fprintlog_first(f, &buffer);
-}
-
-jmp_buf ttybuf;
-
-void endtty(int signo)
-{
-	longjmp(ttybuf, 1);
+	fprintlog_first(f, &buffer, NULL);
 }
 
 /*
  *  WALLMSG -- Write a message to the world at large
  *
  *	Write the specified message to either the entire
- *	world, or a list of approved users.
+ *	world, or a list of approved users.  Handed over
+ *	to the wall helper thread, which does the writing.
  */
 void wallmsg(struct filed *f, struct iovec *iov, int iovcnt)
 {
-	static int reenter = 0;
-	struct utmp *uptr;
-	struct utmp  ut;
-	char p[sizeof(_PATH_DEV) + UNAMESZ + 1];
+	const char *users[MAXUNAMES];
 	char greetings[200];
-	int ttyf, len, i;
-
-	(void)&len;
+	size_t num = 0;
 
-	if (reenter++)
+	if (f->f_type == F_USERS) {
+		for (num = 0; num < MAXUNAMES && f->f_un.f_uname[num][0]; num++)
+			users[num] = f->f_un.f_uname[num];
+		if (wall_send(users, num, &iov[1], iovcnt - 1))
+			logit("wall: dropped message, helper busy\n");
 		return;
+	}
 
-	/* open the user login file */
-	setutent();
-
-	/*
-	 * Might as well fork instead of using nonblocking I/O
-	 * and doing notty().
-	 */
-	if (fork() == 0) {
+	if (iovcnt > 5) {
+		struct iovec wiov[iovcnt - 4];
 		time_t t_now = time(NULL);
 
-		(void)signal(SIGTERM, SIG_DFL);
-		(void)alarm(0);
-
+		/* Greeting replaces time and hostname, skips <PRI> field */
 		(void)snprintf(greetings, sizeof(greetings),
 		               "\r\n\7Message from syslogd@%s at %.24s ...\r\n",
 		               (char *)iov[3].iov_base, ctime(&t_now));
-		len = strlen(greetings);
-
-		/* scan the user login file */
-		while ((uptr = getutent())) {
-			memcpy(&ut, uptr, sizeof(ut));
-			/* is this slot used? */
-			if (ut.ut_name[0] == '\0')
-				continue;
-			if (ut.ut_type != USER_PROCESS)
-				continue;
-			if (!(strcmp(ut.ut_name, "LOGIN"))) /* paranoia */
-				continue;
-
-			/* should we send the message to this user? */
-			if (f->f_type == F_USERS) {
-				for (i = 0; i < MAXUNAMES; i++) {
-					if (!f->f_un.f_uname[i][0]) {
-						i = MAXUNAMES;
-						break;
-					}
-					if (strncmp(f->f_un.f_uname[i],
-					            ut.ut_name, UNAMESZ) == 0)
-						break;
-				}
-				if (i >= MAXUNAMES)
-					continue;
-			}
+		wiov[0].iov_base = greetings;
+		wiov[0].iov_len  = strlen(greetings);
+		memcpy(&wiov[1], &iov[5], (iovcnt - 5) * sizeof(*iov));
 
-			/* compute the device name */
-			snprintf(p, sizeof(p), "%s%s", _PATH_DEV, ut.ut_line);
-
-			if (f->f_type == F_WALL) {
-				/* Overwrite time, skip space */
-				iov[1].iov_base = greetings;
-				iov[1].iov_len = len;
-				iov[2].iov_len = 0;
-				/* Skip hostname and space, we know where we're at */
-				iov[3].iov_len = 0;
-				iov[4].iov_len = 0;
-			}
-			if (setjmp(ttybuf) == 0) {
-				(void)signal(SIGALRM, endtty);
-				(void)alarm(15);
-
-				/* open terminal, skip <PRI> field for all cases */
-				ttyf = open(p, O_WRONLY | O_NOCTTY);
-				if (ttyf >= 0) {
-					struct stat st;
-					int rc;
-
-					rc = fstat(ttyf, &st);
-					if (rc == 0 && (st.st_mode & S_IWRITE))
-						(void)writev(ttyf, &iov[1], iovcnt - 1);
-					close(ttyf);
-				}
-			}
-			(void)alarm(0);
-		}
-		exit(0);
+		if (wall_send(NULL, 0, wiov, iovcnt - 4))
+			logit("wall: dropped message, helper busy\n");
 	}
-	/* close the user login file */
-	endutent();
-	reenter = 0;
 }
 
 void reapchild(int signo)
 {
 	int saved_errno;
 	int status;
+	pid_t pid;
 
 	saved_errno = errno;
-	while (waitpid(-1, &status, WNOHANG) > 0)
-		;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+		notifier_reaped(pid);
 
 	errno = saved_errno;
 }
@@ -2177,18 +4026,37 @@ const char *cvtaddr(struct sockaddr_storage *f, int len)
 	return ip;
 }
 
+/*
+ * Only a domain name rule in -a can allow this peer, so it cannot be
+ * validated until its name is known.  Safe to call from any thread.
+ */
+static int needname(const struct sockaddr *sa, socklen_t len)
+{
+	struct sockaddr_storage ss;
+	int rule;
+
+	if (apnames == 0 || len > sizeof(ss))
+		return 0;
+
+	memcpy(&ss, sa, len);
+	unmapped(sstosa(&ss));
+
+	return !allow_match(sstosa(&ss), &rule);
+}
+
 /*
  * Return a printable representation of a host address.
  *
- * Here we could check if the host is permitted to send us syslog
- * messages.  We just have to check the hostname we're about to return
- * and compared it (case-insensitively) to a blacklist or whitelist.
- * Callers of cvthname() need to know that if NULL is returned then
- * the host is to be ignored.
+ * The result is stored in hname, which should be NI_MAXHOST bytes, so
+ * that it can be called from receiver workers.  Names come from the
+ * reverse DNS cache, until a name is resolved the numeric address is
+ * returned.  Except for peers that need their name to be validated,
+ * then NULL is returned, with the address in hname, and the caller has
+ * to hold the message, or peer, and try again later.
  */
-const char *cvthname(struct sockaddr *f, socklen_t len)
+const char *cvthname(struct sockaddr *f, socklen_t len, char *hname, size_t hlen)
 {
-	static char hname[NI_MAXHOST], ip[NI_MAXHOST];
+	char ip[NI_MAXHOST];
 	char *p;
 	int err;
 
@@ -2198,14 +4066,36 @@ const char *cvthname(struct sockaddr *f, socklen_t len)
 		return "???";
 	}
 
-	if (!resolve)
-		return ip;
+	if (!resolve) {
+		strlcpy(hname, ip, hlen);
+		return hname;
+	}
 
-	err = getnameinfo(f, len, hname, sizeof(hname), NULL, 0, NI_NAMEREQD);
-	if (err) {
-		logit("Host name for your address (%s) unknown: %s\n",
-		      ip, gai_strerror(err));
-		return ip;
+	switch (dnscache_lookup(f, len, hname, hlen)) {
+	case DNSCACHE_HIT:
+		break;
+
+	case DNSCACHE_MISS:
+		/* Lookup in progress, use address for now */
+		strlcpy(hname, ip, hlen);
+		if (needname(f, len))
+			return NULL;
+		return hname;
+
+	case DNSCACHE_OFF:
+		err = getnameinfo(f, len, hname, hlen, NULL, 0, NI_NAMEREQD);
+		if (err) {
+			logit("Host name for your address (%s) unknown: %s\n",
+			      ip, gai_strerror(err));
+			strlcpy(hname, ip, hlen);
+			return hname;
+		}
+		break;
+
+	default:
+		/* No name, use address */
+		strlcpy(hname, ip, hlen);
+		return hname;
 	}
 
 	/*
@@ -2260,37 +4150,70 @@ void flog(int pri, char *fmt, ...)
 	logmsg(&buffer);
 }
 
+/*
+ * Send messages held by forw_hold(), or drop them if the lookup failed
+ */
+static void forw_release(struct filed *f)
+{
+	struct stream *conn = f->f_un.f_forw.f_conn;
+	char *hold = f->f_un.f_forw.f_hold;
+	size_t len = f->f_un.f_forw.f_holdlen;
+	struct iovec iov;
+	size_t off = 0;
+
+	if (!hold)
+		return;
+	f->f_un.f_forw.f_hold = NULL;
+	f->f_un.f_forw.f_holdlen = 0;
+
+	while (f->f_type == F_FORW && off < len) {
+		memcpy(&iov.iov_len, &hold[off], sizeof(iov.iov_len));
+		iov.iov_base = &hold[off + sizeof(iov.iov_len)];
+		off += sizeof(iov.iov_len) + iov.iov_len;
+
+		if (conn ? stream_send(conn, f->f_un.f_forw.f_addr, &iov, 1)
+			 : fprintlog_forw(f, &iov, 1))
+			break;
+		fprintlog_count(f, &iov, 1);
+	}
+
+	free(hold);
+}
+
 static void forw_lookup(struct filed *f)
 {
 	char *host = f->f_un.f_forw.f_hname;
 	char *serv = f->f_un.f_forw.f_serv;
 	struct addrinfo *ai;
-	int err, first;
-	time_t diff;
+	int err, first, rc;
 
 	if (SecureMode > 1) {
-		if (f->f_un.f_forw.f_addr)
-			freeaddrinfo(f->f_un.f_forw.f_addr);
-		f->f_un.f_forw.f_addr = NULL;
+		forw_close(f);
 		f->f_type = F_FORW_UNKN;
 		return;
 	}
 
-	/* Called from cfline() for initial lookup? */
-	first = f->f_type == F_UNUSED ? 1 : 0;
+	/* Called from cfopen() for initial lookup, or for its result? */
+	first = f->f_type == F_UNUSED || (f->f_flags & RESOLVING);
 
 	/*
-	 * Not INET_SUSPEND_TIME, but back off a few seconds at least
-	 * to prevent syslogd from hammering the resolver for every
-	 * little message that is logged.  E.g., at boot when we read
-	 * the kernel ring buffer.
+	 * Names are resolved in the background, and failed lookups are
+	 * cached for a few seconds, to prevent syslogd from hammering
+	 * the resolver for every little message that is logged.  E.g.,
+	 * at boot when we read the kernel ring buffer.
 	 */
-	diff = timer_now() - f->f_time;
-	if (!first && diff < 5)
+	rc = resolve_lookup(host, serv, family, f->f_un.f_forw.f_proto ? SOCK_STREAM : SOCK_DGRAM,
+			    &ai, &err);
+	if (rc == RESOLVE_PENDING) {
+		f->f_type = F_FORW_UNKN;
+		if (first)
+			f->f_flags |= RESOLVING;
 		return;
+	}
+	f->f_flags &= ~RESOLVING;
 
-	err = nslookup(host, serv, &ai);
-	if (err) {
+	if (rc == RESOLVE_FAIL) {
+		forw_release(f);
 		f->f_type = F_FORW_UNKN;
 		f->f_time = timer_now();
 		if (!first && !(f->f_flags & SUSP_RETR))
@@ -2303,11 +4226,29 @@ static void forw_lookup(struct filed *f)
 	f->f_type = F_FORW;
 	f->f_un.f_forw.f_addr = ai;
 	f->f_prevcount = 0;
+	forw_release(f);
 
 	if (!first)
 		NOTE("Successfully resolved '%s:%s', initiating forwarding.", host, serv);
 }
 
+/*
+ * Lookups done by the resolver thread, retry all targets waiting for
+ * one.  At startup, the time until all are resolved is recorded.
+ */
+static void resolve_cb(int sd, void *arg)
+{
+	struct filed *f;
+
+	resolve_ack();
+	SIMPLEQ_FOREACH(f, &fhead, f_link) {
+		if (f->f_type == F_FORW_UNKN)
+			forw_lookup(f);
+	}
+
+	startup_resolved();
+}
+
 void domark(void *arg)
 {
 	static time_t t_last = 0;
@@ -2320,9 +4261,23 @@ void domark(void *arg)
 	}
 }
 
+static void ratelimit_log(const char *source, uint64_t num)
+{
+	WARN("%" PRIu64 " messages suppressed from %s, rate limit exceeded", num, source);
+}
+
+/*
+ * Summary of messages suppressed by the rate limit, if any
+ */
+static void doratelimit(void *arg)
+{
+	ratelimit_report(timer_now_us(), ratelimit_log);
+}
+
 void doflush(void *arg)
 {
 	struct filed *f;
+	uint64_t errors;
 
 	SIMPLEQ_FOREACH(f, &fhead, f_link) {
 		if (f->f_type == F_FORW_UNKN) {
@@ -2331,13 +4286,128 @@ void doflush(void *arg)
 				continue;
 		}
 
-		if (f->f_prevcount && timer_now() >= REPEATTIME(f)) {
-			logit("flush %s: repeated %lu times, %d sec.\n",
-			      TypeNames[f->f_type], f->f_prevcount,
-			      repeatinterval[f->f_repeatcount]);
-			fprintlog_successive(f, 0);
-			BACKOFF(f);
-		}
+		if (f->f_prevcount && timer_now() >= REPEATTIME(f)) {
+			logit("flush %s: repeated %lu times, %d sec.\n",
+			      TypeNames[f->f_type], f->f_prevcount,
+			      repeatinterval[f->f_repeatcount]);
+			fprintlog_successive(f, 0);
+			BACKOFF(f);
+		}
+
+		if (f->f_queue) {
+			uint64_t drops = outq_drops(f->f_queue);
+
+			if (drops)
+				WARN("Dropped %" PRIu64 " messages to %s, queue full (depth %zu)",
+				     drops, f->f_un.f_fname, outq_depth(f->f_queue));
+		}
+
+		if (f->f_type == F_FORW && f->f_un.f_forw.f_conn) {
+			uint64_t drops = stream_drops(f->f_un.f_forw.f_conn);
+
+			if (drops)
+				WARN("Dropped %" PRIu64 " messages to %s:%s, send buffer full",
+				     drops, f->f_un.f_forw.f_hname, f->f_un.f_forw.f_serv);
+		}
+
+		if (f->f_spool) {
+			uint64_t drops = spool_drops(f->f_spool);
+
+			if (drops)
+				WARN("Dropped %" PRIu64 " messages to %s:%s, spool full",
+				     drops, f->f_un.f_forw.f_hname, f->f_un.f_forw.f_serv);
+		}
+	}
+
+	errors = compress_errors();
+	if (errors)
+		WARN("Failed compressing %" PRIu64 " rotated log files", errors);
+
+	errors = wall_drops();
+	if (errors)
+		WARN("Dropped %" PRIu64 " messages to logged in users, wall queue full", errors);
+}
+
+/*
+ * Replay spooled messages, at most f_spoolrate per call, to a target
+ * that is up again.  Live traffic is sent directly meanwhile, it never
+ * waits for the replay.  Called every second by dowflush().
+ */
+static void spool_replay(struct filed *f)
+{
+	struct stream *conn = f->f_un.f_forw.f_conn;
+	char buf[SPOOL_MAXREC];
+	struct iovec iov;
+	ssize_t len;
+
+	if (spool_empty(f->f_spool))
+		return;
+
+	/* No live traffic may be what is needed to retry the target */
+	if (f->f_type == F_FORW_SUSP && timer_now() - f->f_time >= INET_SUSPEND_TIME) {
+		f->f_metrics.suspended += timer_now() - f->f_time;
+		f->f_type = F_FORW_UNKN;
+	}
+	if (f->f_type == F_FORW_UNKN)
+		forw_lookup(f);
+	if (f->f_type != F_FORW || (conn && !stream_isopen(conn)))
+		return;
+
+	for (int i = 0; i < f->f_spoolrate; i++) {
+		/* Leave room in send buffer for live traffic */
+		if (conn && stream_pending(conn) > STREAM_SNDBUF / 2)
+			break;
+
+		len = spool_get(f->f_spool, buf, sizeof(buf));
+		if (len <= 0)
+			break;
+
+		iov.iov_base = buf;
+		iov.iov_len  = len;
+		if (conn ? stream_send(conn, f->f_un.f_forw.f_addr, &iov, 1)
+			 : fprintlog_forw(f, &iov, 1)) {
+			/* put back, out of order, and retry later */
+			spool_put(f->f_spool, &iov, 1);
+			return;
+		}
+	}
+
+	if (spool_empty(f->f_spool))
+		NOTE("Spool for %s:%s replayed.", f->f_un.f_forw.f_hname, f->f_un.f_forw.f_serv);
+}
+
+/*
+ * Runs every second when any file has a write buffer or sync_interval
+ * is set, or when forwarding over TCP/TLS.  Flush buffers older than
+ * their max latency, do the group fdatasync() of synced files, and
+ * reconnect forwarding connections.
+ */
+static void dowflush(void *arg)
+{
+	static time_t synctime;
+	struct filed *f;
+
+	SIMPLEQ_FOREACH(f, &fhead, f_link) {
+		if (f->f_type == F_FORW && f->f_un.f_forw.f_conn)
+			stream_tick(f->f_un.f_forw.f_conn, f->f_un.f_forw.f_addr);
+
+		if (f->f_spool)
+			spool_replay(f);
+
+		if (f->f_type != F_FILE)
+			continue;
+
+		if (f->f_wlen && timer_now() - f->f_wtime >= f->f_wsec)
+			wbuf_flush(f);
+
+		if (f->f_type == F_FILE && timer_now() - f->f_synctime >= SyncInterval)
+			file_datasync(f);
+	}
+
+	/* All files of templated actions are synced together */
+	if (timer_now() - synctime >= SyncInterval) {
+		fdcache_sync();
+		synctime = timer_now();
 	}
 }
 
@@ -2350,15 +4420,29 @@ void debug_switch(int signo)
 /*
  * Called by die() and init()
  */
-static void close_open_log_files(void)
+static void close_log_files(struct files *list)
 {
 	struct filed *f = NULL, *next = NULL;
 
-	SIMPLEQ_FOREACH_SAFE(f, &fhead, f_link, next) {
+	SIMPLEQ_FOREACH_SAFE(f, list, f_link, next) {
 		/* flush any pending output */
 		if (f->f_prevcount)
 			fprintlog_successive(f, 0);
 
+		/* flush write buffer and wait for async writer */
+		wbuf_flush(f);
+		if (f->f_queue) {
+			outq_free(f->f_queue);
+			f->f_queue = NULL;
+		}
+		if (f->f_type == F_FILE)
+			file_datasync(f);
+		if (f->f_ring) {
+			uring_file_free(f->f_ring);
+			f->f_ring = NULL;
+		}
+		free(f->f_wbuf);
+
 		switch (f->f_type) {
 		case F_FILE:
 		case F_TTY:
@@ -2369,17 +4453,37 @@ static void close_open_log_files(void)
 			break;
 
 		case F_FORW:
-			if (f->f_un.f_forw.f_addr) {
-				freeaddrinfo(f->f_un.f_forw.f_addr);
-				f->f_un.f_forw.f_addr = NULL;
-			}
+		case F_FORW_SUSP:
+		case F_FORW_UNKN:
+			stream_free(f->f_un.f_forw.f_conn);
+			f->f_un.f_forw.f_conn = NULL;
+			if (f->f_type == F_FORW)
+				forw_send(f);
+			forw_close(f);
+			spool_close(f->f_spool);
+			f->f_spool = NULL;
 			break;
 		}
 
+		free(f->f_prevline);
+		free(f->f_action);
 		free(f);
 	}
 }
 
+static void close_open_log_files(void)
+{
+	/* Any logging from here on uses the slow path */
+	free(dtab);
+	dtab = NULL;
+
+	/* Send UDP batches while all targets can still log errors */
+	forw_flush();
+
+	close_log_files(&fhead);
+	SIMPLEQ_INIT(&fhead);
+}
+
 void die(int signo)
 {
 	struct peer *pe = NULL, *next = NULL;
@@ -2389,19 +4493,42 @@ void die(int signo)
 		flog(LOG_SYSLOG | LOG_INFO, "exiting on signal %d", signo);
 	}
 
+	rxworker_stop_all();
+	logit("Receive batches: %" PRIu64 " full, %" PRIu64 " partial\n",
+	      rcvring.full, rcvring.partial);
+
+	if (resolve) {
+		struct dnscache_stats st;
+
+		dnscache_stats(&st);
+		logit("DNS cache: %zu entries, %" PRIu64 " hits, %" PRIu64 " negative, "
+		      "%" PRIu64 " misses, %" PRIu64 " evicted, %" PRIu64 " dropped\n",
+		      st.entries, st.hits, st.negative, st.misses, st.evicted, st.dropped);
+		dnscache_exit();
+	}
+	ratelimit_exit();
+	hold_exit();
+
 	/*
 	 * Stop all active timers
 	 */
 	timer_exit();
+	metrics_close();
 
 	/*
 	 * Close all open log files.
 	 */
 	close_open_log_files();
+	fdcache_exit();
+	uring_exit();
+	resolve_exit();
 
 	/*
-	 * Close all UNIX and inet sockets
+	 * Close all UNIX and inet sockets, and accepted connections
 	 */
+	stream_exit();
+	compress_exit();
+	wall_exit();
 	SIMPLEQ_FOREACH_SAFE(pe, &pqueue, pe_link, next) {
 		for (size_t i = 0; i < pe->pe_socknum; i++) {
 			logit("Closing socket %d ...\n", pe->pe_sock[i]);
@@ -2410,6 +4537,8 @@ void die(int signo)
 		free(pe);
 	}
 
+	if (KernLog)
+		sys_seqno_save();
 	kern_console_on();
 
 	exit(0);
@@ -2519,30 +4648,146 @@ static FILE *cftemp(void)
 	return fp;
 }
 
-/* Set up signal callbacks, only done once in main() */
-static void signal_init(void)
+/*
+ * Called from the main loop, never from a signal handler, so no other
+ * code path can be interrupted, logmsg() et al need no signal masking.
+ */
+static void signal_dispatch(int signo)
+{
+	switch (signo) {
+	case SIGTERM:
+	case SIGINT:
+	case SIGQUIT:
+		die(signo);
+		break;
+
+	case SIGUSR1:
+		debug_switch(signo);
+		break;
+
+	case SIGUSR2:
+		signal_rotate(signo);
+		break;
+
+	case SIGHUP:
+		reload(signo);
+		break;
+
+	case SIGCHLD:
+		reapchild(signo);
+		break;
+	}
+}
+
+#ifdef HAVE_SYS_SIGNALFD_H
+static void signal_cb(int sd, void *arg)
+{
+	struct signalfd_siginfo si;
+
+	while (read(sd, &si, sizeof(si)) == sizeof(si))
+		signal_dispatch(si.ssi_signo);
+}
+#else
+/*
+ * Write to pipe to create an event in the main loop
+ */
+static void signal_handler(int signo)
+{
+	int saved_errno = errno;
+	unsigned char sig = signo;
+
+	(void)write(signal_pipe[1], &sig, 1);
+	errno = saved_errno;
+}
+
+static void signal_cb(int sd, void *arg)
+{
+	unsigned char sig;
+
+	while (read(sd, &sig, 1) == 1)
+		signal_dispatch(sig);
+}
+#endif
+
+/*
+ * Set up signal callbacks, only done once in main(), before any thread
+ * is started, so they all inherit the signal mask.  The signals we act
+ * on are blocked and read from a signalfd, or the handlers write them
+ * to a pipe, and dispatched from the main loop.
+ */
+static int signal_init(void)
 {
 	struct sigaction sa;
+	sigset_t mask;
+	int sd;
 #define SIGNAL(signo, cb)				\
 	sa.sa_handler = cb;				\
 	if (sigaction(signo, &sa, NULL)) {		\
 		warn("sigaction(%s)", xstr(signo));	\
-		return;					\
+		return -1;				\
 	}
 
-	/* restart syscalls and allow signals in signal handlers */
 	memset(&sa, 0, sizeof(sa));
-	sa.sa_flags = SA_RESTART | SA_NODEFER;
+	sa.sa_flags = SA_RESTART;
 	sigemptyset(&sa.sa_mask);
 
-	SIGNAL(SIGTERM, die);
-	SIGNAL(SIGINT,  Debug ? die : SIG_IGN);
-	SIGNAL(SIGQUIT, Debug ? die : SIG_IGN);
-	SIGNAL(SIGUSR1, Debug ? debug_switch : SIG_IGN);
-	SIGNAL(SIGUSR2, signal_rotate);
 	SIGNAL(SIGXFSZ, SIG_IGN);
-	SIGNAL(SIGHUP,  reload);
-	SIGNAL(SIGCHLD, reapchild);
+	SIGNAL(SIGPIPE, SIG_IGN);
+	if (!Debug) {
+		SIGNAL(SIGINT,  SIG_IGN);
+		SIGNAL(SIGQUIT, SIG_IGN);
+		SIGNAL(SIGUSR1, SIG_IGN);
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR2);
+	sigaddset(&mask, SIGCHLD);
+	if (Debug) {
+		sigaddset(&mask, SIGINT);
+		sigaddset(&mask, SIGQUIT);
+		sigaddset(&mask, SIGUSR1);
+	}
+
+#ifdef HAVE_SYS_SIGNALFD_H
+	if (sigprocmask(SIG_BLOCK, &mask, NULL)) {
+		warn("sigprocmask()");
+		return -1;
+	}
+
+	sd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sd == -1) {
+		warn("signalfd()");
+		return -1;
+	}
+#else
+	if (pipe(signal_pipe)) {
+		warn("pipe()");
+		return -1;
+	}
+
+	for (int i = 0; i < 2; i++) {
+		int flags = fcntl(signal_pipe[i], F_GETFL, 0);
+
+		fcntl(signal_pipe[i], F_SETFL, flags | O_NONBLOCK);
+		fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	for (int signo = 1; signo < NSIG; signo++) {
+		if (sigismember(&mask, signo) != 1)
+			continue;
+		SIGNAL(signo, signal_handler);
+	}
+	sd = signal_pipe[0];
+#endif
+
+	if (socket_register(sd, NULL, signal_cb, NULL) < 0) {
+		warn("socket_register()");
+		return -1;
+	}
+
+	return 0;
 }
 
 static void boot_time_init(void)
@@ -2561,23 +4806,91 @@ static void boot_time_init(void)
 }
 
 /*
- *  INIT -- Initialize syslogd from configuration table
+ * Per-socket and per-action counters for metrics_render(), labeled
+ * like the listen address, and the file or forwarding target.
  */
-static void init(void)
+static void metrics_cb(int family, metrics_emit_fn emit, void *ctx)
 {
-	struct notifiers newn = SIMPLEQ_HEAD_INITIALIZER(newn);
-	struct files newf = SIMPLEQ_HEAD_INITIALIZER(newf);
+	char label[MAXFNAME + 32];
 	struct filed *f;
 	struct peer *pe;
-	FILE *fp;
-	char *p;
 
-	/* Set up timer framework */
-	if (timer_init())
-		err(1, "Failed initializing internal timers");
+	if (family == MF_SOCKET_RX) {
+		SIMPLEQ_FOREACH(pe, &pqueue, pe_link) {
+			if (!pe->pe_socknum)
+				continue;
+
+			if (pe->pe_name && pe->pe_name[0] == '/')
+				strlcpy(label, pe->pe_name, sizeof(label));
+			else
+				snprintf(label, sizeof(label), "%s%s:%s",
+					 pe->pe_proto == STREAM_TLS ? "tls://" :
+					 pe->pe_proto == STREAM_TCP ? "tcp://" : "",
+					 pe->pe_name ?: "*", pe->pe_serv);
+			emit(ctx, label, __atomic_load_n(&pe->pe_rx, __ATOMIC_RELAXED));
+		}
+		return;
+	}
+
+	SIMPLEQ_FOREACH(f, &fhead, f_link) {
+		uint64_t val = 0;
+
+		switch (f->f_type) {
+		case F_FILE:
+		case F_PIPE:
+		case F_TTY:
+		case F_CONSOLE:
+		case F_TEMPLATE:
+			strlcpy(label, f->f_un.f_fname, sizeof(label));
+			break;
+
+		case F_FORW:
+		case F_FORW_SUSP:
+		case F_FORW_UNKN:
+			snprintf(label, sizeof(label), "@%s:%s", f->f_un.f_forw.f_hname,
+				 f->f_un.f_forw.f_serv);
+			break;
+
+		case F_USERS:
+		case F_WALL:
+			strlcpy(label, TypeNames[f->f_type], sizeof(label));
+			break;
+
+		default:
+			continue;
+		}
+
+		switch (family) {
+		case MF_ACTION_WRITES:
+			val = f->f_metrics.writes;
+			break;
+		case MF_ACTION_BYTES:
+			val = f->f_metrics.bytes;
+			break;
+		case MF_ACTION_ERRORS:
+			val = f->f_metrics.errors;
+			break;
+		case MF_ACTION_DUPS:
+			val = f->f_metrics.dups;
+			break;
+		case MF_ACTION_SUSPENDED:
+			val = f->f_metrics.suspended;
+			if (f->f_type == F_FORW_SUSP)
+				val += timer_now() - f->f_time;
+			break;
+		}
+		emit(ctx, label, val);
+	}
+}
 
-	/* Get hostname */
-	(void)gethostname(LocalHostName, sizeof(LocalHostName));
+/*
+ * Set LocalHostName and LocalDomain, may query DNS for our FQDN.
+ */
+static void hostname_init(void)
+{
+	char *p;
+
+	strlcpy(LocalHostName, RawHostName, sizeof(LocalHostName));
 	LocalDomain = emptystring;
 	if ((p = strchr(LocalHostName, '.'))) {
 		*p++ = '\0';
@@ -2613,15 +4926,106 @@ static void init(void)
 		if (isupper(*p))
 			*p = tolower(*p);
 	}
+}
+
+/*
+ * Time of a phase of the initial start, reloads are not recorded
+ */
+static void startup_phase(int phase, uint64_t *start)
+{
+	uint64_t now = metrics_usec();
+
+	if (!Initialized)
+		metrics_phase(phase, now - *start);
+	*start = now;
+}
+
+/*
+ * Time from start until the forwarding targets of the initial .conf
+ * are resolved, or have failed, recorded once.
+ */
+static void startup_resolved(void)
+{
+	static int done;
+	struct filed *f;
+
+	if (done)
+		return;
+
+	SIMPLEQ_FOREACH(f, &fhead, f_link) {
+		if (f->f_flags & RESOLVING)
+			return;
+	}
+
+	metrics_phase(MS_RESOLVE, metrics_usec() - StartTime);
+	done = 1;
+}
+
+/*
+ *  INIT -- Initialize syslogd from configuration table
+ *
+ * On reload the new .conf is parsed, and new actions opened, before the
+ * running set is touched.  This runs in the main loop, so intake is
+ * paused meanwhile, messages logged by syslogd itself, e.g., errors
+ * opening new actions, go to the running set.  Actions that are the
+ * same as before, only the selector may differ, take over the open file
+ * or connection of the running one.  The new set then replaces the
+ * running set in one go, and what is left of the previous set is
+ * closed.  Listening sockets and receiver workers are only restarted if
+ * their settings changed.  They are opened before the actions, which
+ * may take a while at boot.
+ */
+static void init(void)
+{
+	struct notifiers newn = SIMPLEQ_HEAD_INITIALIZER(newn);
+	struct files newf = SIMPLEQ_HEAD_INITIALIZER(newf);
+	uint64_t start = metrics_usec();
+	struct files oldf;
+	char name[sizeof(RawHostName)];
+	int rxmode, rxbatch, rxworkers;
+	struct dispatch *newd;
+	struct filed *f;
+	struct peer *pe;
+	uint64_t globals;
+	int restart;
+	int rc;
+	FILE *fp;
+
+	/* Set up timer framework */
+	if (timer_init())
+		err(1, "Failed initializing internal timers");
+
+	/* Reverse lookups in the background, falls back to blocking */
+	if (resolve && (rc = dnscache_init()))
+		logit("Failed starting resolver thread: %s\n", strerror(rc));
 
 	/*
 	 * Load / reload timezone data (in case it changed)
 	 */
 	tzset();
+	memset(&ts3164, 0, sizeof(ts3164));
+	memset(&ts5424, 0, sizeof(ts5424));
+	lt_sec = -1;
+
+	/*
+	 * Receiver workers read LocalHostName et al, so are stopped before
+	 * it changes, they are restarted with the inet sockets below.
+	 */
+	(void)gethostname(name, sizeof(name));
+	restart = !Initialized || strcmp(name, RawHostName);
+	if (restart) {
+		rxworker_stop_all();
+		strlcpy(RawHostName, name, sizeof(RawHostName));
+		hostname_init();
+	}
 
 	/*
 	 * Read configuration file(s)
 	 */
+	rxmode    = SecureMode;
+	rxbatch   = RcvBatch;
+	rxworkers = RcvWorkers;
+
 	fp = fopen(ConfFile, "r");
 	if (!fp) {
 		logit("Cannot open %s: %s\n", ConfFile, strerror(errno));
@@ -2638,28 +5042,30 @@ static void init(void)
 		return;
 	}
 	fclose(fp);
+	startup_phase(MS_CONFIG, &start);
 
-	/*
-	 * Close all open log files.
-	 */
-	close_open_log_files();
-
-	fhead = newf;
+	ratelimit_set(RateLimit, RateBurst);
+	fdcache_init(FileCache);
 
-	/*
-	 * Free all notifiers
-	 */
-	notifier_free_all();
+	/* TLS contexts are set up on first use, with the new settings */
+	if (stream_tls(TlsCa, TlsCert, TlsKey))
+		ERRX("TLS settings ignored, built without TLS support");
 
-	nothead = newn;
+	/* Inet sockets, and their workers, are restarted on new settings */
+	if (rxmode != SecureMode || rxbatch != RcvBatch || rxworkers != RcvWorkers) {
+		rxworker_stop_all();
+		restart = 1;
+	}
 
 	/*
-	 * Open or close sockets for local and remote communication
+	 * Open or close sockets for local and remote communication.  This
+	 * is done before opening the actions, so senders are not refused
+	 * meanwhile, messages are read by the main loop when we are done.
 	 */
 	SIMPLEQ_FOREACH(pe, &pqueue, pe_link) {
 		if (pe->pe_name && pe->pe_name[0] == '/') {
 			create_unix_socket(pe);
-		} else {
+		} else if (restart) {
 			for (size_t i = 0; i < pe->pe_socknum; i++)
 				socket_close(pe->pe_sock[i]);
 			pe->pe_socknum = 0;
@@ -2669,6 +5075,82 @@ static void init(void)
 		}
 	}
 
+	if (MetricsSocket && metrics_open(MetricsSocket, metrics_cb))
+		ERR("Failed opening metrics socket %s", MetricsSocket);
+	startup_phase(MS_SOCKETS, &start);
+
+	/* Forwarding targets are looked up again on reload */
+	if (Initialized)
+		resolve_flush();
+
+	/*
+	 * Actions are opened with the global settings, e.g., sync_interval,
+	 * so running ones can only be taken over if those are unchanged.
+	 */
+	globals = hash_str(TlsCa ?: "", 0);
+	globals = hash_str(TlsCert ?: "", globals);
+	globals = hash_str(TlsKey ?: "", globals);
+	globals = hash_str(SpoolDir ?: "", globals);
+	globals = hash_mix(globals, SyncInterval);
+	globals = hash_mix(globals, SecureMode);
+	if (globals != CfGlobals)
+		logit("Global settings changed, reopening all actions.\n");
+
+	/* Open new actions, internal messages still go to the running set */
+	SIMPLEQ_FOREACH(f, &newf, f_link) {
+		f->f_reuse = Initialized && globals == CfGlobals ? cfmatch(f) : NULL;
+		if (!f->f_reuse)
+			cfopen(f);
+	}
+	CfGlobals = globals;
+
+	newd = dispatch_new(&newf);
+	if (!newd)
+		ERR("Failed allocating dispatch table, falling back to slow path");
+
+	/*
+	 * Swap in the new set, with the file descriptors, connections and
+	 * buffers of unchanged actions.  Send pending UDP batches first.
+	 */
+	forw_flush();
+	SIMPLEQ_FOREACH(f, &newf, f_link) {
+		if (f->f_reuse)
+			cfreuse(f, f->f_reuse);
+	}
+
+	free(dtab);
+	oldf  = fhead;
+	fhead = newf;
+	dtab  = newd;
+
+	/* Close actions no longer in use, and the shells of taken over ones */
+	close_log_files(&oldf);
+
+	/* Start write buffer timer, if any action needs it */
+	SIMPLEQ_FOREACH(f, &fhead, f_link) {
+		int forw = f->f_type == F_FORW || f->f_type == F_FORW_UNKN;
+
+		if (f->f_wbuf || (SyncInterval && (f->f_flags & SYNC_FILE)) ||
+		    (forw && (f->f_un.f_forw.f_conn || f->f_spool))) {
+			if (!WflushTimer) {
+				timer_add(1, dowflush, NULL);
+				if (Initialized)
+					timer_start();
+				WflushTimer = 1;
+			}
+			break;
+		}
+	}
+
+	/*
+	 * Free all notifiers
+	 */
+	notifier_free_all();
+
+	nothead = newn;
+	startup_phase(MS_ACTIONS, &start);
+	startup_resolved();
+
 	Initialized = 1;
 
 	if (Debug) {
@@ -2701,6 +5183,10 @@ static void init(void)
 					printf(" (unused)");
 				break;
 
+			case F_TEMPLATE:
+				printf("%s (%zu open)", f->f_un.f_fname, fdcache_count());
+				break;
+
 			case F_FORW:
 			case F_FORW_SUSP:
 			case F_FORW_UNKN:
@@ -2721,30 +5207,104 @@ static void init(void)
 				printf("\t;BSD");
 			if (f->f_rotatesz > 0)
 				printf(",rotate=%d:%d", f->f_rotatesz, f->f_rotatecount);
+			if (f->f_queue)
+				printf(",queue=%d:%s", f->f_qsize, outq_policy(f->f_qpolicy));
+			if (f->f_wbuf)
+				printf(",buffer=%zu:%d", f->f_wbufsz, f->f_wsec);
+			if (f->f_spoolsz)
+				printf(",spool=%d:%d", f->f_spoolsz, f->f_spoolrate);
 			printf("\n");
 		}
 	}
 
-	flog(LOG_SYSLOG | LOG_INFO, "syslogd v" VERSION ": restart.");
-	logit("syslogd: restarted.\n");
+	flog(LOG_SYSLOG | LOG_INFO, "syslogd v" VERSION ": restart.");
+	logit("syslogd: restarted.\n");
+}
+
+static void cfrot(char *ptr, struct filed *f)
+{
+	char *c;
+	int sz = 0, cnt = 0;
+
+	c = strchr(ptr, ':');
+	if (c) {
+		*c++ = 0;
+		cnt = atoi(c);
+	}
+
+	sz = strtobytes(ptr);
+	if (sz > 0 && cnt > 0) {
+		logit("Set rotate size %d bytes, %d rotations\n", sz, cnt);
+		f->f_rotatecount = cnt;
+		f->f_rotatesz = sz;
+	}
+}
+
+static void cfbuf(char *ptr, struct filed *f)
+{
+	char *c;
+	int sz, sec = 1;
+
+	c = strchr(ptr, ':');
+	if (c) {
+		*c++ = 0;
+		sec = atoi(c);
+	}
+
+	sz = strtobytes(ptr);
+	if (sz > 0 && sz <= WBUF_MAX && sec > 0) {
+		logit("Set write buffer %d bytes, max %d sec\n", sz, sec);
+		f->f_wbufsz = sz;
+		f->f_wsec = sec;
+	} else
+		logit("Invalid write buffer '%s', max %d bytes\n", ptr, WBUF_MAX);
+}
+
+static void cfspool(char *ptr, struct filed *f)
+{
+	char *c;
+	int sz, rate = SPOOL_RATE;
+
+	c = strchr(ptr, ':');
+	if (c) {
+		*c++ = 0;
+		rate = atoi(c);
+	}
+
+	sz = strtobytes(ptr);
+	if (sz > 0 && sz <= SPOOL_MAX && rate > 0) {
+		logit("Set spool %d bytes, replay %d msg/sec\n", sz, rate);
+		f->f_spoolsz = sz;
+		f->f_spoolrate = rate;
+	} else
+		logit("Invalid spool '%s', max %d bytes\n", ptr, SPOOL_MAX);
 }
 
-static void cfrot(char *ptr, struct filed *f)
+static void cfqueue(char *ptr, struct filed *f)
 {
 	char *c;
-	int sz = 0, cnt = 0;
+	int sz;
 
 	c = strchr(ptr, ':');
 	if (c) {
 		*c++ = 0;
-		cnt = atoi(c);
+		if (!strcasecmp(c, "drop-oldest"))
+			f->f_qpolicy = OUTQ_DROP_OLDEST;
+		else if (!strcasecmp(c, "drop-newest"))
+			f->f_qpolicy = OUTQ_DROP_NEWEST;
+		else if (!strcasecmp(c, "block"))
+			f->f_qpolicy = OUTQ_BLOCK;
+		else {
+			logit("Invalid queue overflow policy '%s'\n", c);
+			return;
+		}
 	}
 
-	sz = strtobytes(ptr);
-	if (sz > 0 && cnt > 0) {
-		logit("Set rotate size %d bytes, %d rotations\n", sz, cnt);
-		f->f_rotatecount = cnt;
-		f->f_rotatesz = sz;
+	sz = atoi(ptr);
+	if (sz > 0) {
+		logit("Set async queue size %d messages, overflow %s\n",
+		      sz, outq_policy(f->f_qpolicy));
+		f->f_qsize = sz;
 	}
 }
 
@@ -2777,7 +5337,7 @@ static void cfopts(char *ptr, struct filed *f)
 	if (*ptr != ';')
 		*ptr++ = 0;
 
-	opt = strtok(ptr, ";");
+	opt = strtok(ptr, ";,");
 	if (!opt)
 		return;
 
@@ -2790,10 +5350,16 @@ static void cfopts(char *ptr, struct filed *f)
 			f->f_flags |=  RFC3164;
 		} else if (cfopt(&opt, "rotate="))
 			cfrot(opt, f);
+		else if (cfopt(&opt, "queue="))
+			cfqueue(opt, f);
+		else if (cfopt(&opt, "spool="))
+			cfspool(opt, f);
+		else if (cfopt(&opt, "buffer="))
+			cfbuf(opt, f);
 		else
 			cfrot(ptr, f); /* Compat v1.6 syntax */
 
-		opt = strtok(NULL, ",");
+		opt = strtok(NULL, ";,");
 	}
 }
 
@@ -2937,6 +5503,9 @@ static struct filed *cfline(char *line)
 	while (*p == '\t' || *p == ' ')
 		p++;
 
+	/* What identifies the action on reload, before cfopts() chops it up */
+	f->f_action = strdup(p);
+
 	if (*p == '-') {
 		syncfile = 0;
 		p++;
@@ -2948,16 +5517,28 @@ static struct filed *cfline(char *line)
 	case '@':
 		cfopts(p, f);
 
-		bp = strchr(++p, ':');
+		p++;
+		if (!strncmp(p, "tcp://", 6))
+			f->f_un.f_forw.f_proto = STREAM_TCP;
+		else if (!strncmp(p, "tls://", 6))
+			f->f_un.f_forw.f_proto = STREAM_TLS;
+		if (f->f_un.f_forw.f_proto)
+			p += 6;
+
+		bp = strchr(p, ':');
 		if (bp)
 			*bp++ = 0;
+		else if (f->f_un.f_forw.f_proto == STREAM_TLS)
+			bp = "6514";
+		else if (f->f_un.f_forw.f_proto == STREAM_TCP)
+			bp = "514";
 		else
 			bp = "syslog"; /* default: 514/udp */
 
 		strlcpy(f->f_un.f_forw.f_hname, p, sizeof(f->f_un.f_forw.f_hname));
 		strlcpy(f->f_un.f_forw.f_serv, bp, sizeof(f->f_un.f_forw.f_serv));
 		logit("forwarding host: '%s:%s'\n", p, bp);
-		forw_lookup(f);
+		f->f_type = F_FORW_UNKN;
 		break;
 
 	case '|':
@@ -2968,25 +5549,13 @@ static struct filed *cfline(char *line)
 		logit("filename: '%s'\n", p); /*ASP*/
 		if (syncfile)
 			f->f_flags |= SYNC_FILE;
-		if (*p == '|') {
-			f->f_file = open(++p, O_RDWR | O_NONBLOCK | O_NOCTTY);
+		if (*p == '|')
 			f->f_type = F_PIPE;
-		} else {
-			f->f_file = open(p, O_CREATE | O_NONBLOCK | O_NOCTTY, 0644);
+		else if (strchr(p, '%'))
+			f->f_type = F_TEMPLATE;
+		else
 			f->f_type = F_FILE;
-		}
-
-		if (f->f_file < 0) {
-			f->f_file = -1;
-			ERR("Error opening log file: %s", p);
-			break;
-		}
-		if (isatty(f->f_file)) {
-			f->f_type = F_TTY;
-			untty();
-		}
-		if (strcmp(p, ctty) == 0)
-			f->f_type = F_CONSOLE;
+		f->f_file = -1;
 		break;
 
 	case '*':
@@ -3022,6 +5591,13 @@ static struct filed *cfline(char *line)
 		f->f_flags |= RFC3164;
 		break;
 
+	case F_TEMPLATE:
+		if (f->f_wbufsz || f->f_qsize)
+			WARN("Templated file %s, buffer and queue options not supported.",
+			     f->f_un.f_fname);
+		f->f_wbufsz = f->f_qsize = 0;
+		/* fallthrough */
+
 	case F_FILE:
 		/* default rotate from command line */
 		if (f->f_rotatesz == 0) {
@@ -3047,6 +5623,202 @@ static struct filed *cfline(char *line)
 	return f;
 }
 
+/* Spools are named after the target, so they survive restarts */
+static void spool_name(struct filed *f, char *name, size_t len)
+{
+	strlcpy(name, f->f_un.f_forw.f_hname, len);
+	strlcat(name, ":", len);
+	strlcat(name, f->f_un.f_forw.f_serv, len);
+}
+
+/*
+ * On reload, a running action for the same target that is not taken
+ * over, e.g., its options changed, must close its spool before the new
+ * action opens the same segment files.  Until the new set is swapped
+ * in, the running action can then only send, not spool.
+ */
+static void spool_release(const char *name)
+{
+	struct filed *f;
+
+	SIMPLEQ_FOREACH(f, &fhead, f_link) {
+		char other[sizeof(f->f_un.f_forw.f_hname) + sizeof(f->f_un.f_forw.f_serv) + 1];
+
+		if (!f->f_spool)
+			continue;
+
+		spool_name(f, other, sizeof(other));
+		if (strcmp(name, other))
+			continue;
+
+		logit("Closing spool for %s, reopened by new action\n", name);
+		spool_close(f->f_spool);
+		f->f_spool = NULL;
+	}
+}
+
+/*
+ * Open the file, or pipe, or set up the forwarding target of an action
+ * parsed by cfline(), then start its spool and async writer.
+ */
+static void cfopen(struct filed *f)
+{
+	char *p = f->f_un.f_fname;
+	int sync;
+
+	switch (f->f_type) {
+	case F_FORW_UNKN:
+		if (f->f_un.f_forw.f_proto) {
+			f->f_un.f_forw.f_conn = stream_new(f->f_un.f_forw.f_proto,
+							   f->f_un.f_forw.f_hname,
+							   f->f_un.f_forw.f_serv);
+			if (!f->f_un.f_forw.f_conn) {
+				ERR("Cannot forward to %s:%s", f->f_un.f_forw.f_hname,
+				    f->f_un.f_forw.f_serv);
+				f->f_type = F_UNUSED;
+				return;
+			}
+		}
+
+		/* F_UNUSED tells forw_lookup() this is the initial lookup */
+		f->f_type = F_UNUSED;
+		forw_lookup(f);
+
+		if (f->f_spoolsz) {
+			char name[sizeof(f->f_un.f_forw.f_hname) + sizeof(f->f_un.f_forw.f_serv) + 1];
+
+			spool_name(f, name, sizeof(name));
+			spool_release(name);
+			f->f_spool = spool_open(SpoolDir ?: _PATH_SPOOL, name, f->f_spoolsz);
+			if (!f->f_spool)
+				ERR("Failed opening spool for %s in %s", name, SpoolDir ?: _PATH_SPOOL);
+			else if (!spool_empty(f->f_spool))
+				NOTE("Spool for %s has %zu messages, replaying.", name,
+				     spool_count(f->f_spool));
+		}
+		break;
+
+	case F_PIPE:
+	case F_FILE:
+		if (f->f_type == F_PIPE)
+			f->f_file = open(++p, O_RDWR | O_NONBLOCK | O_NOCTTY);
+		else
+			f->f_file = open(p, O_CREATE | O_NONBLOCK | O_NOCTTY, 0644);
+
+		if (f->f_file < 0) {
+			f->f_file = -1;
+			ERR("Error opening log file: %s", p);
+			return;
+		}
+		if (isatty(f->f_file)) {
+			f->f_type = F_TTY;
+			untty();
+		}
+		if (strcmp(p, ctty) == 0)
+			f->f_type = F_CONSOLE;
+
+		/* Only place we stat, from here on logrotate() counts bytes written */
+		if (f->f_type == F_FILE) {
+			struct stat st;
+
+			if (fstat(f->f_file, &st) || !S_ISREG(st.st_mode))
+				f->f_size = -1;
+			else
+				f->f_size = st.st_size;
+
+			if (!Initialized && f->f_rotatecount > 0)
+				rotate_recover(p, f->f_rotatecount);
+		}
+
+		/* Write buffers are only for regular files */
+		if (f->f_wbufsz && f->f_type == F_FILE) {
+			f->f_wbuf = malloc(f->f_wbufsz);
+			if (!f->f_wbuf)
+				ERR("Failed allocating write buffer for %s", p);
+		}
+		break;
+
+	default:
+		return;
+	}
+
+	sync = f->f_type == F_FILE && (f->f_flags & SYNC_FILE) && !SyncInterval;
+	if (f->f_qsize <= 0) {
+		/* Regular files are written by io_uring, when available */
+		if (f->f_type == F_FILE && uring_active()) {
+			f->f_ring = uring_file_new(f->f_file, sync);
+			if (!f->f_ring)
+				ERR("Failed starting io_uring writer for %s", f->f_un.f_fname);
+		}
+		return;
+	}
+
+	f->f_queue = outq_new(f->f_file, f->f_qsize, f->f_qpolicy, sync);
+	if (!f->f_queue)
+		ERR("Failed starting async writer for %s", f->f_un.f_fname);
+}
+
+/*
+ * Find a running action, from the previous .conf, with the same action
+ * and options as nf.  Each can only be taken over once, and only if it
+ * is in working order, a file that failed to open is retried.
+ */
+static struct filed *cfmatch(struct filed *nf)
+{
+	struct filed *f;
+
+	if (!nf->f_action)
+		return NULL;
+
+	SIMPLEQ_FOREACH(f, &fhead, f_link) {
+		if ((f->f_flags & REUSED) || !f->f_action || f->f_type == F_UNUSED)
+			continue;
+		if (f->f_file < 0 && (f->f_type == F_FILE || f->f_type == F_PIPE ||
+				      f->f_type == F_TTY  || f->f_type == F_CONSOLE))
+			continue;
+		if (strcmp(f->f_action, nf->f_action))
+			continue;
+
+		f->f_flags |= REUSED;
+		return f;
+	}
+
+	return NULL;
+}
+
+/*
+ * The new entry nf takes over the open file or connection, buffers,
+ * queues, and repeat counters of the running entry of.  Only the
+ * selector can differ.  What is left of of is an empty shell, to be
+ * freed with the rest of the previous .conf.
+ */
+static void cfreuse(struct filed *nf, struct filed *of)
+{
+	struct filed *next = SIMPLEQ_NEXT(nf, f_link);
+	u_char pmask[LOG_NFACILITIES + 1];
+	char *action = nf->f_action;
+
+	/* Buffered lines reach the file on reload, as before */
+	if (of->f_wbuf)
+		wbuf_flush(of);
+
+	memcpy(pmask, nf->f_pmask, sizeof(pmask));
+	free(of->f_action);
+
+	*nf = *of;
+	SIMPLEQ_NEXT(nf, f_link) = next;
+	memcpy(nf->f_pmask, pmask, sizeof(pmask));
+	nf->f_action = action;
+	nf->f_flags &= ~REUSED;
+	nf->f_reuse = NULL;
+
+	next = SIMPLEQ_NEXT(of, f_link);
+	memset(of, 0, sizeof(*of));
+	SIMPLEQ_NEXT(of, f_link) = next;
+	of->f_type = F_UNUSED;
+	of->f_file = -1;
+}
+
 /*
  * Find matching cfkey and modify cline to the argument.
  * Note, the key '=' value separator is optional.
@@ -3185,6 +5957,122 @@ static int cfparse(FILE *fp, struct files *newf, struct notifiers *newn)
 		secure_str = NULL;
 	}
 
+	if (rcvbatch_str) {
+		int val;
+
+		val = atoi(rcvbatch_str);
+		if (val < 1 || val > RCVBATCH_MAX)
+			logit("Invalid value to rcvbatch = %s\n", rcvbatch_str);
+		else
+			RcvBatch = val;
+
+		free(rcvbatch_str);
+		rcvbatch_str = NULL;
+	}
+
+	if (rcvworkers_str) {
+		int val;
+
+		val = atoi(rcvworkers_str);
+		if (val < 0 || val > RCVWORKERS_MAX)
+			logit("Invalid value to rcvworkers = %s\n", rcvworkers_str);
+		else
+			RcvWorkers = val;
+
+		free(rcvworkers_str);
+		rcvworkers_str = NULL;
+	}
+
+	if (sync_interval_str) {
+		int val;
+
+		val = atoi(sync_interval_str);
+		if (val < 0 || val > SYNCINTVL_MAX)
+			logit("Invalid value to sync_interval = %s\n", sync_interval_str);
+		else
+			SyncInterval = val;
+
+		free(sync_interval_str);
+		sync_interval_str = NULL;
+	}
+
+	if (rotate_compress_str) {
+		int codec, level;
+
+		if (compress_parse(rotate_compress_str, &codec, &level))
+			logit("Invalid value to rotate_compress = %s\n", rotate_compress_str);
+		else if (!compress_avail(codec) && codec != COMPRESS_GZIP)
+			WARN("rotate_compress %s not supported, built without it.", rotate_compress_str);
+		else {
+			RotateCodec = codec;
+			RotateLevel = level;
+		}
+
+		free(rotate_compress_str);
+		rotate_compress_str = NULL;
+	}
+
+	if (tls_ca_str) {
+		free(TlsCa);
+		TlsCa = tls_ca_str;
+		tls_ca_str = NULL;
+	}
+
+	if (tls_cert_str) {
+		free(TlsCert);
+		TlsCert = tls_cert_str;
+		tls_cert_str = NULL;
+	}
+
+	if (tls_key_str) {
+		free(TlsKey);
+		TlsKey = tls_key_str;
+		tls_key_str = NULL;
+	}
+
+	if (spool_dir_str) {
+		free(SpoolDir);
+		SpoolDir = spool_dir_str;
+		spool_dir_str = NULL;
+	}
+
+	if (metrics_socket_str) {
+		free(MetricsSocket);
+		MetricsSocket = metrics_socket_str;
+		metrics_socket_str = NULL;
+	}
+
+	if (file_cache_str) {
+		int val;
+
+		val = atoi(file_cache_str);
+		if (val < 1 || val > FDCACHE_MAX)
+			logit("Invalid value to file_cache = %s\n", file_cache_str);
+		else
+			FileCache = val;
+
+		free(file_cache_str);
+		file_cache_str = NULL;
+	}
+
+	if (rate_limit_str) {
+		char *ptr;
+		int rate, burst;
+
+		rate  = atoi(rate_limit_str);
+		ptr   = strchr(rate_limit_str, ':');
+		burst = ptr ? atoi(++ptr) : rate;
+		if (rate < 0 || burst < 0 || (rate && !burst))
+			logit("Invalid value to rate_limit = %s\n", rate_limit_str);
+		else {
+			RateLimit = rate;
+			RateBurst = burst;
+		}
+
+		free(rate_limit_str);
+		rate_limit_str = NULL;
+	}
+
 	return 0;
 }
 
@@ -3238,7 +6126,7 @@ static int allowaddr(char *s)
 	char *cp1, *cp2;
 	struct allowedpeer *ap;
 	struct servent *se;
-	int masklen = -1;
+	int masklen = -1, bits;
 	struct addrinfo hints, *res = NULL;
 	in_addr_t *addrp, *maskp;
 	uint32_t *addr6p, *mask6p;
@@ -3311,11 +6199,12 @@ static int allowaddr(char *s)
 			if (masklen < 0) {
 				/* use default netmask */
 				if (IN_CLASSA(ntohl(*addrp)))
-					*maskp = htonl(IN_CLASSA_NET);
+					masklen = 8;
 				else if (IN_CLASSB(ntohl(*addrp)))
-					*maskp = htonl(IN_CLASSB_NET);
+					masklen = 16;
 				else
-					*maskp = htonl(IN_CLASSC_NET);
+					masklen = 24;
+				*maskp = htonl(~((1 << (32 - masklen)) - 1));
 			} else if (masklen == 0) {
 				*maskp = 0;
 			} else if (masklen <= 32) {
@@ -3326,6 +6215,7 @@ static int allowaddr(char *s)
 			}
 			/* Lose any host bits in the network number. */
 			*addrp &= *maskp;
+			bits = masklen;
 			break;
 
 		case AF_INET6:
@@ -3334,6 +6224,7 @@ static int allowaddr(char *s)
 
 			if (masklen < 0)
 				masklen = 128;
+			bits = masklen;
 			mask6p = (uint32_t *)&sstosin6(&ap->a_mask)->sin6_addr.s6_addr32[0];
 			addr6p = (uint32_t *)&sstosin6(&ap->a_addr)->sin6_addr.s6_addr32[0];
 			/* convert masklen to netmask */
@@ -3355,9 +6246,15 @@ static int allowaddr(char *s)
 			goto err;
 		}
 		freeaddrinfo(res);
+		res = NULL;
+
+		/* compiled into the matcher used by validate() */
+		if (allow_add(sstosa(&ap->a_addr), bits, ap->port, aprules + 1))
+			goto err;
 	} else {
 		/* arg `s' is domain name */
 		ap->isnumeric = 0;
+		apnames++;
 		ap->a_name = s;
 		if (cp1)
 			*cp1 = '/';
@@ -3367,6 +6264,7 @@ static int allowaddr(char *s)
 		}
 	}
 	SIMPLEQ_INSERT_TAIL(&aphead, ap, next);
+	aprules++;
 
 	if (Debug) {
 		char ip[NI_MAXHOST];
@@ -3405,98 +6303,73 @@ err:
 
 /*
  * Validate that the remote peer has permission to log to us.
+ *
+ * Numeric rules are compiled into a prefix trie by allowaddr(), so the
+ * common case is decided on the address and port in `sa` alone.  Only
+ * if that fails, and there are domain name rules, is `hname` matched.
+ * It comes from cvthname(), i.e., the reverse DNS cache, messages from
+ * peers not cached yet are held until they are, so there are no
+ * resolver calls here.  Called from receiver workers too.
  */
 static int validate(struct sockaddr *sa, const char *hname)
 {
-	char name[NI_MAXHOST], ip[NI_MAXHOST], port[NI_MAXSERV];
+	char name[NI_MAXHOST];
+	struct in_addr in;
 	struct allowedpeer *ap;
-	struct sockaddr_in *sin4, *a4p = NULL, *m4p = NULL;
-	struct sockaddr_in6 *sin6, *a6p = NULL, *m6p = NULL;
-	struct addrinfo hints, *res;
-	socklen_t len;
 	u_short sport;
-	int i, num = 0;
+	int i;
 
-	SIMPLEQ_FOREACH(ap, &aphead, next)
-		num++;
-
-	logit("# of validation rule: %d\n", num);
-	if (num == 0)
+	logit("# of validation rule: %d\n", aprules);
+	if (aprules == 0)
 		/* traditional behaviour, allow everything */
 		return 1;
 
+	if (allow_match(sa, &i)) {
+		logit("accepted in rule %d.\n", i);
+		return 1;	/* hooray! */
+	}
+
+	if (apnames == 0) {
+		logit("rejected, no numeric rule matches.\n");
+		return 0;
+	}
+
+	switch (sa->sa_family) {
+	case AF_INET:
+		sport = ntohs(satosin(sa)->sin_port);
+		break;
+	case AF_INET6:
+		sport = ntohs(satosin6(sa)->sin6_port);
+		break;
+	default:
+		return 0;	/* for safety, should not occur */
+	}
+
+	/* Numeric address, not (yet) resolved, or name without domain */
 	(void)strlcpy(name, hname, sizeof(name));
-	hints = (struct addrinfo){
-		.ai_family = PF_UNSPEC,
-		.ai_socktype = SOCK_DGRAM,
-		.ai_flags = AI_PASSIVE | AI_NUMERICHOST
-	};
-	if (getaddrinfo(name, NULL, &hints, &res) == 0)
-		freeaddrinfo(res);
-	else if (strchr(name, '.') == NULL) {
+	if (!strchr(name, ':') && inet_pton(AF_INET, name, &in) != 1 &&
+	    strchr(name, '.') == NULL) {
 		strlcat(name, ".", sizeof name);
 		strlcat(name, LocalDomain, sizeof name);
 	}
 
-#ifdef HAVE_SA_LEN
-	len = sa->sa_len;
-#else
-	if (sa->sa_family == AF_INET)
-		len = sizeof(struct sockaddr_in);
-	else
-		len = sizeof(struct sockaddr_in6);
-#endif
-	if (getnameinfo(sa, len, ip, sizeof(ip), port, sizeof(port),
-			NI_NUMERICHOST | NI_NUMERICSERV) != 0)
-		return 0;	/* for safety, should not occur */
-
-	logit("validate: dgram from IP %s, port %s, name %s;\n", ip, port, name);
-	sport = atoi(port);
+	logit("validate: dgram from port %d, name %s;\n", sport, name);
 
-	/* now, walk down the list */
+	/* now, walk down the list of domain name rules */
 	i = 0;
 	SIMPLEQ_FOREACH(ap, &aphead, next) {
 		i++;
+		if (ap->isnumeric)
+			continue;
+
 		if (ap->port != 0 && ap->port != sport) {
 			logit("rejected in rule %d due to port mismatch.\n", i);
 			continue;
 		}
 
-		if (ap->isnumeric) {
-			if (ap->a_addr.ss_family != sa->sa_family) {
-				logit("rejected in rule %d due to address family mismatch.\n", i);
-				continue;
-			} else if (ap->a_addr.ss_family == AF_INET) {
-				sin4 = satosin(sa);
-				a4p = satosin(&ap->a_addr);
-				m4p = satosin(&ap->a_mask);
-				if ((sin4->sin_addr.s_addr & m4p->sin_addr.s_addr)
-				    != a4p->sin_addr.s_addr) {
-					logit("rejected in rule %d due to IP mismatch.\n", i);
-					continue;
-				}
-			} else if (ap->a_addr.ss_family == AF_INET6) {
-				sin6 = satosin6(sa);
-				a6p = satosin6(&ap->a_addr);
-				m6p = satosin6(&ap->a_mask);
-				if (a6p->sin6_scope_id != 0 &&
-				    sin6->sin6_scope_id != a6p->sin6_scope_id) {
-					logit("rejected in rule %d due to scope mismatch.\n", i);
-					continue;
-				}
-				if (!IN6_ARE_MASKED_ADDR_EQUAL(&sin6->sin6_addr,
-				    &a6p->sin6_addr, &m6p->sin6_addr)) {
-					logit("rejected in rule %d due to IP mismatch.\n", i);
-					continue;
-				}
-			} else
-				continue;
-		} else {
-			if (fnmatch(ap->a_name, name, FNM_NOESCAPE) ==
-			    FNM_NOMATCH) {
-				logit("rejected in rule %d due to name mismatch.\n", i);
-				continue;
-			}
+		if (fnmatch(ap->a_name, name, FNM_NOESCAPE) == FNM_NOMATCH) {
+			logit("rejected in rule %d due to name mismatch.\n", i);
+			continue;
 		}
 
 		logit("accepted in rule %d.\n", i);
@@ -3545,33 +6418,103 @@ static void notifier_add(struct notifiers *newn, const char *program)
 		logit("notify: non-existing, or not executable program\n");
 }
 
-static void notifier_invoke(const char *logfile)
+/*
+ * Start notifier with posix_spawn(), which unlike fork() does not copy
+ * the page tables of the daemon.  The child does not get our blocked
+ * signals, see signal_init(), and has default SIGPIPE.
+ */
+static int notifier_spawn(struct notify_job *job)
 {
+	posix_spawnattr_t attr;
+	sigset_t mask, def;
 	char *argv[3];
-	int childpid;
+	int rc;
+
+	argv[0] = job->j_program;
+	argv[1] = job->j_path;
+	argv[2] = NULL;
+
+	sigemptyset(&mask);
+	sigemptyset(&def);
+	sigaddset(&def, SIGPIPE);
+
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	posix_spawnattr_setsigdefault(&attr, &def);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+	rc = posix_spawn(&job->j_pid, job->j_program, NULL, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+	if (rc) {
+		errno = rc;
+		ERR("Cannot start notifier %s", job->j_program);
+		return -1;
+	}
+
+	logit("notify: started child pid %d for %s\n", job->j_pid, job->j_program);
+
+	return 0;
+}
+
+static void notifier_job_free(struct notify_job *job)
+{
+	TAILQ_REMOVE(&jobhead, job, j_link);
+	free(job->j_program);
+	free(job);
+}
+
+static void notifier_invoke(const char *logfile)
+{
 	struct notifier *np;
 
 	logit("notify: rotated %s, invoking hooks\n", logfile);
 
 	SIMPLEQ_FOREACH(np, &nothead, n_link) {
-		childpid = fork();
+		struct notify_job *job;
+		size_t len;
+
+		TAILQ_FOREACH(job, &jobhead, j_link) {
+			if (!strcmp(job->j_program, np->n_program) && !strcmp(job->j_path, logfile))
+				break;
+		}
+		if (job) {
+			logit("notify: %s still running for %s, coalescing\n", np->n_program, logfile);
+			job->j_again = 1;
+			continue;
+		}
 
-		switch (childpid) {
-		case -1:
+		len = strlen(logfile) + 1;
+		job = calloc(1, sizeof(*job) + len);
+		if (!job || !(job->j_program = strdup(np->n_program))) {
+			free(job);
 			ERR("Cannot start notifier %s", np->n_program);
-			break;
-		case 0:
-			argv[0] = np->n_program;
-			argv[1] = (char*)logfile;
-			argv[2] = NULL;
-			execv(argv[0], argv);
-			_exit(1);
-		default:
-			logit("notify: forked child pid %d for %s\n",
-				childpid, np->n_program);
-			break;
+			continue;
 		}
+		memcpy(job->j_path, logfile, len);
+
+		TAILQ_INSERT_TAIL(&jobhead, job, j_link);
+		if (notifier_spawn(job))
+			notifier_job_free(job);
+	}
+}
+
+/* Called by reapchild(), run again if rotated meanwhile */
+static void notifier_reaped(pid_t pid)
+{
+	struct notify_job *job;
+
+	TAILQ_FOREACH(job, &jobhead, j_link) {
+		if (job->j_pid == pid)
+			break;
+	}
+	if (!job)
+		return;
+
+	if (job->j_again) {
+		job->j_again = 0;
+		if (!notifier_spawn(job))
+			return;
 	}
+	notifier_job_free(job);
 }
 
 static void notifier_free_all(void)
@@ -37,6 +37,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>		/* struct addrinfo */
+#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
 #ifdef __linux__
 #include <sys/klog.h>
@@ -46,15 +48,35 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>		/* struct sockaddr_un */
+#include "mpsc.h"
+#include "outq.h"
 #include "queue.h"
 #include "syslog.h"
+#include "uring.h"
 
 #define MAXLINE        2048            /* maximum line length */
 #define MAXSVLINE      MAXLINE         /* maximum saved line length */
 #define DEFUPRI        (LOG_USER | LOG_NOTICE)
 #define DEFSPRI        (LOG_KERN | LOG_CRIT)
 #define TIMERINTVL     30              /* interval for checking flush/nslookup */
+#define SEQNOINTVL     5               /* interval for saving kernel seqno */
+#define KMSG_MAXREC    8192            /* max /dev/kmsg record, with dictionary */
+#define KMSG_BULK      (64 * 1024)     /* file write buffer while reading kernel backlog */
 #define RCVBUF_MINSIZE (80 * MAXLINE)  /* minimum size of dgram rcv buffer */
+#define RCVBATCH_DEF   16              /* default datagrams per wakeup */
+#define RCVBATCH_MAX   64              /* max datagrams per wakeup */
+#define RCVWORKERS_MAX 32              /* max receiver workers per inet socket */
+#define RXQUEUE_MAX    8192            /* max messages queued by receiver workers */
+#define RXPOOL_SLOTS   256             /* preallocated message slots per worker */
+#define HOLD_MAX       256             /* max datagrams waiting for a peer name */
+#define HOLD_TIMEOUT   10              /* seconds to wait for it, then rejected */
+#define HOLDINTVL      100             /* msec between checks for the name */
+#define WBUF_MAX       (1024 * 1024)   /* max size of a file write buffer */
+#define SYNCINTVL_MAX  3600            /* max seconds between fdatasync() */
+#define FORW_MAXSD     8               /* max connected UDP sockets per target */
+#define FORW_BATCH     32              /* max messages per sendmmsg() */
+#define FORW_BUFSZ     (64 * 1024)     /* max bytes per batch */
+#define FORW_HOLD      (64 * 1024)     /* max bytes held while initial lookup is pending */
 
 /*
  * Linux uses EIO instead of EBADFD (mrn 12 May 96)
@@ -89,6 +111,10 @@
 #define _PATH_CACHE  RUNSTATEDIR "/syslogd.cache"
 #endif
 
+#ifndef _PATH_SPOOL
+#define _PATH_SPOOL  LOCALSTATEDIR "/spool/syslogd"
+#endif
+
 #ifndef _PATH_DEV
 #define _PATH_DEV      "/dev/"
 #endif
@@ -105,6 +131,10 @@
 #define _PATH_LOG      "/dev/log"
 #endif
 
+#ifndef _PATH_KMSG
+#define _PATH_KMSG	"/dev/kmsg"
+#endif
+
 #ifndef _PATH_KLOG
 #define _PATH_KLOG	"/proc/kmsg"
 #endif
@@ -184,6 +214,10 @@
 #define RFC3164   0x010  /* format log message according to RFC 3164 */
 #define RFC5424   0x020  /* format log message according to RFC 5424 */
 #define SUSP_RETR 0x040  /* suspend/forw_unkn, retrying nslookup */
+#define SYNC_PEND 0x080  /* file written since last fdatasync() */
+#define REUSED    0x100  /* taken over by new .conf on reload */
+#define RESOLVING 0x200  /* initial forw_lookup() pending in resolver thread */
+#define BULK_WBUF 0x400  /* f_wbuf only while reading kernel backlog */
 
 /* Syslog timestamp formats. */
 #define	BSDFMT_DATELEN	0
@@ -215,6 +249,7 @@
 #define F_FORW_SUSP       7   /* suspended host forwarding */
 #define F_FORW_UNKN       8   /* unknown host forwarding */
 #define F_PIPE            9   /* named pipe */
+#define F_TEMPLATE       10   /* file, path expanded per message */
 
 /*
  * Struct to hold records of peers and sockets
@@ -224,8 +259,48 @@ struct peer {
 	const char	*pe_name;
 	const char	*pe_serv;
 	mode_t		 pe_mode;
+	int		 pe_proto;	/* 0: UDP, or STREAM_TCP, STREAM_TLS */
 	int		 pe_sock[16];
 	size_t		 pe_socknum;
+	uint64_t	 pe_rx;		/* messages received, for metrics */
+};
+
+#ifndef HAVE_RECVMMSG
+struct mmsghdr {
+	struct msghdr	 msg_hdr;
+	unsigned int	 msg_len;
+};
+#endif
+
+/*
+ * Ring of receive buffers for batched reads from a socket
+ */
+struct rcvring {
+	struct mmsghdr		 hdr[RCVBATCH_MAX];
+	struct iovec		 iov[RCVBATCH_MAX];
+	struct sockaddr_storage	 ss[RCVBATCH_MAX];
+	char			*bufp[RCVBATCH_MAX]; /* receive here, default buf[] */
+	char			 buf[RCVBATCH_MAX][MAXLINE + 1];
+#ifdef SO_PASSCRED
+	char			 ctl[RCVBATCH_MAX][CMSG_SPACE(sizeof(struct ucred))];
+#endif
+	uint64_t		 full;	  /* batches with max datagrams */
+	uint64_t		 partial; /* batches that drained the socket */
+};
+
+/*
+ * Receiver worker thread, owns one SO_REUSEPORT inet socket
+ */
+struct rxworker {
+	SIMPLEQ_ENTRY(rxworker)	 rw_link;
+	pthread_t		 rw_tid;
+	int			 rw_sd;
+	int			 rw_batch;
+	volatile int		 rw_stop;
+	struct rcvring		*rw_ring;
+	struct rxpool		*rw_pool;
+	struct peer		*rw_pe;
+	struct rxslot		*rw_slot[RCVBATCH_MAX]; /* receiving into these */
 };
 
 /*
@@ -257,10 +332,8 @@ struct logtime {
 /* message buffer container used for processing, formatting, and queueing */
 struct buf_msg {
 	int	 	 pri;
-	char		 pribuf[8];
 	int	 	 flags;
 	struct logtime	 timestamp;
-	char		 timebuf[33];
 	char		*recvhost;
 	char		*hostname;
 	char		*app_name;
@@ -268,6 +341,65 @@ struct buf_msg {
 	char		*msgid;
 	char		*sd;	       /* structured data */
 	char		*msg;	       /* message content */
+	uint64_t	 rxtime;       /* usec when received, 0: not set */
+};
+
+/* message rendered in one output format, iov points into buf_msg and here */
+struct fmtbuf {
+	char		 pribuf[8];
+	char		 timebuf[33];
+	struct iovec	 iov[20];
+	int		 iovcnt;
+};
+
+/* output formats, index in struct fmtcache */
+#define FMT_BSD     0
+#define FMT_RFC3164 1
+#define FMT_RFC5424 2
+#define FMT_MAX     3
+
+/* each format rendered at most once per message, on first use */
+struct fmtcache {
+	int		 valid;	       /* bitmask of rendered FMT_* */
+	struct fmtbuf	 fb[FMT_MAX];
+};
+
+/*
+ * Message slot of a receiver worker.  The datagram is received into
+ * data and parsed in place, the fields of msg point into data, host,
+ * or line, which only holds the message text if it had to be escaped.
+ */
+struct rxslot {
+	struct mpsc_node	 node;
+	struct rxslot		*next;	  /* free list */
+	struct rxpool		*pool;	  /* owner, or NULL if from malloc() */
+	struct buf_msg		 msg;
+	int			 held;	  /* data not parsed, peer name unknown */
+	struct sockaddr_storage	 ss;	  /* ... and the peer, for hold_add() */
+	socklen_t		 sslen;
+	char			 host[NI_MAXHOST];
+	char			 line[MAXLINE + 1];
+	char			 data[MAXLINE + 1];
+};
+
+/*
+ * Datagram held until the name of its peer is known, see hold_add()
+ */
+struct held {
+	TAILQ_ENTRY(held)	 link;
+	struct sockaddr_storage	 ss;	  /* as received, before unmapped() */
+	socklen_t		 sslen;
+	time_t			 since;
+	char			 data[];
+};
+
+/*
+ * Pool of message slots owned by one worker, returned by the main loop
+ */
+struct rxpool {
+	struct mpsc		 ret;	  /* returned by main loop */
+	struct rxslot		*free;	  /* worker only */
+	struct rxslot		 slots[];
 };
 
 /*
@@ -290,10 +422,19 @@ struct filed {
 			char f_hname[MAXHOSTNAMELEN + 1];
 			char f_serv[20];
 			struct addrinfo *f_addr;
+			int f_proto;           /* 0: UDP, or STREAM_TCP, STREAM_TLS */
+			struct stream *f_conn; /* TCP/TLS connection, or NULL */
+			struct forwq *f_batch; /* UDP messages to send, or NULL */
+			int f_sd[FORW_MAXSD];  /* connected UDP sockets */
+			int f_nsd;
+			char *f_hold;          /* messages logged while RESOLVING */
+			size_t f_holdlen;
 		} f_forw; /* forwarding address */
 		char f_fname[MAXFNAME];
 	} f_un;
-	char	 f_prevline[MAXSVLINE];        /* last message logged */
+	char	*f_prevline;                   /* last message logged, or NULL */
+	size_t	 f_prevsz;                     /* allocated size of f_prevline */
+	uint64_t f_prevhash;                   /* hash64() of f_prevline fields */
 	struct logtime f_lasttime;             /* time of last occurrence */
 	char	 f_prevhost[MAXHOSTNAMELEN + 1]; /* host from which recd. */
 	int	 f_prevpri;                    /* pri of f_prevline */
@@ -303,6 +444,39 @@ struct filed {
 	int	 f_flags;                      /* store some additional flags */
 	int	 f_rotatecount;
 	int	 f_rotatesz;
+	off_t	 f_size;                       /* bytes written, -1: not a regular file */
+	int	 f_qsize;                      /* async queue, 0: disabled */
+	int	 f_qpolicy;                    /* OUTQ_DROP_OLDEST, ... */
+	struct outq *f_queue;                  /* async writer, or NULL */
+	struct uring_file *f_ring;             /* io_uring writer, or NULL */
+	int	 f_spoolsz;                    /* spool when target is down, 0: disabled */
+	int	 f_spoolrate;                  /* max messages/sec to replay */
+	struct spool *f_spool;                 /* disk spool, or NULL */
+	char	*f_wbuf;                       /* write buffer, or NULL */
+	size_t	 f_wbufsz;                     /* size of write buffer */
+	size_t	 f_wlen;                       /* bytes in write buffer */
+	int	 f_wsec;                       /* max seconds to buffer */
+	time_t	 f_wtime;                      /* time of first buffered line */
+	time_t	 f_synctime;                   /* time of last fdatasync() */
+	char	*f_action;                     /* action and options, matched on reload */
+	struct filed *f_reuse;                 /* running entry to take over on reload */
+	struct {
+		uint64_t writes;               /* messages written */
+		uint64_t bytes;
+		uint64_t errors;               /* write/send errors */
+		uint64_t dups;                 /* repeated messages suppressed */
+		time_t   suspended;            /* seconds forwarding was suspended */
+	} f_metrics;
+};
+
+/*
+ * Dispatch table, built from the list of actions by init().  Each cell
+ * is a NULL terminated array of the actions matching that facility and
+ * severity, in the same order as in the list.
+ */
+struct dispatch {
+	struct filed **cell[LOG_NFACILITIES + 1][LOG_PRIMASK + 1];
+	struct filed  *slab[];
 };
 
 /*
@@ -313,6 +487,15 @@ struct notifier {
 	char			*n_program;
 };
 
+/* Running notifier, for one rotated file */
+struct notify_job {
+	TAILQ_ENTRY(notify_job)	 j_link;
+	pid_t			 j_pid;
+	int			 j_again;	/* rotated again while running */
+	char			*j_program;
+	char			 j_path[];
+};
+
 void flog(int pri, char *fmt, ...);
 
 #endif /* SYSKLOGD_SYSLOGD_H_ */
@@ -28,37 +28,62 @@
  * SUCH DAMAGE.
  */
 
+#include "config.h"
+
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/time.h>
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
 
-#include "queue.h"
 #include "socket.h"
+#include "timer.h"
 
+/*
+ * Timers are kept in a binary min-heap ordered by deadline, in
+ * milliseconds on the monotonic clock.  The earliest deadline arms a
+ * timerfd, or on systems without, an interval timer whose SIGALRM is
+ * turned into an event with a self-pipe.
+ */
 struct timer {
-	LIST_ENTRY(timer) tmr_link;
-
-	int      tmr_period;	/* period time in seconds */
-	time_t   tmr_timeout;
+	uint64_t tmr_deadline;	/* monotonic ms */
+	int      tmr_period;	/* period time in ms, 0 for one-shot */
 
 	void   (*tmr_cb)(void *arg);
 	void    *tmr_arg;
 };
 
-static LIST_HEAD(, timer) tmr_head = LIST_HEAD_INITIALIZER();
+static struct timer **heap;
+static size_t heap_len, heap_max;
+static struct timer *running;	/* callback in progress, see timer_del() */
+static int cancelled;
 
 static struct timespec now;
-static int timer_fd[2];
+static uint64_t now_ms;
+static uint64_t now_us;
+static int started;
+static int timer_fd[2] = { -1, -1 };
 
 /*
  * what time is it?
  */
 int timer_update(void)
 {
-	return clock_gettime(CLOCK_MONOTONIC, &now);
+	int rc;
+
+	rc = clock_gettime(CLOCK_MONOTONIC, &now);
+	now_ms = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	now_us = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+	return rc;
 }
 
 time_t timer_now(void)
@@ -66,47 +91,199 @@ time_t timer_now(void)
 	return now.tv_sec;
 }
 
+uint64_t timer_now_ms(void)
+{
+	return now_ms;
+}
+
+uint64_t timer_now_us(void)
+{
+	return now_us;
+}
+
+static int before(size_t a, size_t b)
+{
+	return heap[a]->tmr_deadline < heap[b]->tmr_deadline;
+}
+
+static void swap(size_t a, size_t b)
+{
+	struct timer *tmp = heap[a];
+
+	heap[a] = heap[b];
+	heap[b] = tmp;
+}
+
+static void sift_up(size_t i)
+{
+	while (i > 0 && before(i, (i - 1) / 2)) {
+		swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void sift_down(size_t i)
+{
+	for (;;) {
+		size_t l = 2 * i + 1, r = l + 1, min = i;
+
+		if (l < heap_len && before(l, min))
+			min = l;
+		if (r < heap_len && before(r, min))
+			min = r;
+		if (min == i)
+			break;
+
+		swap(i, min);
+		i = min;
+	}
+}
+
+static int heap_push(struct timer *tmr)
+{
+	if (heap_len == heap_max) {
+		size_t max = heap_max ? heap_max * 2 : 8;
+		struct timer **h;
+
+		h = realloc(heap, max * sizeof(*h));
+		if (!h)
+			return -1;
+		heap = h;
+		heap_max = max;
+	}
+
+	heap[heap_len++] = tmr;
+	sift_up(heap_len - 1);
+
+	return 0;
+}
+
+static void heap_del(size_t i)
+{
+	heap[i] = heap[--heap_len];
+	if (i < heap_len) {
+		sift_up(i);
+		sift_down(i);
+	}
+}
+
 /*
- * create periodic timer (seconds)
+ * Arm the kernel timer for the earliest deadline, or disarm it.
  */
-int timer_add(int period, void (*cb)(void *), void *arg)
+static int arm(void)
+{
+	uint64_t ms = 0;
+
+	if (!started)
+		return 0;
+
+	if (heap_len > 0) {
+		ms = heap[0]->tmr_deadline;
+		if (ms <= now_ms)
+			ms = now_ms + 1;
+	}
+
+#ifdef HAVE_SYS_TIMERFD_H
+	{
+		struct itimerspec its = { 0 };
+
+		if (ms) {
+			its.it_value.tv_sec  = ms / 1000;
+			its.it_value.tv_nsec = (ms % 1000) * 1000000;
+		}
+
+		return timerfd_settime(timer_fd[0], TFD_TIMER_ABSTIME, &its, NULL);
+	}
+#else
+	{
+		struct itimerval itv = { 0 };
+
+		if (ms) {
+			ms -= now_ms;
+			itv.it_value.tv_sec  = ms / 1000;
+			itv.it_value.tv_usec = (ms % 1000) * 1000;
+		}
+
+		return setitimer(ITIMER_REAL, &itv, NULL);
+	}
+#endif
+}
+
+static int add(int period, int once, void (*cb)(void *), void *arg)
 {
 	struct timer *tmr;
 
+	if (period <= 0 || !cb)
+		return -1;
+
 	tmr = calloc(1, sizeof(*tmr));
 	if (!tmr)
 		return -1;
 
-	tmr->tmr_period = period;
+	tmr->tmr_period = once ? 0 : period;
 	tmr->tmr_cb     = cb;
 	tmr->tmr_arg    = arg;
 
-	LIST_INSERT_HEAD(&tmr_head, tmr, tmr_link);
+	timer_update();
+	tmr->tmr_deadline = now_ms + period;
+	if (heap_push(tmr)) {
+		free(tmr);
+		return -1;
+	}
+
+	/* only rearm if new timer is first in line */
+	if (heap[0] == tmr && !running)
+		arm();
 
 	return 0;
 }
 
-static int __timer_start(void)
+/*
+ * create periodic timer (seconds)
+ */
+int timer_add(int period, void (*cb)(void *), void *arg)
+{
+	return add(period * 1000, 0, cb, arg);
+}
+
+/*
+ * create periodic timer (milliseconds)
+ */
+int timer_add_ms(int period, void (*cb)(void *), void *arg)
 {
-	struct timer *next, *tmr;
-	time_t sec;
+	return add(period, 0, cb, arg);
+}
 
-	LIST_FOREACH(tmr, &tmr_head, tmr_link) {
-		if (tmr->tmr_timeout == 0)
-			tmr->tmr_timeout = timer_now() + tmr->tmr_period;
-	}
+/*
+ * create one-shot timer, called once after timeout milliseconds
+ */
+int timer_once(int timeout, void (*cb)(void *), void *arg)
+{
+	return add(timeout, 1, cb, arg);
+}
 
-	next = LIST_FIRST(&tmr_head);
-	LIST_FOREACH(tmr, &tmr_head, tmr_link) {
-		if (next->tmr_timeout > tmr->tmr_timeout)
-			next = tmr;
-	}
+/*
+ * delete all timers with this callback and argument, also safe to call
+ * from the callback itself
+ */
+void timer_del(void (*cb)(void *), void *arg)
+{
+	size_t i = 0;
 
-	sec = next->tmr_timeout - timer_now();
-	if (sec <= 0)
-		sec = 1;
+	if (running && running->tmr_cb == cb && running->tmr_arg == arg)
+		cancelled = 1;
 
-	return alarm(sec);
+	while (i < heap_len) {
+		if (heap[i]->tmr_cb == cb && heap[i]->tmr_arg == arg) {
+			free(heap[i]);
+			heap_del(i);
+			continue;
+		}
+		i++;
+	}
+
+	if (!running)
+		arm();
 }
 
 /*
@@ -114,59 +291,101 @@ static int __timer_start(void)
  */
 int timer_start(void)
 {
-	if (LIST_EMPTY(&tmr_head))
+	if (heap_len == 0)
 		return -1;
 
 	timer_update();
+	started = 1;
 
-	return __timer_start();
+	return arm();
 }
 
 /*
- * callback for activity on pipe
+ * callback for activity on timerfd/pipe, run all expired timers
  */
 static void timer_cb(int sd, void *arg)
 {
 	struct timer *tmr;
-	char dummy;
 
-	(void)read(sd, &dummy, 1);
+	(void)arg;
+
+#ifdef HAVE_SYS_TIMERFD_H
+	{
+		uint64_t exp;
+
+		(void)read(sd, &exp, sizeof(exp));
+	}
+#else
+	{
+		char dummy[16];
+
+		/* Drain pipe, the event loop is edge-triggered */
+		while (read(sd, dummy, sizeof(dummy)) > 0)
+			;
+	}
+#endif
 
 	timer_update();
 
-	LIST_FOREACH(tmr, &tmr_head, tmr_link) {
-		if (tmr->tmr_timeout > timer_now())
-			continue;
+	while (heap_len > 0 && heap[0]->tmr_deadline <= now_ms) {
+		tmr = heap[0];
+		heap_del(0);
+
+		running   = tmr;
+		cancelled = 0;
+		tmr->tmr_cb(tmr->tmr_arg);
+		running   = NULL;
 
-		if (tmr->tmr_cb)
-			tmr->tmr_cb(tmr->tmr_arg);
-		tmr->tmr_timeout = 0;
+		if (!tmr->tmr_period || cancelled) {
+			free(tmr);
+			continue;
+		}
+
+		/* Skip missed periods rather than run back-to-back */
+		tmr->tmr_deadline += tmr->tmr_period;
+		if (tmr->tmr_deadline <= now_ms)
+			tmr->tmr_deadline = now_ms + tmr->tmr_period;
+		if (heap_push(tmr))
+			free(tmr);
 	}
 
-	__timer_start();
+	arm();
 }
 
+#ifndef HAVE_SYS_TIMERFD_H
 /*
  * Write to pipe to create an event on SIGALRM
  */
 static void sigalarm_handler(int signo)
 {
+	int saved_errno = errno;
+
 	(void)signo;
 	(void)write(timer_fd[1], "!", 1);
+	errno = saved_errno;
 }
+#endif
 
 /*
- * register signal pipe and callback
+ * register timerfd, or signal pipe, and callback
  */
 int timer_init(void)
 {
 	static int initialized = 0;
-	struct sigaction sa;
 	int rc;
 
 	if (initialized)
 		return 0;
 
+#ifdef HAVE_SYS_TIMERFD_H
+	timer_fd[0] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd[0] == -1) {
+		warn("timerfd_create()");
+		return -1;
+	}
+#else
+	struct sigaction sa;
+
 	if (pipe(timer_fd)) {
 		warn("pipe()");
 		return -1;
@@ -181,11 +400,14 @@ int timer_init(void)
 		goto err;
 	}
 
-	rc = fcntl(timer_fd[0], F_GETFL, 0);
-	if (rc != -1) {
-		if (fcntl(timer_fd[0], F_SETFL, rc | O_NONBLOCK) < 0)
-			warn("Failed setting pipe() descriptor non-blocking");
+	for (int i = 0; i < 2; i++) {
+		rc = fcntl(timer_fd[i], F_GETFL, 0);
+		if (rc != -1) {
+			if (fcntl(timer_fd[i], F_SETFL, rc | O_NONBLOCK) < 0)
+				warn("Failed setting pipe() descriptor non-blocking");
+		}
 	}
+#endif
 
 	rc = socket_register(timer_fd[0], NULL, timer_cb, NULL);
 	if (rc < 0) {
@@ -193,32 +415,39 @@ int timer_init(void)
 		goto err;
 	}
 
+	timer_update();
 	initialized = 1;
 
 	return 0;
 err:
 	close(timer_fd[0]);
-	close(timer_fd[1]);
+	if (timer_fd[1] != -1)
+		close(timer_fd[1]);
 
 	return -1;
 }
 
 /*
- * deregister signal pipe and callbacks
+ * deregister timerfd, or signal pipe, and callbacks
  */
 void timer_exit(void)
 {
-	struct timer *tmr, *tmp;
-
-	alarm(0);
-
-	socket_close((timer_fd[0]));
-	close(timer_fd[1]);
-
-	LIST_FOREACH_SAFE(tmr, &tmr_head, tmr_link, tmp) {
-		LIST_REMOVE(tmr, tmr_link);
-		free(tmr);
-	}
+	size_t len = heap_len;
+
+	/* Disarm, with an empty heap arm() clears the deadline */
+	heap_len = 0;
+	arm();
+	started = 0;
+
+	socket_close(timer_fd[0]);
+	if (timer_fd[1] != -1)
+		close(timer_fd[1]);
+
+	while (len > 0)
+		free(heap[--len]);
+	free(heap);
+	heap = NULL;
+	heap_max = 0;
 }
 
 /**
@@ -31,14 +31,22 @@
 #ifndef SYSKLOGD_TIMER_H_
 #define SYSKLOGD_TIMER_H_
 
-int    timer_add    (int period, void (*cb)(void *), void *arg);
+#include <stdint.h>
+#include <time.h>
 
-int    timer_start  (void);
+int      timer_add    (int period, void (*cb)(void *), void *arg);
+int      timer_add_ms (int period, void (*cb)(void *), void *arg);
+int      timer_once   (int timeout, void (*cb)(void *), void *arg);
+void     timer_del    (void (*cb)(void *), void *arg);
 
-int    timer_update (void);
-time_t timer_now    (void);
+int      timer_start  (void);
 
-int    timer_init   (void);
-void   timer_exit   (void);
+int      timer_update (void);
+time_t   timer_now    (void);
+uint64_t timer_now_ms (void);
+uint64_t timer_now_us (void);
+
+int      timer_init   (void);
+void     timer_exit   (void);
 
 #endif /* SYSKLOGD_TIMER_H_ */
@@ -0,0 +1,620 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "queue.h"
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#ifndef __NR_io_uring_setup		/* same on all archs but alpha */
+#define __NR_io_uring_setup 425
+#define __NR_io_uring_enter 426
+#endif
+
+#define URING_MAXBUF  (4 * 1024 * 1024)	/* pending bytes per file, then wait */
+
+/* Operation, in the low bits of user_data, the rest is a pointer */
+#define OP_WRITE      0
+#define OP_FSYNC      1
+#define OP_SEND       2
+#define OP_MASK       3
+
+/*
+ * The writer of one file.  At most one write, optionally linked with
+ * an fdatasync(), is in flight, so writes reach the file in order.
+ * Messages logged meanwhile are collected in buf[] and written as one
+ * when the previous write completes.  Errors are kept for the caller,
+ * as with the async writer threads.
+ */
+struct uring_file {
+	TAILQ_ENTRY(uring_file) link;	/* on pending list */
+	int     queued;			/* ... is on pending list */
+
+	int     fd;
+	int     sync;			/* fdatasync() after each write */
+	int     syncreq;		/* fdatasync() after pending data */
+	int     busy;			/* ops in flight */
+	int     error;			/* last write error, for caller */
+
+	char   *buf;			/* pending, written next */
+	size_t  len;
+	size_t  size;
+
+	char   *wbuf;			/* in flight */
+	size_t  wlen;
+	size_t  woff;			/* written, after a short write */
+	size_t  wsize;
+};
+
+static struct {
+	int                  fd;
+	unsigned             entries;
+
+	unsigned            *sq_tail;
+	unsigned            *sq_mask;
+	unsigned            *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned             tail;	/* next free sqe */
+	unsigned             subtail;	/* submitted up to */
+
+	unsigned            *cq_head;
+	unsigned            *cq_tail;
+	unsigned            *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void                *sq_ptr;
+	size_t               sq_sz;
+	void                *cq_ptr;
+	size_t               cq_sz;
+	size_t               sqes_sz;
+
+	unsigned             inflight;	/* submitted, not completed */
+	unsigned             sends;	/* queued sends, not completed */
+} ring = { .fd = -1 };
+
+static TAILQ_HEAD(, uring_file) pending = TAILQ_HEAD_INITIALIZER(pending);
+
+static int sys_enter(unsigned submit, unsigned wait, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, ring.fd, submit, wait, flags, NULL, 0);
+}
+
+static void unmap(void)
+{
+	if (ring.sqes && ring.sqes != MAP_FAILED)
+		munmap(ring.sqes, ring.sqes_sz);
+	if (ring.cq_ptr && ring.cq_ptr != MAP_FAILED && ring.cq_ptr != ring.sq_ptr)
+		munmap(ring.cq_ptr, ring.cq_sz);
+	if (ring.sq_ptr && ring.sq_ptr != MAP_FAILED)
+		munmap(ring.sq_ptr, ring.sq_sz);
+	ring.sqes = NULL;
+	ring.cq_ptr = ring.sq_ptr = NULL;
+}
+
+int uring_init(unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+	int fd, e;
+
+	if (ring.fd >= 0)
+		return 0;
+
+	memset(&p, 0, sizeof(p));
+	fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+		return -1;
+
+	/* Writes at the file position, and no dropped completions, Linux 5.6 */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS) || !(p.features & IORING_FEAT_NODROP)) {
+		close(fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	ring.sq_sz   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring.cq_sz   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring.sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cq_sz > ring.sq_sz)
+			ring.sq_sz = ring.cq_sz;
+		ring.cq_sz = ring.sq_sz;
+	}
+
+	ring.sq_ptr = mmap(NULL, ring.sq_sz, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring.sq_ptr == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring.cq_ptr = ring.sq_ptr;
+	else
+		ring.cq_ptr = mmap(NULL, ring.cq_sz, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	if (ring.cq_ptr == MAP_FAILED)
+		goto fail;
+	ring.sqes = mmap(NULL, ring.sqes_sz, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		goto fail;
+
+	sq = ring.sq_ptr;
+	cq = ring.cq_ptr;
+	ring.sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+	ring.sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring.cq_head  = (unsigned *)(cq + p.cq_off.head);
+	ring.cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+	ring.cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring.cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	ring.entries  = p.sq_entries;
+	ring.tail     = ring.subtail = *ring.sq_tail;
+	ring.fd       = fd;
+
+	return 0;
+fail:
+	e = errno;
+	unmap();
+	close(fd);
+	errno = e;
+
+	return -1;
+}
+
+/* Call after all writers have been freed */
+void uring_exit(void)
+{
+	if (ring.fd < 0)
+		return;
+
+	uring_submit();
+	while (ring.inflight && sys_enter(0, 1, IORING_ENTER_GETEVENTS) >= 0)
+		uring_reap();
+
+	unmap();
+	close(ring.fd);
+	ring.fd = -1;
+}
+
+int uring_active(void)
+{
+	return ring.fd >= 0;
+}
+
+/* For the main loop, readable when there are completions to reap */
+int uring_fd(void)
+{
+	return ring.fd;
+}
+
+static void file_queue(struct uring_file *uf)
+{
+	if (uf->queued)
+		return;
+
+	TAILQ_INSERT_TAIL(&pending, uf, link);
+	uf->queued = 1;
+}
+
+static void file_dequeue(struct uring_file *uf)
+{
+	if (!uf->queued)
+		return;
+
+	TAILQ_REMOVE(&pending, uf, link);
+	uf->queued = 0;
+}
+
+static void complete(uint64_t data, int res)
+{
+	void *ptr = (void *)(uintptr_t)(data & ~(uint64_t)OP_MASK);
+	struct uring_file *uf = ptr;
+
+	switch (data & OP_MASK) {
+	case OP_SEND:
+		*(int *)ptr = res;
+		ring.sends--;
+		break;
+
+	case OP_WRITE:
+		uf->busy--;
+		if (res < 0) {
+			/* Dropped, as with a failed writev() */
+			if (!uf->error)
+				uf->error = -res;
+			uf->wlen = uf->woff = 0;
+			break;
+		}
+
+		uf->woff += res;
+		if (uf->woff < uf->wlen)
+			file_queue(uf);	/* short write, rest goes next */
+		else
+			uf->wlen = uf->woff = 0;
+		break;
+
+	case OP_FSYNC:
+		uf->busy--;
+		/* Link broken by a failed or short write, retry after it */
+		if (res == -ECANCELED) {
+			uf->syncreq = 1;
+			file_queue(uf);
+		}
+		break;
+	}
+}
+
+void uring_reap(void)
+{
+	unsigned head, tail;
+
+	if (ring.fd < 0)
+		return;
+
+	head = *ring.cq_head;
+	tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+
+		complete(cqe->user_data, cqe->res);
+		ring.inflight--;
+		head++;
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Fail everything not yet submitted, e.g., when the kernel is out of memory */
+static void ring_fail(int e)
+{
+	unsigned tail = ring.tail;
+
+	ring.tail = ring.subtail;
+	__atomic_store_n(ring.sq_tail, ring.tail, __ATOMIC_RELEASE);
+	for (unsigned i = ring.subtail; i != tail; i++)
+		complete(ring.sqes[i & *ring.sq_mask].user_data, -e);
+}
+
+static void ring_wait(void)
+{
+	while (sys_enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno == EINTR)
+		;
+	uring_reap();
+}
+
+/* Submit all queued sqes, then optionally wait for a completion */
+static void ring_enter(int wait)
+{
+	__atomic_store_n(ring.sq_tail, ring.tail, __ATOMIC_RELEASE);
+	while (ring.tail != ring.subtail) {
+		int rc;
+
+		rc = sys_enter(ring.tail - ring.subtail, 0, 0);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			/* Completion queue full, or short of memory */
+			if ((errno == EBUSY || errno == EAGAIN) && ring.inflight) {
+				ring_wait();
+				continue;
+			}
+			ring_fail(errno);
+			break;
+		}
+
+		ring.subtail  += rc;
+		ring.inflight += rc;
+	}
+
+	if (wait && ring.inflight)
+		ring_wait();
+	else
+		uring_reap();
+}
+
+/* Get num consecutive sqes, the first is returned */
+static struct io_uring_sqe *sqe_get(unsigned num)
+{
+	struct io_uring_sqe *sqe;
+
+	if (ring.entries - (ring.tail - ring.subtail) < num)
+		ring_enter(0);
+
+	sqe = &ring.sqes[ring.tail & *ring.sq_mask];
+	for (unsigned i = 0; i < num; i++) {
+		unsigned idx = (ring.tail + i) & *ring.sq_mask;
+
+		memset(&ring.sqes[idx], 0, sizeof(ring.sqes[idx]));
+		ring.sq_array[idx] = idx;
+	}
+
+	return sqe;
+}
+
+static struct io_uring_sqe *sqe_next(void)
+{
+	return &ring.sqes[ring.tail++ & *ring.sq_mask];
+}
+
+/*
+ * Queue the next write of a file, and its fdatasync(), unless the
+ * previous write is still in flight.
+ */
+static void file_prep(struct uring_file *uf)
+{
+	struct io_uring_sqe *sqe;
+	int sync = uf->syncreq;
+
+	if (uf->busy)
+		return;
+	file_dequeue(uf);
+
+	/* Swap buffers, unless the rest of a short write goes first */
+	if (!uf->wlen && uf->len) {
+		char  *buf  = uf->wbuf;
+		size_t size = uf->wsize;
+
+		uf->wbuf  = uf->buf;
+		uf->wsize = uf->size;
+		uf->wlen  = uf->len;
+		uf->woff  = 0;
+		uf->buf   = buf;
+		uf->size  = size;
+		uf->len   = 0;
+		sync     |= uf->sync;
+	}
+
+	sqe_get(!!uf->wlen + !!sync);
+	if (uf->wlen) {
+		sqe = sqe_next();
+		sqe->opcode    = IORING_OP_WRITE;
+		sqe->fd        = uf->fd;
+		sqe->addr      = (uintptr_t)(uf->wbuf + uf->woff);
+		sqe->len       = uf->wlen - uf->woff;
+		sqe->off       = (uint64_t)-1;
+		sqe->user_data = (uintptr_t)uf | OP_WRITE;
+		if (sync)
+			sqe->flags = IOSQE_IO_LINK;
+		uf->busy++;
+	}
+
+	if (sync) {
+		sqe = sqe_next();
+		sqe->opcode      = IORING_OP_FSYNC;
+		sqe->fd          = uf->fd;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		sqe->user_data   = (uintptr_t)uf | OP_FSYNC;
+		uf->syncreq      = 0;
+		uf->busy++;
+	}
+}
+
+/*
+ * Called from the main loop, before it polls.  Queues the next write of
+ * all files with pending data and submits everything queued since last
+ * time, in one io_uring_enter().  Waits for all sends to complete, the
+ * caller owns their buffers.
+ */
+void uring_submit(void)
+{
+	struct uring_file *uf, *tmp;
+
+	if (ring.fd < 0)
+		return;
+
+	uring_reap();
+	TAILQ_FOREACH_SAFE(uf, &pending, link, tmp)
+		file_prep(uf);
+
+	ring_enter(0);
+	while (ring.sends && ring.inflight)
+		ring_wait();
+}
+
+/*
+ * Queue a sendmsg() on a connected datagram socket, with link set the
+ * next one is only sent if this one succeeds.  The result, byte count
+ * or -errno, is stored in *res by uring_submit().
+ */
+void uring_sendmsg(int sd, struct msghdr *msg, int link, int *res)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe_get(1);
+	sqe = sqe_next();
+	sqe->opcode    = IORING_OP_SENDMSG;
+	sqe->fd        = sd;
+	sqe->addr      = (uintptr_t)msg;
+	sqe->len       = 1;
+	sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+	sqe->user_data = (uintptr_t)res | OP_SEND;
+	if (link)
+		sqe->flags = IOSQE_IO_LINK;
+
+	*res = -EINPROGRESS;
+	ring.sends++;
+}
+
+struct uring_file *uring_file_new(int fd, int sync)
+{
+	struct uring_file *uf;
+
+	if (ring.fd < 0) {
+		errno = ENOSYS;
+		return NULL;
+	}
+
+	uf = calloc(1, sizeof(*uf));
+	if (!uf)
+		return NULL;
+
+	uf->fd   = fd;
+	uf->sync = sync;
+
+	return uf;
+}
+
+/* Writes, and syncs, everything pending */
+void uring_file_free(struct uring_file *uf)
+{
+	if (!uf)
+		return;
+
+	uring_file_drain(uf);
+	file_dequeue(uf);
+	free(uf->buf);
+	free(uf->wbuf);
+	free(uf);
+}
+
+/*
+ * Copy message to the pending buffer.  If the disk cannot keep up and
+ * the buffer grows too large, wait for it.  Returns -1 if out of memory.
+ */
+int uring_file_push(struct uring_file *uf, const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (uf->len + len > URING_MAXBUF)
+		uring_file_drain(uf);
+
+	if (uf->len + len > uf->size) {
+		size_t size = uf->size ? uf->size * 2 : 4096;
+		char *buf;
+
+		while (size < uf->len + len)
+			size *= 2;
+		buf = realloc(uf->buf, size);
+		if (!buf)
+			return -1;
+		uf->buf  = buf;
+		uf->size = size;
+	}
+
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(&uf->buf[uf->len], iov[i].iov_base, iov[i].iov_len);
+		uf->len += iov[i].iov_len;
+	}
+	file_queue(uf);
+
+	return 0;
+}
+
+/* Request fdatasync(), after anything pending */
+void uring_file_sync(struct uring_file *uf)
+{
+	uf->syncreq = 1;
+	file_queue(uf);
+}
+
+/* Wait for everything pending to be written, and synced, e.g. to rotate */
+void uring_file_drain(struct uring_file *uf)
+{
+	while (uf->busy || uf->len || uf->wlen || uf->syncreq) {
+		if (!uf->busy) {
+			file_prep(uf);
+			ring_enter(0);
+		} else
+			ring_enter(1);
+	}
+}
+
+/*
+ * Wait for anything in flight, drop what is pending, and switch to a
+ * new descriptor, -1 when the file is closed on error.
+ */
+void uring_file_setfd(struct uring_file *uf, int fd)
+{
+	while (uf->busy)
+		ring_enter(1);
+
+	file_dequeue(uf);
+	uf->len = uf->wlen = uf->woff = 0;
+	uf->syncreq = 0;
+	uf->fd = fd;
+}
+
+/* Last write error, cleared when read */
+int uring_file_error(struct uring_file *uf)
+{
+	int e = uf->error;
+
+	uf->error = 0;
+	return e;
+}
+
+#else /* !HAVE_IO_URING */
+
+int uring_init(unsigned entries)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+void uring_exit(void)                 { }
+int  uring_active(void)               { return 0; }
+int  uring_fd(void)                   { return -1; }
+void uring_submit(void)               { }
+void uring_reap(void)                 { }
+
+void uring_sendmsg(int sd, struct msghdr *msg, int link, int *res)
+{
+	*res = -ENOSYS;
+}
+
+struct uring_file *uring_file_new(int fd, int sync)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void uring_file_free(struct uring_file *uf)  { }
+int  uring_file_push(struct uring_file *uf, const struct iovec *iov, int iovcnt) { return -1; }
+void uring_file_sync(struct uring_file *uf)  { }
+void uring_file_drain(struct uring_file *uf) { }
+void uring_file_setfd(struct uring_file *uf, int fd) { }
+int  uring_file_error(struct uring_file *uf) { return 0; }
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,66 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef SYSKLOGD_URING_H_
+#define SYSKLOGD_URING_H_
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define URING_ENTRIES 256	/* submission queue size */
+
+/*
+ * Optional io_uring output engine, main thread only.  Writes to files
+ * and UDP sends are queued and submitted together by uring_submit(),
+ * once per main loop iteration.  Without io_uring support in the build,
+ * or the kernel, uring_init() fails and the classic path is used.
+ */
+struct uring_file;
+
+int                uring_init      (unsigned entries);
+void               uring_exit      (void);
+int                uring_active    (void);
+int                uring_fd        (void);
+
+void               uring_submit    (void);
+void               uring_reap      (void);
+void               uring_sendmsg   (int sd, struct msghdr *msg, int link, int *res);
+
+struct uring_file *uring_file_new  (int fd, int sync);
+void               uring_file_free (struct uring_file *uf);
+
+int                uring_file_push (struct uring_file *uf, const struct iovec *iov, int iovcnt);
+void               uring_file_sync (struct uring_file *uf);
+void               uring_file_drain(struct uring_file *uf);
+void               uring_file_setfd(struct uring_file *uf, int fd);
+int                uring_file_error(struct uring_file *uf);
+
+#endif /* SYSKLOGD_URING_H_ */
@@ -0,0 +1,384 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <paths.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utmp.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include "queue.h"
+#include "wall.h"
+
+#ifndef _PATH_UTMP
+#define _PATH_UTMP "/var/run/utmp"
+#endif
+
+#define NAMESZ sizeof(((struct utmp *)0)->ut_name)
+#define LINESZ sizeof(((struct utmp *)0)->ut_line)
+
+/*
+ * Messages to logged in users are written by a helper thread, started
+ * on first use, so an emergency storm does not fork the daemon for each
+ * message.  The list of logged in users is cached by the helper, and
+ * only read again from utmp when it has changed.  Terminals are opened
+ * non-blocking, a message to a stuck terminal is lost for that user.
+ */
+struct msg {
+	TAILQ_ENTRY(msg) link;
+	char		*users;		/* NUL separated, or NULL for all */
+	size_t		 len;
+	char		 data[];
+};
+
+struct tty {
+	char name[NAMESZ + 1];
+	char line[LINESZ + 1];
+};
+
+static TAILQ_HEAD(, msg)  msgs = TAILQ_HEAD_INITIALIZER(msgs);
+static size_t             nmsgs;
+static uint64_t           drops;
+
+static pthread_mutex_t    lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t     cond = PTHREAD_COND_INITIALIZER; /* new message, or stop */
+static pthread_t          tid;
+static int                running, stop;
+
+/* Helper thread only */
+static struct tty        *ttys;
+static size_t             nttys;
+static int                stale = 1;	/* read utmp before next message */
+static int                ifd = -1;
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* Watch the directory, utmp may be replaced, not only written to */
+static void watch_init(void)
+{
+	char path[] = _PATH_UTMP;
+
+	ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ifd == -1)
+		return;
+
+	if (inotify_add_watch(ifd, dirname(path), IN_MODIFY | IN_CLOSE_WRITE |
+			      IN_CREATE | IN_DELETE | IN_MOVED_TO) == -1) {
+		close(ifd);
+		ifd = -1;
+	}
+}
+
+static void watch_check(void)
+{
+	char path[] = _PATH_UTMP;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const char *name;
+	ssize_t len;
+
+	if (ifd == -1) {
+		stale = 1;
+		return;
+	}
+
+	name = basename(path);
+	while ((len = read(ifd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + len; ) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+
+			if (ev->mask & IN_Q_OVERFLOW)
+				stale = 1;
+			else if (ev->len && !strcmp(ev->name, name))
+				stale = 1;
+			p += sizeof(*ev) + ev->len;
+		}
+	}
+}
+#else
+static struct stat        utmp_st;
+
+static void watch_init(void)
+{
+}
+
+/* No inotify, compare modification time and size of utmp instead */
+static void watch_check(void)
+{
+	struct stat st;
+
+	if (stat(_PATH_UTMP, &st)) {
+		stale = 1;
+		return;
+	}
+
+	if (st.st_mtime != utmp_st.st_mtime || st.st_size != utmp_st.st_size ||
+	    st.st_ino != utmp_st.st_ino)
+		stale = 1;
+	utmp_st = st;
+}
+#endif
+
+static void refresh(void)
+{
+	struct utmp *ut;
+	size_t max = 0;
+
+	nttys = 0;
+	setutent();
+	while ((ut = getutent())) {
+		struct tty *t;
+
+		if (ut->ut_name[0] == '\0' || ut->ut_type != USER_PROCESS)
+			continue;
+		if (!strncmp(ut->ut_name, "LOGIN", NAMESZ)) /* paranoia */
+			continue;
+
+		if (nttys == max) {
+			max = max ? max * 2 : 16;
+			t = realloc(ttys, max * sizeof(*t));
+			if (!t)
+				break;
+			ttys = t;
+		}
+
+		t = &ttys[nttys++];
+		memcpy(t->name, ut->ut_name, NAMESZ);
+		t->name[NAMESZ] = 0;
+		memcpy(t->line, ut->ut_line, LINESZ);
+		t->line[LINESZ] = 0;
+	}
+	endutent();
+
+	stale = 0;
+}
+
+static int wanted(const struct msg *m, const struct tty *t)
+{
+	if (!m->users)
+		return 1;
+
+	for (const char *u = m->users; *u; u += strlen(u) + 1) {
+		if (!strncmp(u, t->name, NAMESZ))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void deliver(const struct msg *m)
+{
+	watch_check();
+	if (stale)
+		refresh();
+
+	for (size_t i = 0; i < nttys; i++) {
+		char path[sizeof(_PATH_DEV) + LINESZ + 1];
+		struct stat st;
+		int fd;
+
+		if (!wanted(m, &ttys[i]))
+			continue;
+
+		snprintf(path, sizeof(path), "%s%s", _PATH_DEV, ttys[i].line);
+		fd = open(path, O_WRONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+		if (fd == -1)
+			continue;
+
+		if (!fstat(fd, &st) && (st.st_mode & S_IWRITE))
+			(void)write(fd, m->data, m->len);
+		close(fd);
+	}
+}
+
+static void *helper(void *arg)
+{
+	(void)arg;
+
+	watch_init();
+
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		struct msg *m;
+
+		while (!stop && TAILQ_EMPTY(&msgs))
+			pthread_cond_wait(&cond, &lock);
+		if (stop)
+			break;
+
+		m = TAILQ_FIRST(&msgs);
+		TAILQ_REMOVE(&msgs, m, link);
+		nmsgs--;
+		pthread_mutex_unlock(&lock);
+
+		deliver(m);
+		free(m);
+
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
+}
+
+static int start(void)
+{
+	sigset_t all, old;
+	int rc;
+
+	if (running)
+		return 0;
+
+	/* Signals are handled by the main thread only */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	stop = 0;
+	rc = pthread_create(&tid, NULL, helper, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc)
+		return -1;
+
+	running = 1;
+
+	return 0;
+}
+
+/*
+ * Queue message for the terminals of all users, or the num users given.
+ * Returns -1 if the queue is full, or out of memory, the message is then
+ * dropped.
+ */
+int wall_send(const char *const *users, size_t num, const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0, ulen = 0;
+	struct msg *m;
+	char *p;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (users) {
+		for (size_t i = 0; i < num; i++)
+			ulen += strlen(users[i]) + 1;
+		ulen++;
+	}
+
+	m = malloc(sizeof(*m) + len + ulen);
+	if (!m)
+		goto fail;
+
+	m->len = len;
+	p = m->data;
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	m->users = NULL;
+	if (users) {
+		m->users = p;
+		for (size_t i = 0; i < num; i++) {
+			size_t n = strlen(users[i]) + 1;
+
+			memcpy(p, users[i], n);
+			p += n;
+		}
+		*p = 0;
+	}
+
+	pthread_mutex_lock(&lock);
+	if (nmsgs >= WALL_QUEUE || start()) {
+		pthread_mutex_unlock(&lock);
+		free(m);
+		goto fail;
+	}
+	TAILQ_INSERT_TAIL(&msgs, m, link);
+	nmsgs++;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+fail:
+	pthread_mutex_lock(&lock);
+	drops++;
+	pthread_mutex_unlock(&lock);
+
+	return -1;
+}
+
+void wall_exit(void)
+{
+	struct msg *m, *next;
+
+	if (!running)
+		return;
+
+	pthread_mutex_lock(&lock);
+	running = 0;
+	stop = 1;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(tid, NULL);
+
+	TAILQ_FOREACH_SAFE(m, &msgs, link, next)
+		free(m);
+	TAILQ_INIT(&msgs);
+	nmsgs = 0;
+
+	free(ttys);
+	ttys = NULL;
+	nttys = 0;
+	stale = 1;
+	if (ifd != -1)
+		close(ifd);
+	ifd = -1;
+}
+
+/* Messages dropped since last call */
+uint64_t wall_drops(void)
+{
+	uint64_t num;
+
+	pthread_mutex_lock(&lock);
+	num = drops;
+	drops = 0;
+	pthread_mutex_unlock(&lock);
+
+	return num;
+}
@@ -0,0 +1,56 @@
+#!/bin/sh
+# Test the compiled -a allow-list, first a secondary syslogd with rules
+# that do not match the forwarding peer, then one where a CIDR rule does,
+# and one where only a domain name rule does, from the first datagram.
+# shellcheck disable=SC1090
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+
+. ${srcdir}/lib.sh
+setup -m0
+
+cat <<EOF >"${CONFD}/fwd.conf"
+kern.*		/dev/null
+ntp.*		@127.0.0.2:${PORT2}	;RFC5424
+EOF
+
+reload
+
+cat <<EOF >"${CONFD2}/50-default.conf"
+kern.*		/dev/null
+*.*;kern.none	${LOG2}			;RFC5424
+EOF
+
+rm -f "${LOG2}"
+setup2 -m0 -a 10.0.0.0/8 -a 127.0.0.2:1 -a "[::1]" -a "*.example.com" -b ":${PORT2}"
+
+print "TEST: Rejected"
+logger -t allow -p ntp.notice -m "NTP1" "not allowed"
+sleep 3
+grep "allow - NTP1 - not allowed" "${LOG2}" && FAIL "Rejected peer logged."
+
+kill "$(cat "${PID2}")"
+sleep 1
+rm -f "${PID2}"
+
+setup2 -m0 -a 10.0.0.0/8 -a 127.0.0.2:1 -a "*.example.com" -a 127.0.0.0/24:* -b ":${PORT2}"
+
+print "TEST: Accepted"
+logger -t allow -p ntp.notice -m "NTP2" "allowed"
+sleep 3
+grep "allow - NTP2 - allowed" "${LOG2}" || FAIL "Allowed peer not logged."
+
+kill "$(cat "${PID2}")"
+sleep 1
+rm -f "${PID2}"
+
+setup2 -m0 -a 10.0.0.0/8 -a "localhost*:*" -b ":${PORT2}"
+
+print "TEST: Accepted by name"
+logger -t allow -p ntp.notice -m "NTP3" "allowed by name"
+sleep 3
+grep "allow - NTP3 - allowed by name" "${LOG2}" || FAIL "Peer allowed by name not logged."
+
+OK
@@ -1,22 +1,56 @@
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "syslog.h"
 
+#define THREADS 8
+#define NUMMSG  50
+
+static char *msg;
+
+static void *worker(void *arg)
+{
+	long id = (long)arg;
+	int i;
+
+	for (i = 0; i < NUMMSG; i++)
+		syslog(LOG_NOTICE, "%s-%ld-%d", msg, id, i);
+
+	return NULL;
+}
+
+static void threads(void)
+{
+	pthread_t tid[THREADS];
+	long i;
+
+	for (i = 0; i < THREADS; i++)
+		pthread_create(&tid[i], NULL, worker, (void *)i);
+	for (i = 0; i < THREADS; i++)
+		pthread_join(tid[i], NULL);
+}
+
 int main(int argc, char *argv[])
 {
 	char *ident = NULL;
-	char *msg = getenv("MSG");
 	char c;
+	int logopt = LOG_NOWAIT;
+	int mt = 0;
 	int severity = LOG_NOTICE;
 	int facility = LOG_CONSOLE;
 	int v1 = 0;
 
+	msg = getenv("MSG");
 	if (!msg)
 		return 1;
 
-	while ((c = getopt(argc, argv, "i:lp")) != EOF) {
+	while ((c = getopt(argc, argv, "ai:lpt")) != EOF) {
 		switch (c) {
+		case 'a':
+			logopt |= LOG_ASYNC;
+			break;
+
 		case 'i':
 			ident = optarg;
 			break;
@@ -30,13 +64,19 @@ int main(int argc, char *argv[])
 			v1 = 1;
 			facility = LOG_FTP;
 			break;
+
+		case 't':
+			mt = 1;
+			break;
 		}
 	}
 
 	if (ident)
-		openlog(ident, LOG_NOWAIT, facility);
+		openlog(ident, logopt, facility);
 
-	if (v1)
+	if (mt)
+		threads();
+	else if (v1)
 		syslogp(severity, "MSGID", NULL, "%s", msg);
 	else
 		syslog(severity, "%s", msg);
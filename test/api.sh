@@ -41,4 +41,14 @@ print "Phase 4 - Verify RFC5424 API with logger(1)"
 sleep 2
 grep "exampleSDID@32473" "${LOGV1}" || (echo "== ${LOGV1}"; tail -10  "${LOGV1}"; FAIL "Cannot find exampleSDID@32473")
 
+print "Phase 5 - syslog() from many threads, sync and LOG_ASYNC"
+MSG=threads ./api -i mt -t
+MSG=async ./api -i mt -a -t
+sleep 2
+num=$(grep -c "mt: threads-" "${LOGCONS}")
+[ "$num" -eq 400 ] || FAIL "Lost messages from threads: $num/400"
+num=$(grep -c "mt: async-" "${LOGCONS}")
+[ "$num" -eq 400 ] || FAIL "Lost messages in async mode: $num/400"
+grep "mt: async-7-49" "${LOGCONS}" || FAIL "Missing last async message"
+
 OK
@@ -0,0 +1,72 @@
+#!/bin/sh
+# Benchmark harness, run with 'make bench', not part of 'make check'.
+# Runs the microbenchmarks, then loadgen against syslogd over UNIX and
+# UDP, RFC3164 and RFC5424, reporting sustained rate, loss and latency.
+#
+# Environment, all optional:
+#   BENCH_CONF     .conf file to benchmark, in addition to the file the
+#                  load generator reads back from
+#   BENCH_COUNT    messages per run, default: 200000
+#   BENCH_RATE     total messages/sec, default: as fast as possible
+#   BENCH_THREADS  sender threads, default: 4
+#   BENCH_SIZE     approximate message size, default: 100
+# shellcheck disable=SC1090
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+. ${srcdir}/lib.sh
+
+[ -x ./loadgen ] && [ -x ./microbench ] || SKIP 'loadgen or microbench missing'
+
+BLOG=${DIR}/${NM}.log
+MCONF=${DIR}/${NM}-micro.conf
+COUNT=${BENCH_COUNT:-200000}
+RATE=${BENCH_RATE:-0}
+THREADS=${BENCH_THREADS:-4}
+SIZE=${BENCH_SIZE:-100}
+rm -f "${BLOG}"
+
+cat <<EOF > "${CONF}"
+include ${CONFD}/*.conf
+EOF
+cat <<EOF > "${CONFD}/bench.conf"
+local0.*	-${BLOG}
+EOF
+if [ -n "${BENCH_CONF}" ]; then
+	cp "${BENCH_CONF}" "${CONFD}/user.conf" || FAIL "Cannot read ${BENCH_CONF}"
+	cp "${BENCH_CONF}" "${MCONF}"
+else
+	cat <<-EOF > "${MCONF}"
+		*.*;auth,authpriv.none	-/dev/null
+		auth,authpriv.*		/dev/null
+		mail.*			-/dev/null
+		*.=debug		-/dev/null
+		EOF
+fi
+
+print "Microbenchmarks"
+./microbench -f "${MCONF}" || FAIL "Microbenchmarks failed"
+
+ip link set lo up 2>/dev/null
+print "Starting syslogd ..."
+../src/syslogd -F -K -n -m0 -b ":${PORT}" -f "${CONF}" -p "${SOCK}" \
+	       -C "${CACHE}" -P "${PID}" &
+echo $! >> "$DIR/PIDs"
+sleep 2
+[ -f "${PID}" ] || FAIL "Failed starting syslogd"
+touch "${BLOG}"
+
+rc=0
+for dst in "-u ${SOCK}" "-H 127.0.0.1 -P ${PORT}"; do
+	for fmt in "" "-5"; do
+		print "Load: $dst $fmt"
+		# shellcheck disable=SC2086
+		./loadgen $dst $fmt -T "${THREADS}" -n "${COUNT}" -r "${RATE}" \
+			  -s "${SIZE}" -F "${BLOG}" || rc=1
+		: > "${BLOG}"
+	done
+done
+
+[ $rc -eq 0 ] || print "Messages were lost, see above"
+OK
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Test buffered file writes and group fdatasync(): lines must reach the
+# file within the max latency, and be flushed on rotation and reload.
+# shellcheck disable=SC1090
+set -x
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+. ${srcdir}/lib.sh
+
+[ -x ../src/logger ] || SKIP 'logger missing'
+
+BLOG=${DIR}/${NM}-buffer.log
+SLOG=${DIR}/${NM}-sync.log
+rm -f "${BLOG}"* "${SLOG}"
+
+cat <<EOF > ${CONFD}/buffer.conf
+sync_interval 2
+*.*       -${BLOG}   ;rotate=10M:2,buffer=64k:5
+*.*       ${SLOG}    ;buffer=4k:1
+EOF
+
+setup
+
+for i in $(seq 1 20); do
+	logger "buffered-$i"
+done
+sleep 7
+
+for i in $(seq 1 20); do
+	grep "buffered-$i\$" "${BLOG}" || FAIL "Missing buffered message $i"
+	grep "buffered-$i\$" "${SLOG}" || FAIL "Missing synced message $i"
+done
+
+# Max latency is 5 sec, so only the rotation can flush this one
+logger "buffered-rotate"
+sleep 0.5
+kill -USR2 `cat ${PID}`
+sleep 1
+[ -f "${BLOG}.0" ] && grep "buffered-rotate" "${BLOG}.0" || FAIL 'Not flushed on rotation'
+
+logger "buffered-reload"
+sleep 0.5
+reload
+grep "buffered-reload" "${BLOG}" || FAIL 'Not flushed on reload'
+
+OK
@@ -0,0 +1,78 @@
+#!/bin/sh
+# Test rotation on size and background compression of rotated files,
+# gzip with a custom level, rotations in quick succession, recovery of
+# files left behind by a previous run, and zstd if built in.
+# shellcheck disable=SC1090
+set -x
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+. ${srcdir}/lib.sh
+
+[ -x ../src/logger ] || SKIP 'logger missing'
+command -v zgrep >/dev/null 2>&1 || SKIP 'zgrep(1) missing'
+
+CLOG=${DIR}/${NM}-compress.log
+rm -f "${CLOG}"*
+
+cat <<EOF > ${CONFD}/compress.conf
+rotate_compress gzip:9
+*.*       -${CLOG}   ;rotate=10k:3
+EOF
+
+echo "compress-leftover" > "${CLOG}.0.7"
+setup
+
+print "TEST: Left behind"
+sleep 1
+[ -f "${CLOG}.0.7" ] && FAIL 'File left behind not rotated'
+zgrep "compress-leftover" "${CLOG}.1.gz" || FAIL 'File left behind not compressed'
+
+print "TEST: Rotate on size"
+for i in $(seq 1 150); do
+	logger "compress-$i padding the log file to reach the rotation size quickly ......"
+done
+sleep 1
+[ -f "${CLOG}.0" ] || FAIL 'Not rotated on size'
+
+print "TEST: gzip"
+logger "compress-gzip"
+kill -USR2 `cat ${PID}`
+sleep 2
+[ -f "${CLOG}.1.gz" ] || FAIL 'Not compressed'
+[ -f "${CLOG}.1" ] && FAIL 'Uncompressed file left'
+zgrep "compress-1 " "${CLOG}.1.gz" || FAIL 'Missing message in compressed file'
+
+print "TEST: Back-to-back rotations"
+for i in 1 2 3 4 5; do
+	logger "compress-burst-$i"
+	sleep 0.3
+	kill -USR2 `cat ${PID}`
+	sleep 0.3
+done
+sleep 2
+ls "${CLOG}".0.* 2>/dev/null && FAIL 'Rotated files left behind'
+grep "compress-burst-5" "${CLOG}.0"    || FAIL 'Missing last message in .0'
+zgrep "compress-burst-4" "${CLOG}.1.gz" || FAIL 'Wrong order in .1.gz'
+zgrep "compress-burst-3" "${CLOG}.2.gz" || FAIL 'Wrong order in .2.gz'
+
+grep -q "define HAVE_ZSTD 1" ../config.h || OK
+command -v zstd >/dev/null 2>&1 || OK
+
+print "TEST: zstd"
+cat <<EOF > ${CONFD}/compress.conf
+rotate_compress zstd:3
+*.*       -${CLOG}   ;rotate=10k:3
+EOF
+reload
+
+logger "compress-zstd"
+kill -USR2 `cat ${PID}`
+sleep 1
+kill -USR2 `cat ${PID}`
+sleep 2
+[ -f "${CLOG}.1.zst" ] || FAIL 'Not compressed with zstd'
+zstd -dc "${CLOG}.1.zst" | grep "compress-zstd" || FAIL 'Missing message in zstd file'
+
+OK
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Test duplicate suppression: repeated messages are only logged once,
+# followed by a summary when a different message arrives.
+# shellcheck disable=SC1090
+set -x
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+. ${srcdir}/lib.sh
+
+[ -x ../src/logger ] || SKIP 'logger missing'
+
+DLOG=${DIR}/${NM}-dup.log
+rm -f "${DLOG}"
+
+cat <<EOF > ${CONFD}/dup.conf
+*.*       -${DLOG}
+EOF
+
+setup
+
+for i in $(seq 1 5); do
+	logger -t dup "same old message"
+done
+logger -t dup "something different"
+logger -t dup "same old message"
+sleep 1
+
+num=$(grep -c "dup: same old message" "${DLOG}")
+[ "$num" -eq 2 ] || FAIL "Expected 2 unique lines, got $num"
+grep "last message buffered 4 times" "${DLOG}" || FAIL 'Missing repeat summary'
+grep "dup: something different" "${DLOG}" || FAIL 'Missing different message'
+
+OK
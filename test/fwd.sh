@@ -1,5 +1,6 @@
 #!/bin/sh
-# Test FWD between two syslogd, second binds 127.0.0.2:5555
+# Test FWD between two syslogd, second binds 127.0.0.2:5555, first a
+# single message then a burst, sent in batches on a connected socket
 # shellcheck disable=SC1090
 
 if [ x"${srcdir}" = x ]; then
@@ -31,4 +32,14 @@ logger -t fwd -p ntp.notice -m "NTP123" "${MSG}"
 sleep 3  # Allow message to be received, processed, and forwarded
 grep "fwd - NTP123 - ${MSG}" "${LOG2}" || FAIL "Nothing forwarded."
 
+print "TEST: Burst"
+for i in $(seq 1 50); do
+	logger -t fwd -p ntp.notice -m "BURST$i" "burst message $i"
+done
+sleep 3
+
+for i in $(seq 1 50); do
+	grep "fwd - BURST$i - burst message $i" "${LOG2}" || FAIL "Missing message $i"
+done
+
 OK
@@ -0,0 +1,470 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Load generator for syslogd: sender threads blast RFC3164 or RFC5424
+ * datagrams over UDP or a UNIX socket, at a controlled total rate, and
+ * an optional reader tails the log file the messages end up in.  Each
+ * message carries a run id, sender and sequence number, and the time
+ * it was sent, so the reader can report sustained rate, loss, and the
+ * end-to-end latency distribution, from send() until read back.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAXMSG  2048
+#define TAG     "bench"
+
+struct sender {
+	pthread_t	 tid;
+	int		 id;
+	int		 sd;
+	uint64_t	 count;		/* messages to send */
+	uint64_t	 sent;
+	uint64_t	 errors;
+};
+
+static int      rfc5424;
+static int      threads  = 4;
+static uint64_t count    = 100000;
+static uint64_t rate;			/* total messages/sec, 0: unlimited */
+static int      size     = 100;		/* approx. message size */
+static int      linger   = 2;		/* seconds to wait for stragglers */
+static char    *logfile;
+static char     runid[16];
+static char     hostname[64];
+
+static volatile int done;
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int sock_open(const char *sock, const char *host, const char *port)
+{
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM };
+	struct addrinfo *res;
+	int sd, rc;
+
+	if (sock) {
+		struct sockaddr_un sun = { .sun_family = AF_UNIX };
+
+		if (strlen(sock) >= sizeof(sun.sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		strcpy(sun.sun_path, sock);
+
+		sd = socket(AF_UNIX, SOCK_DGRAM, 0);
+		if (sd < 0)
+			return -1;
+		if (connect(sd, (struct sockaddr *)&sun, sizeof(sun))) {
+			close(sd);
+			return -1;
+		}
+		return sd;
+	}
+
+	rc = getaddrinfo(host, port, &hints, &res);
+	if (rc) {
+		fprintf(stderr, "loadgen: %s:%s: %s\n", host, port, gai_strerror(rc));
+		errno = EINVAL;
+		return -1;
+	}
+
+	sd = socket(res->ai_family, SOCK_DGRAM, 0);
+	if (sd >= 0 && connect(sd, res->ai_addr, res->ai_addrlen)) {
+		close(sd);
+		sd = -1;
+	}
+	freeaddrinfo(res);
+
+	return sd;
+}
+
+/* Date in the format of each protocol, refreshed once per second */
+static size_t date(char *buf, size_t len, time_t *last)
+{
+	static __thread char cache[40];
+	static __thread size_t clen;
+	struct timespec ts;
+	struct tm tm;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	if (ts.tv_sec != *last) {
+		*last = ts.tv_sec;
+		localtime_r(&ts.tv_sec, &tm);
+		clen = strftime(cache, sizeof(cache), rfc5424
+				? "%Y-%m-%dT%H:%M:%S%z" : "%b %e %H:%M:%S", &tm);
+		if (rfc5424 && clen == 24) {
+			/* RFC 5424 wants a colon in the zone offset */
+			memmove(&cache[23], &cache[22], 3);
+			cache[22] = ':';
+			clen++;
+		}
+	}
+
+	if (clen >= len)
+		return 0;
+	memcpy(buf, cache, clen + 1);
+
+	return clen;
+}
+
+static void *sender(void *arg)
+{
+	struct sender *s = arg;
+	char pad[MAXMSG], buf[MAXMSG], ts[48];
+	uint64_t start, interval = 0;
+	time_t last = 0;
+	int padlen;
+
+	padlen = size - 40;
+	if (padlen < 0)
+		padlen = 0;
+	if (padlen >= (int)sizeof(pad) - 200)
+		padlen = sizeof(pad) - 200;
+	memset(pad, 'x', padlen);
+	pad[padlen] = 0;
+
+	if (rate)
+		interval = (uint64_t)threads * 1000000000 / rate;	/* nsec */
+
+	start = now_usec();
+	for (uint64_t seq = 0; seq < s->count && !done; seq++) {
+		uint64_t t;
+		int len;
+
+		if (interval) {
+			uint64_t due = start * 1000 + seq * interval;
+			struct timespec ts_due = {
+				.tv_sec  = due / 1000000000,
+				.tv_nsec = due % 1000000000,
+			};
+
+			/* Sleep only when ahead, bursts make up for slow wakeups */
+			if (due > now_usec() * 1000 + 100000)
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts_due, NULL);
+		}
+
+		date(ts, sizeof(ts), &last);
+		t = now_usec();
+		if (rfc5424)
+			len = snprintf(buf, sizeof(buf), "<134>1 %s %s %s %d - - %s %s %d:%llu %llu %s",
+				       ts, hostname, TAG, getpid(), TAG, runid, s->id,
+				       (unsigned long long)seq, (unsigned long long)t, pad);
+		else
+			len = snprintf(buf, sizeof(buf), "<134>%s %s[%d]: %s %s %d:%llu %llu %s",
+				       ts, TAG, getpid(), TAG, runid, s->id,
+				       (unsigned long long)seq, (unsigned long long)t, pad);
+
+		while (send(s->sd, buf, len, 0) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS || errno == EAGAIN) {
+				usleep(100);
+				continue;
+			}
+			s->errors++;
+			break;
+		}
+		s->sent++;
+	}
+
+	return NULL;
+}
+
+/*
+ * Tail logfile from its current end, collect the latency of each of
+ * our messages, until all are accounted for or nothing new arrives in
+ * linger seconds after the senders are done.
+ */
+struct reader {
+	pthread_t	 tid;
+	int		 fd;
+	uint64_t	 total;		/* expected, set when senders are done */
+	uint64_t	 received;
+	uint64_t	 first, last;	/* time of first and last message read */
+	uint64_t	*lat;
+	size_t		 nlat, maxlat;
+};
+
+static void reader_line(struct reader *r, char *line, uint64_t now)
+{
+	unsigned long long seq, t;
+	char *p;
+	int id;
+
+	p = strstr(line, runid);
+	if (!p || sscanf(p + strlen(runid), " %d:%llu %llu", &id, &seq, &t) != 3)
+		return;
+	if (t > now)
+		t = now;
+
+	if (r->nlat == r->maxlat) {
+		size_t num = r->maxlat ? r->maxlat * 2 : 65536;
+		uint64_t *lat;
+
+		lat = realloc(r->lat, num * sizeof(*lat));
+		if (!lat)
+			return;
+		r->lat = lat;
+		r->maxlat = num;
+	}
+	r->lat[r->nlat++] = now - t;
+
+	if (!r->received++)
+		r->first = now;
+	r->last = now;
+}
+
+static void *reader(void *arg)
+{
+	struct reader *r = arg;
+	static char buf[1 << 20];
+	uint64_t idle = 0;
+	size_t len = 0;
+
+	for (;;) {
+		uint64_t now;
+		ssize_t num;
+		char *p, *nl;
+
+		num = read(r->fd, buf + len, sizeof(buf) - 1 - len);
+		now = now_usec();
+		if (num <= 0) {
+			uint64_t total = __atomic_load_n(&r->total, __ATOMIC_ACQUIRE);
+
+			if (total) {
+				if (r->received >= total)
+					break;
+				if (!idle)
+					idle = now;
+				else if (now - idle > (uint64_t)linger * 1000000)
+					break;
+			}
+			usleep(200);
+			continue;
+		}
+		idle = 0;
+
+		len += num;
+		buf[len] = 0;
+		for (p = buf; (nl = strchr(p, '\n')); p = nl + 1) {
+			*nl = 0;
+			reader_line(r, p, now);
+		}
+		len -= p - buf;
+		memmove(buf, p, len);
+		if (len == sizeof(buf) - 1)
+			len = 0;	/* unterminated, just drop it */
+	}
+
+	return NULL;
+}
+
+static int cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double pct(struct reader *r, double p)
+{
+	size_t i;
+
+	if (!r->nlat)
+		return 0;
+
+	i = (size_t)(p * r->nlat);
+	if (i >= r->nlat)
+		i = r->nlat - 1;
+
+	return r->lat[i] / 1000.0;
+}
+
+static int usage(int code)
+{
+	printf("Usage: loadgen [-5h] [-u SOCK | -H HOST [-P PORT]] [-T THREADS] [-n COUNT]\n"
+	       "               [-r RATE] [-s SIZE] [-F LOGFILE] [-w SEC]\n"
+	       "\n"
+	       "  -5          Send RFC5424 messages, default RFC3164\n"
+	       "  -F LOGFILE  Read back messages from LOGFILE, report loss and latency\n"
+	       "  -H HOST     Send UDP to HOST, default port 514\n"
+	       "  -h          This help text\n"
+	       "  -n COUNT    Total number of messages, default: 100000\n"
+	       "  -P PORT     UDP port, or service name\n"
+	       "  -r RATE     Total messages/sec, default: as fast as possible\n"
+	       "  -s SIZE     Approximate size of message text, default: 100\n"
+	       "  -T THREADS  Number of sender threads, default: 4\n"
+	       "  -u SOCK     Send to UNIX socket SOCK\n"
+	       "  -w SEC      Wait for stragglers when reading back, default: 2\n");
+
+	return code;
+}
+
+int main(int argc, char *argv[])
+{
+	struct reader r = { .fd = -1 };
+	char *sock = NULL, *host = NULL, *port = "514";
+	uint64_t start, elapsed, sent = 0, errors = 0;
+	struct sender *s;
+	int c;
+
+	while ((c = getopt(argc, argv, "5F:hH:n:P:r:s:T:u:w:")) != EOF) {
+		switch (c) {
+		case '5':
+			rfc5424 = 1;
+			break;
+		case 'F':
+			logfile = optarg;
+			break;
+		case 'H':
+			host = optarg;
+			break;
+		case 'h':
+			return usage(0);
+		case 'n':
+			count = strtoull(optarg, NULL, 0);
+			break;
+		case 'P':
+			port = optarg;
+			break;
+		case 'r':
+			rate = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 'T':
+			threads = atoi(optarg);
+			break;
+		case 'u':
+			sock = optarg;
+			break;
+		case 'w':
+			linger = atoi(optarg);
+			break;
+		default:
+			return usage(1);
+		}
+	}
+
+	if ((!sock && !host) || threads < 1 || !count)
+		return usage(1);
+
+	gethostname(hostname, sizeof(hostname));
+	snprintf(runid, sizeof(runid), "%08lx", (unsigned long)(now_usec() ^ getpid()));
+
+	if (logfile) {
+		r.fd = open(logfile, O_RDONLY);
+		if (r.fd < 0) {
+			perror(logfile);
+			return 1;
+		}
+		lseek(r.fd, 0, SEEK_END);
+		if (pthread_create(&r.tid, NULL, reader, &r)) {
+			perror("reader");
+			return 1;
+		}
+	}
+
+	s = calloc(threads, sizeof(*s));
+	if (!s)
+		return 1;
+
+	start = now_usec();
+	for (int i = 0; i < threads; i++) {
+		s[i].id    = i;
+		s[i].count = count / threads + (i < (int)(count % threads));
+		s[i].sd    = sock_open(sock, host, port);
+		if (s[i].sd < 0) {
+			perror(sock ?: host);
+			return 1;
+		}
+		if (pthread_create(&s[i].tid, NULL, sender, &s[i])) {
+			perror("sender");
+			return 1;
+		}
+	}
+
+	for (int i = 0; i < threads; i++) {
+		pthread_join(s[i].tid, NULL);
+		close(s[i].sd);
+		sent   += s[i].sent;
+		errors += s[i].errors;
+	}
+	elapsed = now_usec() - start;
+
+	printf("%-10s %s over %s, %d threads, %d byte messages\n", "mode:",
+	       rfc5424 ? "RFC5424" : "RFC3164", sock ? "UNIX" : "UDP", threads, size);
+	printf("%-10s %llu msgs in %.3f sec, %.0f msgs/s, %llu errors\n", "sent:",
+	       (unsigned long long)sent, elapsed / 1e6,
+	       elapsed ? sent * 1e6 / elapsed : 0.0, (unsigned long long)errors);
+
+	if (!logfile)
+		return 0;
+
+	__atomic_store_n(&r.total, sent, __ATOMIC_RELEASE);
+	pthread_join(r.tid, NULL);
+	close(r.fd);
+
+	elapsed = r.last > start ? r.last - start : 0;
+	printf("%-10s %llu msgs, %.0f msgs/s sustained, %.3f%% loss\n", "received:",
+	       (unsigned long long)r.received,
+	       elapsed ? r.received * 1e6 / elapsed : 0.0,
+	       sent ? 100.0 * (sent > r.received ? sent - r.received : 0) / sent : 0.0);
+
+	qsort(r.lat, r.nlat, sizeof(r.lat[0]), cmp);
+	printf("%-10s p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n", "latency:",
+	       pct(&r, 0.50), pct(&r, 0.99), pct(&r, 0.999),
+	       r.nlat ? r.lat[r.nlat - 1] / 1000.0 : 0.0);
+	free(r.lat);
+	free(s);
+
+	return r.received < sent;
+}
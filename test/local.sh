@@ -19,4 +19,10 @@ grep ${MSG} "${LOG}" || FAIL "Cannot find: ${MSG}"
 logger "${ALTSOCK}" ${MSG2}
 grep ${MSG2} "${LOG}" || FAIL "Cannot find: ${MSG2}"
 
+# Control characters are escaped, the rest of the message is kept
+MSG3="$(printf 'ctrl\001char')"
+logger "${MSG3}"
+sleep 1
+grep -F 'ctrl^Achar' "${LOG}" || FAIL "Control character not escaped"
+
 OK
@@ -0,0 +1,71 @@
+#!/bin/sh
+# Test the metrics control socket: counters for received and logged
+# messages, per-action writes, the latency histogram, and the startup
+# phases, in both the Prometheus text format and JSON.
+# shellcheck disable=SC1090
+set -x
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+. ${srcdir}/lib.sh
+
+command -v curl >/dev/null 2>&1 || SKIP 'curl(1) missing'
+
+MSOCK=${DIR}/${NM}-metrics.sock
+MLOG=${DIR}/${NM}-metrics.log
+OUT=${DIR}/${NM}-metrics.out
+rm -f "${MLOG}" "${OUT}"
+
+cat <<EOF > ${CONFD}/metrics.conf
+metrics_socket	${MSOCK}
+local4.*	-${MLOG}
+local5.*	@localhost:${PORT2}
+EOF
+
+setup
+
+for i in $(seq 1 10); do
+	logger -p local4.info "metrics-$i"
+done
+logger -p local4.info "metrics-dup"
+logger -p local4.info "metrics-dup"
+sleep 1
+
+print "TEST: Prometheus"
+curl -sf --unix-socket "${MSOCK}" http://localhost/metrics >"${OUT}" || FAIL "No reply"
+cat "${OUT}"
+grep -q '^# TYPE syslogd_received_total counter' "${OUT}" || FAIL "Missing TYPE"
+num=$(sed -n 's/^syslogd_received_total{source="unix"} //p' "${OUT}")
+[ "${num:-0}" -ge 12 ] || FAIL "Too few received, got $num"
+grep -qE "^syslogd_action_writes_total\{action=\"${MLOG}\"\} 11\$" "${OUT}" \
+	|| FAIL "Wrong number of writes to ${MLOG}"
+grep -qE "^syslogd_action_duplicates_total\{action=\"${MLOG}\"\} 1\$" "${OUT}" \
+	|| FAIL "Duplicate not counted"
+grep -q '^syslogd_latency_seconds_bucket{le="+Inf"} ' "${OUT}" || FAIL "Missing histogram"
+num=$(sed -n 's/^syslogd_latency_seconds_count //p' "${OUT}")
+[ "${num:-0}" -ge 12 ] || FAIL "Latency not observed, got $num"
+for phase in config sockets actions kernel ready resolve; do
+	grep -qE "^syslogd_startup_seconds\{phase=\"${phase}\"\} [0-9.]+\$" "${OUT}" \
+		|| FAIL "Missing startup phase ${phase}"
+done
+grep -qE '^syslogd_startup_seconds\{phase="ready"\} 0\.000000$' "${OUT}" \
+	&& FAIL "Startup time not recorded"
+
+print "TEST: JSON"
+curl -sf --unix-socket "${MSOCK}" http://localhost/metrics.json >"${OUT}" || FAIL "No reply"
+cat "${OUT}"
+if command -v python3 >/dev/null 2>&1; then
+	python3 -c "import json,sys; d=json.load(open(sys.argv[1])); \
+assert d['action_writes_total'][sys.argv[2]] == 11; \
+assert d['startup_usec']['ready'] > 0 and d['startup_usec']['resolve'] > 0" "${OUT}" "${MLOG}" \
+		|| FAIL "Invalid JSON"
+else
+	grep -q "\"${MLOG}\": 11" "${OUT}" || FAIL "Wrong number of writes in JSON"
+fi
+
+print "TEST: Unknown request"
+curl -s -o /dev/null -w '%{http_code}' --unix-socket "${MSOCK}" http://localhost/foo \
+	| grep -q 404 || FAIL "Expected 404"
+
+OK
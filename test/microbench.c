@@ -0,0 +1,251 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (C) 2022  Joachim Wiberg <troglobit@gmail.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmarks for the syslogd hot paths.  The daemon is included
+ * as-is, with its main() renamed, to reach the static functions: the
+ * parser, routing of a parsed message to the actions of a .conf file,
+ * the output formatters, and the peer ACL check.
+ */
+
+#define main syslogd_main
+#include "syslogd.c"
+#undef main
+
+#define MSG3164 "<134>Oct 14 10:20:30 myhost app[1234]: Lorem ipsum dolor sit amet, " \
+		"consectetur adipiscing elit, sed do eiusmod tempor incididunt"
+#define MSG5424 "<134>1 2026-10-14T10:20:30.123456+02:00 myhost app 1234 ID47 "	\
+		"[exampleSDID@32473 iut=\"3\" eventSource=\"Application\"] "	\
+		"Lorem ipsum dolor sit amet, consectetur adipiscing elit"
+
+struct bench {
+	const char *name;
+	void      (*fn)(uint64_t num);
+};
+
+static struct buf_msg bm;
+static char bmline[MAXLINE + 1];
+static char bmdata[MAXLINE + 1];
+static volatile int sink;
+
+static uint64_t nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The parser works in place, so the copy is part of the cost */
+static void parse(const char *msg, uint64_t num)
+{
+	struct buf_msg buffer;
+	char line[MAXLINE + 1];
+	char buf[MAXLINE + 1];
+	size_t len = strlen(msg) + 1;
+
+	for (uint64_t i = 0; i < num; i++) {
+		memcpy(buf, msg, len);
+		sink += parsemsg_buf("192.0.2.1", buf, &buffer, line);
+	}
+}
+
+static void bench_parse3164(uint64_t num)
+{
+	parse(MSG3164, num);
+}
+
+static void bench_parse5424(uint64_t num)
+{
+	parse(MSG5424, num);
+}
+
+/* Unique message text, or the duplicate suppression kicks in */
+static void bench_logmsg(uint64_t num)
+{
+	char *saved = bm.msg;
+	char msg[128];
+
+	bm.msg = msg;
+	for (uint64_t i = 0; i < num; i++) {
+		snprintf(msg, sizeof(msg), "Lorem ipsum dolor sit amet %" PRIu64, i);
+		bm.pri = LOG_MAKEPRI(LOG_FAC(i % LOG_NFACILITIES) << 3, i % 8);
+		bm.rxtime = 0;
+		logmsg(&bm);
+	}
+	bm.msg = saved;
+}
+
+static void bench_fmt5424(uint64_t num)
+{
+	struct fmtbuf fb;
+
+	for (uint64_t i = 0; i < num; i++) {
+		bm.timestamp.usec = i % 1000000;
+		sink += fmt5424(&bm, RFC5424_DATEFMT, &fb);
+	}
+}
+
+static void bench_fmt3164(uint64_t num)
+{
+	struct fmtbuf fb;
+
+	for (uint64_t i = 0; i < num; i++)
+		sink += fmt3164(&bm, RFC3164_DATEFMT, &fb);
+}
+
+static void bench_validate(uint64_t num, const char *addr)
+{
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_port   = htons(514),
+	};
+
+	inet_pton(AF_INET, addr, &sin.sin_addr);
+	for (uint64_t i = 0; i < num; i++)
+		sink += validate((struct sockaddr *)&sin, addr);
+}
+
+static void bench_validate_hit(uint64_t num)
+{
+	bench_validate(num, "192.168.1.10");
+}
+
+static void bench_validate_miss(uint64_t num)
+{
+	bench_validate(num, "203.0.113.7");
+}
+
+static const struct bench benches[] = {
+	{ "parsemsg-rfc3164", bench_parse3164     },
+	{ "parsemsg-rfc5424", bench_parse5424     },
+	{ "logmsg",           bench_logmsg        },
+	{ "fmt5424",          bench_fmt5424       },
+	{ "fmt3164",          bench_fmt3164       },
+	{ "validate-hit",     bench_validate_hit  },
+	{ "validate-miss",    bench_validate_miss },
+};
+
+/*
+ * Run in rounds, doubling the count until a round takes at least
+ * 100 ms, then report the best of a few rounds of that size.
+ */
+static void run(const struct bench *b, uint64_t num)
+{
+	uint64_t best = UINT64_MAX, t;
+
+	if (!num) {
+		for (num = 1000; ; num *= 2) {
+			t = nsec();
+			b->fn(num);
+			if (nsec() - t >= 100000000)
+				break;
+		}
+	}
+
+	for (int round = 0; round < 3; round++) {
+		t = nsec();
+		b->fn(num);
+		t = nsec() - t;
+		if (t < best)
+			best = t;
+	}
+
+	printf("%-18s %12" PRIu64 " ops %10.1f ns/op %12.0f ops/s\n", b->name, num,
+	       (double)best / num, best ? num * 1e9 / best : 0.0);
+}
+
+static int bench_usage(int code)
+{
+	printf("Usage: microbench [-h] [-f FILE] [-n NUM] [BENCH ...]\n"
+	       "\n"
+	       "  -f FILE  .conf file for logmsg routing, default: no actions\n"
+	       "  -h       This help text\n"
+	       "  -n NUM   Iterations per round, default: calibrated to 100 ms\n"
+	       "\n"
+	       "Benchmarks:");
+	for (size_t i = 0; i < NELEMS(benches); i++)
+		printf(" %s", benches[i].name);
+	printf("\n");
+
+	return code;
+}
+
+int main(int argc, char *argv[])
+{
+	char peer1[] = "192.168.0.0/16:*";
+	char peer2[] = "10.0.0.0/8:514";
+	char peer3[] = "[2001:db8::]/32:*";
+	uint64_t num = 0;
+	int c;
+
+	ConfFile = "/dev/null";
+	while ((c = getopt(argc, argv, "f:hn:")) != EOF) {
+		switch (c) {
+		case 'f':
+			ConfFile = optarg;
+			break;
+		case 'h':
+			return bench_usage(0);
+		case 'n':
+			num = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			return bench_usage(1);
+		}
+	}
+
+	/* Log to actions, not our console, and never to a terminal */
+	KernLog = 0;
+	consfile.f_type = F_CONSOLE;
+	strlcpy(consfile.f_un.f_fname, "/dev/null", sizeof(consfile.f_un.f_fname));
+	scan_init();
+	init();
+
+	allowaddr(peer1);
+	allowaddr(peer2);
+	allowaddr(peer3);
+
+	/* A parsed message for the formatters and logmsg() */
+	strlcpy(bmdata, MSG5424, sizeof(bmdata));
+	if (parsemsg_buf("192.0.2.1", bmdata, &bm, bmline))
+		errx(1, "failed parsing sample message");
+
+	for (size_t i = 0; i < NELEMS(benches); i++) {
+		int match = optind == argc;
+
+		for (int j = optind; j < argc; j++)
+			match |= !strcmp(argv[j], benches[i].name);
+		if (match)
+			run(&benches[i], num);
+	}
+
+	return 0;
+}
@@ -32,10 +32,31 @@ logger 1${MSG}
 logger 2${MSG}
 sleep 1
 
-if [ -f "${LOG}.0" ] &&
-		grep 'script 1' "${NOT1STAMP}" &&
-		grep 'script 2' "${NOT2STAMP}"; then
-	OK
-else
-	FAIL 'Notifier did not run.'
-fi
+[ -f "${LOG}.0" ] || FAIL 'Not rotated.'
+grep 'script 1' "${NOT1STAMP}" || FAIL 'Notifier 1 did not run.'
+grep 'script 2' "${NOT2STAMP}" || FAIL 'Notifier 2 did not run.'
+
+# Rotations while a notifier runs give only one more run
+print "TEST: Coalescing"
+SLOW=${DIR}/${NM}-slow.sh
+SLOWRUNS=${DIR}/${NM}-slow.runs
+rm -f "${SLOWRUNS}"
+printf '#!/bin/sh -\necho $* >> '${SLOWRUNS}'\nsleep 2\n' > ${SLOW}
+chmod 0755 ${SLOW}
+
+cat <<EOF > ${CONFD}/notifier.conf
+notify      ${SLOW}
+*.*       -${LOG}    ;rotate=1k:2,RFC5424
+EOF
+reload
+
+for i in $(seq 1 10); do
+	logger ${i}${MSG}
+	logger ${i}${i}${MSG}
+done
+sleep 5
+
+runs=$(wc -l < "${SLOWRUNS}")
+[ "$runs" -eq 2 ] || FAIL "Expected 2 notifier runs, got $runs"
+
+OK
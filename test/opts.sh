@@ -5,13 +5,16 @@ if [ x"${srcdir}" = x ]; then
 fi
 . ${srcdir}/lib.sh
 
-cat <<EOF > "${CONF}"
+cat <<EOF2 > "${CONF}"
 # Match all log messages, store in RC5424 format and rotate every 10 MiB
 *.*       -${LOG}    ;rotate=10M:5,RFC5424
-EOF
+# Several options, all should be applied
+*.*       -${LOG}.multi ;queue=100,rotate=10k:2,buffer=64k
+EOF2
 
 setup -m0 >"${LOG2}"
 
 grep ';RFC5424,rotate=10000000:5' "${LOG2}" || FAIL "Failed parsing RFC5424 .conf"
+grep ',rotate=10000:2,queue=100:.*,buffer=64000:' "${LOG2}" || FAIL "Failed parsing several options"
 
 OK
@@ -0,0 +1,49 @@
+#!/bin/sh
+# Test async output queues: a queued file action, alongside a named pipe
+# nobody reads, must get all messages, also across rotation and reload.
+# shellcheck disable=SC1090
+set -x
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+. ${srcdir}/lib.sh
+
+[ -x ../src/logger ] || SKIP 'logger missing'
+
+QLOG=${DIR}/${NM}-queue.log
+FIFO=${DIR}/${NM}.fifo
+rm -f "${QLOG}"*
+rm -f "${FIFO}"
+mkfifo "${FIFO}" || SKIP 'mkfifo(1) failed'
+
+cat <<EOF > ${CONFD}/queue.conf
+*.*       -${QLOG}   ;rotate=10M:2,queue=100
+*.*       |${FIFO}   ;queue=10:drop-newest
+EOF
+
+setup
+
+for i in $(seq 1 50); do
+	logger "queued-$i"
+done
+sleep 2
+
+for i in $(seq 1 50); do
+	grep "queued-$i\$" "${QLOG}" || FAIL "Missing queued message $i"
+done
+
+kill -USR2 `cat ${PID}`
+sleep 2
+[ -f "${QLOG}.0" ] && grep "queued-50\$" "${QLOG}.0" || FAIL 'Not rotated'
+
+logger "queued-rotated"
+sleep 1
+grep "queued-rotated" "${QLOG}" || FAIL 'Nothing after rotation'
+
+reload
+logger "queued-reload"
+sleep 1
+grep "queued-reload" "${QLOG}" || FAIL 'Nothing after reload'
+
+OK
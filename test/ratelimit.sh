@@ -0,0 +1,42 @@
+#!/bin/sh
+# Test per-source rate limiting: a flood from one process is cut at the
+# burst size, others still get through, and the number of suppressed
+# messages is reported.
+# shellcheck disable=SC1090
+set -x
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+. ${srcdir}/lib.sh
+
+[ -x ../src/logger ] || SKIP 'logger missing'
+
+RLOG=${DIR}/${NM}-ratelimit.log
+rm -f "${RLOG}"
+
+cat <<EOF > ${CONFD}/ratelimit.conf
+rate_limit	5:50
+local6.*	-${RLOG}
+EOF
+
+setup
+
+print "TEST: Flood from one process"
+seq 1 500 | sed 's/^/flood-/' | ../src/logger -S -u "${SOCK}" -t flood -p local6.info
+sleep 1
+num=$(grep -c "flood-" "${RLOG}")
+[ "$num" -ge 50 ] || FAIL "Too few messages, got $num, burst is 50"
+[ "$num" -lt 100 ] || FAIL "Not rate limited, got $num/500"
+
+print "TEST: Other sources unaffected"
+logger -p local6.info -t other "other-1"
+sleep 1
+grep -q "other-1\$" "${RLOG}" || FAIL "Message from other process suppressed"
+
+print "TEST: Summary"
+sleep 10
+grep -qE "4[0-9]{2} messages suppressed from .*[0-9]+, uid [0-9]+" "${LOG}" \
+	|| FAIL "No summary of suppressed messages"
+
+OK
@@ -0,0 +1,60 @@
+#!/bin/sh
+# Test incremental reload: actions unchanged in the new .conf keep their
+# open file, new ones are opened, removed ones are closed.
+# shellcheck disable=SC1090
+set -x
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+. ${srcdir}/lib.sh
+
+[ -x ../src/logger ] || SKIP 'logger missing'
+
+KLOG=${DIR}/${NM}-kept.log
+NLOG=${DIR}/${NM}-new.log
+rm -f "${KLOG}" "${NLOG}"
+
+cat <<EOF > ${CONFD}/reload.conf
+local4.*	-${KLOG}	;RFC5424
+EOF
+
+setup
+
+print "TEST: Before reload"
+logger -p local4.info -t reload "reload-1"
+sleep 1
+grep -q "reload-1\$" "${KLOG}" || FAIL "Missing message before reload"
+
+# Moved away, an unchanged action must keep writing to the same file
+mv "${KLOG}" "${KLOG}.old"
+
+print "TEST: Change selector, add action"
+cat <<EOF > ${CONFD}/reload.conf
+local4.*;local5.*	-${KLOG}	;RFC5424
+local5.*		-${NLOG}
+EOF
+reload
+
+logger -p local4.info -t reload "reload-2"
+logger -p local5.info -t reload "reload-3"
+sleep 1
+[ -f "${KLOG}" ] && FAIL "Unchanged action reopened"
+grep -q "reload-2\$" "${KLOG}.old" || FAIL "Missing message after reload"
+grep -q "reload-3\$" "${KLOG}.old" || FAIL "New selector not used"
+grep -q "reload-3\$" "${NLOG}"     || FAIL "New action not opened"
+
+print "TEST: Change options, remove action"
+cat <<EOF > ${CONFD}/reload.conf
+local4.*	-${KLOG}	;RFC3164
+EOF
+reload
+
+logger -p local4.info -t reload "reload-4"
+logger -p local5.info -t reload "reload-5"
+sleep 1
+grep -q "reload-4\$" "${KLOG}" || FAIL "Changed action not reopened"
+grep -q "reload-5\$" "${NLOG}" && FAIL "Removed action still logging"
+rm -f "${KLOG}.old"
+
+OK
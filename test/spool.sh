@@ -0,0 +1,60 @@
+#!/bin/sh
+# Test disk spool for a TCP forwarding target: messages logged while the
+# second syslogd is down must be replayed when it comes up, also after
+# the first has been restarted in between, and reloaded with a changed
+# spool size, which reopens the action and its spool.
+# shellcheck disable=SC1090
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+
+. ${srcdir}/lib.sh
+
+SPOOL=${DIR}/${NM}-spool
+rm -rf "${LOG2}" "${SPOOL}"
+
+cat <<EOF >"${CONFD2}/50-default.conf"
+kern.*		/dev/null
+*.*;kern.none	${LOG2}			;RFC5424
+EOF
+
+setup -m0
+
+cat <<EOF >"${CONFD}/fwd.conf"
+spool_dir	${SPOOL}
+kern.*		/dev/null
+ntp.*		@tcp://127.0.0.2:${PORT2}	;RFC5424,spool=1M:100
+EOF
+
+reload
+
+print "TEST: Spooling"
+for i in $(seq 1 20); do
+	logger -t spool -p ntp.notice -m "SPOOL$i" "spooled message $i"
+done
+sleep 2
+ls "${SPOOL}"/* >/dev/null 2>&1 || FAIL "No spool files created."
+
+print "TEST: Restart"
+reload
+logger -t spool -p ntp.notice -m "SPOOL21" "spooled after reload"
+sleep 1
+
+print "TEST: Reopen"
+sed -i 's/spool=1M:100/spool=2M:100/' "${CONFD}/fwd.conf"
+reload
+logger -t spool -p ntp.notice -m "SPOOL22" "spooled after reopen"
+sleep 1
+
+print "TEST: Replay"
+setup2 -m0 -a "127.0.0.2:*" -b "tcp://127.0.0.2:${PORT2}"
+sleep 10
+
+for i in $(seq 1 20); do
+	grep "spool - SPOOL$i - spooled message $i" "${LOG2}" || FAIL "Missing message $i"
+done
+grep "spool - SPOOL21 - spooled after reload" "${LOG2}" || FAIL "Missing message after reload"
+grep "spool - SPOOL22 - spooled after reopen" "${LOG2}" || FAIL "Missing message after reopen"
+
+OK
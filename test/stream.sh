@@ -0,0 +1,48 @@
+#!/bin/sh
+# Test logger streaming mode: many lines from stdin to syslogd, both
+# RFC5424 and RFC3164, and to a log file with rotation on size.
+# shellcheck disable=SC1090
+set -x
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+. ${srcdir}/lib.sh
+
+[ -x ../src/logger ] || SKIP 'logger missing'
+
+SLOG=${DIR}/${NM}-stream.log
+FLOG=${DIR}/${NM}-file.log
+RPT=${DIR}/${NM}-report
+rm -f "${SLOG}" "${FLOG}"*
+
+cat <<EOF > ${CONFD}/stream.conf
+local3.*	-${SLOG}	;RFC5424
+EOF
+
+setup
+
+print "TEST: Stream to syslogd"
+seq 1 5000 | sed 's/^/stream-/' | \
+	../src/logger -S -u "${SOCK}" -t stream -p local3.info -m MID 2>"${RPT}"
+cat "${RPT}"
+grep -q "5000 messages" "${RPT}" || FAIL "No throughput report"
+sleep 2
+num=$(grep -c "stream - MID - stream-" "${SLOG}")
+[ "$num" -eq 5000 ] || FAIL "Lost messages, got $num/5000"
+grep -q "stream - MID - stream-5000\$" "${SLOG}" || FAIL "Missing last message"
+
+print "TEST: Stream RFC3164"
+printf "bsd-1\nbsd-2\nbsd-3" | ../src/logger -S -b -i -u "${SOCK}" -t bsd -p local3.info
+sleep 1
+for i in 1 2 3; do
+	grep -qE "bsd [0-9]+ - - bsd-$i\$" "${SLOG}" || FAIL "Missing RFC3164 message $i"
+done
+
+print "TEST: Stream to file with rotation"
+seq 1 20000 | sed 's/^/file-/' | ../src/logger -S -t file -f "${FLOG}" -r 100k:3
+[ -f "${FLOG}.1" ] || FAIL "Not rotated"
+grep -q "file: file-20000\$" "${FLOG}" || FAIL "Missing last line in file"
+[ "$(stat -c %s "${FLOG}")" -le 110000 ] || FAIL "File not rotated on size"
+
+OK
@@ -0,0 +1,49 @@
+#!/bin/sh
+# Test FWD over TCP (RFC 6587) between two syslogd, the second listens
+# on 127.0.0.2:5555/tcp.  Also verifies reconnect when it restarts.
+# shellcheck disable=SC1090
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+
+. ${srcdir}/lib.sh
+
+rm -f "${LOG2}"
+cat <<EOF >"${CONFD2}/50-default.conf"
+kern.*		/dev/null
+*.*;kern.none	${LOG2}			;RFC5424
+EOF
+
+setup2 -m0 -a "127.0.0.2:*" -b "tcp://127.0.0.2:${PORT2}"
+setup -m0
+
+cat <<EOF >"${CONFD}/fwd.conf"
+kern.*		/dev/null
+ntp.*		@tcp://127.0.0.2:${PORT2}	;RFC5424
+EOF
+
+reload
+
+print "TEST: Starting"
+
+for i in $(seq 1 20); do
+	logger -t tcp -p ntp.notice -m "TCP$i" "tcp message $i"
+done
+sleep 3
+
+for i in $(seq 1 20); do
+	grep "tcp - TCP$i - tcp message $i" "${LOG2}" || FAIL "Missing message $i"
+done
+
+print "TEST: Reconnect"
+kill "$(cat "${PID2}")"
+sleep 1
+rm -f "${PID2}"
+setup2 -m0 -a "127.0.0.2:*" -b "tcp://127.0.0.2:${PORT2}"
+
+logger -t tcp -p ntp.notice -m "TCP21" "after reconnect"
+sleep 10
+grep "tcp - TCP21 - after reconnect" "${LOG2}" || FAIL "Nothing after reconnect."
+
+OK
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Test templated file actions: one file per host and app-name, created
+# on demand with any missing directories, at most file_cache files open
+# at a time, and rotation per file.
+# shellcheck disable=SC1090
+set -x
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+. ${srcdir}/lib.sh
+
+[ -x ../src/logger ] || SKIP 'logger missing'
+
+TDIR=${DIR}/${NM}-tmpl
+rm -rf "${TDIR}"
+
+cat <<EOF > ${CONFD}/template.conf
+file_cache	2
+local7.*	-${TDIR}/%hostname%/%app-name%.log	;rotate=2k:2
+EOF
+
+setup
+
+print "TEST: One file per app-name"
+for app in app1 app2 app3 app4; do
+	logger -p local7.info -t $app "to-$app"
+done
+logger -p local7.info -t app1 "to-app1-again"
+sleep 1
+for app in app1 app2 app3 app4; do
+	grep -q "to-$app\$" "${TDIR}"/*/$app.log || FAIL "Missing message to $app"
+done
+grep -q "to-app1-again\$" "${TDIR}"/*/app1.log || FAIL "Missing message after reopen"
+
+print "TEST: Bounded number of open files"
+num=$(ls -l /proc/"$(cat "${PID}")"/fd 2>/dev/null | grep -c "${TDIR}")
+[ "$num" -le 2 ] || FAIL "Too many open files, $num"
+
+print "TEST: Sanitized path"
+logger -p local7.info -t "../escape" "escape"
+sleep 1
+[ -f "${TDIR}/escape.log" ] && FAIL "Escaped template directory"
+grep -rq "escape\$" "${TDIR}" || FAIL "Missing sanitized message"
+
+print "TEST: Rotation"
+for i in $(seq 1 50); do
+	logger -p local7.info -t rot "rotate-$i padding the file to reach the rotation size"
+done
+sleep 1
+ls "${TDIR}"/*/rot.log.0 || FAIL "Not rotated"
+
+OK
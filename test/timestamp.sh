@@ -0,0 +1,41 @@
+#!/bin/sh
+# Test the cached date prefix: messages logged in the same second must
+# still get their own microseconds in RFC5424, and proper RFC3164 dates.
+# shellcheck disable=SC1090
+set -x
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+. ${srcdir}/lib.sh
+
+[ -x ../src/logger ] || SKIP 'logger missing'
+
+TLOG=${DIR}/${NM}-5424.log
+BLOG=${DIR}/${NM}-3164.log
+rm -f "${TLOG}" "${BLOG}"
+
+cat <<EOF > ${CONFD}/timestamp.conf
+*.*       -${TLOG}   ;RFC5424
+*.*       -${BLOG}   ;RFC3164
+EOF
+
+setup
+
+for i in $(seq 1 10); do
+	logger "stamp-$i"
+done
+sleep 1
+
+RE5424='^[0-9]{4}-[0-9]{2}-[0-9]{2}T[0-9]{2}:[0-9]{2}:[0-9]{2}\.[0-9]{6}[+-][0-9]{2}:[0-9]{2} '
+RE3164='^[A-Z][a-z]{2} [ 0-9][0-9] [0-9]{2}:[0-9]{2}:[0-9]{2} '
+for i in $(seq 1 10); do
+	grep -E "${RE5424}.* stamp-$i\$" "${TLOG}" || FAIL "Bad RFC5424 timestamp, message $i"
+	grep -E "${RE3164}.* stamp-$i\$" "${BLOG}" || FAIL "Bad RFC3164 timestamp, message $i"
+done
+
+# All times differ, even if in the same second
+num=$(grep stamp- "${TLOG}" | cut -d' ' -f1 | sort -u | wc -l)
+[ "$num" -eq 10 ] || FAIL "Duplicate RFC5424 timestamps"
+
+OK
@@ -0,0 +1,51 @@
+#!/bin/sh
+# Test FWD over TLS (RFC 5425) between two syslogd, with a self-signed
+# certificate for 127.0.0.2, the second listens on 127.0.0.2:5555/tcp
+# shellcheck disable=SC1090
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+
+. ${srcdir}/lib.sh
+
+grep -q "define HAVE_TLS 1" ../config.h || SKIP 'built without TLS'
+command -v openssl >/dev/null || SKIP 'openssl(1) missing'
+
+KEY=${DIR}/${NM}-key.pem
+CRT=${DIR}/${NM}-cert.pem
+rm -f "${LOG2}" "${KEY}" "${CRT}"
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj "/CN=sysklogd-test" \
+	-addext "subjectAltName=IP:127.0.0.2" -keyout "${KEY}" -out "${CRT}" \
+	2>/dev/null || SKIP 'failed creating certificate'
+
+cat <<EOF >"${CONFD2}/50-default.conf"
+tls_cert	${CRT}
+tls_key		${KEY}
+kern.*		/dev/null
+*.*;kern.none	${LOG2}			;RFC5424
+EOF
+
+setup2 -m0 -a "127.0.0.2:*" -b "tls://127.0.0.2:${PORT2}"
+setup -m0
+
+cat <<EOF >"${CONFD}/fwd.conf"
+tls_ca		${CRT}
+kern.*		/dev/null
+ntp.*		@tls://127.0.0.2:${PORT2}	;RFC5424
+EOF
+
+reload
+
+print "TEST: Starting"
+
+for i in $(seq 1 20); do
+	logger -t tls -p ntp.notice -m "TLS$i" "tls message $i"
+done
+sleep 3
+
+for i in $(seq 1 20); do
+	grep "tls - TLS$i - tls message $i" "${LOG2}" || FAIL "Missing message $i"
+done
+
+OK
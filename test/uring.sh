@@ -0,0 +1,62 @@
+#!/bin/sh
+# Test the io_uring output engine, if built in: synced and buffered
+# files, in order, rotation, and a UDP burst to a second syslogd.
+# shellcheck disable=SC1090
+set -x
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+. ${srcdir}/lib.sh
+
+grep -q "define HAVE_IO_URING 1" ../config.h || SKIP 'built without io_uring'
+
+SLOG=${DIR}/${NM}-sync.log
+RLOG=${DIR}/${NM}-rotate.log
+rm -f "${SLOG}" "${RLOG}"* "${LOG2}"
+
+cat <<EOF > ${CONFD}/uring.conf
+local4.*	${SLOG}			;RFC5424
+local5.*	-${RLOG}		;rotate=10k:2
+ntp.*		@127.0.0.2:${PORT2}	;RFC5424
+EOF
+
+cat <<EOF >"${CONFD2}/50-default.conf"
+kern.*		/dev/null
+*.*;kern.none	${LOG2}			;RFC5424
+EOF
+
+setup -m0
+setup2 -m0 -a 127.0.0.2:* -b ":${PORT2}"
+
+# Kernel may lack support, or have it disabled, then syslogd falls back
+ls -l /proc/"$(cat "${PID}")"/fd | grep -q io_uring || SKIP 'io_uring not available'
+
+print "TEST: Synced file, in order"
+for i in $(seq 1 200); do
+	logger -t uring -p local4.info -m "SYNC" "sync-$i"
+done
+sleep 1
+num=$(grep -c "uring - SYNC - sync-" "${SLOG}")
+[ "$num" -eq 200 ] || FAIL "Lost messages, got $num/200"
+seq 1 200 | sed 's/^/sync-/' > "${DIR}/${NM}-expect"
+grep -o "sync-[0-9]*\$" "${SLOG}" | cmp - "${DIR}/${NM}-expect" || FAIL "Messages out of order"
+
+print "TEST: Rotation"
+for i in $(seq 1 150); do
+	logger -t uring -p local5.info "rotate-$i padding the log file to reach the rotation size ......"
+done
+sleep 1
+[ -f "${RLOG}.0" ] || FAIL "Not rotated"
+grep -q "rotate-150 " "${RLOG}" || FAIL "Missing last message after rotation"
+
+print "TEST: UDP burst"
+for i in $(seq 1 50); do
+	logger -t fwd -p ntp.notice -m "BURST$i" "burst message $i"
+done
+sleep 3
+for i in $(seq 1 50); do
+	grep -q "fwd - BURST$i - burst message $i" "${LOG2}" || FAIL "Missing message $i"
+done
+
+OK
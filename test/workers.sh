@@ -0,0 +1,45 @@
+#!/bin/sh
+# Test FWD to a second syslogd with receiver workers enabled, the second
+# syslogd binds 127.0.0.2:5555 with two extra SO_REUSEPORT sockets.
+# shellcheck disable=SC1090
+
+if [ x"${srcdir}" = x ]; then
+    srcdir=.
+fi
+
+. ${srcdir}/lib.sh
+setup -m0
+
+cat <<EOF >"${CONFD}/fwd.conf"
+kern.*		/dev/null
+ntp.*		@127.0.0.2:${PORT2}	;RFC5424
+EOF
+
+reload
+
+cat <<EOF >"${CONFD2}/50-default.conf"
+rcvworkers 2
+kern.*		/dev/null
+*.*;kern.none	${LOG2}			;RFC5424
+EOF
+
+setup2 -m0 -a 127.0.0.2:* -b ":${PORT2}"
+
+print "TEST: Starting"
+
+for i in $(seq 1 10); do
+	logger -t workers -p ntp.notice -m "NTP$i" "worker message $i"
+done
+sleep 3  # Allow messages to be received, processed, and forwarded
+
+for i in $(seq 1 10); do
+	grep "workers - NTP$i - worker message $i" "${LOG2}" || FAIL "Missing message $i"
+done
+
+# Verify receiver workers are restarted on SIGHUP
+reload2
+logger -t workers -p ntp.notice -m "NTP11" "after reload"
+sleep 3
+grep "workers - NTP11 - after reload" "${LOG2}" || FAIL "Nothing after reload."
+
+OK